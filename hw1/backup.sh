@@ -4,98 +4,20 @@
 # ./backup.sh -c catalog_name -a archive_name -e "ext1 ext2 cpp hpp py java"
 # Decrypt archive:
 # openssl enc -d -aes-256-cbc -md sha512 -pbkdf2 -iter 1000 -in "archive.tar.gz" | tar xz
+# Deduplicated backup into chunk store and restoring of its run:
+# ./backup.sh -s store_dir -a run_name -e "cpp hpp"
+# ./backup.sh -s store_dir -r run_name -c catalog_name
 
+# Backup is done by the native tool (src/backup.c): files are found by a parallel walk,
+#  only the ones changed since the last run (see manifest, -m) are archived,
+#  and their contents are streamed into a multi-threaded gzip and AES-256-CBC encryption (src/stream.c).
 
-#################################
-# Processing options/parameters #
-#################################
 
-backup_path=$HOME
-catalog=backup_$(date +%Y-%m-%d_%H%M%S)
-archive=backup_$(date +%Y-%m-%d_%H%M%S)
-extensions=("h hpp cpp c")
+tool_dir="$(dirname -- "$0")/make"
 
-unexpected () {
-    echo "Unexpected parameter/option: \"$1\". Terminating." 1>&2
-    exit -1
-}
-
-assign_archive () {
-    if [ -z "$1" ]; then
-        echo "Archive name expected. Terminating." 1>&2
-        exit -2
-    fi
-    archive=$1
-}
-
-assign_catalog () {
-    if [ -z "$1" ]; then
-        echo "Catalog name expected. Terminating." 1>&2
-        exit -3
-    fi
-    catalog=$1
-}
-
-assign_extenstions () {
-    if [ -z "$1" ]; then
-        echo "Extensions list expected. Terminating." 1>&2
-        exit -4
-    fi
-    extensions=("$1")
-}
-
-while [ -n "$1" ]; do
-    case "$1" in
-        -a) assign_archive "$2"
-            shift;;
-        -c) assign_catalog "$2"
-            shift;;
-        -e) assign_extenstions "$2"
-            shift;;
-        *) unexpected;;
-    esac
-    shift
-done
-
-if [ -d "$catalog" ]; then
-    echo "Specified catalog name already exists. Terminating." 1>&2
-    exit -5
+if ! make -C "${tool_dir}" > /dev/null; then
+    echo "Can't build backup tool. Terminating." 1>&2
+    exit -9
 fi
 
-
-######################
-# Copying to catalog #
-######################
-
-is_valid_extension () {
-    local is=1
-    for e in $extensions; do
-        if [[ "$e" == "$1" ]]; then
-            is=0
-            break
-        fi
-    done
-    return $is
-}
-
-mkdir "$catalog"
-find $backup_path -type f | while read f; do
-    filename=$(basename -- "$f")
-    extension="${filename##*.}"
-    if is_valid_extension $extension; then
-        rf=${f#*${backup_path}}
-        rd=$(dirname -- "$rf")
-        mkdir -p "${catalog}/${rd}"
-        cp "$f" "${catalog}$rf"
-    fi
-done
-
-
-###################################
-# Archive creation and encryption #
-###################################
-
-tar -czf - "${catalog}" \
-| openssl enc -e -aes-256-cbc -md sha512 -pbkdf2 -iter 1000 -out "/tmp/${archive}.tar.gz" -pass pass:12345 \
-&& rm -R "${catalog}" \
-&& echo "done"
+exec "${tool_dir}/backup" "$@"
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <string.h>
+
+// Tar archive (ustar) is a sequence of 512-byte blocks:
+//  each entry is a header block followed by its data padded to the block size,
+//  and two zero blocks mark the end.
+#define ARCHIVE_BLOCK_SIZE 512
+
+#define ARCHIVE_TYPE_REGULAR    '0'
+#define ARCHIVE_TYPE_DIRECTORY  '5'
+#define ARCHIVE_TYPE_LONG_NAME  'L'  // GNU: data is the path of the next entry
+
+struct ArchiveHeader {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char link_name[100];
+    char magic[6];
+    char version[2];
+    char user_name[32];
+    char group_name[32];
+    char dev_major[8];
+    char dev_minor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+/*
+ * Function: archive_header_write
+ * --------------------
+ * Writes entry's header. Path which doesn't fit into ustar header
+ *  is written as GNU long name entry first.
+ *
+ * file:            archive stream
+ * path:            entry's path
+ * type:            entry's type
+ * size:            entry's data size
+ * mtime:           entry's modification time (seconds since epoch)
+ *
+ *  returns: 0 <=> header was written successfully.
+ */
+char archive_header_write(FILE *file, const char *path, char type, unsigned long long size, unsigned long long mtime);
+
+/*
+ * Function: archive_end_write
+ * --------------------
+ * Writes end of archive mark.
+ *
+ *  returns: 0 <=> mark was written successfully.
+ */
+char archive_end_write(FILE *file);
+
+/*
+ * Function: archive_padding
+ * --------------------
+ * Gets number of zero bytes following data of provided size.
+ */
+size_t archive_padding(unsigned long long size);
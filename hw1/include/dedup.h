@@ -0,0 +1,39 @@
+#include <store.h>
+
+#define DEDUP_THREADS_MAX 8
+
+#define DEDUP_OK           0
+#define DEDUP_UNCHANGED    1  // nothing changed since the last run, no run was written
+#define DEDUP_WALK_FAILED  2
+#define DEDUP_FAILED       3
+#define DEDUP_RUN_EXISTS   4  // run with this name is already in the store
+
+/*
+ * Function: dedup_backup
+ * --------------------
+ * Backs up files into chunk store as a new run.
+ * Files unchanged (by size and mtime) since the last run take its chunks without being read,
+ *  other files are cut into chunks by several threads and only chunks missing from the store are written.
+ *
+ * store:           store directory (created if needed)
+ * run:             run name
+ * backup_path:     root directory of files
+ * extensions:      accepted extensions
+ * extensions_count: number of accepted extensions
+ *
+ *  returns: DEDUP_OK, DEDUP_UNCHANGED, DEDUP_WALK_FAILED, DEDUP_RUN_EXISTS or DEDUP_FAILED.
+ */
+char dedup_backup(const char *store, const char *run, const char *backup_path, const char **extensions, size_t extensions_count);
+
+/*
+ * Function: dedup_restore
+ * --------------------
+ * Restores files of a run from chunk store into a new directory.
+ *
+ * store:           store directory
+ * run:             run name
+ * target:          directory to create
+ *
+ *  returns: DEDUP_OK or DEDUP_FAILED.
+ */
+char dedup_restore(const char *store, const char *run, const char *target);
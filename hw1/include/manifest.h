@@ -0,0 +1,46 @@
+#include <walk.h>
+
+// Manifest is a list of files saved by a backup run. It starts with MANIFEST_HEADER,
+//  each record is "SIZE MTIME_SEC MTIME_NSEC CHUNKS PATH" terminated by '\0' (paths may contain '\n')
+//  and followed by CHUNKS hashes of CHUNK_HASH_SIZE bytes.
+// Manifests without the header have records "SIZE MTIME_SEC MTIME_NSEC PATH" and no chunks.
+#define MANIFEST_HEADER "manifest 2"
+struct Manifest {
+    struct FileList files;
+    size_t *index;              // open addressing hash table of files' positions + 1 (0 is empty slot)
+    size_t index_capacity;
+};
+
+/*
+ * Function: manifest_load
+ * --------------------
+ * Loads manifest from file. Missing file is loaded as an empty manifest.
+ *
+ *  returns: 0 <=> manifest was loaded successfully.
+ */
+char manifest_load(const char *file_name, struct Manifest *manifest);
+
+/*
+ * Function: manifest_find
+ * --------------------
+ * Finds file by path.
+ *
+ *  returns: file's record or NULL if there is no such file.
+ */
+struct FileInfo *manifest_find(const struct Manifest *manifest, const char *path);
+
+/*
+ * Function: manifest_save
+ * --------------------
+ * Saves files as a new manifest, files with NULL path are skipped. File is replaced atomically.
+ *
+ *  returns: 0 <=> manifest was saved successfully.
+ */
+char manifest_save(const char *file_name, const struct FileList *files);
+
+/*
+ * Function: manifest_free
+ * --------------------
+ * Frees manifest's memory.
+ */
+void manifest_free(struct Manifest *manifest);
@@ -0,0 +1,93 @@
+#include <manifest.h>
+
+// Chunk store is a directory:
+//  chunks/XX/HASH  - chunk compressed by zlib, preceded by its size (4 bytes, little endian),
+//                    named by hex SHA-256 of its content, XX are the first two digits;
+//  runs/NAME       - manifest of a backup run (see manifest.h) with chunks of every file;
+//  last            - symbolic link to the manifest of the last run.
+#define STORE_CHUNKS_DIR "chunks"
+#define STORE_RUNS_DIR   "runs"
+#define STORE_LAST_LINK  "last"
+
+// Content-defined chunking: a cut is made where gear rolling hash of the last bytes has
+//  the mask bits clear, so an insertion only changes chunks around it.
+// The mask is stricter before CHUNK_SIZE_AVG and looser after it, which keeps sizes close to average.
+#define CHUNK_SIZE_MIN 2048
+#define CHUNK_SIZE_AVG 8192
+#define CHUNK_SIZE_MAX 65536
+
+struct Chunker {
+    int fd;
+    unsigned char *buffer;
+    size_t start;       // beginning of the next chunk in the buffer
+    size_t end;         // end of the read data in the buffer
+    char eof;
+};
+
+/*
+ * Function: chunker_init
+ * --------------------
+ * Prepares chunker of file's content.
+ *
+ *  returns: 0 <=> chunker was prepared successfully.
+ */
+char chunker_init(struct Chunker *chunker, int fd);
+
+/*
+ * Function: chunker_next
+ * --------------------
+ * Finds the next chunk of the content.
+ *
+ * chunker:         chunker
+ * chunk_holder:    holder for chunk's beginning (valid until the next call)
+ * size_holder:     holder for chunk's size (0 at the end of the content)
+ *
+ *  returns: 0 <=> chunk was found (or the end was reached) successfully.
+ */
+char chunker_next(struct Chunker *chunker, const unsigned char **chunk_holder, size_t *size_holder);
+
+/*
+ * Function: chunker_free
+ * --------------------
+ * Frees chunker's memory, the file is not closed.
+ */
+void chunker_free(struct Chunker *chunker);
+
+/*
+ * Function: store_init
+ * --------------------
+ * Creates the store's directories which don't exist yet.
+ *
+ *  returns: 0 <=> store is ready.
+ */
+char store_init(const char *store);
+
+/*
+ * Function: store_put
+ * --------------------
+ * Hashes the chunk and writes it to the store unless the store already has it.
+ * May be called by several threads at once.
+ *
+ * store:           store directory
+ * data:            chunk's content
+ * size:            chunk's size (up to CHUNK_SIZE_MAX)
+ * hash_holder:     holder for chunk's hash (CHUNK_HASH_SIZE bytes)
+ * written_holder:  holder for 1 if chunk was new, 0 otherwise (may be NULL)
+ *
+ *  returns: 0 <=> chunk is in the store.
+ */
+char store_put(const char *store, const unsigned char *data, size_t size, unsigned char *hash_holder, char *written_holder);
+
+/*
+ * Function: store_get
+ * --------------------
+ * Reads chunk from the store and checks its hash.
+ *
+ * store:           store directory
+ * hash:            chunk's hash
+ * data_holder:     holder for chunk's content (CHUNK_SIZE_MAX bytes)
+ * size_holder:     holder for chunk's size
+ *
+ *  returns: 0 <=> chunk was read successfully.
+ */
+char store_get(const char *store, const unsigned char *hash, unsigned char *data_holder, size_t *size_holder);
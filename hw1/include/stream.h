@@ -0,0 +1,24 @@
+#include <stdio.h>
+
+// Archive stream is gzip compressed by several threads and encrypted
+//  the way "openssl enc -e -aes-256-cbc -md sha512 -pbkdf2 -iter 1000" does:
+//  "Salted__", 8 bytes of salt and AES-256-CBC ciphertext with key and IV derived by PBKDF2-HMAC-SHA512.
+#define STREAM_BLOCK_SIZE   (128 * 1024)  // input compressed by one job
+#define STREAM_DICT_SIZE    (32 * 1024)   // deflate window, taken from the previous block
+#define STREAM_THREADS_MAX  8
+#define STREAM_PBKDF2_ITER  1000
+
+/*
+ * Function: stream_open
+ * --------------------
+ * Creates compressed and encrypted archive file and opens a stream writing into it.
+ * Data written to the stream is compressed by up to STREAM_THREADS_MAX threads
+ *  while another thread encrypts and writes already compressed blocks in order.
+ *
+ * file_name:       archive file name
+ * password:        encryption password
+ *
+ *  returns: stream or NULL on failure.
+ *           fclose of the stream returns 0 <=> the whole archive was written successfully.
+ */
+FILE *stream_open(const char *file_name, const char *password);
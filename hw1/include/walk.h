@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WALK_THREADS_MAX 8
+#define CHUNK_HASH_SIZE  32  // SHA-256
+
+// Regular file found by the walk.
+struct FileInfo {
+    char *path;                 // relative to the walk root, without leading '/'
+    unsigned long long size;
+    long long mtime_sec;
+    long mtime_nsec;
+    unsigned char *chunks;      // hashes of content's chunks in order (deduplicated backups only)
+    size_t chunks_count;
+};
+
+struct FileList {
+    struct FileInfo *items;
+    size_t size;
+    size_t capacity;
+};
+
+/*
+ * Function: file_list_push
+ * --------------------
+ * Appends file to the list, the list takes ownership of path.
+ *
+ *  returns: 0 <=> file was appended successfully.
+ */
+char file_list_push(struct FileList *list, char *path, unsigned long long size, long long mtime_sec, long mtime_nsec);
+
+/*
+ * Function: file_list_sort
+ * --------------------
+ * Sorts files by path.
+ */
+void file_list_sort(struct FileList *list);
+
+/*
+ * Function: file_list_free
+ * --------------------
+ * Frees all paths, chunks and the list itself.
+ */
+void file_list_free(struct FileList *list);
+
+/*
+ * Function: get_extension
+ * --------------------
+ * Gets extension of file name the way shell "${name##*.}" does:
+ *  the part after the last '.', or the whole name if there is none.
+ */
+const char *get_extension(const char *name);
+
+/*
+ * Function: walk_files
+ * --------------------
+ * Finds all regular files under root directory with one of provided extensions.
+ * Directories are read by several threads (one per CPU, up to WALK_THREADS_MAX),
+ *  symbolic links are not followed, unreadable directories are reported to stderr and skipped.
+ *
+ * root:            root directory
+ * extensions:      accepted extensions
+ * extensions_count: number of accepted extensions
+ * list:            list to append found files to (in no particular order)
+ *
+ *  returns: 0 <=> walk was finished successfully.
+ */
+char walk_files(const char *root, const char **extensions, size_t extensions_count, struct FileList *list);
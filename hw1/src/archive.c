@@ -0,0 +1,88 @@
+#include <archive.h>
+#include <stddef.h>
+
+// Numeric fields are octal, too large values are stored as base-256 with the top bit set.
+static void format_number(char *field, size_t len, unsigned long long value) {
+    size_t i;
+
+    if ((value >> ((len - 1) * 3)) == 0) {
+        sprintf(field, "%0*llo", (int)(len - 1), value);
+        return;
+    }
+    for (i = len - 1; i > 0; --i) {
+        field[i] = value & 0xFF;
+        value >>= 8;
+    }
+    field[0] = (char)0x80;
+}
+
+static unsigned int get_checksum(struct ArchiveHeader *header) {
+    unsigned char *bytes = (unsigned char *)header;
+    unsigned int sum = 0;
+    size_t i;
+
+    // Checksum field itself is counted as spaces.
+    for (i = 0; i < ARCHIVE_BLOCK_SIZE; ++i) {
+        if ((i >= offsetof(struct ArchiveHeader, checksum)) &&
+            (i < offsetof(struct ArchiveHeader, checksum) + sizeof(header->checksum))) {
+            sum += ' ';
+        } else {
+            sum += bytes[i];
+        }
+    }
+    return sum;
+}
+
+char archive_header_write(FILE *file, const char *path, char type, unsigned long long size, unsigned long long mtime) {
+    struct ArchiveHeader header;
+    char padding[ARCHIVE_BLOCK_SIZE] = {0};
+    size_t len = strlen(path);
+    size_t split;
+
+    memset(&header, 0, sizeof(header));
+
+    if (len <= sizeof(header.name)) {
+        memcpy(header.name, path, len);
+    } else {
+        // Split path between prefix and name at some '/', if possible.
+        for (split = len - 2; split > 0; --split) {
+            if ((path[split] == '/') && (split <= sizeof(header.prefix)) && (len - split - 1 <= sizeof(header.name))) break;
+        }
+        if (split > 0) {
+            memcpy(header.prefix, path, split);
+            memcpy(header.name, path + split + 1, len - split - 1);
+        } else {
+            // Doesn't fit at all: the full path goes as a separate entry.
+            if (archive_header_write(file, "././@LongLink", ARCHIVE_TYPE_LONG_NAME, len + 1, 0) ||
+                (fwrite(path, len + 1, 1, file) != 1)) {
+                return 1;
+            }
+            if ((archive_padding(len + 1) > 0) && (fwrite(padding, archive_padding(len + 1), 1, file) != 1)) {
+                return 1;
+            }
+            memcpy(header.name, path, sizeof(header.name));
+        }
+    }
+
+    format_number(header.mode, sizeof(header.mode), (type == ARCHIVE_TYPE_DIRECTORY) ? 0755 : 0644);
+    format_number(header.uid, sizeof(header.uid), 0);
+    format_number(header.gid, sizeof(header.gid), 0);
+    format_number(header.size, sizeof(header.size), size);
+    format_number(header.mtime, sizeof(header.mtime), mtime);
+    header.type = type;
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+    sprintf(header.checksum, "%06o", get_checksum(&header));
+    header.checksum[7] = ' ';
+
+    return (fwrite(&header, ARCHIVE_BLOCK_SIZE, 1, file) == 1) ? 0 : 1;
+}
+
+char archive_end_write(FILE *file) {
+    char blocks[2 * ARCHIVE_BLOCK_SIZE] = {0};
+    return (fwrite(blocks, sizeof(blocks), 1, file) == 1) ? 0 : 1;
+}
+
+size_t archive_padding(unsigned long long size) {
+    return (ARCHIVE_BLOCK_SIZE - size % ARCHIVE_BLOCK_SIZE) % ARCHIVE_BLOCK_SIZE;
+}
@@ -0,0 +1,324 @@
+#include <archive.h>
+#include <dedup.h>
+#include <stream.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+// Usage example:
+// ./backup -c catalog_name -a archive_name -e "ext1 ext2 cpp hpp py java" [-m manifest]
+// Decrypt archive:
+// openssl enc -d -aes-256-cbc -md sha512 -pbkdf2 -iter 1000 -in "archive.tar.gz" | tar xz
+
+// Only files added or changed (by size or mtime) since the run which wrote the manifest are archived,
+//  paths of removed files are listed in "catalog/.removed". The first run (no manifest) archives everything.
+// Restoring is extracting archives from the oldest one and deleting files listed as removed after each.
+
+// Deduplicated backup into chunk store (see store.h), archive name is the run name:
+// ./backup -s store_dir [-a run_name] [-e "ext1 ext2"]
+// Restore run into a new catalog:
+// ./backup -s store_dir -r run_name [-c catalog_name]
+
+#define ARCHIVE_DIR       "/tmp"
+#define MANIFEST_DEFAULT  "/tmp/backup.manifest"
+#define REMOVED_LIST_NAME ".removed"
+#define ARCHIVE_PASSWORD  "12345"
+#define COPY_CHUNK_SIZE   65536
+
+#define EXIT_UNEXPECTED        -1
+#define EXIT_NO_ARCHIVE_NAME   -2
+#define EXIT_NO_CATALOG_NAME   -3
+#define EXIT_NO_EXTENSIONS     -4
+#define EXIT_RUN_EXISTS        -5
+#define EXIT_MANIFEST_FAILED   -6
+#define EXIT_ARCHIVE_FAILED    -7
+#define EXIT_STORE_FAILED      -8
+#define EXIT_WALK_FAILED       -10
+
+struct BackupOptions {
+    const char *backup_path;
+    const char *catalog;
+    const char *archive;
+    const char *manifest;
+    const char *store;
+    const char *restore_run;
+    char *extensions_list;
+    const char *extensions[256];
+    size_t extensions_count;
+};
+
+static int parse_options(int argc, char **argv, struct BackupOptions *options) {
+    static char timestamp[64];
+    static char default_extensions[] = "h hpp cpp c";
+    time_t now = time(NULL);
+    char *extension;
+    int i;
+
+    strftime(timestamp, sizeof(timestamp), "backup_%Y-%m-%d_%H%M%S", localtime(&now));
+    options->backup_path = getenv("HOME");
+    options->catalog = timestamp;
+    options->archive = timestamp;
+    options->manifest = MANIFEST_DEFAULT;
+    options->store = NULL;
+    options->restore_run = NULL;
+    options->extensions_list = default_extensions;
+
+    for (i = 1; i < argc; i += 2) {
+        if ((strcmp(argv[i], "-a") == 0) && (i + 1 < argc) && (argv[i + 1][0] != '\0')) {
+            options->archive = argv[i + 1];
+        } else if (strcmp(argv[i], "-a") == 0) {
+            fprintf(stderr, "Archive name expected. Terminating.\n");
+            return EXIT_NO_ARCHIVE_NAME;
+        } else if ((strcmp(argv[i], "-c") == 0) && (i + 1 < argc) && (argv[i + 1][0] != '\0')) {
+            options->catalog = argv[i + 1];
+        } else if (strcmp(argv[i], "-c") == 0) {
+            fprintf(stderr, "Catalog name expected. Terminating.\n");
+            return EXIT_NO_CATALOG_NAME;
+        } else if ((strcmp(argv[i], "-e") == 0) && (i + 1 < argc) && (argv[i + 1][0] != '\0')) {
+            options->extensions_list = argv[i + 1];
+        } else if (strcmp(argv[i], "-e") == 0) {
+            fprintf(stderr, "Extensions list expected. Terminating.\n");
+            return EXIT_NO_EXTENSIONS;
+        } else if ((strcmp(argv[i], "-m") == 0) && (i + 1 < argc) && (argv[i + 1][0] != '\0')) {
+            options->manifest = argv[i + 1];
+        } else if ((strcmp(argv[i], "-s") == 0) && (i + 1 < argc) && (argv[i + 1][0] != '\0')) {
+            options->store = argv[i + 1];
+        } else if ((strcmp(argv[i], "-r") == 0) && (i + 1 < argc) && (argv[i + 1][0] != '\0')) {
+            options->restore_run = argv[i + 1];
+        } else {
+            fprintf(stderr, "Unexpected parameter/option: \"%s\". Terminating.\n", argv[i]);
+            return EXIT_UNEXPECTED;
+        }
+    }
+    if ((options->restore_run != NULL) && (options->store == NULL)) {
+        fprintf(stderr, "Store expected for restoring. Terminating.\n");
+        return EXIT_UNEXPECTED;
+    }
+    if (options->backup_path == NULL) {
+        options->backup_path = "/";
+    }
+
+    // Extensions are separated by whitespace, as in the shell version.
+    options->extensions_count = 0;
+    for (extension = strtok(options->extensions_list, " \t\n"); extension != NULL; extension = strtok(NULL, " \t\n")) {
+        if (options->extensions_count == sizeof(options->extensions) / sizeof(options->extensions[0])) break;
+        options->extensions[options->extensions_count++] = extension;
+    }
+    if (options->extensions_count == 0) {
+        fprintf(stderr, "Extensions list expected. Terminating.\n");
+        return EXIT_NO_EXTENSIONS;
+    }
+    return 0;
+}
+
+/*
+ * Function: archive_file
+ * --------------------
+ * Writes file as archive entry. Entry has the size found by the walk:
+ *  file which has grown since is cut, file which has shrunk is padded with zeros.
+ *
+ *  returns: 0 <=> entry was written successfully,
+ *           1 <=> file can't be opened (nothing is written),
+ *           2 <=> archive stream failed.
+ */
+static char archive_file(FILE *archive, const char *backup_path, const char *catalog, const struct FileInfo *file, char *chunk) {
+    char *path, *entry_path;
+    unsigned long long left = file->size;
+    ssize_t n;
+    int fd;
+    char err = 0;
+
+    if ((path = malloc(strlen(backup_path) + strlen(file->path) + 2)) == NULL) return 2;
+    sprintf(path, "%s/%s", backup_path, file->path);
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Can't read file \"%s\", skipped.\n", path);
+        free(path);
+        return 1;
+    }
+    free(path);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if ((entry_path = malloc(strlen(catalog) + strlen(file->path) + 2)) == NULL) {
+        close(fd);
+        return 2;
+    }
+    sprintf(entry_path, "%s/%s", catalog, file->path);
+    err = archive_header_write(archive, entry_path, ARCHIVE_TYPE_REGULAR, file->size, file->mtime_sec) ? 2 : 0;
+    free(entry_path);
+
+    while (!err && (left > 0)) {
+        n = read(fd, chunk, (left < COPY_CHUNK_SIZE) ? left : COPY_CHUNK_SIZE);
+        if (n <= 0) {
+            // Shrunk or unreadable: the rest is zeros.
+            n = (left < COPY_CHUNK_SIZE) ? left : COPY_CHUNK_SIZE;
+            memset(chunk, 0, n);
+        }
+        err = (fwrite(chunk, n, 1, archive) != 1) ? 2 : 0;
+        left -= n;
+    }
+    close(fd);
+
+    memset(chunk, 0, ARCHIVE_BLOCK_SIZE);
+    if (!err && (archive_padding(file->size) > 0) && (fwrite(chunk, archive_padding(file->size), 1, archive) != 1)) {
+        err = 2;
+    }
+    return err;
+}
+
+static char archive_removed(FILE *archive, const char *catalog, const struct Manifest *manifest, const char *seen) {
+    unsigned long long size = 0;
+    char padding[ARCHIVE_BLOCK_SIZE] = {0};
+    char *entry_path;
+    size_t i;
+    char err;
+
+    for (i = 0; i < manifest->files.size; ++i) {
+        if (!seen[i]) size += strlen(manifest->files.items[i].path) + 1;
+    }
+    if ((entry_path = malloc(strlen(catalog) + strlen(REMOVED_LIST_NAME) + 2)) == NULL) return 1;
+    sprintf(entry_path, "%s/%s", catalog, REMOVED_LIST_NAME);
+    err = archive_header_write(archive, entry_path, ARCHIVE_TYPE_REGULAR, size, time(NULL));
+    free(entry_path);
+
+    for (i = 0; !err && (i < manifest->files.size); ++i) {
+        if (seen[i]) continue;
+        err = (fputs(manifest->files.items[i].path, archive) == EOF) || (fputc('\n', archive) == EOF);
+    }
+    if (!err && (archive_padding(size) > 0)) {
+        err = fwrite(padding, archive_padding(size), 1, archive) != 1;
+    }
+    return err;
+}
+
+static int run_dedup(struct BackupOptions *options) {
+    if (options->restore_run != NULL) {
+        if (dedup_restore(options->store, options->restore_run, options->catalog) != DEDUP_OK) {
+            return EXIT_STORE_FAILED;
+        }
+        printf("done\n");
+        return 0;
+    }
+
+    switch (dedup_backup(options->store, options->archive, options->backup_path, options->extensions, options->extensions_count)) {
+        case DEDUP_OK:
+            printf("done\n");
+            return 0;
+        case DEDUP_UNCHANGED:
+            printf("nothing changed\n");
+            return 0;
+        case DEDUP_WALK_FAILED:
+            fprintf(stderr, "Can't walk \"%s\". Terminating.\n", options->backup_path);
+            return EXIT_WALK_FAILED;
+        case DEDUP_RUN_EXISTS:
+            fprintf(stderr, "Run \"%s\" already exists in store \"%s\". Terminating.\n", options->archive, options->store);
+            return EXIT_RUN_EXISTS;
+        default:
+            fprintf(stderr, "Can't back up into store \"%s\". Terminating.\n", options->store);
+            return EXIT_STORE_FAILED;
+    }
+}
+
+int main(int argc, char **argv) {
+    struct BackupOptions options;
+    struct Manifest manifest;
+    struct FileList files = {NULL, 0, 0};
+    struct FileInfo *old;
+    size_t i, changed = 0, removed = 0;
+    char *seen, *changed_flags, *chunk, *archive_path = NULL;
+    FILE *archive = NULL;
+    char err = 0, res;
+    int status;
+
+    if ((status = parse_options(argc, argv, &options)) != 0) {
+        return status;
+    }
+    if (options.store != NULL) {
+        return run_dedup(&options);
+    }
+    if (manifest_load(options.manifest, &manifest)) {
+        fprintf(stderr, "Can't read manifest \"%s\". Terminating.\n", options.manifest);
+        return EXIT_MANIFEST_FAILED;
+    }
+    if (walk_files(options.backup_path, options.extensions, options.extensions_count, &files)) {
+        fprintf(stderr, "Can't walk \"%s\". Terminating.\n", options.backup_path);
+        manifest_free(&manifest);
+        return EXIT_WALK_FAILED;
+    }
+    file_list_sort(&files);
+
+    // Unchanged files are the ones with the same size and mtime as in the manifest.
+    seen = calloc(manifest.files.size + 1, 1);
+    changed_flags = calloc(files.size + 1, 1);
+    chunk = malloc(COPY_CHUNK_SIZE);
+    if ((seen == NULL) || (changed_flags == NULL) || (chunk == NULL)) {
+        err = 1;
+    }
+    for (i = 0; !err && (i < files.size); ++i) {
+        old = manifest_find(&manifest, files.items[i].path);
+        if (old != NULL) seen[old - manifest.files.items] = 1;
+        if ((old == NULL) || (old->size != files.items[i].size) ||
+            (old->mtime_sec != files.items[i].mtime_sec) || (old->mtime_nsec != files.items[i].mtime_nsec)) {
+            changed_flags[i] = 1;
+            ++changed;
+        }
+    }
+    for (i = 0; !err && (i < manifest.files.size); ++i) {
+        removed += !seen[i];
+    }
+
+    if (!err && (changed == 0) && (removed == 0)) {
+        printf("nothing changed\n");
+    } else if (!err) {
+        // Files are read straight into the compressing and encrypting stream.
+        if ((archive_path = malloc(strlen(ARCHIVE_DIR) + strlen(options.archive) + 9)) == NULL) {
+            err = 1;
+        } else {
+            sprintf(archive_path, "%s/%s.tar.gz", ARCHIVE_DIR, options.archive);
+            if ((archive = stream_open(archive_path, ARCHIVE_PASSWORD)) == NULL) {
+                err = 1;
+            }
+        }
+        for (i = 0; !err && (i < files.size); ++i) {
+            if (!changed_flags[i]) continue;
+            res = archive_file(archive, options.backup_path, options.catalog, &files.items[i], chunk);
+            if (res == 1) {
+                // Not in the new manifest, so it is tried again by the next run.
+                free(files.items[i].path);
+                files.items[i].path = NULL;
+            }
+            err = (res == 2);
+        }
+        if (!err && (removed > 0)) {
+            err = archive_removed(archive, options.catalog, &manifest, seen);
+        }
+        if (!err) {
+            err = archive_end_write(archive);
+        }
+        if (archive != NULL) {
+            err |= (fclose(archive) != 0);
+        }
+        if (err && (archive != NULL)) {
+            remove(archive_path);
+        }
+        if (!err && manifest_save(options.manifest, &files)) {
+            fprintf(stderr, "Can't write manifest \"%s\". Terminating.\n", options.manifest);
+            err = 2;
+        }
+        if (!err) {
+            printf("done\n");
+        }
+    }
+
+    free(archive_path);
+    free(chunk);
+    free(changed_flags);
+    free(seen);
+    file_list_free(&files);
+    manifest_free(&manifest);
+    if (err == 1) {
+        fprintf(stderr, "Can't create archive. Terminating.\n");
+        return EXIT_ARCHIVE_FAILED;
+    }
+    return (err == 2) ? EXIT_MANIFEST_FAILED : 0;
+}
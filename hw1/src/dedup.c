@@ -0,0 +1,313 @@
+#include <dedup.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef char (*parallel_fn)(void *arg, size_t i);
+
+struct ParallelRun {
+    parallel_fn fn;
+    void *arg;
+    size_t count;
+    size_t next;
+    pthread_mutex_t lock;
+    char err;
+};
+
+struct DedupFiles {
+    const char *store;
+    const char *root;
+    struct FileList *files;
+    size_t *indexes;    // files to process
+};
+
+static void *parallel_worker(void *arg) {
+    struct ParallelRun *run = arg;
+    size_t i;
+    char err;
+
+    while (1) {
+        pthread_mutex_lock(&run->lock);
+        if (run->err || (run->next == run->count)) {
+            pthread_mutex_unlock(&run->lock);
+            break;
+        }
+        i = run->next++;
+        pthread_mutex_unlock(&run->lock);
+
+        if ((err = run->fn(run->arg, i))) {
+            pthread_mutex_lock(&run->lock);
+            run->err = err;
+            pthread_mutex_unlock(&run->lock);
+        }
+    }
+    return NULL;
+}
+
+// Calls fn for indexes [0, count) by several threads, stops at the first failure.
+static char run_parallel(parallel_fn fn, void *arg, size_t count) {
+    struct ParallelRun run = {fn, arg, count, 0, PTHREAD_MUTEX_INITIALIZER, 0};
+    pthread_t threads[DEDUP_THREADS_MAX];
+    unsigned int i, started, limit;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    limit = (cpus < 1) ? 1 : ((cpus > DEDUP_THREADS_MAX) ? DEDUP_THREADS_MAX : cpus);
+    if (limit > count) limit = count;
+    // Calling thread works as the first worker.
+    for (started = 1; started < limit; ++started) {
+        if (pthread_create(&threads[started], NULL, parallel_worker, &run)) break;
+    }
+    parallel_worker(&run);
+    for (i = 1; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&run.lock);
+    return run.err;
+}
+
+static char *join_paths(const char *dir, const char *name) {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    if (path != NULL) sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+static char push_hash(struct FileInfo *file, size_t *capacity, const unsigned char *hash) {
+    unsigned char *chunks_new;
+    size_t capacity_new;
+
+    if (file->chunks_count == *capacity) {
+        capacity_new = *capacity ? *capacity * 2 : 8;
+        if ((chunks_new = realloc(file->chunks, capacity_new * CHUNK_HASH_SIZE)) == NULL) return 1;
+        file->chunks = chunks_new;
+        *capacity = capacity_new;
+    }
+    memcpy(file->chunks + file->chunks_count * CHUNK_HASH_SIZE, hash, CHUNK_HASH_SIZE);
+    ++file->chunks_count;
+    return 0;
+}
+
+// Cuts changed file into chunks and puts them into the store.
+static char backup_file(void *arg, size_t i) {
+    struct DedupFiles *dedup = arg;
+    struct FileInfo *file = &dedup->files->items[dedup->indexes[i]];
+    unsigned char hash[CHUNK_HASH_SIZE];
+    const unsigned char *chunk;
+    struct Chunker chunker;
+    size_t size, capacity = 0;
+    unsigned long long stored = 0;
+    char *path;
+    char err = 0;
+    int fd;
+
+    if ((path = join_paths(dedup->root, file->path)) == NULL) return 1;
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        // Not in the run, so it is tried again by the next one.
+        fprintf(stderr, "Can't read file \"%s\", skipped.\n", path);
+        free(path);
+        free(file->path);
+        file->path = NULL;
+        return 0;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (chunker_init(&chunker, fd)) {
+        err = 1;
+    }
+    while (!err) {
+        if (chunker_next(&chunker, &chunk, &size)) {
+            fprintf(stderr, "Can't read file \"%s\".\n", path);
+            err = 1;
+        } else if (size == 0) {
+            break;
+        } else {
+            err = store_put(dedup->store, chunk, size, hash, NULL) || push_hash(file, &capacity, hash);
+            stored += size;
+        }
+    }
+    // Run records what was actually stored, even if the file has changed since the walk.
+    file->size = stored;
+    chunker_free(&chunker);
+    close(fd);
+    free(path);
+    return err;
+}
+
+char dedup_backup(const char *store, const char *run, const char *backup_path, const char **extensions, size_t extensions_count) {
+    struct Manifest last;
+    struct FileList files = {NULL, 0, 0};
+    struct DedupFiles dedup;
+    struct FileInfo *old;
+    size_t i, changed = 0, removed = 0;
+    char *seen = NULL, *path = NULL, *last_path = NULL, *link_path = NULL, *run_path = NULL;
+    char err = 0;
+
+    if (store_init(store) || ((last_path = join_paths(store, STORE_LAST_LINK)) == NULL) ||
+        ((path = join_paths(STORE_RUNS_DIR, run)) == NULL) || ((run_path = join_paths(store, path)) == NULL) ||
+        manifest_load(last_path, &last)) {
+        fprintf(stderr, "Can't open store \"%s\".\n", store);
+        free(run_path);
+        free(path);
+        free(last_path);
+        return DEDUP_FAILED;
+    }
+    // Runs are never overwritten: restoring by name must give what was backed up under it.
+    if (access(run_path, F_OK) == 0) {
+        manifest_free(&last);
+        free(run_path);
+        free(path);
+        free(last_path);
+        return DEDUP_RUN_EXISTS;
+    }
+    if (walk_files(backup_path, extensions, extensions_count, &files)) {
+        manifest_free(&last);
+        free(run_path);
+        free(path);
+        free(last_path);
+        return DEDUP_WALK_FAILED;
+    }
+    file_list_sort(&files);
+
+    dedup.store = store;
+    dedup.root = backup_path;
+    dedup.files = &files;
+    seen = calloc(last.files.size + 1, 1);
+    dedup.indexes = malloc((files.size + 1) * sizeof(size_t));
+    if ((seen == NULL) || (dedup.indexes == NULL)) {
+        err = DEDUP_FAILED;
+    }
+
+    // Unchanged files are the ones with the same size and mtime as in the last run.
+    for (i = 0; !err && (i < files.size); ++i) {
+        old = manifest_find(&last, files.items[i].path);
+        if (old != NULL) seen[old - last.files.items] = 1;
+        if ((old != NULL) && (old->size == files.items[i].size) && (old->mtime_sec == files.items[i].mtime_sec) &&
+            (old->mtime_nsec == files.items[i].mtime_nsec) && ((old->chunks_count > 0) || (old->size == 0))) {
+            files.items[i].chunks = old->chunks;
+            files.items[i].chunks_count = old->chunks_count;
+            old->chunks = NULL;
+            old->chunks_count = 0;
+        } else {
+            dedup.indexes[changed++] = i;
+        }
+    }
+    for (i = 0; !err && (i < last.files.size); ++i) {
+        removed += !seen[i];
+    }
+
+    if (!err && (changed == 0) && (removed == 0)) {
+        err = DEDUP_UNCHANGED;
+    } else if (!err) {
+        err = run_parallel(backup_file, &dedup, changed) ? DEDUP_FAILED : DEDUP_OK;
+    }
+
+    // New run becomes the last one only after all its chunks are stored.
+    if (err == DEDUP_OK) {
+        if ((link_path = malloc(strlen(last_path) + 5)) == NULL) {
+            err = DEDUP_FAILED;
+        } else {
+            sprintf(link_path, "%s.tmp", last_path);
+            unlink(link_path);
+            if (manifest_save(run_path, &files) || (symlink(path, link_path) != 0) || (rename(link_path, last_path) != 0)) {
+                fprintf(stderr, "Can't write run \"%s\".\n", run_path);
+                err = DEDUP_FAILED;
+            }
+        }
+    }
+
+    free(link_path);
+    free(run_path);
+    free(path);
+    free(last_path);
+    free(dedup.indexes);
+    free(seen);
+    file_list_free(&files);
+    manifest_free(&last);
+    return err;
+}
+
+// Creates all missing parent directories of the path.
+static char make_parents(char *path) {
+    char *slash;
+    char err = 0;
+
+    for (slash = strchr(path + 1, '/'); !err && (slash != NULL); slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        err = (mkdir(path, 0755) == -1) && (errno != EEXIST);
+        *slash = '/';
+    }
+    return err;
+}
+
+// Writes file of the run from its chunks.
+static char restore_file(void *arg, size_t i) {
+    struct DedupFiles *dedup = arg;
+    struct FileInfo *file = &dedup->files->items[i];
+    struct timespec times[2];
+    unsigned char *data;
+    size_t k, size;
+    char *path;
+    char err = 0;
+    int fd = -1;
+
+    if (((path = join_paths(dedup->root, file->path)) == NULL) || ((data = malloc(CHUNK_SIZE_MAX)) == NULL)) {
+        free(path);
+        return 1;
+    }
+    if (make_parents(path) || ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1)) {
+        fprintf(stderr, "Can't create file \"%s\".\n", path);
+        err = 1;
+    }
+    for (k = 0; !err && (k < file->chunks_count); ++k) {
+        if (store_get(dedup->store, file->chunks + k * CHUNK_HASH_SIZE, data, &size)) {
+            fprintf(stderr, "Chunk of file \"%s\" is missing or broken.\n", path);
+            err = 1;
+        } else {
+            err = write(fd, data, size) != (ssize_t)size;
+        }
+    }
+    if (!err) {
+        times[0].tv_sec = times[1].tv_sec = file->mtime_sec;
+        times[0].tv_nsec = times[1].tv_nsec = file->mtime_nsec;
+        futimens(fd, times);
+    }
+    if ((fd != -1) && (close(fd) != 0)) err = 1;
+
+    free(data);
+    free(path);
+    return err;
+}
+
+char dedup_restore(const char *store, const char *run, const char *target) {
+    struct Manifest manifest;
+    struct DedupFiles dedup;
+    char *path, *run_path = NULL;
+    char err = 0;
+
+    if (((path = join_paths(STORE_RUNS_DIR, run)) == NULL) || ((run_path = join_paths(store, path)) == NULL) ||
+        (access(run_path, R_OK) != 0) || manifest_load(run_path, &manifest)) {
+        fprintf(stderr, "Can't read run \"%s\" of store \"%s\".\n", run, store);
+        free(run_path);
+        free(path);
+        return DEDUP_FAILED;
+    }
+    free(run_path);
+    free(path);
+
+    if (mkdir(target, 0755) == -1) {
+        fprintf(stderr, "Can't create directory \"%s\": %s.\n", target, strerror(errno));
+        err = 1;
+    }
+    if (!err) {
+        dedup.store = store;
+        dedup.root = target;
+        dedup.files = &manifest.files;
+        dedup.indexes = NULL;
+        err = run_parallel(restore_file, &dedup, manifest.files.size);
+    }
+
+    manifest_free(&manifest);
+    return err ? DEDUP_FAILED : DEDUP_OK;
+}
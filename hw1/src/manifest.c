@@ -0,0 +1,154 @@
+#include <manifest.h>
+#include <stdint.h>
+
+// FNV-1a.
+static size_t hash_path(const char *path) {
+    uint64_t hash = 14695981039346656037ULL;
+    const char *c;
+
+    for (c = path; *c; ++c) {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+static char manifest_index_build(struct Manifest *manifest) {
+    size_t i, slot;
+
+    // Load factor is kept under 1/2.
+    manifest->index_capacity = 16;
+    while (manifest->index_capacity < manifest->files.size * 2) manifest->index_capacity *= 2;
+    if ((manifest->index = calloc(manifest->index_capacity, sizeof(size_t))) == NULL) {
+        return 1;
+    }
+    for (i = 0; i < manifest->files.size; ++i) {
+        slot = hash_path(manifest->files.items[i].path) & (manifest->index_capacity - 1);
+        while (manifest->index[slot] != 0) slot = (slot + 1) & (manifest->index_capacity - 1);
+        manifest->index[slot] = i + 1;
+    }
+    return 0;
+}
+
+char manifest_load(const char *file_name, struct Manifest *manifest) {
+    unsigned long long size;
+    long long mtime_sec;
+    long mtime_nsec;
+    char *data = NULL, *record, *end, *path;
+    size_t data_size = 0, data_capacity = 0, n, chunks_count = 0;
+    struct FileInfo *file;
+    FILE *stream;
+    char err = 0, with_chunks = 0;
+
+    manifest->files.items = NULL;
+    manifest->files.size = manifest->files.capacity = 0;
+    manifest->index = NULL;
+    manifest->index_capacity = 0;
+
+    if ((stream = fopen(file_name, "rb")) != NULL) {
+        do {
+            if (data_size == data_capacity) {
+                data_capacity = data_capacity ? data_capacity * 2 : 65536;
+                if ((record = realloc(data, data_capacity + 1)) == NULL) {
+                    err = 1;
+                    break;
+                }
+                data = record;
+            }
+            n = fread(data + data_size, 1, data_capacity - data_size, stream);
+            data_size += n;
+        } while (n > 0);
+        err |= ferror(stream) ? 1 : 0;
+        fclose(stream);
+    }
+
+    record = data;
+    if ((data_size >= sizeof(MANIFEST_HEADER)) && (memcmp(data, MANIFEST_HEADER, sizeof(MANIFEST_HEADER)) == 0)) {
+        record += sizeof(MANIFEST_HEADER);
+        with_chunks = 1;
+    }
+    for (; !err && (record < data + data_size); record = end + 1 + chunks_count * CHUNK_HASH_SIZE) {
+        if ((end = memchr(record, '\0', data + data_size - record)) == NULL) {
+            err = 1;
+            break;
+        }
+        size = strtoull(record, &path, 10);
+        mtime_sec = strtoll(path, &path, 10);
+        mtime_nsec = strtol(path, &path, 10);
+        chunks_count = with_chunks ? strtoull(path, &path, 10) : 0;
+        if ((*path != ' ') || (path + 1 == end) ||
+            (chunks_count > (size_t)(data + data_size - end - 1) / CHUNK_HASH_SIZE)) {
+            err = 1;
+            break;
+        }
+        if ((path = strdup(path + 1)) == NULL) {
+            err = 1;
+        } else if (file_list_push(&manifest->files, path, size, mtime_sec, mtime_nsec)) {
+            free(path);
+            err = 1;
+        } else if (chunks_count > 0) {
+            file = &manifest->files.items[manifest->files.size - 1];
+            if ((file->chunks = malloc(chunks_count * CHUNK_HASH_SIZE)) == NULL) {
+                err = 1;
+            } else {
+                memcpy(file->chunks, end + 1, chunks_count * CHUNK_HASH_SIZE);
+                file->chunks_count = chunks_count;
+            }
+        }
+    }
+    free(data);
+
+    if (!err) err = manifest_index_build(manifest);
+    if (err) manifest_free(manifest);
+    return err;
+}
+
+struct FileInfo *manifest_find(const struct Manifest *manifest, const char *path) {
+    size_t slot;
+
+    if (manifest->index_capacity == 0) return NULL;
+    slot = hash_path(path) & (manifest->index_capacity - 1);
+    for (; manifest->index[slot] != 0; slot = (slot + 1) & (manifest->index_capacity - 1)) {
+        if (strcmp(manifest->files.items[manifest->index[slot] - 1].path, path) == 0) {
+            return &manifest->files.items[manifest->index[slot] - 1];
+        }
+    }
+    return NULL;
+}
+
+char manifest_save(const char *file_name, const struct FileList *files) {
+    char *tmp_name;
+    FILE *file;
+    size_t i;
+    char err = 0;
+
+    // Written next to the old manifest and renamed over it, so a failed run keeps the old one.
+    if ((tmp_name = malloc(strlen(file_name) + 5)) == NULL) return 1;
+    sprintf(tmp_name, "%s.tmp", file_name);
+    if ((file = fopen(tmp_name, "wb")) == NULL) {
+        free(tmp_name);
+        return 1;
+    }
+    err = fwrite(MANIFEST_HEADER, sizeof(MANIFEST_HEADER), 1, file) != 1;
+    for (i = 0; !err && (i < files->size); ++i) {
+        if (files->items[i].path == NULL) continue;
+        err = fprintf(file, "%llu %lld %ld %zu %s", files->items[i].size, files->items[i].mtime_sec,
+                      files->items[i].mtime_nsec, files->items[i].chunks_count, files->items[i].path) < 0;
+        err |= fputc('\0', file) == EOF;
+        if (!err && (files->items[i].chunks_count > 0)) {
+            err = fwrite(files->items[i].chunks, files->items[i].chunks_count * CHUNK_HASH_SIZE, 1, file) != 1;
+        }
+    }
+    err |= (fclose(file) != 0);
+    if (!err) err = rename(tmp_name, file_name) != 0;
+    if (err) remove(tmp_name);
+    free(tmp_name);
+    return err;
+}
+
+void manifest_free(struct Manifest *manifest) {
+    file_list_free(&manifest->files);
+    free(manifest->index);
+    manifest->index = NULL;
+    manifest->index_capacity = 0;
+}
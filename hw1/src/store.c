@@ -0,0 +1,210 @@
+#include <store.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+
+#define CHUNKER_BUFFER_SIZE (16 * CHUNK_SIZE_MAX)
+#define CHUNK_MASK_STRICT   (((1ULL << 15) - 1) << 49)  // 2 bits more than the average size needs
+#define CHUNK_MASK_LOOSE    (((1ULL << 11) - 1) << 53)  // 2 bits less
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// Fixed pseudo-random table (splitmix64), so the same content is always cut the same way.
+static void gear_init(void) {
+    uint64_t state = 0x6261636B7570ULL, z;
+    int i;
+
+    for (i = 0; i < 256; ++i) {
+        z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+char chunker_init(struct Chunker *chunker, int fd) {
+    pthread_once(&gear_once, gear_init);
+    chunker->fd = fd;
+    chunker->start = chunker->end = 0;
+    chunker->eof = 0;
+    return (chunker->buffer = malloc(CHUNKER_BUFFER_SIZE)) == NULL;
+}
+
+char chunker_next(struct Chunker *chunker, const unsigned char **chunk_holder, size_t *size_holder) {
+    const unsigned char *data;
+    uint64_t hash = 0;
+    size_t len, cut, limit, i;
+    ssize_t n;
+
+    // At least the longest chunk is kept in the buffer.
+    if (!chunker->eof && (chunker->end - chunker->start < CHUNK_SIZE_MAX)) {
+        memmove(chunker->buffer, chunker->buffer + chunker->start, chunker->end - chunker->start);
+        chunker->end -= chunker->start;
+        chunker->start = 0;
+        while (!chunker->eof && (chunker->end < CHUNKER_BUFFER_SIZE)) {
+            n = read(chunker->fd, chunker->buffer + chunker->end, CHUNKER_BUFFER_SIZE - chunker->end);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return 1;
+            }
+            chunker->eof = (n == 0);
+            chunker->end += n;
+        }
+    }
+
+    data = chunker->buffer + chunker->start;
+    len = chunker->end - chunker->start;
+    cut = (len < CHUNK_SIZE_MAX) ? len : CHUNK_SIZE_MAX;
+    if (len > CHUNK_SIZE_MIN) {
+        limit = (len < CHUNK_SIZE_AVG) ? len : CHUNK_SIZE_AVG;
+        for (i = CHUNK_SIZE_MIN; i < limit; ++i) {
+            hash = (hash << 1) + gear[data[i]];
+            if (!(hash & CHUNK_MASK_STRICT)) break;
+        }
+        if (i == limit) {
+            for (limit = cut; i < limit; ++i) {
+                hash = (hash << 1) + gear[data[i]];
+                if (!(hash & CHUNK_MASK_LOOSE)) break;
+            }
+        }
+        if (i < cut) cut = i + 1;
+    }
+
+    *chunk_holder = data;
+    *size_holder = cut;
+    chunker->start += cut;
+    return 0;
+}
+
+void chunker_free(struct Chunker *chunker) {
+    free(chunker->buffer);
+    chunker->buffer = NULL;
+}
+
+static char *get_store_path(const char *store, const char *dir, const char *name) {
+    char *path = malloc(strlen(store) + strlen(dir) + strlen(name) + 3);
+
+    if (path != NULL) {
+        sprintf(path, "%s/%s%s%s", store, dir, (name[0] != '\0') ? "/" : "", name);
+    }
+    return path;
+}
+
+static char make_dir(const char *path) {
+    return (mkdir(path, 0755) == -1) && (errno != EEXIST);
+}
+
+char store_init(const char *store) {
+    char name[3];
+    char *path;
+    char err;
+    int i;
+
+    if (make_dir(store)) return 1;
+    if ((path = get_store_path(store, STORE_RUNS_DIR, "")) == NULL) return 1;
+    err = make_dir(path);
+    free(path);
+    if (err || ((path = get_store_path(store, STORE_CHUNKS_DIR, "")) == NULL)) return 1;
+    err = make_dir(path);
+    free(path);
+
+    for (i = 0; !err && (i < 256); ++i) {
+        sprintf(name, "%02x", i);
+        if ((path = get_store_path(store, STORE_CHUNKS_DIR, name)) == NULL) return 1;
+        err = make_dir(path);
+        free(path);
+    }
+    return err;
+}
+
+// "chunks/XX/HASH" for chunk's hash.
+static char *get_chunk_path(const char *store, const unsigned char *hash) {
+    char name[3 + 2 * CHUNK_HASH_SIZE + 1];
+    int i;
+
+    sprintf(name, "%02x/", hash[0]);
+    for (i = 0; i < CHUNK_HASH_SIZE; ++i) {
+        sprintf(name + 3 + 2 * i, "%02x", hash[i]);
+    }
+    return get_store_path(store, STORE_CHUNKS_DIR, name);
+}
+
+char store_put(const char *store, const unsigned char *data, size_t size, unsigned char *hash_holder, char *written_holder) {
+    unsigned char *packed = NULL;
+    uLongf packed_size;
+    char *path, *tmp_path = NULL;
+    char err = 0;
+    int fd, i;
+
+    if (written_holder != NULL) *written_holder = 0;
+    if ((size > CHUNK_SIZE_MAX) || !EVP_Digest(data, size, hash_holder, NULL, EVP_sha256(), NULL)) {
+        return 1;
+    }
+    if ((path = get_chunk_path(store, hash_holder)) == NULL) return 1;
+    if (access(path, F_OK) == 0) {
+        free(path);
+        return 0;
+    }
+
+    packed_size = compressBound(size);
+    if (((packed = malloc(4 + packed_size)) == NULL) || ((tmp_path = malloc(strlen(path) + 8)) == NULL) ||
+        (compress2(packed + 4, &packed_size, data, size, Z_DEFAULT_COMPRESSION) != Z_OK)) {
+        err = 1;
+    }
+    for (i = 0; !err && (i < 4); ++i) {
+        packed[i] = (size >> (8 * i)) & 0xFF;
+    }
+
+    // Written under a unique name and renamed, so readers never see a partial chunk.
+    if (!err) {
+        sprintf(tmp_path, "%s.XXXXXX", path);
+        if ((fd = mkstemp(tmp_path)) == -1) {
+            err = 1;
+        } else {
+            err = write(fd, packed, 4 + packed_size) != (ssize_t)(4 + packed_size);
+            err |= (close(fd) != 0);
+            if (!err) err = rename(tmp_path, path) != 0;
+            if (err) unlink(tmp_path);
+        }
+    }
+    if (!err && (written_holder != NULL)) *written_holder = 1;
+
+    free(tmp_path);
+    free(packed);
+    free(path);
+    return err;
+}
+
+char store_get(const char *store, const unsigned char *hash, unsigned char *data_holder, size_t *size_holder) {
+    unsigned char packed[4 + CHUNK_SIZE_MAX + CHUNK_SIZE_MAX / 64 + 64];
+    unsigned char check[CHUNK_HASH_SIZE];
+    uLongf size = CHUNK_SIZE_MAX;
+    size_t size_stored = 0;
+    ssize_t n;
+    char *path;
+    int fd, i;
+
+    if ((path = get_chunk_path(store, hash)) == NULL) return 1;
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1) return 1;
+    n = read(fd, packed, sizeof(packed));
+    close(fd);
+    if (n < 4) return 1;
+
+    for (i = 0; i < 4; ++i) {
+        size_stored |= (size_t)packed[i] << (8 * i);
+    }
+    if ((uncompress(data_holder, &size, packed + 4, n - 4) != Z_OK) || (size != size_stored) ||
+        !EVP_Digest(data_holder, size, check, NULL, EVP_sha256(), NULL) || (memcmp(check, hash, CHUNK_HASH_SIZE) != 0)) {
+        return 1;
+    }
+    *size_holder = size;
+    return 0;
+}
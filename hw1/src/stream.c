@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include <stream.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#define STREAM_JOBS_PER_THREAD 2
+#define STREAM_SALT_SIZE       8
+
+#define JOB_FREE        0
+#define JOB_READY       1
+#define JOB_COMPRESSING 2
+#define JOB_DONE        3
+
+// One block of input. Blocks are raw deflate streams ending on a byte boundary (sync flush),
+//  each primed with the end of the previous block, so together they are a single deflate stream.
+struct CompressJob {
+    unsigned char *in;
+    size_t in_size;
+    unsigned char dict[STREAM_DICT_SIZE];
+    size_t dict_size;
+    unsigned char *out;
+    size_t out_size;
+    size_t out_capacity;
+    unsigned long crc;
+    char last;
+    char state;
+};
+
+struct ArchiveStream {
+    FILE *file;
+    EVP_CIPHER_CTX *cipher;
+    unsigned int threads;
+    pthread_t compressors[STREAM_THREADS_MAX];
+    pthread_t writer;
+    unsigned int compressors_started;
+    char writer_started;
+
+    // Ring of jobs: filled by the writing thread, compressed by any compressor, written in order.
+    struct CompressJob *jobs;
+    size_t jobs_count;
+    size_t next_fill;
+    size_t next_compress;
+    size_t next_write;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+
+    unsigned char tail[STREAM_DICT_SIZE];  // end of the input filled so far
+    size_t tail_size;
+    char closed;
+    char err;
+};
+
+static void stream_fail(struct ArchiveStream *stream) {
+    pthread_mutex_lock(&stream->lock);
+    stream->err = 1;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+static char stream_failed(struct ArchiveStream *stream) {
+    char err;
+    pthread_mutex_lock(&stream->lock);
+    err = stream->err;
+    pthread_mutex_unlock(&stream->lock);
+    return err;
+}
+
+static char compress_job(z_stream *z, struct CompressJob *job) {
+    unsigned char *out_new;
+    size_t capacity_new;
+    int res;
+
+    if ((deflateReset(z) != Z_OK) ||
+        ((job->dict_size > 0) && (deflateSetDictionary(z, job->dict, job->dict_size) != Z_OK))) {
+        return 1;
+    }
+    capacity_new = deflateBound(z, job->in_size) + 64;
+    if (job->out_capacity < capacity_new) {
+        if ((out_new = realloc(job->out, capacity_new)) == NULL) return 1;
+        job->out = out_new;
+        job->out_capacity = capacity_new;
+    }
+
+    z->next_in = job->in;
+    z->avail_in = job->in_size;
+    z->next_out = job->out;
+    z->avail_out = job->out_capacity;
+    res = deflate(z, job->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if ((res != (job->last ? Z_STREAM_END : Z_OK)) || (z->avail_in != 0)) {
+        return 1;
+    }
+    job->out_size = job->out_capacity - z->avail_out;
+    job->crc = crc32(crc32(0L, Z_NULL, 0), job->in, job->in_size);
+    return 0;
+}
+
+static void *compressor_worker(void *arg) {
+    struct ArchiveStream *stream = arg;
+    struct CompressJob *job;
+    z_stream z;
+    char err;
+
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        stream_fail(stream);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    while (1) {
+        job = &stream->jobs[stream->next_compress % stream->jobs_count];
+        while (!stream->err && (job->state != JOB_READY) && !(stream->closed && (stream->next_compress == stream->next_fill))) {
+            pthread_cond_wait(&stream->changed, &stream->lock);
+            job = &stream->jobs[stream->next_compress % stream->jobs_count];
+        }
+        if (stream->err || (job->state != JOB_READY)) break;
+        job->state = JOB_COMPRESSING;
+        ++stream->next_compress;
+        pthread_mutex_unlock(&stream->lock);
+
+        err = compress_job(&z, job);
+
+        pthread_mutex_lock(&stream->lock);
+        if (err) {
+            stream->err = 1;
+        } else {
+            job->state = JOB_DONE;
+        }
+        pthread_cond_broadcast(&stream->changed);
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    deflateEnd(&z);
+    return NULL;
+}
+
+static char write_encrypted(struct ArchiveStream *stream, const unsigned char *data, size_t size, unsigned char *buffer) {
+    size_t chunk;
+    int n;
+
+    for (; size > 0; data += chunk, size -= chunk) {
+        chunk = (size < STREAM_BLOCK_SIZE) ? size : STREAM_BLOCK_SIZE;
+        if (!EVP_EncryptUpdate(stream->cipher, buffer, &n, data, chunk)) return 1;
+        if ((n > 0) && (fwrite(buffer, n, 1, stream->file) != 1)) return 1;
+    }
+    return 0;
+}
+
+// Encrypts and writes compressed blocks in order, wrapped into gzip header and trailer.
+static void *writer_worker(void *arg) {
+    static const unsigned char gzip_header[10] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 3};
+    struct ArchiveStream *stream = arg;
+    struct CompressJob *job;
+    unsigned char trailer[8];
+    unsigned char *buffer;
+    unsigned long crc = crc32(0L, Z_NULL, 0);
+    unsigned long long total = 0;
+    char err, last = 0;
+    int n, i;
+
+    if (((buffer = malloc(STREAM_BLOCK_SIZE + EVP_MAX_BLOCK_LENGTH)) == NULL) ||
+        write_encrypted(stream, gzip_header, sizeof(gzip_header), buffer)) {
+        free(buffer);
+        stream_fail(stream);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    while (!last) {
+        job = &stream->jobs[stream->next_write % stream->jobs_count];
+        while (!stream->err && (job->state != JOB_DONE)) {
+            pthread_cond_wait(&stream->changed, &stream->lock);
+        }
+        if (stream->err) break;
+        pthread_mutex_unlock(&stream->lock);
+
+        err = write_encrypted(stream, job->out, job->out_size, buffer);
+        crc = crc32_combine(crc, job->crc, job->in_size);
+        total += job->in_size;
+        last = job->last;
+
+        pthread_mutex_lock(&stream->lock);
+        if (err) {
+            stream->err = 1;
+        } else {
+            job->state = JOB_FREE;
+            ++stream->next_write;
+        }
+        pthread_cond_broadcast(&stream->changed);
+    }
+    err = stream->err;
+    pthread_mutex_unlock(&stream->lock);
+
+    if (!err) {
+        // CRC-32 and size modulo 2^32, little endian.
+        for (i = 0; i < 4; ++i) {
+            trailer[i] = (crc >> (8 * i)) & 0xFF;
+            trailer[4 + i] = (total >> (8 * i)) & 0xFF;
+        }
+        err = write_encrypted(stream, trailer, sizeof(trailer), buffer);
+        if (!err && (!EVP_EncryptFinal_ex(stream->cipher, buffer, &n) || ((n > 0) && (fwrite(buffer, n, 1, stream->file) != 1)))) {
+            err = 1;
+        }
+        if (err) stream_fail(stream);
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Hands the filled job to compressors and takes the next one.
+static char stream_dispatch(struct ArchiveStream *stream, char last) {
+    struct CompressJob *job = &stream->jobs[stream->next_fill % stream->jobs_count], *next;
+    size_t keep;
+    char err;
+
+    if (stream_failed(stream)) return 1;
+
+    // Dictionary of the next block is the end of everything before it.
+    job->dict_size = stream->tail_size;
+    memcpy(job->dict, stream->tail, stream->tail_size);
+    if (job->in_size >= STREAM_DICT_SIZE) {
+        memcpy(stream->tail, job->in + job->in_size - STREAM_DICT_SIZE, STREAM_DICT_SIZE);
+        stream->tail_size = STREAM_DICT_SIZE;
+    } else {
+        keep = (stream->tail_size + job->in_size > STREAM_DICT_SIZE) ? STREAM_DICT_SIZE - job->in_size : stream->tail_size;
+        memmove(stream->tail, stream->tail + stream->tail_size - keep, keep);
+        memcpy(stream->tail + keep, job->in, job->in_size);
+        stream->tail_size = keep + job->in_size;
+    }
+    job->last = last;
+
+    pthread_mutex_lock(&stream->lock);
+    job->state = JOB_READY;
+    ++stream->next_fill;
+    pthread_cond_broadcast(&stream->changed);
+    next = &stream->jobs[stream->next_fill % stream->jobs_count];
+    while (!last && !stream->err && (next->state != JOB_FREE)) {
+        pthread_cond_wait(&stream->changed, &stream->lock);
+    }
+    err = stream->err;
+    pthread_mutex_unlock(&stream->lock);
+
+    if (!last && !err) next->in_size = 0;
+    return err;
+}
+
+static ssize_t stream_write(void *cookie, const char *data, size_t size) {
+    struct ArchiveStream *stream = cookie;
+    struct CompressJob *job;
+    size_t written = 0, n;
+
+    if (stream_failed(stream)) return 0;
+    while (written < size) {
+        job = &stream->jobs[stream->next_fill % stream->jobs_count];
+        n = STREAM_BLOCK_SIZE - job->in_size;
+        if (n > size - written) n = size - written;
+        memcpy(job->in + job->in_size, data + written, n);
+        job->in_size += n;
+        written += n;
+        if ((job->in_size == STREAM_BLOCK_SIZE) && stream_dispatch(stream, 0)) {
+            return 0;
+        }
+    }
+    return written;
+}
+
+static void stream_free(struct ArchiveStream *stream) {
+    size_t i;
+
+    if (stream->jobs != NULL) {
+        for (i = 0; i < stream->jobs_count; ++i) {
+            free(stream->jobs[i].in);
+            free(stream->jobs[i].out);
+        }
+        free(stream->jobs);
+    }
+    if (stream->cipher != NULL) EVP_CIPHER_CTX_free(stream->cipher);
+    pthread_cond_destroy(&stream->changed);
+    pthread_mutex_destroy(&stream->lock);
+    free(stream);
+}
+
+// Stops all threads: after the last block is written on success, at once on failure.
+static char stream_finish(struct ArchiveStream *stream, char last_dispatched) {
+    unsigned int i;
+    char err;
+
+    pthread_mutex_lock(&stream->lock);
+    if (!last_dispatched) stream->err = 1;
+    stream->closed = 1;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+
+    if (stream->writer_started) pthread_join(stream->writer, NULL);
+    // Writer is done with all jobs (or failed), compressors have nothing left.
+    pthread_mutex_lock(&stream->lock);
+    stream->err |= !stream->writer_started;
+    err = stream->err;
+    if (err) pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+    for (i = 0; i < stream->compressors_started; ++i) {
+        pthread_join(stream->compressors[i], NULL);
+    }
+
+    err |= (fclose(stream->file) != 0);
+    stream_free(stream);
+    return err;
+}
+
+static int stream_close(void *cookie) {
+    struct ArchiveStream *stream = cookie;
+    char last_dispatched = !stream_dispatch(stream, 1);
+    return stream_finish(stream, last_dispatched) ? EOF : 0;
+}
+
+FILE *stream_open(const char *file_name, const char *password) {
+    cookie_io_functions_t functions = {NULL, stream_write, NULL, stream_close};
+    unsigned char salt[STREAM_SALT_SIZE];
+    unsigned char key_iv[32 + 16];
+    struct ArchiveStream *stream;
+    FILE *file;
+    size_t i;
+    long cpus;
+    char err = 0;
+
+    if ((stream = calloc(1, sizeof(struct ArchiveStream))) == NULL) return NULL;
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->changed, NULL);
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    stream->threads = (cpus < 1) ? 1 : ((cpus > STREAM_THREADS_MAX) ? STREAM_THREADS_MAX : cpus);
+    stream->jobs_count = stream->threads * STREAM_JOBS_PER_THREAD + 2;
+    if ((stream->jobs = calloc(stream->jobs_count, sizeof(struct CompressJob))) == NULL) {
+        stream_free(stream);
+        return NULL;
+    }
+    for (i = 0; i < stream->jobs_count; ++i) {
+        if ((stream->jobs[i].in = malloc(STREAM_BLOCK_SIZE)) == NULL) err = 1;
+    }
+
+    // Same key and IV as openssl enc derives from password and salt.
+    if (!err) {
+        err = (RAND_bytes(salt, sizeof(salt)) != 1) ||
+              (PKCS5_PBKDF2_HMAC(password, strlen(password), salt, sizeof(salt), STREAM_PBKDF2_ITER,
+                                 EVP_sha512(), sizeof(key_iv), key_iv) != 1) ||
+              ((stream->cipher = EVP_CIPHER_CTX_new()) == NULL) ||
+              (EVP_EncryptInit_ex(stream->cipher, EVP_aes_256_cbc(), NULL, key_iv, key_iv + 32) != 1);
+    }
+    if (err || ((stream->file = fopen(file_name, "wb")) == NULL)) {
+        stream_free(stream);
+        return NULL;
+    }
+    if ((fwrite("Salted__", 8, 1, stream->file) != 1) || (fwrite(salt, sizeof(salt), 1, stream->file) != 1)) {
+        stream_finish(stream, 0);
+        return NULL;
+    }
+
+    for (; stream->compressors_started < stream->threads; ++stream->compressors_started) {
+        if (pthread_create(&stream->compressors[stream->compressors_started], NULL, compressor_worker, stream)) break;
+    }
+    stream->writer_started = (stream->compressors_started > 0) && !pthread_create(&stream->writer, NULL, writer_worker, stream);
+    if (!stream->writer_started || ((file = fopencookie(stream, "w", functions)) == NULL)) {
+        stream_finish(stream, 0);
+        return NULL;
+    }
+    setvbuf(file, NULL, _IOFBF, STREAM_BLOCK_SIZE);
+    return file;
+}
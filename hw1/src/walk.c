@@ -0,0 +1,239 @@
+#include <walk.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Directories are read by a few threads sharing one stack of directories still to read.
+// Reading a directory costs a few system calls, so a single lock taken twice per directory is cheap.
+struct FileWalk {
+    const char *root;
+    const char **extensions;
+    size_t extensions_count;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char **dirs;            // paths relative to root, '' for root itself
+    size_t dirs_count;
+    size_t dirs_capacity;
+    unsigned int busy;      // threads reading a directory, they may add more
+    struct FileList *list;
+    char result;
+};
+
+char file_list_push(struct FileList *list, char *path, unsigned long long size, long long mtime_sec, long mtime_nsec) {
+    struct FileInfo *items_new;
+    size_t capacity_new;
+
+    if (list->size == list->capacity) {
+        capacity_new = list->capacity ? list->capacity * 2 : 256;
+        if ((items_new = realloc(list->items, capacity_new * sizeof(struct FileInfo))) == NULL) {
+            return 1;
+        }
+        list->items = items_new;
+        list->capacity = capacity_new;
+    }
+    list->items[list->size].path = path;
+    list->items[list->size].size = size;
+    list->items[list->size].mtime_sec = mtime_sec;
+    list->items[list->size].mtime_nsec = mtime_nsec;
+    list->items[list->size].chunks = NULL;
+    list->items[list->size].chunks_count = 0;
+    ++list->size;
+    return 0;
+}
+
+static int compare_files(const void *a, const void *b) {
+    return strcmp(((const struct FileInfo *)a)->path, ((const struct FileInfo *)b)->path);
+}
+
+void file_list_sort(struct FileList *list) {
+    if (list->size > 1) qsort(list->items, list->size, sizeof(struct FileInfo), compare_files);
+}
+
+void file_list_free(struct FileList *list) {
+    size_t i;
+
+    for (i = 0; i < list->size; ++i) {
+        free(list->items[i].path);
+        free(list->items[i].chunks);
+    }
+    free(list->items);
+    list->items = NULL;
+    list->size = list->capacity = 0;
+}
+
+const char *get_extension(const char *name) {
+    const char *dot = strrchr(name, '.');
+    return dot ? dot + 1 : name;
+}
+
+static char is_valid_extension(struct FileWalk *walk, const char *name) {
+    const char *extension = get_extension(name);
+    size_t i;
+
+    for (i = 0; i < walk->extensions_count; ++i) {
+        if (strcmp(walk->extensions[i], extension) == 0) return 1;
+    }
+    return 0;
+}
+
+static char *join_path(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir), name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+
+    if (path == NULL) return NULL;
+    if (dir_len == 0) {
+        memcpy(path, name, name_len + 1);
+    } else {
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, name, name_len + 1);
+    }
+    return path;
+}
+
+static char dirs_push(char ***dirs, size_t *count, size_t *capacity, char *path) {
+    char **dirs_new;
+    size_t capacity_new;
+
+    if (path == NULL) return 1;
+    if (*count == *capacity) {
+        capacity_new = *capacity ? *capacity * 2 : 16;
+        if ((dirs_new = realloc(*dirs, capacity_new * sizeof(char *))) == NULL) {
+            free(path);
+            return 1;
+        }
+        *dirs = dirs_new;
+        *capacity = capacity_new;
+    }
+    (*dirs)[(*count)++] = path;
+    return 0;
+}
+
+// Reads directory, matching files and subdirectories are collected into lists of the caller.
+static char read_dir(struct FileWalk *walk, const char *dir_path, struct FileList *files, char ***dirs, size_t *dirs_count, size_t *dirs_capacity) {
+    struct dirent *entry;
+    struct stat st;
+    char *full_path, *path;
+    DIR *dir;
+    char err = 0;
+
+    full_path = (dir_path[0] == '\0') ? strdup(walk->root) : join_path(walk->root, dir_path);
+    if (full_path == NULL) return 1;
+    if ((dir = opendir(full_path)) == NULL) {
+        fprintf(stderr, "Can't read directory \"%s\": %s.\n", full_path, strerror(errno));
+        free(full_path);
+        return 0;
+    }
+    free(full_path);
+
+    while (!err && ((entry = readdir(dir)) != NULL)) {
+        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) continue;
+        // Type from the directory entry saves stat of skipped files.
+        if ((entry->d_type == DT_REG) && !is_valid_extension(walk, entry->d_name)) continue;
+        if ((entry->d_type != DT_REG) && (entry->d_type != DT_DIR) && (entry->d_type != DT_UNKNOWN)) continue;
+
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) continue;
+        if (S_ISDIR(st.st_mode)) {
+            err = dirs_push(dirs, dirs_count, dirs_capacity, join_path(dir_path, entry->d_name));
+        } else if (S_ISREG(st.st_mode) && is_valid_extension(walk, entry->d_name)) {
+            err = ((path = join_path(dir_path, entry->d_name)) == NULL) ||
+                  file_list_push(files, path, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+            if (err) free(path);
+        }
+    }
+    closedir(dir);
+    return err;
+}
+
+static void *walk_worker(void *arg) {
+    struct FileWalk *walk = arg;
+    struct FileList files = {NULL, 0, 0};
+    char **dirs = NULL;
+    size_t dirs_count = 0, dirs_capacity = 0, i;
+    char *path;
+    char err;
+
+    pthread_mutex_lock(&walk->lock);
+    while (1) {
+        // Stack may get more directories while some thread is still reading.
+        while ((walk->dirs_count == 0) && (walk->busy > 0) && (walk->result == 0)) {
+            pthread_cond_wait(&walk->changed, &walk->lock);
+        }
+        if ((walk->dirs_count == 0) || (walk->result != 0)) break;
+        path = walk->dirs[--walk->dirs_count];
+        ++walk->busy;
+        pthread_mutex_unlock(&walk->lock);
+
+        err = read_dir(walk, path, &files, &dirs, &dirs_count, &dirs_capacity);
+        free(path);
+
+        // Found files and subdirectories are handed over at once.
+        pthread_mutex_lock(&walk->lock);
+        for (i = 0; !err && (i < files.size); ++i) {
+            err = file_list_push(walk->list, files.items[i].path, files.items[i].size,
+                                 files.items[i].mtime_sec, files.items[i].mtime_nsec);
+            if (!err) files.items[i].path = NULL;
+        }
+        for (i = 0; !err && (i < dirs_count); ++i) {
+            err = dirs_push(&walk->dirs, &walk->dirs_count, &walk->dirs_capacity, dirs[i]);
+            dirs[i] = NULL;
+        }
+        if (err) walk->result = 1;
+        --walk->busy;
+        pthread_cond_broadcast(&walk->changed);
+        pthread_mutex_unlock(&walk->lock);
+
+        for (i = 0; i < dirs_count; ++i) free(dirs[i]);
+        dirs_count = 0;
+        file_list_free(&files);
+        pthread_mutex_lock(&walk->lock);
+    }
+    pthread_mutex_unlock(&walk->lock);
+
+    free(dirs);
+    return NULL;
+}
+
+char walk_files(const char *root, const char **extensions, size_t extensions_count, struct FileList *list) {
+    struct FileWalk walk;
+    pthread_t threads[WALK_THREADS_MAX];
+    unsigned int threads_count, started, i;
+    long cpus;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads_count = (cpus < 1) ? 1 : ((cpus > WALK_THREADS_MAX) ? WALK_THREADS_MAX : cpus);
+    walk.root = root;
+    walk.extensions = extensions;
+    walk.extensions_count = extensions_count;
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.changed, NULL);
+    walk.dirs = NULL;
+    walk.dirs_count = walk.dirs_capacity = 0;
+    walk.busy = 0;
+    walk.list = list;
+    walk.result = 0;
+
+    // Root is the first directory, as an empty relative path.
+    if (dirs_push(&walk.dirs, &walk.dirs_count, &walk.dirs_capacity, calloc(1, 1))) {
+        walk.result = 1;
+    } else {
+        // Calling thread works as one of the threads.
+        for (started = 1; started < threads_count; ++started) {
+            if (pthread_create(&threads[started], NULL, walk_worker, &walk)) break;
+        }
+        walk_worker(&walk);
+        for (i = 1; i < started; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    // Directories left after a failure.
+    for (i = 0; i < walk.dirs_count; ++i) free(walk.dirs[i]);
+    free(walk.dirs);
+    pthread_cond_destroy(&walk.changed);
+    pthread_mutex_destroy(&walk.lock);
+    return walk.result;
+}
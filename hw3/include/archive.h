@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <string.h>
+
+// Tar archive (ustar) is a sequence of 512-byte blocks:
+//  each entry is a header block followed by its data padded to the block size,
+//  and two zero blocks mark the end.
+#define ARCHIVE_BLOCK_SIZE 512
+#define ARCHIVE_PATH_MAX   4096
+
+#define ARCHIVE_TYPE_REGULAR    '0'
+#define ARCHIVE_TYPE_DIRECTORY  '5'
+#define ARCHIVE_TYPE_LONG_NAME  'L'  // GNU: data is the path of the next entry
+#define ARCHIVE_TYPE_PAX        'x'  // pax: data is attributes of the next entry
+#define ARCHIVE_TYPE_PAX_GLOBAL 'g'  // pax: data is attributes of all entries
+
+#define ARCHIVE_READ_OK     0
+#define ARCHIVE_READ_END    1
+#define ARCHIVE_READ_BROKEN 2
+
+struct ArchiveHeader {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char link_name[100];
+    char magic[6];
+    char version[2];
+    char user_name[32];
+    char group_name[32];
+    char dev_major[8];
+    char dev_minor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+/*
+ * Function: archive_header_read
+ * --------------------
+ * Reads the next entry's header, GNU long names and pax headers included.
+ * Stream is left at the beginning of entry's data.
+ *
+ * file:            archive stream
+ * path_holder:     holder for entry's path (ARCHIVE_PATH_MAX bytes)
+ * type_holder:     holder for entry's type (old regular file type is reported as ARCHIVE_TYPE_REGULAR)
+ * size_holder:     holder for entry's data size
+ *
+ *  returns: ARCHIVE_READ_OK <=> entry's header was read,
+ *           ARCHIVE_READ_END <=> end of archive was reached,
+ *           ARCHIVE_READ_BROKEN <=> stream is not a valid archive.
+ */
+char archive_header_read(FILE *file, char *path_holder, char *type_holder, unsigned long long *size_holder);
+
+/*
+ * Function: archive_header_write
+ * --------------------
+ * Writes entry's header. Path which doesn't fit into ustar header
+ *  is written as GNU long name entry first.
+ *
+ * file:            archive stream
+ * path:            entry's path
+ * type:            entry's type
+ * size:            entry's data size
+ *
+ *  returns: 0 <=> header was written successfully.
+ */
+char archive_header_write(FILE *file, const char *path, char type, unsigned long long size);
+
+/*
+ * Function: archive_end_write
+ * --------------------
+ * Writes end of archive mark.
+ *
+ *  returns: 0 <=> mark was written successfully.
+ */
+char archive_end_write(FILE *file);
+
+/*
+ * Function: archive_padding
+ * --------------------
+ * Gets number of zero bytes following data of provided size.
+ */
+size_t archive_padding(unsigned long long size);
+
+/*
+ * Function: archive_skip
+ * --------------------
+ * Skips bytes of a stream, which may be a pipe.
+ *
+ *  returns: 0 <=> bytes were skipped successfully.
+ */
+char archive_skip(FILE *file, unsigned long long size);
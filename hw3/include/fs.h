@@ -1,26 +1,67 @@
 #include <fs_core.h>
 
-void cmd_pwd(FILE *fs, inode_pointer_t inode_p, char *buffer, int endline);
+// File content shown by cat and read has to fit into a reply along with current directory.
+// Reply is a string, so NUL bytes go as "\0" and backslashes as "\\", doubling the size at most.
+#define OUTPUT_SIZE_MAX (BUFFER_SIZE / 2)
+#define READ_SIZE_MAX   (OUTPUT_SIZE_MAX / 2)
 
-void cmd_mkdir(FILE *fs, inode_pointer_t inode_p, const char *name, char *buffer);
+void cmd_pwd(int fs, inode_pointer_t inode_p, char *buffer, int endline);
 
-void cmd_rmdir(FILE *fs, inode_pointer_t inode_p, const char *name, char *buffer);
+void cmd_mkdir(int fs, inode_pointer_t inode_p, const char *name, char *buffer);
 
-inode_pointer_t cmd_cd(FILE *fs, inode_pointer_t inode_p, const char *target, char *buffer);
+void cmd_rmdir(int fs, inode_pointer_t inode_p, const char *name, char *buffer);
 
-void cmd_touch(FILE *fs, inode_pointer_t inode_p, const char *name, char *buffer);
+inode_pointer_t cmd_cd(int fs, inode_pointer_t inode_root, inode_pointer_t inode_p, const char *target, char *buffer);
 
-void cmd_rm(FILE *fs, inode_pointer_t inode_p, const char *name, char *buffer);
+void cmd_touch(int fs, inode_pointer_t inode_p, const char *name, char *buffer);
 
-void cmd_ls(FILE *fs, inode_pointer_t inode_p, char *buffer);
+void cmd_rm(int fs, inode_pointer_t inode_p, const char *name, char *buffer);
 
-void cmd_cat(FILE *fs, inode_pointer_t inode_p, const char *name, char *buffer);
+void cmd_ls(int fs, inode_pointer_t inode_p, char *buffer);
 
-void cmd_download(FILE *fs, inode_pointer_t inode_p, const char *name_fs, const char *name_local, char *buffer);
+void cmd_cat(int fs, inode_pointer_t inode_p, const char *name, char *buffer);
 
-void cmd_upload(FILE *fs, inode_pointer_t inode_p, const char *name_local, const char *name_fs, char *buffer);
+void cmd_download(int fs, inode_pointer_t inode_p, const char *name_fs, const char *name_local, char *buffer);
+
+void cmd_upload(int fs, inode_pointer_t inode_p, const char *name_local, const char *name_fs, char *buffer);
+
+void cmd_cp(int fs, inode_pointer_t inode_p, const char *name_src, const char *target, char *buffer);
+
+void cmd_mv(int fs, inode_pointer_t inode_p, const char *name, const char *target, char *buffer);
+
+void cmd_import(int fs, inode_pointer_t inode_p, const char *path_local, const char *name_fs, char *buffer);
+
+void cmd_export(int fs, inode_pointer_t inode_p, const char *name_fs, const char *path_local, char *buffer);
+
+void cmd_untar(int fs, inode_pointer_t inode_p, const char *path_local, const char *name_fs, char *buffer);
+
+void cmd_tar(int fs, inode_pointer_t inode_p, const char *name_fs, const char *path_local, char *buffer);
+
+void cmd_read(int fs, inode_pointer_t inode_p, const char *name, const char *offset_str, const char *size_str, char *buffer);
+
+void cmd_write(int fs, inode_pointer_t inode_p, const char *name_fs, const char *offset_str, const char *name_local, char *buffer);
+
+void cmd_truncate(int fs, inode_pointer_t inode_p, const char *name, const char *size_str, char *buffer);
+
+void cmd_du(int fs, inode_pointer_t inode_p, const char *name, char *buffer);
+
+void cmd_snapshot(int fs, const char *name, char *buffer);
+
+void cmd_snapshots(int fs, char *buffer);
+
+void cmd_rmsnapshot(int fs, const char *name, char *buffer);
+
+void cmd_compact(int fs, char *buffer);
+
+void cmd_defrag(int fs, inode_pointer_t inode_p, const char *name, char *buffer);
+
+void cmd_compactdir(int fs, inode_pointer_t inode_p, const char *name, char *buffer);
+
+int is_cmd_modifying(const char *cmd);
+
+int is_cmd_exclusive(const char *cmd);
 
 void cmd_help(char *buffer);
 
-int get_cmd(FILE *fs, inode_pointer_t *inode_p, char *cmd, char *buffer);
+int get_cmd(int fs, inode_pointer_t inode_root, inode_pointer_t *inode_p, char *cmd, char *buffer);
 
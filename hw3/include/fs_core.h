@@ -1,23 +1,78 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <utils.h>
 #include <bitmap.h>
+#include <fs_io.h>
 
 typedef unsigned int block_pointer_t;
-typedef unsigned short inode_pointer_t;
+typedef unsigned int inode_pointer_t;
 
 struct SuperBlock {
     unsigned int magic_number;
     unsigned int block_size;
+    unsigned int version;
+    unsigned int inode_groups_count;
+    inode_pointer_t inode_hint;  // no free inodes below this one
+    inode_pointer_t orphans_p;   // hidden directory with files being removed
+    inode_pointer_t snapshots_p; // hidden directory with read-only copies of the tree
+};
+
+// Blocks are split into groups, each one is covered by a single page of blocks bitmap.
+struct BlockGroupDescriptor {
+    unsigned int used_blocks;
+    block_pointer_t refs_p;         // references table, 0 if the group has no tracked blocks
+    unsigned int tracked_blocks;    // blocks with non-zero entry in references table
+};
+
+// Data blocks of regular files may be shared by several files.
+// Such blocks are tracked in the references table of their group: the entry is
+//  the number of files referring to the block, 0 means a block owned by a single file.
+// The table is allocated with the first tracked block of the group and freed with the last one.
+typedef unsigned int block_refs_t;
+
+// Content index: direct-mapped hash table of tracked blocks, used to find a block equal to a new one.
+// Entries are hints only: a block is shared if it's still tracked and its content is equal.
+struct DedupSlot {
+    unsigned int tag;           // upper half of content hash
+    block_pointer_t block_p;    // 0 - empty slot (block 0 belongs to root directory)
+};
+
+// Inodes are kept in groups, which are created on demand.
+// Inode group i is placed into block group i (modulo groups count).
+// Each group consists of one block with inodes bitmap
+//  and a contiguous run of blocks with inodes table.
+struct InodeGroupDescriptor {
+    block_pointer_t bitmap_p;
+    block_pointer_t table_p;
+    unsigned int free_inodes;
 };
 
 #define INODE_BLOCKS_COUNT 14
 
+// Space used by a file, or by a whole subtree for directory.
+struct TreeTotals {
+    unsigned long long bytes;   // content size (size on disk for directories)
+    unsigned long long blocks;  // blocks on disk, including indirect ones
+    unsigned long long files;   // number of inodes
+};
+
+// Result of defragmenting a subtree.
+struct DefragTotals {
+    unsigned long long files;            // files with blocks
+    unsigned long long files_rewritten;  // fragmented files moved into runs
+    unsigned long long extents_before;
+    unsigned long long extents_after;
+};
+
 struct INode {
-    int file_type;
-    unsigned int file_size;  // number of blocks with file data
+    short file_type;
+    unsigned short flags;
+    unsigned int file_size;  // number of blocks with file data (bytes if inline)
     block_pointer_t block_p[INODE_BLOCKS_COUNT];
+    struct TreeTotals totals;  // directory only: the subtree including directory itself
+    char reserved[40];         // pads inode up to INODE_SIZE
 };
 
 #define MAX_NAME_LENGTH 14
@@ -25,35 +80,116 @@ struct INode {
 struct BlockDirectoryRecord {
     inode_pointer_t inode_p;
     char name[MAX_NAME_LENGTH];
+} __attribute__((packed));
+
+// Content of a regular file being written, kept in memory until
+//  the blocks for it are allocated all at once.
+struct FileWriteBuffer {
+    inode_pointer_t inode_p;
+    struct INode inode;
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+// Blocks of a regular file being read, fetched ahead of the reader.
+// Window grows while the file is read sequentially and drops on a seek.
+struct FileReadBuffer {
+    struct INode inode;
+    block_pointer_t next_k;     // block expected to be requested next
+    block_pointer_t window;     // number of blocks to fetch at once
+    block_pointer_t first_k;    // index of the first buffered block
+    block_pointer_t count;      // number of buffered blocks
+    block_pointer_t *blocks;    // block numbers of the window
+    char *data;
 };
 
+// Growing list of block (or inode) numbers.
+struct BlockList {
+    block_pointer_t *items;
+    size_t size;
+    size_t capacity;
+};
+
+// Callback of walk_tree, called once per file (possibly from several threads at once).
+// Non-zero result stops the walk.
+typedef int (*tree_walk_fn)(int fs, inode_pointer_t inode_p, struct INode *inode, void *arg);
+
 #define FS_MAGIC_NUMBER 0x53EF53EF
+#define FS_VERSION      7
 
 #define FS_BLOCK_SIZE 1024
-#define INODE_SIZE 64
+#define INODE_SIZE 128
 
 #define TYPE_NONE      -1
 #define TYPE_DIRECTORY  0
 #define TYPE_REGULAR    1
 
+#define INODE_FLAG_INLINE 0x0001  // content is stored in block_p area itself
+#define INODE_FLAG_SPARSE 0x0002  // file may have holes
+
+#define ORPHAN_MIN_BLOCKS 64  // smaller files are removed right away
+
+#define INODES_PER_BLOCK        (FS_BLOCK_SIZE / sizeof(struct INode))
+#define INODES_PER_GROUP        (FS_BLOCK_SIZE * 8)
+#define INODE_GROUP_TABLE_SIZE  (INODES_PER_GROUP / INODES_PER_BLOCK)
+#define INODE_GROUPS_MAX        ((1ULL << (8 * sizeof(inode_pointer_t))) / INODES_PER_GROUP)
+
 #define AREA_SIZE_SUPERBLOCK    (sizeof(struct SuperBlock))
 #define AREA_SIZE_BITMAP_BLOCKS (1 << (8 * sizeof(block_pointer_t) - 3))
-#define AREA_SIZE_BITMAP_INODES (1 << (8 * sizeof(inode_pointer_t) - 3))
-#define AREA_SIZE_INODES        (sizeof(struct INode) * (1 << (8 * sizeof(inode_pointer_t))))
+#define AREA_SIZE_BLOCK_GROUPS  (sizeof(struct BlockGroupDescriptor) * BLOCK_GROUPS_COUNT)
+#define AREA_SIZE_INODE_GROUPS  (sizeof(struct InodeGroupDescriptor) * INODE_GROUPS_MAX)
+#define AREA_SIZE_DEDUP_INDEX   (sizeof(struct DedupSlot) * DEDUP_INDEX_SLOTS)
 
 #define AREA_POS_SUPERBLOCK     0
 #define AREA_POS_BITMAP_BLOCKS  (AREA_POS_SUPERBLOCK + AREA_SIZE_SUPERBLOCK)
-#define AREA_POS_BITMAP_INODES  (AREA_POS_BITMAP_BLOCKS + AREA_SIZE_BITMAP_BLOCKS)
-#define AREA_POS_INODES         (AREA_POS_BITMAP_INODES + AREA_SIZE_BITMAP_INODES)
-#define AREA_POS_BLOCKS         (AREA_POS_INODES + AREA_SIZE_INODES)
+#define AREA_POS_BLOCK_GROUPS   (AREA_POS_BITMAP_BLOCKS + AREA_SIZE_BITMAP_BLOCKS)
+#define AREA_POS_INODE_GROUPS   (AREA_POS_BLOCK_GROUPS + AREA_SIZE_BLOCK_GROUPS)
+#define AREA_POS_DEDUP_INDEX    (AREA_POS_INODE_GROUPS + AREA_SIZE_INODE_GROUPS)
+#define AREA_POS_BLOCKS         (AREA_POS_DEDUP_INDEX + AREA_SIZE_DEDUP_INDEX)
 
 #define RECORD_SIZE         (sizeof(struct BlockDirectoryRecord))
 #define BLOCKS_P_PER_BLOCK  (FS_BLOCK_SIZE / sizeof(block_pointer_t))
 #define RECORDS_PER_BLOCK   (FS_BLOCK_SIZE / sizeof(struct BlockDirectoryRecord))
 
+#define INODE_INLINE_SIZE       (sizeof(block_pointer_t) * INODE_BLOCKS_COUNT)
+#define INODE_INLINE_RECORDS    (INODE_INLINE_SIZE / sizeof(struct BlockDirectoryRecord))
+
+#define FILE_BLOCKS_MAX ((INODE_BLOCKS_COUNT - 3) + BLOCKS_P_PER_BLOCK + \
+                         BLOCKS_P_PER_BLOCK * BLOCKS_P_PER_BLOCK + \
+                         BLOCKS_P_PER_BLOCK * BLOCKS_P_PER_BLOCK * BLOCKS_P_PER_BLOCK)
+
 #define PAGE_SIZE_BITMAP_BLOCKS (1 << 13)
 #define PAGES_COUNT (AREA_SIZE_BITMAP_BLOCKS / PAGE_SIZE_BITMAP_BLOCKS)
 
+#define BLOCKS_PER_GROUP    (PAGE_SIZE_BITMAP_BLOCKS * 8)
+#define BLOCK_GROUPS_COUNT  PAGES_COUNT
+
+#define REFS_TABLE_BLOCKS   (BLOCKS_PER_GROUP * sizeof(block_refs_t) / FS_BLOCK_SIZE)
+#define BLOCK_REFS_MAX      0xFFFFFFFFU
+#define REFS_WINDOW         (FS_BLOCK_SIZE / sizeof(block_refs_t))  // entries read and written at once
+
+
+#define PUNCH_MIN_BLOCKS    64      // freed runs from this length get their disk space released
+#define COMPACT_RUN_MAX     REFS_WINDOW  // blocks moved at once by compaction
+#define COMPACT_SLOTS       (COMPACT_RUN_MAX * FS_BLOCK_SIZE / sizeof(struct DedupSlot))  // index slots rewritten at once
+
+#define DEDUP_INDEX_SLOTS   (1 << 20)
+#define DEDUP_BATCH         512     // blocks looked up or indexed at once
+
+#define WRITE_BUFFER_SIZE_MIN (1 << 16)
+#define WRITE_BUFFER_SIZE_MAX (1 << 24)
+
+#define INODES_BATCH_MAX RECORDS_PER_BLOCK
+
+#define READ_AHEAD_MIN 4
+#define READ_AHEAD_MAX 1024
+
+#define WALK_THREADS_MAX 8
+
+#define WALK_TREE_STOPPED   1  // walk_tree was stopped by callback
+#define REMOVE_TREE_TOO_BIG 2  // remove_tree found subtree over the limit
+
 #define INODE_BLOCK_POP_SUCCESS  0
 #define INODE_BLOCK_POP_NOTHING  1
 #define INODE_BLOCK_POP_OVERSIZE 2
@@ -78,20 +214,27 @@ void directory_block_init(char *bytes, inode_pointer_t *inode_current, inode_poi
  * Function: open_fs_file
  * --------------------
  * Opens existing FS file by its name.
+ * All further access goes through pread/pwrite, so the descriptor
+ *  has no meaningful file position.
+ *
+ *  returns: file descriptor of FS file.
  */
-FILE* open_fs_file(const char *fname);
+int open_fs_file(const char *fname);
 
 /*
  * Function: generate_fs_file
  * --------------------
  * Creates FS file with specified name and constructs the FS architecture.
+ *
+ *  returns: file descriptor of FS file.
  */
-FILE* generate_fs_file(const char *fname);
+int generate_fs_file(const char *fname);
 
 /*
  * Function: get_block_k
  * --------------------
  * Gets k-th block's number of file.
+ * Block number 0 means a hole in regular file (block 0 belongs to root directory).
  *
  * fs:              filesystem file
  * inode:           inode of the file
@@ -100,26 +243,67 @@ FILE* generate_fs_file(const char *fname);
  *
  *  returns: 0 <=> block number was obtained successfully.
  */
-char get_block_k(FILE* fs, struct INode *inode, block_pointer_t k, block_pointer_t* block_p_holder);
+char get_block_k(int fs, struct INode *inode, block_pointer_t k, block_pointer_t* block_p_holder);
+
+/*
+ * Function: get_blocks_k
+ * --------------------
+ * Gets block numbers of count consecutive blocks of file starting from k-th.
+ * Each indirect block on the way is read only once.
+ * Zero block number means a hole.
+ *
+ * fs:              filesystem file
+ * inode:           inode of the file
+ * k:               index number of the first block within the file
+ * count:           number of blocks
+ * blocks_holder:   holder for output - block numbers (at least count items)
+ *
+ *  returns: 0 <=> block numbers were obtained successfully.
+ */
+char get_blocks_k(int fs, struct INode *inode, block_pointer_t k, block_pointer_t count, block_pointer_t *blocks_holder);
 
 /*
  * Function: is_block_allocated
  * --------------------
  * Finds out whether space for a block with provided number
  * has already been allocated on a FS file.
+ * Tracked size of FS file is used, so no system call is made.
  *
  * fs:          filesystem file
  * block_p:     block number
  *
  *  returns: 1 <=> space for the block is already allocated.
  */
-char is_block_allocated(FILE *fs, block_pointer_t block_p);
+char is_block_allocated(int fs, block_pointer_t block_p);
+
+/*
+ * Function: get_block_group
+ * --------------------
+ * Gets block group descriptor by its number.
+ *
+ * fs:          filesystem file
+ * group:       the number of block group
+ * gd_holder:   holder for output - struct BlockGroupDescriptor
+ */
+void get_block_group(int fs, unsigned int group, struct BlockGroupDescriptor *gd_holder);
+
+/*
+ * Function: update_block_group
+ * --------------------
+ * Updates block group descriptor on FS file.
+ *
+ * fs:      filesystem file
+ * group:   the number of block group
+ * gd:      struct BlockGroupDescriptor
+ */
+void update_block_group(int fs, unsigned int group, struct BlockGroupDescriptor *gd);
 
 /*
  * Function: occupy_block
  * --------------------
- * Finds the first free block and occupies it, allocating space on FS file
- * if necessary. Also initializes the whole block to zeros.
+ * Finds the first free block and occupies it.
+ * Also initializes the whole block to zeros. Blocks which have never been
+ *  written (past the end of FS file) are left as is, as they read as zeros.
  *
  * fs:              filesystem file
  * block_p_holder:  holder for output - occupied block number
@@ -127,31 +311,171 @@ char is_block_allocated(FILE *fs, block_pointer_t block_p);
  *  returns: 0 <=> some block has been occupied;
  *           otherwise, there are no free blocks left.
  */
-char occupy_block(FILE *fs, block_pointer_t *block_p_holder);
+char occupy_block(int fs, block_pointer_t *block_p_holder);
+
+/*
+ * Function: occupy_block_near
+ * --------------------
+ * Same as occupy_block, but the search starts from the goal block
+ *  and goes through the rest of goal's block group first.
+ * Full block groups are skipped without reading their bitmap pages.
+ *
+ * fs:              filesystem file
+ * goal:            preferred block number
+ * block_p_holder:  holder for output - occupied block number
+ *
+ *  returns: 0 <=> some block has been occupied;
+ *           otherwise, there are no free blocks left.
+ */
+char occupy_block_near(int fs, block_pointer_t goal, block_pointer_t *block_p_holder);
+
+/*
+ * Function: occupy_blocks_run
+ * --------------------
+ * Finds a run of contiguous free blocks and occupies it.
+ * The search starts from the goal's block group.
+ * Run never crosses a block group.
+ * Doesn't initialize occupied blocks.
+ *
+ * fs:              filesystem file
+ * goal:            preferred block number
+ * count:           number of blocks in the run
+ * block_p_holder:  holder for output - the first block number of the run
+ *
+ *  returns: 0 <=> the run has been occupied;
+ *           otherwise, there is no run of such length.
+ */
+char occupy_blocks_run(int fs, block_pointer_t goal, block_pointer_t count, block_pointer_t *block_p_holder);
 
 /*
  * Function: free_block
  * --------------------
- * Marks specified block as free in blocks bitmap.
+ * Drops a reference to specified block. The block is marked as free
+ *  in blocks bitmap when its last reference goes.
  *
  * fs:      filesystem file
  * block_p: the number of block to free
  */
-void free_block(FILE *fs, block_pointer_t block_p);
+void free_block(int fs, block_pointer_t block_p);
+
+/*
+ * Function: free_blocks
+ * --------------------
+ * Drops a reference to each of specified blocks, the same way free_block does.
+ * Zero block numbers (holes) are skipped.
+ * Blocks are sorted first, so every touched page of bitmap
+ *  and range of references table is read and written only once.
+ *
+ * fs:      filesystem file
+ * blocks:  numbers of blocks to free (gets reordered)
+ * count:   number of blocks
+ */
+void free_blocks(int fs, block_pointer_t *blocks, size_t count);
+
+/*
+ * Function: get_block_refs
+ * --------------------
+ * Gets the number of files referring to an occupied block.
+ *
+ * fs:      filesystem file
+ * block_p: block number
+ *
+ *  returns: number of references (1 for a block which is not tracked).
+ */
+block_refs_t get_block_refs(int fs, block_pointer_t block_p);
+
+/*
+ * Function: share_blocks
+ * --------------------
+ * Adds a reference to each of specified data blocks, so one more file can point to them.
+ * Blocks which weren't tracked become tracked with 2 references.
+ * Zero block numbers (holes) are skipped. On failure no reference is left added.
+ *
+ * fs:      filesystem file
+ * blocks:  block numbers
+ * count:   number of blocks
+ *
+ *  returns: 0 <=> references were added successfully.
+ */
+char share_blocks(int fs, block_pointer_t *blocks, size_t count);
+
+/*
+ * Function: find_equal_blocks
+ * --------------------
+ * Looks up content index for tracked blocks equal to provided ones.
+ * All index slots are read as one batch, and so are the candidate blocks.
+ *
+ * fs:              filesystem file
+ * data:            content of count blocks
+ * count:           number of blocks
+ * blocks_holder:   holder for found block numbers, 0 where nothing is found (at least count items)
+ *
+ *  returns: 0 <=> lookup was done successfully.
+ */
+char find_equal_blocks(int fs, const char *data, size_t count, block_pointer_t *blocks_holder);
+
+/*
+ * Function: index_blocks_run
+ * --------------------
+ * Tracks just written run of data blocks and adds them to content index.
+ * Tracking costs a references table (REFS_TABLE_BLOCKS) in each block group holding indexed blocks,
+ * and a references entry written per block.
+ *
+ * fs:      filesystem file
+ * first:   the first block of the run (run doesn't cross block group)
+ * count:   number of blocks in the run
+ * data:    content of the run
+ *
+ *  returns: 0 <=> blocks were indexed successfully.
+ */
+char index_blocks_run(int fs, block_pointer_t first, block_pointer_t count, const char *data);
+
+/*
+ * Function: inode_block_attach
+ * --------------------
+ * Attaches already occupied block to the end of inode,
+ *  occupying indirect blocks if necessary.
+ * Doesn't update the inode in FS file.
+ *
+ * fs:              FS file
+ * inode:           inode with blocks (can't be inline)
+ * new_block_p:     block number to attach
+ *
+ *  returns: 0 <=> the block was attached successfully.
+ */
+char inode_block_attach(int fs, struct INode *inode, block_pointer_t new_block_p);
 
 /*
  * Function: inode_block_append
  * --------------------
  * Appends new block with zeros to inode.
+ * The block is placed right after the last one of the inode if possible,
+ *  or next to the inode itself for an empty file.
  * Doesn't update the inode in FS file.
  *
  * fs:              FS file
+ * inode_p:         inode number (used as allocation hint only)
  * inode:           inode with blocks
  * block_p_holder:  holder for a new block number (optional)
  *
  *  returns: 0 <=> a new block was appended successfully.
  */
-char inode_block_append(FILE *fs, struct INode *inode, block_pointer_t *block_p_holder);
+char inode_block_append(int fs, inode_pointer_t inode_p, struct INode *inode, block_pointer_t *block_p_holder);
+
+/*
+ * Function: inode_block_append_nozero
+ * --------------------
+ * Same as inode_block_append, but leaves content of the new block
+ *  uninitialized. Caller must overwrite the whole block.
+ *
+ * fs:              FS file
+ * inode_p:         inode number (used as allocation hint only)
+ * inode:           inode with blocks
+ * block_p_holder:  holder for a new block number (optional)
+ *
+ *  returns: 0 <=> a new block was appended successfully.
+ */
+char inode_block_append_nozero(int fs, inode_pointer_t inode_p, struct INode *inode, block_pointer_t *block_p_holder);
 
 /*
  * Function: inode_block_pop
@@ -164,18 +488,178 @@ char inode_block_append(FILE *fs, struct INode *inode, block_pointer_t *block_p_
  *
  *  returns: 0 <=> the last block was popped successfully.
  */
-char inode_block_pop(FILE *fs, struct INode *inode);
+char inode_block_pop(int fs, struct INode *inode);
+
+/*
+ * Function: inode_truncate_blocks
+ * --------------------
+ * Dettaches and frees all blocks of inode past the first count ones,
+ *  including indirect blocks which become unused.
+ * Block map is walked only once, and all blocks are freed in one batch.
+ * Doesn't update the inode in FS file.
+ *
+ * fs:      FS file
+ * inode:   inode with blocks
+ * count:   number of blocks to keep
+ *
+ *  returns: 0 <=> blocks were freed successfully.
+ */
+char inode_truncate_blocks(int fs, struct INode *inode, block_pointer_t count);
+
+/*
+ * Function: inode_collect_blocks
+ * --------------------
+ * Collects all blocks of inode, including indirect ones, into list.
+ * Neither the inode nor FS file is changed.
+ *
+ * fs:      FS file
+ * inode:   inode with blocks
+ * list:    list to append block numbers to
+ *
+ *  returns: 0 <=> blocks were collected successfully.
+ */
+char inode_collect_blocks(int fs, struct INode *inode, struct BlockList *list);
+
+/*
+ * Function: block_list_push
+ * --------------------
+ * Appends block number to the list, growing it when needed.
+ *
+ * list:    list of block numbers
+ * block_p: block number
+ *
+ *  returns: 0 <=> block number was appended successfully.
+ */
+char block_list_push(struct BlockList *list, block_pointer_t block_p);
+
+/*
+ * Function: inode_block_fill
+ * --------------------
+ * Gets k-th block's number of file, allocating the block if it's a hole.
+ * Missing indirect blocks on the way are allocated too.
+ * Block shared with other files is replaced by a private copy,
+ *  so the returned block can be modified in place.
+ * Doesn't update the inode in FS file.
+ *
+ * fs:              FS file
+ * inode_p:         inode number (used as allocation hint only)
+ * inode:           inode with blocks
+ * k:               index number of a block within the file (below file_size)
+ * zero:            whether a newly allocated data block has to be zeroed
+ * block_p_holder:  holder for block number (optional)
+ *
+ *  returns: 0 <=> block is allocated.
+ */
+char inode_block_fill(int fs, inode_pointer_t inode_p, struct INode *inode, block_pointer_t k, char zero, block_pointer_t *block_p_holder);
+
+/*
+ * Function: inode_inline_promote
+ * --------------------
+ * Moves inline content of inode to a regular block, so the inode
+ *  can grow further. Does nothing if inode isn't inline.
+ * Doesn't update the inode in FS file.
+ *
+ * fs:              FS file
+ * inode_p:         inode number (used as allocation hint only)
+ * inode:           inode with inline content
+ *
+ *  returns: 0 <=> inode is not inline anymore.
+ */
+char inode_inline_promote(int fs, inode_pointer_t inode_p, struct INode *inode);
+
+/*
+ * Function: write_buffer_open
+ * --------------------
+ * Starts delayed writing of content to an empty regular file.
+ * Nothing is allocated until the buffer is full or closed, so blocks
+ *  are occupied in contiguous runs and written exactly once.
+ * Blocks equal to ones already stored in FS file are shared instead of written.
+ *
+ * fs:      FS file
+ * inode_p: inode number of the empty regular file
+ * wb:      write buffer to initialize
+ *
+ *  returns: 0 <=> the buffer is ready.
+ */
+char write_buffer_open(int fs, inode_pointer_t inode_p, struct FileWriteBuffer *wb);
+
+/*
+ * Function: write_buffer_write
+ * --------------------
+ * Appends data to the file through write buffer.
+ *
+ * fs:      FS file
+ * wb:      opened write buffer
+ * data:    data to append
+ * size:    size of data in bytes
+ *
+ *  returns: 0 <=> data was accepted successfully.
+ */
+char write_buffer_write(int fs, struct FileWriteBuffer *wb, const char *data, size_t size);
+
+/*
+ * Function: write_buffer_close
+ * --------------------
+ * Flushes the rest of the data (inline, if it fits into inode),
+ *  updates the inode in FS file and releases the buffer.
+ *
+ * fs:      FS file
+ * wb:      opened write buffer
+ *
+ *  returns: 0 <=> the file was written successfully.
+ */
+char write_buffer_close(int fs, struct FileWriteBuffer *wb);
+
+/*
+ * Function: read_buffer_open
+ * --------------------
+ * Prepares a regular file for reading block by block with read-ahead.
+ *
+ * fs:      FS file
+ * inode:   inode of the file
+ * rb:      read buffer to initialize
+ *
+ *  returns: 0 <=> read buffer is ready.
+ */
+char read_buffer_open(int fs, struct INode *inode, struct FileReadBuffer *rb);
+
+/*
+ * Function: read_buffer_get_block
+ * --------------------
+ * Gets k-th block content of a file, same as get_file_block_k.
+ * On a miss the whole window is fetched: block map is resolved at once,
+ *  physically adjacent blocks are read with a single read, and the kernel
+ *  is advised to prefetch the area past the window.
+ *
+ * fs:              FS file
+ * rb:              read buffer
+ * k:               index number of a block within the file
+ * block_holder:    holder for output - block content
+ *
+ *  returns: 0 <=> block was obtained successfully.
+ */
+char read_buffer_get_block(int fs, struct FileReadBuffer *rb, block_pointer_t k, char *block_holder);
+
+/*
+ * Function: read_buffer_close
+ * --------------------
+ * Releases read buffer.
+ *
+ * rb:      read buffer
+ */
+void read_buffer_close(struct FileReadBuffer *rb);
 
 /*
  * Function: get_block
  * --------------------
  * Gets block content by its number.
+ * Block which has never been written is read as zeros.
  *
  * fs:              filesystem file
  * block_p:         the number of block to obtain
  * block_holder:    holder for output - block content
  */
-void get_block(FILE* fs, block_pointer_t block_p, char* block_holder);
+void get_block(int fs, block_pointer_t block_p, char* block_holder);
 
 /*
  * Function: update_block
@@ -186,7 +670,76 @@ void get_block(FILE* fs, block_pointer_t block_p, char* block_holder);
  * block_p:     the number of block to update
  * block:       block content
  */
-void update_block(FILE* fs, block_pointer_t block_p, char* block);
+void update_block(int fs, block_pointer_t block_p, char* block);
+
+/*
+ * Function: get_dir_blocks_count
+ * --------------------
+ * Gets a number of blocks with directory records.
+ * Inline directory is treated as a single block.
+ *
+ * inode:       directory inode
+ *
+ *  returns: number of directory blocks
+ */
+block_pointer_t get_dir_blocks_count(struct INode *inode);
+
+/*
+ * Function: get_dir_records_count
+ * --------------------
+ * Gets a number of records one block of directory can hold.
+ *
+ * inode:       directory inode
+ *
+ *  returns: RECORDS_PER_BLOCK, or INODE_INLINE_RECORDS for inline directory
+ */
+unsigned int get_dir_records_count(struct INode *inode);
+
+/*
+ * Function: get_file_block_k
+ * --------------------
+ * Gets k-th block content of regular file.
+ * Holes are read as zeros, inline content is padded with zeros up to the full block.
+ *
+ * fs:              filesystem file
+ * inode:           file inode
+ * k:               index number of a block within the file
+ * block_holder:    holder for output - block content
+ *
+ *  returns: 0 <=> block was obtained successfully.
+ */
+char get_file_block_k(int fs, struct INode *inode, block_pointer_t k, char *block_holder);
+
+/*
+ * Function: get_dir_block_k
+ * --------------------
+ * Gets k-th block content of directory.
+ * Inline records are padded with empty records up to the full block.
+ *
+ * fs:              filesystem file
+ * inode:           directory inode
+ * k:               index number of a block within the directory
+ * block_holder:    holder for output - block content
+ *
+ *  returns: 0 <=> block was obtained successfully.
+ */
+char get_dir_block_k(int fs, struct INode *inode, block_pointer_t k, char *block_holder);
+
+/*
+ * Function: update_dir_block_k
+ * --------------------
+ * Updates k-th block content of directory.
+ * Inline records are written back to the inode (in memory and on FS file).
+ *
+ * fs:          FS file
+ * inode_p:     directory inode number
+ * inode:       directory inode
+ * k:           index number of a block within the directory
+ * block:       block content
+ *
+ *  returns: 0 <=> block was updated successfully.
+ */
+char update_dir_block_k(int fs, inode_pointer_t inode_p, struct INode *inode, block_pointer_t k, char *block);
 
 /*
  * Function: get_inode_by_name_in_block
@@ -201,7 +754,7 @@ void update_block(FILE* fs, block_pointer_t block_p, char* block);
  *  returns: 0 <=> inode number was determined successfully;
  *           1 <=> record with provided name doesn't exist.
  */
-char get_inode_by_name_in_block(FILE* fs, block_pointer_t block_p, const char* name, inode_pointer_t* inode_p_holder);
+char get_inode_by_name_in_block(int fs, block_pointer_t block_p, const char* name, inode_pointer_t* inode_p_holder);
 
 /*
  * Function: get_inode_by_name_in_inode
@@ -216,7 +769,7 @@ char get_inode_by_name_in_block(FILE* fs, block_pointer_t block_p, const char* n
  *  returns: 0 <=> inode number was determined successfully;
  *           1 <=> record with provided name doesn't exist.
  */
-char get_inode_by_name_in_inode(FILE* fs, struct INode *inode, const char* name, inode_pointer_t* inode_p_holder);
+char get_inode_by_name_in_inode(int fs, struct INode *inode, const char* name, inode_pointer_t* inode_p_holder);
 
 /*
  * Function: get_name_by_inode_in_block
@@ -231,7 +784,7 @@ char get_inode_by_name_in_inode(FILE* fs, struct INode *inode, const char* name,
  *  returns: 0 <=> name was determined successfully;
  *           1 <=> record with provided inode number doesn't exist.
  */
-char get_name_by_inode_in_block(FILE* fs, block_pointer_t block_p, inode_pointer_t inode_p, char* name_holder);
+char get_name_by_inode_in_block(int fs, block_pointer_t block_p, inode_pointer_t inode_p, char* name_holder);
 
 /*
  * Function: get_name_by_inode_in_inode
@@ -246,7 +799,7 @@ char get_name_by_inode_in_block(FILE* fs, block_pointer_t block_p, inode_pointer
  *  returns: 0 <=> name was determined successfully;
  *           1 <=> record with provided inode number doesn't exist.
  */
-char get_name_by_inode_in_inode(FILE* fs, struct INode *inode, inode_pointer_t inode_p, char* name_holder);
+char get_name_by_inode_in_inode(int fs, struct INode *inode, inode_pointer_t inode_p, char* name_holder);
 
 /*
  * Function: get_parent_directory
@@ -257,7 +810,7 @@ char get_name_by_inode_in_inode(FILE* fs, struct INode *inode, inode_pointer_t i
  *
  *  returns: 0 <=> parent was found successfully.
  */
-char get_parent_directory(FILE* fs, inode_pointer_t inode_p, inode_pointer_t* inode_p_parent);
+char get_parent_directory(int fs, inode_pointer_t inode_p, inode_pointer_t* inode_p_parent);
 
 /*
  * Function: get_directory_name
@@ -270,12 +823,13 @@ char get_parent_directory(FILE* fs, inode_pointer_t inode_p, inode_pointer_t* in
  *
  *  returns: 0 <=> name was determined successfully.
  */
-char get_directory_name(FILE* fs, inode_pointer_t inode_p, char* name_holder);
+char get_directory_name(int fs, inode_pointer_t inode_p, char* name_holder);
 
 /*
  * Function: get_full_path
  * --------------------
  * Gets full path of a directory.
+ * Path inside snapshots directory starts with "@snapshots" instead of root.
  *
  * fs:      filesystem file
  * inode_p: inode number of the directory
@@ -284,20 +838,76 @@ char get_directory_name(FILE* fs, inode_pointer_t inode_p, char* name_holder);
  *  returns: 0 <=> path was obtained successfully;
  *           1 <=> error occurred.
  */
-int get_full_path(FILE *fs, inode_pointer_t inode_p, char *holder);
+int get_full_path(int fs, inode_pointer_t inode_p, char *holder);
+
+/*
+ * Function: get_inode_group
+ * --------------------
+ * Gets inode group descriptor by its number.
+ *
+ * fs:          filesystem file
+ * group:       the number of inode group
+ * gd_holder:   holder for output - struct InodeGroupDescriptor
+ */
+void get_inode_group(int fs, unsigned int group, struct InodeGroupDescriptor *gd_holder);
+
+/*
+ * Function: update_inode_group
+ * --------------------
+ * Updates inode group descriptor on FS file.
+ *
+ * fs:      filesystem file
+ * group:   the number of inode group
+ * gd:      struct InodeGroupDescriptor
+ */
+void update_inode_group(int fs, unsigned int group, struct InodeGroupDescriptor *gd);
+
+/*
+ * Function: create_inode_group
+ * --------------------
+ * Allocates bitmap and table for the next inode group.
+ *
+ * fs:              filesystem file
+ * group_holder:    holder for output - the number of created group
+ *
+ *  returns: 0 <=> a new group was created successfully.
+ */
+char create_inode_group(int fs, unsigned int *group_holder);
 
 /*
  * Function: occupy_inode
  * --------------------
  * Finds the first free inode and occupies it, initializing it with zeros.
+ * Goal's group is tried first, so related files share inode group
+ *  (and block group, as a consequence).
+ * Otherwise search starts from the free inode hint kept in superblock,
+ *  and groups with no free inodes are skipped without reading their bitmaps.
+ * Creates a new inode group if all existing ones are full.
  *
  * fs:              filesystem file
+ * inode_goal_p:    preferred inode number, e.g. parent directory
  * inode_p_holder:  holder for output - occupied inode number
  *
  *  returns: 0 <=> some inode has been occupied;
  *           otherwise, there are no free inodes left.
  */
-char occupy_inode(FILE *fs, inode_pointer_t *inode_p_holder);
+char occupy_inode(int fs, inode_pointer_t inode_goal_p, inode_pointer_t *inode_p_holder);
+
+/*
+ * Function: occupy_inodes
+ * --------------------
+ * Occupies count free inodes in the same way as occupy_inode does, but
+ *  each inodes bitmap and group descriptor is updated once for all of them.
+ * Nothing is occupied on failure.
+ *
+ * fs:              filesystem file
+ * inode_goal_p:    preferred inode number, e.g. parent directory
+ * count:           number of inodes
+ * inode_ps_holder: holder for output - occupied inode numbers (at least count items)
+ *
+ *  returns: 0 <=> all inodes have been occupied.
+ */
+char occupy_inodes(int fs, inode_pointer_t inode_goal_p, unsigned int count, inode_pointer_t *inode_ps_holder);
 
 /*
  * Function: free_inode
@@ -307,7 +917,19 @@ char occupy_inode(FILE *fs, inode_pointer_t *inode_p_holder);
  * fs:      filesystem file
  * inode_p: the number of inode to free
  */
-void free_inode(FILE *fs, inode_pointer_t inode_p);
+void free_inode(int fs, inode_pointer_t inode_p);
+
+/*
+ * Function: get_inode_goal
+ * --------------------
+ * Gets block number to allocate data of inode near to.
+ *
+ * fs:      filesystem file
+ * inode_p: inode number
+ *
+ *  returns: block of inodes table the inode is stored in.
+ */
+block_pointer_t get_inode_goal(int fs, inode_pointer_t inode_p);
 
 /*
  * Function: get_inode
@@ -318,7 +940,21 @@ void free_inode(FILE *fs, inode_pointer_t inode_p);
  * inode_p:         the number of inode to obtain
  * inode_holder:    holder for output - struct INode
  */
-void get_inode(FILE* fs, inode_pointer_t inode_p, struct INode *inode_holder);
+void get_inode(int fs, inode_pointer_t inode_p, struct INode *inode_holder);
+
+/*
+ * Function: get_inodes
+ * --------------------
+ * Gets several inodes by their numbers, all reads are issued as one batch.
+ *
+ * fs:              FS file
+ * inode_ps:        inode numbers
+ * count:           number of inodes
+ * inodes_holder:   holder for inodes (at least count items)
+ *
+ *  returns: 0 <=> all inodes were read.
+ */
+char get_inodes(int fs, inode_pointer_t *inode_ps, unsigned int count, struct INode *inodes_holder);
 
 /*
  * Function: update_inode
@@ -329,19 +965,20 @@ void get_inode(FILE* fs, inode_pointer_t inode_p, struct INode *inode_holder);
  * inode_p: inode number
  * inode:   struct INode
  */
-void update_inode(FILE* fs, inode_pointer_t inode_p, struct INode *inode);
+void update_inode(int fs, inode_pointer_t inode_p, struct INode *inode);
 
 /*
  * Function: is_directory_block_full
  * --------------------
  * Checks if provided directory block has no zero records.
  *
- * block: the content of directory block
+ * block:           the content of directory block
+ * records_count:   how many records the block can hold
  *
  *  returns: 1 <=> directory block has no zero records;
  *           0 <=> directory block has at least one zero record.
  */
-char is_directory_block_full(char *block);
+char is_directory_block_full(char *block, unsigned int records_count);
 
 /*
  * Function: is_directory_block_empty
@@ -355,6 +992,48 @@ char is_directory_block_full(char *block);
  */
 char is_directory_block_empty(char *block);
 
+/*
+ * Function: link_file_to_dir
+ * --------------------
+ * Adds a record with existing inode to provided directory.
+ * Doesn't check if a file with provided name already exists.
+ * File's totals are added to the directory and all directories above.
+ *
+ * fs:              FS file
+ * inode_dir_p:     inode number of the directory
+ * inode_p:         inode number of the file
+ * name:            file name
+ *
+ *  returns: 0 <=> record was added successfully.
+ */
+char link_file_to_dir(int fs, inode_pointer_t inode_dir_p, inode_pointer_t inode_p, const char *name);
+
+/*
+ * Function: get_file_totals
+ * --------------------
+ * Gets space used by file. Directory keeps the totals of its whole subtree
+ *  in the inode, so it's O(1) for any directory.
+ *
+ * fs:              FS file
+ * inode:           inode of the file
+ * totals_holder:   holder for output
+ */
+void get_file_totals(int fs, struct INode *inode, struct TreeTotals *totals_holder);
+
+/*
+ * Function: add_dir_totals
+ * --------------------
+ * Applies a change of one file's totals (from totals_before to totals_after)
+ *  to the directory containing it and to all directories above.
+ * Orphans directory and everything below it is not counted.
+ *
+ * fs:              FS file
+ * inode_dir_p:     inode number of directory containing the changed file
+ * totals_before:   totals of the file before the change
+ * totals_after:    totals of the file after the change
+ */
+void add_dir_totals(int fs, inode_pointer_t inode_dir_p, struct TreeTotals *totals_before, struct TreeTotals *totals_after);
+
 /*
  * Function: create_file_in_dir
  * --------------------
@@ -370,7 +1049,125 @@ char is_directory_block_empty(char *block);
  *
  *  returns: 0 <=> file was created successfully.
  */
-char create_file_in_dir(FILE *fs, inode_pointer_t inode_p, int file_type, const char *name, inode_pointer_t *inode_p_holder);
+char create_file_in_dir(int fs, inode_pointer_t inode_p, int file_type, const char *name, inode_pointer_t *inode_p_holder);
+
+/*
+ * Function: create_files_in_dir
+ * --------------------
+ * Creates several files inside provided directory at once.
+ * Inodes are occupied as one run, and records are appended so that
+ *  each directory block is written only once.
+ * Doesn't check names, neither for validity nor for duplicates.
+ *
+ * fs:              FS file
+ * inode_p:         inode number of the directory
+ * file_types:      whether to create regular file or directory, for each file
+ * names:           file names
+ * count:           number of files
+ * inode_ps_holder: holder for inode numbers of created files (at least count items)
+ *
+ *  returns: 0 <=> all files were created successfully.
+ */
+char create_files_in_dir(int fs, inode_pointer_t inode_p, const int *file_types, const char **names,
+                         unsigned int count, inode_pointer_t *inode_ps_holder);
+
+/*
+ * Function: clone_file
+ * --------------------
+ * Makes content of an empty regular file the same as of another regular file.
+ * Data blocks are shared by both files, only block map is copied.
+ *
+ * fs:              FS file
+ * inode_src_p:     inode number of the file to copy
+ * inode_dst_p:     inode number of the empty file
+ *
+ *  returns: 0 <=> content was copied successfully.
+ */
+char clone_file(int fs, inode_pointer_t inode_src_p, inode_pointer_t inode_dst_p);
+
+/*
+ * Function: create_snapshot
+ * --------------------
+ * Makes a read-only copy of the whole tree in snapshots directory.
+ * Directories and block maps are copied, data blocks are shared with the live tree,
+ *  so later writes to the live tree copy only blocks they change.
+ *
+ * fs:      FS file
+ * name:    name of the snapshot
+ *
+ *  returns: 0 <=> snapshot was created successfully,
+ *           1 <=> snapshot with provided name already exists.
+ */
+char create_snapshot(int fs, const char *name);
+
+/*
+ * Function: get_snapshot
+ * --------------------
+ * Finds the root directory of a snapshot.
+ *
+ * fs:              FS file
+ * name:            name of the snapshot
+ * inode_p_holder:  holder for inode number of snapshot's root (may be NULL)
+ *
+ *  returns: 0 <=> snapshot was found.
+ */
+char get_snapshot(int fs, const char *name, inode_pointer_t *inode_p_holder);
+
+/*
+ * Function: remove_snapshot
+ * --------------------
+ * Removes a snapshot, its blocks are freed in background as with any removed directory.
+ *
+ * fs:      FS file
+ * name:    name of the snapshot
+ *
+ *  returns: 0 <=> snapshot was removed successfully.
+ */
+char remove_snapshot(int fs, const char *name);
+
+/*
+ * Function: get_snapshots_dir
+ * --------------------
+ * Gets inode number of snapshots directory.
+ */
+inode_pointer_t get_snapshots_dir(int fs);
+
+/*
+ * Function: walk_tree
+ * --------------------
+ * Visits file and, if it's a directory, all of its subfiles in no particular order.
+ * Directories are read by a pool of threads, each thread keeps its own queue
+ *  of directories to read and steals from others when it runs out of them.
+ * Directory is always visited before its subfiles.
+ *
+ * fs:              FS file
+ * inode_p:         inode number of the root of the walk
+ * visit:           callback for each file
+ * arg:             argument passed to callback
+ *
+ *  returns: 0 <=> all files were visited,
+ *           WALK_TREE_STOPPED <=> callback stopped the walk,
+ *           other <=> directory couldn't be read.
+ */
+char walk_tree(int fs, inode_pointer_t inode_p, tree_walk_fn visit, void *arg);
+
+/*
+ * Function: remove_tree
+ * --------------------
+ * Removes file (regular file or directory) with all its subfiles.
+ * The whole subtree is collected by walk_tree first, then all of its blocks
+ *  are freed in one batch. Nothing is changed if the subtree exceeds the limit.
+ *
+ * fs:              FS file
+ * inode_parent_p:  inode number of directory to unlink the file from (NULL - none)
+ * inode_p:         inode number of the file to remove
+ * limit:           max number of blocks and inodes to free (0 - unlimited)
+ * cost_holder:     holder for number of freed blocks and inodes (may be NULL)
+ *
+ *  returns: 0 <=> file was removed successfully,
+ *           REMOVE_TREE_TOO_BIG <=> subtree exceeds the limit.
+ */
+char remove_tree(int fs, inode_pointer_t *inode_parent_p, inode_pointer_t inode_p, size_t limit, size_t *cost_holder);
 
 /*
  * Function: remove_file
@@ -384,12 +1181,58 @@ char create_file_in_dir(FILE *fs, inode_pointer_t inode_p, int file_type, const
  *
  *  returns: 0 <=> file was removed successfully.
  */
-char remove_file(FILE *fs, inode_pointer_t inode_p);
+char remove_file(int fs, inode_pointer_t inode_p);
+
+/*
+ * Function: compact_dir
+ * --------------------
+ * Rewrites directory into the minimum number of blocks: records are packed
+ *  into the first blocks, the rest of blocks and indirect blocks are freed.
+ * Directory with records which fit into the inode becomes inline again (except root).
+ * Directory's totals are updated. Nothing is written if the directory is already compact.
+ *
+ * fs:              FS file
+ * inode_dir_p:     inode number of the directory
+ *
+ *  returns: 0 <=> directory was compacted successfully.
+ */
+char compact_dir(int fs, inode_pointer_t inode_dir_p);
+
+/*
+ * Function: compact_dirs
+ * --------------------
+ * Compacts directory and all directories below it by compact_dir.
+ *
+ * fs:              FS file
+ * inode_p:         inode number of the root directory
+ * blocks_before:   holder for number of blocks of directories before
+ * blocks_after:    holder for number of blocks of directories after
+ *
+ *  returns: 0 <=> all directories were compacted successfully.
+ */
+char compact_dirs(int fs, inode_pointer_t inode_p, unsigned long long *blocks_before, unsigned long long *blocks_after);
+
+/*
+ * Function: unlink_file_from_dir
+ * --------------------
+ * Removes file's record from provided directory, the file itself stays intact.
+ * File's totals are subtracted from the directory and all directories above.
+ * Directory which has lost a block, or whose records fit into the inode, is compacted by compact_dir.
+ *
+ * fs:              FS file
+ * inode_dir_p:     inode number of the directory
+ * inode_victim_p:  inode number of file to unlink
+ *
+ *  returns: 0 <=> record was removed successfully.
+ */
+char unlink_file_from_dir(int fs, inode_pointer_t inode_dir_p, inode_pointer_t inode_victim_p);
 
 /*
  * Function: remove_file_from_dir
  * --------------------
  * Removes file (regular file or directory) from provided directory.
+ * Small files are freed immediately, large files and non-empty directories
+ *  are moved to orphans directory and freed later by reclaim_orphans.
  *
  * fs:              FS file
  * inode_dir_p:     inode number of the directory
@@ -397,7 +1240,130 @@ char remove_file(FILE *fs, inode_pointer_t inode_p);
  *
  *  returns: 0 <=> file was removed successfully.
  */
-char remove_file_from_dir(FILE *fs, inode_pointer_t inode_dir_p, inode_pointer_t inode_victim_p);
+char remove_file_from_dir(int fs, inode_pointer_t inode_dir_p, inode_pointer_t inode_victim_p);
+
+/*
+ * Function: move_file
+ * --------------------
+ * Moves file (regular file or directory) to another directory or renames it,
+ *  only directory records are changed, content stays where it is.
+ * Moved directory gets the new directory as its parent, totals are moved too.
+ * Doesn't check if a file with provided name already exists.
+ *
+ * fs:              FS file
+ * inode_dir_p:     inode number of the directory containing the file
+ * inode_p:         inode number of the file
+ * inode_dir_new_p: inode number of the target directory (may be the same one)
+ * name:            new name of the file
+ *
+ *  returns: 0 <=> file was moved successfully,
+ *           2 <=> directory would be moved into itself or its subdirectory.
+ */
+char move_file(int fs, inode_pointer_t inode_dir_p, inode_pointer_t inode_p, inode_pointer_t inode_dir_new_p, const char *name);
+
+/*
+ * Function: get_last_record
+ * --------------------
+ * Finds the last non-empty record of a directory ("." and ".." are skipped).
+ *
+ * fs:              FS file
+ * inode:           inode of the directory
+ * record_holder:   holder for the record
+ *
+ *  returns: 0 <=> directory has at least one record,
+ *           1 <=> directory is empty.
+ */
+char get_last_record(int fs, struct INode *inode, struct BlockDirectoryRecord *record_holder);
+
+/*
+ * Function: orphan_file
+ * --------------------
+ * Links already detached file to orphans directory, so it survives restart
+ *  until reclaim_orphans frees it. Orphaned directory gets orphans directory
+ *  as its parent, so its changes are not counted in the tree it left.
+ *
+ * fs:              FS file
+ * inode_p:         inode number of the file
+ *
+ *  returns: 0 <=> file was linked successfully.
+ */
+char orphan_file(int fs, inode_pointer_t inode_p);
+
+/*
+ * Function: reclaim_orphans
+ * --------------------
+ * Frees a portion of orphaned files. Subtree which fits the budget is removed
+ *  at once by remove_tree, larger one is split starting from its deepest files.
+ * Large file may be left partially truncated to stay within the budget.
+ *
+ * fs:              FS file
+ * budget:          approximate number of blocks to free
+ *
+ *  returns: 0 <=> no orphans left,
+ *           1 <=> some orphans are still pending,
+ *           2 <=> file couldn't be truncated,
+ *           3 <=> subtree couldn't be removed.
+ */
+char reclaim_orphans(int fs, unsigned int budget);
+
+/*
+ * Function: compact_image
+ * --------------------
+ * Moves occupied blocks from the tail of FS file into free blocks below,
+ *  rewrites pointers to them and truncates FS file after the last occupied block.
+ * Inode tables and references tables are moved only as a whole,
+ *  a block which doesn't fit anywhere lower stays where it is.
+ *
+ * fs:                  FS file
+ * blocks_end_holder:   holder for number of blocks left in FS file
+ *
+ *  returns: 0 <=> FS file was compacted successfully.
+ */
+char compact_image(int fs, block_pointer_t *blocks_end_holder);
+
+/*
+ * Function: get_file_extents
+ * --------------------
+ * Counts extents of file, i.e. runs of consecutive data blocks.
+ * Holes don't break a run, indirect blocks aren't counted.
+ *
+ * fs:              FS file
+ * inode:           inode of the file
+ * extents_holder:  holder for number of extents
+ *
+ *  returns: 0 <=> block map was read successfully.
+ */
+char get_file_extents(int fs, struct INode *inode, block_pointer_t *extents_holder);
+
+/*
+ * Function: defrag_file
+ * --------------------
+ * Rewrites data blocks of a fragmented regular file or directory into runs
+ *  (a run per block group at best). File with not more extents than that is left as it is.
+ * New block map is built aside and the inode is switched to it with a single write,
+ *  so the file is never seen half moved. Shared blocks stay where they are.
+ *
+ * fs:              FS file
+ * inode_p:         inode number of the file
+ * extents_before:  holder for number of extents before
+ * extents_after:   holder for number of extents after
+ *
+ *  returns: 0 <=> file was defragmented or didn't need it.
+ */
+char defrag_file(int fs, inode_pointer_t inode_p, block_pointer_t *extents_before, block_pointer_t *extents_after);
+
+/*
+ * Function: defrag_tree
+ * --------------------
+ * Defragments file and, if it's a directory, all of its subfiles by defrag_file.
+ *
+ * fs:              FS file
+ * inode_p:         inode number of the root
+ * totals_holder:   holder for numbers of files and extents
+ *
+ *  returns: 0 <=> all files were processed successfully.
+ */
+char defrag_tree(int fs, inode_pointer_t inode_p, struct DefragTotals *totals_holder);
 
 /*
  * Function: get_size_on_disk
@@ -405,6 +1371,7 @@ char remove_file_from_dir(FILE *fs, inode_pointer_t inode_dir_p, inode_pointer_t
  * Calculates how much actual disk space the file occupies.
  * This is different from inode.file_size, as the latter only shows a number
  *  of blocks with exactly file data, not indirect addresses.
+ * Holes of sparse file are counted as occupied.
  *
  * inode:     inode representing the file
  *
@@ -412,6 +1379,20 @@ char remove_file_from_dir(FILE *fs, inode_pointer_t inode_dir_p, inode_pointer_t
  */
 block_pointer_t get_size_on_disk(struct INode *inode);
 
+/*
+ * Function: get_allocated_blocks
+ * --------------------
+ * Counts blocks actually allocated for the file, including indirect ones.
+ * Unlike get_size_on_disk, holes of sparse file are not counted,
+ *  block map is read only for a file which may have holes.
+ *
+ * fs:        filesystem file
+ * inode:     inode representing the file
+ *
+ *  returns: number of allocated blocks
+ */
+block_pointer_t get_allocated_blocks(int fs, struct INode *inode);
+
 /*
  * Function: get_regular_file_size
  * --------------------
@@ -421,7 +1402,54 @@ block_pointer_t get_size_on_disk(struct INode *inode);
  *
  *  returns: file's content size in bytes.
  */
-size_t get_regular_file_size(FILE *fs, struct INode *inode);
+size_t get_regular_file_size(int fs, struct INode *inode);
+
+/*
+ * Function: read_file
+ * --------------------
+ * Reads a range of regular file's content, starting right from the block
+ *  containing offset. The range is clipped by the end of file.
+ *
+ * fs:          FS file
+ * inode:       inode of the file
+ * offset:      position in bytes to read from
+ * data:        holder for the data (at least size bytes)
+ * size:        number of bytes to read
+ * size_holder: holder for number of bytes actually read (optional)
+ *
+ *  returns: 0 <=> data was read successfully.
+ */
+char read_file(int fs, struct INode *inode, size_t offset, char *data, size_t size, size_t *size_holder);
+
+/*
+ * Function: truncate_file
+ * --------------------
+ * Sets size of a regular file's content.
+ * Extended part is a hole: it takes no blocks and is read as zeros.
+ *
+ * fs:        FS file
+ * inode_p:   inode number of the file
+ * size:      new size in bytes
+ *
+ *  returns: 0 <=> file was resized successfully.
+ */
+char truncate_file(int fs, inode_pointer_t inode_p, size_t size);
+
+/*
+ * Function: write_file
+ * --------------------
+ * Writes data into a regular file at provided offset, extending the file if needed.
+ * Only the blocks covered by data are allocated, a gap before offset is left as a hole.
+ *
+ * fs:        FS file
+ * inode_p:   inode number of the file
+ * offset:    position in bytes to write to
+ * data:      data to write
+ * size:      data size in bytes
+ *
+ *  returns: 0 <=> data was written successfully.
+ */
+char write_file(int fs, inode_pointer_t inode_p, size_t offset, const char *data, size_t size);
 
 /*
  * Function: get_dir
@@ -438,7 +1466,7 @@ size_t get_regular_file_size(FILE *fs, struct INode *inode);
  *
  *  returns: 0 <=> inode was found successfully.
  */
-char get_dir(FILE *fs, inode_pointer_t inode_p, const char *target, inode_pointer_t *inode_target_p);
+char get_dir(int fs, inode_pointer_t inode_p, const char *target, inode_pointer_t *inode_target_p);
 
 /*
  * Function: is_name_valid
@@ -463,4 +1491,4 @@ int is_name_valid(const char *name);
  *
  *  returns: 1 <=> name is already taken
  */
-int is_name_taken(FILE *fs, inode_pointer_t inode_p, const char *name);
+int is_name_taken(int fs, inode_pointer_t inode_p, const char *name);
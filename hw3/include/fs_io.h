@@ -0,0 +1,99 @@
+#include <unistd.h>
+#include <sys/types.h>
+
+// Single read or write of FS file, a part of a batch.
+struct IORequest {
+    char write;     // 0 - read, 1 - write
+    void *data;
+    size_t size;
+    off_t pos;
+};
+
+#define IO_QUEUE_DEPTH 64   // requests in flight at once (io_uring engine)
+#define IO_THREADS     4    // workers of thread pool engine
+
+/*
+ * Function: fs_read
+ * --------------------
+ * Reads data from FS file at provided position.
+ * Area past the end of FS file has never been written, it's read as zeros.
+ *
+ * fs:      FS file descriptor
+ * data:    holder for the data
+ * size:    number of bytes to read
+ * pos:     position in FS file
+ *
+ *  returns: 0 <=> data was read (or is past the end of FS file).
+ */
+char fs_read(int fs, void *data, size_t size, off_t pos);
+
+/*
+ * Function: fs_write
+ * --------------------
+ * Writes data to FS file at provided position.
+ *
+ * fs:      FS file descriptor
+ * data:    data to write
+ * size:    number of bytes to write
+ * pos:     position in FS file
+ *
+ *  returns: 0 <=> all data was written.
+ */
+char fs_write(int fs, const void *data, size_t size, off_t pos);
+
+/*
+ * Function: fs_size
+ * --------------------
+ * Gets the size of FS file, which is the high-water mark of everything written to it.
+ * The size is queried once and then tracked by writes and resizes of this module,
+ *  so a process may use only one descriptor of one FS file (checked by assert).
+ *
+ * fs:      FS file descriptor
+ *
+ *  returns: size of FS file in bytes.
+ */
+off_t fs_size(int fs);
+
+/*
+ * Function: fs_resize
+ * --------------------
+ * Extends or truncates FS file. Extended area is read as zeros.
+ *
+ * fs:      FS file descriptor
+ * size:    new size of FS file
+ *
+ *  returns: 0 <=> FS file was resized successfully.
+ */
+char fs_resize(int fs, off_t size);
+
+/*
+ * Function: fs_punch
+ * --------------------
+ * Releases disk space of an area of FS file, the area is read as zeros afterwards.
+ * Size of FS file doesn't change. Does nothing if the file system doesn't support it.
+ *
+ * fs:      FS file descriptor
+ * pos:     position of the area
+ * size:    size of the area
+ *
+ *  returns: 0 <=> the area was released or the file system can't do it.
+ */
+char fs_punch(int fs, off_t pos, off_t size);
+
+/*
+ * Function: io_batch
+ * --------------------
+ * Performs all requests of a batch and waits for all of them.
+ * Requests are in flight together and complete in any order, so they
+ *  must not overlap. Reads follow the same rules as fs_read.
+ * io_uring is used when built with FS_IO_URING and supported by the kernel,
+ *  otherwise requests are spread over a pool of threads.
+ * If io_uring fails, requests it hasn't done are performed synchronously and it isn't used anymore.
+ *
+ * fs:          FS file descriptor
+ * requests:    requests of the batch
+ * count:       number of requests
+ *
+ *  returns: 0 <=> all requests were performed in full.
+ */
+char io_batch(int fs, struct IORequest *requests, size_t count);
@@ -0,0 +1,205 @@
+#include <archive.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+// Numeric fields are octal, too large values are stored as base-256 with the top bit set.
+static unsigned long long parse_number(const char *field, size_t len) {
+    unsigned long long value = 0;
+    size_t i = 0;
+
+    if (field[0] & 0x80) {
+        value = field[0] & 0x7F;
+        for (i = 1; i < len; ++i) value = (value << 8) | (unsigned char)field[i];
+        return value;
+    }
+    while ((i < len) && (field[i] == ' ')) ++i;
+    for (; (i < len) && (field[i] >= '0') && (field[i] <= '7'); ++i) {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+static void format_number(char *field, size_t len, unsigned long long value) {
+    size_t i;
+
+    if ((value >> ((len - 1) * 3)) == 0) {
+        sprintf(field, "%0*llo", (int)(len - 1), value);
+        return;
+    }
+    for (i = len - 1; i > 0; --i) {
+        field[i] = value & 0xFF;
+        value >>= 8;
+    }
+    field[0] = (char)0x80;
+}
+
+static unsigned int get_checksum(struct ArchiveHeader *header) {
+    unsigned char *bytes = (unsigned char *)header;
+    unsigned int sum = 0;
+    size_t i;
+
+    // Checksum field itself is counted as spaces.
+    for (i = 0; i < ARCHIVE_BLOCK_SIZE; ++i) {
+        if ((i >= offsetof(struct ArchiveHeader, checksum)) &&
+            (i < offsetof(struct ArchiveHeader, checksum) + sizeof(header->checksum))) {
+            sum += ' ';
+        } else {
+            sum += bytes[i];
+        }
+    }
+    return sum;
+}
+
+// Pax attributes are records "LENGTH KEY=VALUE\n".
+static char read_pax_path(FILE *file, unsigned long long size, char *path_holder) {
+    char *data, *record, *key, *end;
+    unsigned long long len;
+    char err = 0;
+
+    path_holder[0] = '\0';
+    if ((data = malloc(size + archive_padding(size) + 1)) == NULL) {
+        return 1;
+    }
+    if ((size > 0) && (fread(data, size + archive_padding(size), 1, file) != 1)) {
+        free(data);
+        return 1;
+    }
+    data[size] = '\0';
+
+    for (record = data; record < data + size; record += len) {
+        len = strtoull(record, &key, 10);
+        if ((len == 0) || (*key != ' ') || (record + len > data + size)) {
+            err = 1;
+            break;
+        }
+        ++key;
+        end = record + len - 1;  // '\n'
+        if ((strncmp(key, "path=", 5) == 0) && (end - (key + 5) < ARCHIVE_PATH_MAX)) {
+            memcpy(path_holder, key + 5, end - (key + 5));
+            path_holder[end - (key + 5)] = '\0';
+        }
+    }
+
+    free(data);
+    return err;
+}
+
+char archive_header_read(FILE *file, char *path_holder, char *type_holder, unsigned long long *size_holder) {
+    struct ArchiveHeader header;
+    unsigned long long size;
+    char long_name = 0;
+
+    while (1) {
+        if (fread(&header, ARCHIVE_BLOCK_SIZE, 1, file) != 1) {
+            return ARCHIVE_READ_BROKEN;
+        }
+        if (header.name[0] == '\0') {
+            return ARCHIVE_READ_END;
+        }
+        if (parse_number(header.checksum, sizeof(header.checksum)) != get_checksum(&header)) {
+            return ARCHIVE_READ_BROKEN;
+        }
+        size = parse_number(header.size, sizeof(header.size));
+
+        if (header.type == ARCHIVE_TYPE_LONG_NAME) {
+            // Path of the next entry.
+            if ((size >= ARCHIVE_PATH_MAX) || (fread(path_holder, size, 1, file) != 1) || archive_skip(file, archive_padding(size))) {
+                return ARCHIVE_READ_BROKEN;
+            }
+            path_holder[size] = '\0';
+            long_name = 1;
+            continue;
+        }
+        if (header.type == ARCHIVE_TYPE_PAX) {
+            // Only path of the next entry is taken from pax attributes.
+            if (read_pax_path(file, size, path_holder)) {
+                return ARCHIVE_READ_BROKEN;
+            }
+            long_name |= (path_holder[0] != '\0');
+            continue;
+        }
+        if (header.type == ARCHIVE_TYPE_PAX_GLOBAL) {
+            if (archive_skip(file, size + archive_padding(size))) {
+                return ARCHIVE_READ_BROKEN;
+            }
+            continue;
+        }
+
+        if (!long_name) {
+            if ((memcmp(header.magic, "ustar", 5) == 0) && (header.prefix[0] != '\0')) {
+                sprintf(path_holder, "%.155s/%.100s", header.prefix, header.name);
+            } else {
+                sprintf(path_holder, "%.100s", header.name);
+            }
+        }
+        *type_holder = ((header.type == '\0') || (header.type == '7')) ? ARCHIVE_TYPE_REGULAR : header.type;
+        *size_holder = size;
+        return ARCHIVE_READ_OK;
+    }
+}
+
+char archive_header_write(FILE *file, const char *path, char type, unsigned long long size) {
+    struct ArchiveHeader header;
+    char padding[ARCHIVE_BLOCK_SIZE] = {0};
+    size_t len = strlen(path);
+    size_t split;
+
+    memset(&header, 0, sizeof(header));
+
+    if (len <= sizeof(header.name)) {
+        memcpy(header.name, path, len);
+    } else {
+        // Split path between prefix and name at some '/', if possible.
+        for (split = len - 2; split > 0; --split) {
+            if ((path[split] == '/') && (split <= sizeof(header.prefix)) && (len - split - 1 <= sizeof(header.name))) break;
+        }
+        if (split > 0) {
+            memcpy(header.prefix, path, split);
+            memcpy(header.name, path + split + 1, len - split - 1);
+        } else {
+            // Doesn't fit at all: the full path goes as a separate entry.
+            if (archive_header_write(file, "././@LongLink", ARCHIVE_TYPE_LONG_NAME, len + 1) ||
+                (fwrite(path, len + 1, 1, file) != 1)) {
+                return 1;
+            }
+            if ((archive_padding(len + 1) > 0) && (fwrite(padding, archive_padding(len + 1), 1, file) != 1)) {
+                return 1;
+            }
+            memcpy(header.name, path, sizeof(header.name));
+        }
+    }
+
+    format_number(header.mode, sizeof(header.mode), (type == ARCHIVE_TYPE_DIRECTORY) ? 0755 : 0644);
+    format_number(header.uid, sizeof(header.uid), 0);
+    format_number(header.gid, sizeof(header.gid), 0);
+    format_number(header.size, sizeof(header.size), size);
+    format_number(header.mtime, sizeof(header.mtime), 0);
+    header.type = type;
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+    sprintf(header.checksum, "%06o", get_checksum(&header));
+    header.checksum[7] = ' ';
+
+    return (fwrite(&header, ARCHIVE_BLOCK_SIZE, 1, file) == 1) ? 0 : 1;
+}
+
+char archive_end_write(FILE *file) {
+    char blocks[2 * ARCHIVE_BLOCK_SIZE] = {0};
+    return (fwrite(blocks, sizeof(blocks), 1, file) == 1) ? 0 : 1;
+}
+
+size_t archive_padding(unsigned long long size) {
+    return (ARCHIVE_BLOCK_SIZE - size % ARCHIVE_BLOCK_SIZE) % ARCHIVE_BLOCK_SIZE;
+}
+
+char archive_skip(FILE *file, unsigned long long size) {
+    char chunk[ARCHIVE_BLOCK_SIZE * 16];
+    size_t n;
+
+    while (size > 0) {
+        n = (size < sizeof(chunk)) ? size : sizeof(chunk);
+        if (fread(chunk, n, 1, file) != 1) return 1;
+        size -= n;
+    }
+    return 0;
+}
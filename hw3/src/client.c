@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -56,12 +57,13 @@ void client_fs(struct sockaddr_in *addr, char *msg) {
     close(sock);
 }
 
-int main() {
+// fs_client [PORT], port of a server with read-only snapshot may be provided.
+int main(int argc, char *argv[]) {
     char msg[BUFFER_SIZE];
     struct sockaddr_in addr;
 
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(PORT);
+    addr.sin_port = htons((argc > 1) ? atoi(argv[1]) : PORT);
     addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
     // List available commands & get initial path.
@@ -1,6 +1,12 @@
 #include <fs.h>
+#include <archive.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/stat.h>
 
-void cmd_pwd(FILE *fs, inode_pointer_t inode_p, char *buffer, int endline) {
+void cmd_pwd(int fs, inode_pointer_t inode_p, char *buffer, int endline) {
     char path[BUFFER_SIZE];
     if (get_full_path(fs, inode_p, path) != 0) {
         sprintf(buffer, "[Error] pwd\n");
@@ -13,7 +19,7 @@ void cmd_pwd(FILE *fs, inode_pointer_t inode_p, char *buffer, int endline) {
     }
 }
 
-void cmd_mkdir(FILE *fs, inode_pointer_t inode_p, const char *name, char *buffer) {
+void cmd_mkdir(int fs, inode_pointer_t inode_p, const char *name, char *buffer) {
     char err;
 
     // Check name.
@@ -34,7 +40,7 @@ void cmd_mkdir(FILE *fs, inode_pointer_t inode_p, const char *name, char *buffer
     }
 }
 
-void cmd_rmdir(FILE *fs, inode_pointer_t inode_p, const char *name, char *buffer) {
+void cmd_rmdir(int fs, inode_pointer_t inode_p, const char *name, char *buffer) {
     struct INode inode;
     struct INode inode_victim;
     inode_pointer_t inode_victim_p;
@@ -66,7 +72,7 @@ void cmd_rmdir(FILE *fs, inode_pointer_t inode_p, const char *name, char *buffer
     }
 }
 
-inode_pointer_t cmd_cd(FILE *fs, inode_pointer_t inode_p, const char *target, char *buffer) {
+inode_pointer_t cmd_cd(int fs, inode_pointer_t inode_root, inode_pointer_t inode_p, const char *target, char *buffer) {
     inode_pointer_t inode_cur_p;
     size_t begin, end;
     char name[MAX_NAME_LENGTH];
@@ -74,8 +80,9 @@ inode_pointer_t cmd_cd(FILE *fs, inode_pointer_t inode_p, const char *target, ch
 
     if (strlen(target) == 0) return inode_p;
 
+    // Absolute path starts from the root of served tree.
     if (target[0] == '/') {
-        inode_cur_p = 0;
+        inode_cur_p = inode_root;
         begin = 1;
     } else {
         inode_cur_p = inode_p;
@@ -90,6 +97,11 @@ inode_pointer_t cmd_cd(FILE *fs, inode_pointer_t inode_p, const char *target, ch
         }
         memcpy(name, target + begin, end - begin);
         memcpy(name + (end - begin), &zero, sizeof(zero));
+        // Served tree can't be left, its root is its own parent.
+        if ((inode_cur_p == inode_root) && (strcmp(name, "..") == 0)) {
+            begin = end + 1;
+            continue;
+        }
         if (get_dir(fs, inode_cur_p, name, &inode_cur_p)) {
             sprintf(buffer, "cd: invalid path\n");
             return inode_p;
@@ -100,7 +112,7 @@ inode_pointer_t cmd_cd(FILE *fs, inode_pointer_t inode_p, const char *target, ch
     return inode_cur_p;
 }
 
-void cmd_touch(FILE *fs, inode_pointer_t inode_p, const char *name, char *buffer) {
+void cmd_touch(int fs, inode_pointer_t inode_p, const char *name, char *buffer) {
     char err;
 
     // Check name.
@@ -121,7 +133,7 @@ void cmd_touch(FILE *fs, inode_pointer_t inode_p, const char *name, char *buffer
     }
 }
 
-void cmd_rm(FILE *fs, inode_pointer_t inode_p, const char *name, char *buffer) {
+void cmd_rm(int fs, inode_pointer_t inode_p, const char *name, char *buffer) {
     struct INode inode;
     struct INode inode_victim;
     inode_pointer_t inode_victim_p;
@@ -153,36 +165,44 @@ void cmd_rm(FILE *fs, inode_pointer_t inode_p, const char *name, char *buffer) {
     }
 }
 
-void cmd_ls(FILE *fs, inode_pointer_t inode_p, char *buffer) {
+void cmd_ls(int fs, inode_pointer_t inode_p, char *buffer) {
     char err;
     struct INode inode, inode2;
     unsigned int k;
-    int i, i_start;
-    block_pointer_t block_p;
+    int i, i_start, n, j;
     char block[FS_BLOCK_SIZE];
-    struct BlockDirectoryRecord record;
+    struct BlockDirectoryRecord records[RECORDS_PER_BLOCK];
+    inode_pointer_t inode_ps[RECORDS_PER_BLOCK];
+    struct INode inodes[RECORDS_PER_BLOCK];
     unsigned long long sz;
     char file_type;
 
     get_inode(fs, inode_p, &inode);
 
-    for (k = 0; k < inode.file_size; ++k) {
-        if (err = get_block_k(fs, &inode, k, &block_p)) {
-            sprintf(buffer, "[Error] ls, get_block_k (%d)\n", err);
+    for (k = 0; k < get_dir_blocks_count(&inode); ++k) {
+        if (err = get_dir_block_k(fs, &inode, k, block)) {
+            sprintf(buffer, "[Error] ls, get_dir_block_k (%d)\n", err);
             return;
         }
-        get_block(fs, block_p, block);
         if (k == 0) {
             i_start = 2;
         } else {
             i_start = 0;
         }
-        for (i = i_start; i < RECORDS_PER_BLOCK; ++i) {
-            memcpy(&record, block + i * sizeof(record), sizeof(record));
-            if (strlen(record.name) == 0) {
-                return;
-            }
-            get_inode(fs, record.inode_p, &inode2);
+
+        // Inodes of the whole block are read as one batch.
+        for (n = 0, i = i_start; i < get_dir_records_count(&inode); ++i, ++n) {
+            memcpy(&records[n], block + i * RECORD_SIZE, RECORD_SIZE);
+            if (strlen(records[n].name) == 0) break;
+            inode_ps[n] = records[n].inode_p;
+        }
+        if (err = get_inodes(fs, inode_ps, n, inodes)) {
+            sprintf(buffer, "[Error] ls, get_inodes (%d)\n", err);
+            return;
+        }
+
+        for (j = 0; j < n; ++j) {
+            inode2 = inodes[j];
             switch (inode2.file_type) {
                 case TYPE_REGULAR:
                     file_type = 'F';
@@ -198,19 +218,41 @@ void cmd_ls(FILE *fs, inode_pointer_t inode_p, char *buffer) {
             } else {
                 sz = get_size_on_disk(&inode2) * FS_BLOCK_SIZE;
             }
-            sprintf(buffer + strlen(buffer), "%c %-13llu %s\n", file_type, sz, record.name);
+            sprintf(buffer + strlen(buffer), "%c %-13llu %s\n", file_type, sz, records[j].name);
+        }
+        if (i < get_dir_records_count(&inode)) return;
+    }
+}
+
+// Appends file content to command output, escaping bytes the reply string can't carry.
+// Returns non-zero if the content was cut at OUTPUT_SIZE_MAX.
+static char append_content(char *buffer, const char *data, size_t size) {
+    size_t len = strlen(buffer), i;
+
+    for (i = 0; i < size; ++i) {
+        if (len + 2 >= OUTPUT_SIZE_MAX) {
+            buffer[len] = '\0';
+            return 1;
+        }
+        if ((data[i] == '\0') || (data[i] == '\\')) {
+            buffer[len++] = '\\';
+            buffer[len++] = (data[i] == '\0') ? '0' : '\\';
+        } else {
+            buffer[len++] = data[i];
         }
     }
+    buffer[len] = '\0';
+    return 0;
 }
 
-void cmd_cat(FILE *fs, inode_pointer_t inode_p, const char *name, char *buffer) {
+void cmd_cat(int fs, inode_pointer_t inode_p, const char *name, char *buffer) {
     char err;
     struct INode inode;
     struct INode inode_file;
     inode_pointer_t inode_file_p;
-    block_pointer_t block_p;
+    struct FileReadBuffer rb;
     char block[FS_BLOCK_SIZE];
-    size_t k, i;
+    size_t k;
     long eof_pos;
 
     // Check name.
@@ -235,43 +277,108 @@ void cmd_cat(FILE *fs, inode_pointer_t inode_p, const char *name, char *buffer)
         return;
     }
 
+    // Inline file keeps its content right in the inode.
+    if (inode_file.flags & INODE_FLAG_INLINE) {
+        if (append_content(buffer, (char *)inode_file.block_p, inode_file.file_size)) {
+            sprintf(buffer + strlen(buffer), "\n[output is cut at %d bytes]\n", OUTPUT_SIZE_MAX);
+        }
+        return;
+    }
+
     // Do nothing with empty file.
     if (inode_file.file_size == 0) return;
 
+    if (err = read_buffer_open(fs, &inode_file, &rb)) {
+        sprintf(buffer, "[Error] cat, read_buffer_open (%d)\n", err);
+        return;
+    }
+
     // Show full blocks one by one, except the last one.
     for (k = 0; k < inode_file.file_size - 1; ++k) {
-        if (get_block_k(fs, &inode_file, k, &block_p)) {
-            sprintf(buffer, "[Error] cat, get_block_k (%d)\n", err);
+        if (err = read_buffer_get_block(fs, &rb, k, block)) {
+            sprintf(buffer, "[Error] cat, read_buffer_get_block (%d)\n", err);
+            read_buffer_close(&rb);
+            return;
+        }
+        if (append_content(buffer, block, FS_BLOCK_SIZE)) {
+            sprintf(buffer + strlen(buffer), "\n[output is cut at %d bytes]\n", OUTPUT_SIZE_MAX);
+            read_buffer_close(&rb);
             return;
         }
-        get_block(fs, block_p, block);
-        for (i = 0; i < FS_BLOCK_SIZE; ++i) sprintf(buffer + strlen(buffer), "%c", block[i]);
     }
 
     // Show the last block properly (considering EOF).
-    if (get_block_k(fs, &inode_file, inode_file.file_size - 1, &block_p)) {
-        sprintf(buffer, "[Error] cat, get_block_k (%d)\n", err);
+    err = read_buffer_get_block(fs, &rb, inode_file.file_size - 1, block);
+    read_buffer_close(&rb);
+    if (err) {
+        sprintf(buffer, "[Error] cat, read_buffer_get_block (%d)\n", err);
         return;
     }
-    get_block(fs, block_p, block);
     for (eof_pos = FS_BLOCK_SIZE - 1; (eof_pos >= 0) && block[eof_pos] != EOF; --eof_pos) {}
     if (eof_pos < 0) {
-        sprintf(buffer, "[Error] cat: no EOF in the last block (%d)\n", err);
+        sprintf(buffer, "[Error] cat: no EOF in the last block\n");
         return;
     }
-    for (i = 0; i < eof_pos; ++i) sprintf(buffer + strlen(buffer), "%c", block[i]);
+    if (append_content(buffer, block, eof_pos)) {
+        sprintf(buffer + strlen(buffer), "\n[output is cut at %d bytes]\n", OUTPUT_SIZE_MAX);
+    }
 }
 
-void cmd_download(FILE *fs, inode_pointer_t inode_p, const char *name_fs, const char *name_local, char *buffer) {
+// Writes content of regular file from FS into local file.
+static char download_file_content(int fs, struct INode *inode_file, FILE *file, const char *cmd_name, char *buffer) {
     char err;
+    struct FileReadBuffer rb;
+    char block[FS_BLOCK_SIZE];
+    size_t k;
+    long eof_pos;
+
+    // Inline file keeps its content right in the inode.
+    if (inode_file->flags & INODE_FLAG_INLINE) {
+        fwrite(inode_file->block_p, inode_file->file_size, 1, file);
+        return 0;
+    }
+
+    // Do nothing with empty file.
+    if (inode_file->file_size == 0) {
+        return 0;
+    }
+
+    if (err = read_buffer_open(fs, inode_file, &rb)) {
+        sprintf(buffer, "[Error] %s, read_buffer_open (%d)\n", cmd_name, err);
+        return 1;
+    }
+
+    // Write full blocks to file one by one, except the last one.
+    for (k = 0; k < inode_file->file_size - 1; ++k) {
+        if (err = read_buffer_get_block(fs, &rb, k, block)) {
+            sprintf(buffer, "[Error] %s, read_buffer_get_block (%d)\n", cmd_name, err);
+            read_buffer_close(&rb);
+            return 1;
+        }
+        fwrite(block, FS_BLOCK_SIZE, 1, file);
+    }
+
+    // Write the last block to file properly (considering EOF).
+    err = read_buffer_get_block(fs, &rb, inode_file->file_size - 1, block);
+    read_buffer_close(&rb);
+    if (err) {
+        sprintf(buffer, "[Error] %s, read_buffer_get_block (%d)\n", cmd_name, err);
+        return 1;
+    }
+    for (eof_pos = FS_BLOCK_SIZE - 1; (eof_pos >= 0) && block[eof_pos] != EOF; --eof_pos) {}
+    if (eof_pos < 0) {
+        sprintf(buffer, "[Error] %s: no EOF in the last block\n", cmd_name);
+        return 1;
+    }
+    fwrite(block, eof_pos, 1, file);
+    return 0;
+}
+
+void cmd_download(int fs, inode_pointer_t inode_p, const char *name_fs, const char *name_local, char *buffer) {
     struct INode inode;
     struct INode inode_file;
     inode_pointer_t inode_file_p;
-    block_pointer_t block_p;
-    char block[FS_BLOCK_SIZE];
-    size_t k;
     FILE *file;
-    long eof_pos;
 
     // Check name.
     if (!is_name_valid(name_fs)) {
@@ -302,50 +409,46 @@ void cmd_download(FILE *fs, inode_pointer_t inode_p, const char *name_fs, const
         return;
     }
 
-    // Do nothing with empty file.
-    if (inode_file.file_size == 0) {
-        fclose(file);
-        return;
-    }
+    download_file_content(fs, &inode_file, file, "download", buffer);
+    fclose(file);
+}
 
-    // Write full blocks to file one by one, except the last one.
-    for (k = 0; k < inode_file.file_size - 1; ++k) {
-        if (get_block_k(fs, &inode_file, k, &block_p)) {
-            sprintf(buffer, "[Error] download, get_block_k (%d)\n", err);
-            fclose(file);
-            return;
+// Copies up to size bytes of local file into empty regular file of FS.
+// Blocks are occupied only when the buffer gets flushed.
+static char upload_file_content(int fs, inode_pointer_t inode_file_p, FILE *file, size_t size, const char *cmd_name, char *buffer) {
+    char err;
+    struct FileWriteBuffer wb;
+    char chunk[WRITE_BUFFER_SIZE_MIN];
+    size_t sz;
+
+    if (err = write_buffer_open(fs, inode_file_p, &wb)) {
+        sprintf(buffer, "[Error] %s, write_buffer_open (%d)\n", cmd_name, err);
+        return 1;
+    }
+    while ((size > 0) && ((sz = fread(chunk, 1, (size < sizeof(chunk)) ? size : sizeof(chunk), file)) > 0)) {
+        if (err = write_buffer_write(fs, &wb, chunk, sz)) {
+            sprintf(buffer, "[Error] %s, write_buffer_write (%d)\n", cmd_name, err);
+            break;
         }
-        get_block(fs, block_p, block);
-        fwrite(block, FS_BLOCK_SIZE, 1, file);
+        size -= sz;
     }
-
-    // Write the last block to file properly (considering EOF).
-    if (get_block_k(fs, &inode_file, inode_file.file_size - 1, &block_p)) {
-        sprintf(buffer, "[Error] download, get_block_k (%d)\n", err);
-        fclose(file);
-        return;
+    if (err) {
+        write_buffer_close(fs, &wb);
+        return 1;
     }
-    get_block(fs, block_p, block);
-    for (eof_pos = FS_BLOCK_SIZE - 1; (eof_pos >= 0) && block[eof_pos] != EOF; --eof_pos) {}
-    if (eof_pos < 0) {
-        sprintf(buffer, "[Error] download: no EOF in the last block (%d)\n", err);
-        fclose(file);
-        return;
+    if (err = write_buffer_close(fs, &wb)) {
+        sprintf(buffer, "[Error] %s, write_buffer_close (%d)\n", cmd_name, err);
+        return 1;
     }
-    fwrite(block, eof_pos, 1, file);
-
-    fclose(file);
+    return 0;
 }
 
-void cmd_upload(FILE *fs, inode_pointer_t inode_p, const char *name_local, const char *name_fs, char *buffer) {
+void cmd_upload(int fs, inode_pointer_t inode_p, const char *name_local, const char *name_fs, char *buffer) {
     char err;
-    struct INode inode_file;
     inode_pointer_t inode_file_p;
-    block_pointer_t block_p;
-    char block[FS_BLOCK_SIZE];
-    size_t k;
+    struct INode inode_file;
+    struct TreeTotals totals_before, totals_after;
     FILE *file;
-    long sz, pos;
 
     // Open local file.
     file = fopen(name_local, "r");
@@ -375,122 +478,1121 @@ void cmd_upload(FILE *fs, inode_pointer_t inode_p, const char *name_local, const
 
     // Copy content from local file to file in FS.
     get_inode(fs, inode_file_p, &inode_file);
-    fseek(file, 0L, SEEK_END);
-    sz = ftell(file);
-    fseek(file, 0L, SEEK_SET);
-    for (pos = 0; (pos + FS_BLOCK_SIZE) <= sz; pos += FS_BLOCK_SIZE) {
-        // Reading full blocks.
-        if (err = inode_block_append(fs, &inode_file, &block_p)) {
-            sprintf(buffer, "[Error] upload, inode_block_append (%d)\n", err);
-            fclose(file);
-            return;
-        }
-        fread(block, FS_BLOCK_SIZE, 1, file);
-        update_block(fs, block_p, block);
+    get_file_totals(fs, &inode_file, &totals_before);
+    upload_file_content(fs, inode_file_p, file, SIZE_MAX, "upload", buffer);
+    get_inode(fs, inode_file_p, &inode_file);
+    get_file_totals(fs, &inode_file, &totals_after);
+    add_dir_totals(fs, inode_p, &totals_before, &totals_after);
+
+    fclose(file);
+}
+
+// Target of cp and mv is either an existing directory (the file keeps its name there)
+//  or a new name in the current directory.
+static char get_target(int fs, inode_pointer_t inode_p, const char *name, const char *target,
+                       inode_pointer_t *inode_dir_holder, const char **name_holder, char *buffer) {
+    if (get_dir(fs, inode_p, target, inode_dir_holder) == 0) {
+        *name_holder = name;
+    } else {
+        *inode_dir_holder = inode_p;
+        *name_holder = target;
     }
-    // Final block.
-    if (err = inode_block_append(fs, &inode_file, &block_p)) {
-        sprintf(buffer, "[Error] upload, inode_block_append (%d)\n", err);
-        fclose(file);
+    if (!is_name_valid(*name_holder)) {
+        sprintf(buffer, "name \"%s\" is invalid\n", *name_holder);
+        return 1;
+    }
+    if (is_name_taken(fs, *inode_dir_holder, *name_holder)) {
+        sprintf(buffer, "name \"%s\" is already taken\n", *name_holder);
+        return 1;
+    }
+    return 0;
+}
+
+void cmd_cp(int fs, inode_pointer_t inode_p, const char *name_src, const char *target, char *buffer) {
+    char err;
+    struct INode inode;
+    struct INode inode_file;
+    inode_pointer_t inode_src_p, inode_dst_p, inode_dir_p;
+    struct TreeTotals totals_before, totals_after;
+    const char *name_dst;
+
+    // Check name.
+    if (!is_name_valid(name_src)) {
+        sprintf(buffer, "name \"%s\" is invalid\n", name_src);
         return;
     }
-    for (k = 0; k < FS_BLOCK_SIZE; ++k) block[k] = '\0';
-    block[sz - pos] = EOF;
-    if (pos < sz) fread(block, sz - pos, 1, file);
-    update_block(fs, block_p, block);
-    update_inode(fs, inode_file_p, &inode_file);
 
-    fclose(file);
+    // Find source file.
+    get_inode(fs, inode_p, &inode);
+    if (get_inode_by_name_in_inode(fs, &inode, name_src, &inode_src_p)) {
+        sprintf(buffer, "file \"%s\" doesn't exist\n", name_src);
+        return;
+    }
+    get_inode(fs, inode_src_p, &inode_file);
+    if (inode_file.file_type != TYPE_REGULAR) {
+        sprintf(buffer, "\"%s\" is not a regular file\n", name_src);
+        return;
+    }
+    if (get_target(fs, inode_p, name_src, target, &inode_dir_p, &name_dst, buffer)) {
+        return;
+    }
+
+    // The copy shares data blocks with the source.
+    if (err = create_file_in_dir(fs, inode_dir_p, TYPE_REGULAR, name_dst, &inode_dst_p)) {
+        sprintf(buffer, "[Error] cp, create_file_in_dir (%d)\n", err);
+        return;
+    }
+    get_inode(fs, inode_dst_p, &inode_file);
+    get_file_totals(fs, &inode_file, &totals_before);
+    if (err = clone_file(fs, inode_src_p, inode_dst_p)) {
+        sprintf(buffer, "[Error] cp, clone_file (%d)\n", err);
+        remove_file_from_dir(fs, inode_dir_p, inode_dst_p);
+        return;
+    }
+    get_inode(fs, inode_dst_p, &inode_file);
+    get_file_totals(fs, &inode_file, &totals_after);
+    add_dir_totals(fs, inode_dir_p, &totals_before, &totals_after);
 }
 
-void cmd_help(char *buffer) {
-    sprintf(buffer + strlen(buffer), "%-30s%s\n", "pwd", "-- показать текущую директорию");
-    sprintf(buffer + strlen(buffer), "%-30s%s\n", "ls", "-- аналог ls -l");
-    sprintf(buffer + strlen(buffer), "%-30s%s\n", "mkdir DIRECTORY", "-- создать каталог");
-    sprintf(buffer + strlen(buffer), "%-30s%s\n", "rmdir DIRECTORY", "-- удаляет каталог и его содержимое");
-    sprintf(buffer + strlen(buffer), "%-30s%s\n", "cd DIRECTORY", "-- изменить текущую директорию");
-    sprintf(buffer + strlen(buffer), "%-30s%s\n", "touch FILE", "-- создать пустой файл");
-    sprintf(buffer + strlen(buffer), "%-30s%s\n", "rm FILE", "-- удалить файл");
-    sprintf(buffer + strlen(buffer), "%-30s%s\n", "cat FILE", "-- вывести содержимое файла");
-    sprintf(buffer + strlen(buffer), "%-30s%s\n", "upload FILE_LOCAL FILE_FS", "-- загрузка локального файла с абсолютным путём FILE_LOCAL в ФС");
-    sprintf(buffer + strlen(buffer), "%-30s%s\n", "download FILE_FS FILE_LOCAL", "-- выгрузка файла FILE_FS в локальный файл по абсолютному пути FILE_LOCAL");
-    sprintf(buffer + strlen(buffer), "%-30s%s\n", "unmount", "-- завершение работы сервера виртуальной ФС");
-    sprintf(buffer + strlen(buffer), "%-30s%s\n", "help", "-- вывести список доступных комманд");
+void cmd_mv(int fs, inode_pointer_t inode_p, const char *name, const char *target, char *buffer) {
+    char err;
+    struct INode inode;
+    inode_pointer_t inode_file_p, inode_dir_p;
+    const char *name_new;
+
+    // Check name.
+    if (!is_name_valid(name)) {
+        sprintf(buffer, "name \"%s\" is invalid\n", name);
+        return;
+    }
+
+    // Find file.
+    get_inode(fs, inode_p, &inode);
+    if (get_inode_by_name_in_inode(fs, &inode, name, &inode_file_p)) {
+        sprintf(buffer, "file \"%s\" doesn't exist\n", name);
+        return;
+    }
+    if (get_target(fs, inode_p, name, target, &inode_dir_p, &name_new, buffer)) {
+        return;
+    }
+
+    // Only directory records change, content is never copied.
+    err = move_file(fs, inode_p, inode_file_p, inode_dir_p, name_new);
+    if (err == 2) {
+        sprintf(buffer, "can't move \"%s\" into itself\n", name);
+    } else if (err) {
+        sprintf(buffer, "[Error] mv (%d)\n", err);
+    }
 }
 
-int get_cmd(FILE *fs, inode_pointer_t *inode_p, char *cmd, char *buffer) {
-    char unit[BUFFER_SIZE];
-    char unit2[BUFFER_SIZE];
-    unsigned int i, units_count, *units_begins, *units_lens;
-    int on_space, return_code;
-    char zero = '\0';
+// Removes directory left incomplete by a failed command, the reason is already in buffer.
+static void remove_incomplete_dir(int fs, inode_pointer_t inode_p, inode_pointer_t inode_dir_p, const char *name, char *buffer) {
+    if (remove_file_from_dir(fs, inode_p, inode_dir_p)) {
+        sprintf(buffer + strlen(buffer), "directory \"%s\" is left incomplete\n", name);
+    } else {
+        sprintf(buffer + strlen(buffer), "directory \"%s\" is not created\n", name);
+    }
+}
 
-    buffer[0] = zero;
+// Local directory entries to be created in FS as one batch.
+struct ImportList {
+    char (*names)[MAX_NAME_LENGTH];
+    const char **name_ps;
+    int *file_types;
+    inode_pointer_t *inode_ps;
+    unsigned int size;
+    unsigned int capacity;
+};
 
-    // Count units.
-    on_space = 1;
-    units_count = 0;
-    for (i = 0; i < BUFFER_SIZE; ++i) {
-        if (cmd[i] == '\0') {
-            if (!on_space) ++units_count;
-            break;
-        }
-        switch (cmd[i]) {
-            case ' ':
-                if (on_space) continue;
-                on_space = 1;
-                ++units_count;
-                break;
-            default:
-                on_space = 0;
-        }
+static char import_list_push(struct ImportList *list, const char *name, int file_type) {
+    char (*names_new)[MAX_NAME_LENGTH];
+    const char **name_ps_new;
+    int *file_types_new;
+    inode_pointer_t *inode_ps_new;
+    unsigned int capacity_new, i;
+
+    // Array which has grown is kept even if the next one can't, capacity changes only when all have grown.
+    if (list->size == list->capacity) {
+        capacity_new = list->capacity ? list->capacity * 2 : 64;
+        if ((names_new = realloc(list->names, capacity_new * sizeof(*list->names))) == NULL) return 1;
+        list->names = names_new;
+        for (i = 0; i < list->size; ++i) list->name_ps[i] = list->names[i];
+        if ((name_ps_new = realloc(list->name_ps, capacity_new * sizeof(*list->name_ps))) == NULL) return 1;
+        list->name_ps = name_ps_new;
+        if ((file_types_new = realloc(list->file_types, capacity_new * sizeof(*list->file_types))) == NULL) return 1;
+        list->file_types = file_types_new;
+        if ((inode_ps_new = realloc(list->inode_ps, capacity_new * sizeof(*list->inode_ps))) == NULL) return 1;
+        list->inode_ps = inode_ps_new;
+        list->capacity = capacity_new;
     }
-    if (i == BUFFER_SIZE) {
-        sprintf(buffer, "[Error] Command line is too long.\n");
-        return 0;
+    strcpy(list->names[list->size], name);
+    list->name_ps[list->size] = list->names[list->size];
+    list->file_types[list->size] = file_type;
+    ++list->size;
+    return 0;
+}
+
+static void import_list_free(struct ImportList *list) {
+    free(list->names);
+    free(list->name_ps);
+    free(list->file_types);
+    free(list->inode_ps);
+}
+
+// Copies content of local directory into empty directory of FS, recursively.
+static char import_dir(int fs, inode_pointer_t inode_dir_p, const char *path_local, unsigned int *skipped, char *buffer) {
+    struct ImportList list = {NULL, NULL, NULL, NULL, 0, 0};
+    struct TreeTotals totals_before = {0, 0, 0}, totals_after = {0, 0, 0}, totals;
+    struct INode inode_file;
+    struct dirent *entry;
+    struct stat st;
+    char path[PATH_MAX];
+    DIR *dir;
+    FILE *file;
+    unsigned int i;
+    char err = 0;
+
+    dir = opendir(path_local);
+    if (dir == NULL) {
+        sprintf(buffer, "Can't access local directory \"%s\".\n", path_local);
+        return 1;
     }
 
-    // Remember all units.
-    units_begins = malloc(units_count * sizeof(unsigned int));
-    units_lens = malloc(units_count * sizeof(unsigned int));
-    on_space = 1;
-    units_count = 0;
-    for (i = 0; i < BUFFER_SIZE; ++i) {
-        if (cmd[i] == '\0') {
-            if (!on_space) {
-                units_lens[units_count] = i - units_begins[units_count];
-                ++units_count;
-            }
+    // Collect the whole directory first, so that all its files are created at once.
+    while ((entry = readdir(dir)) != NULL) {
+        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) continue;
+        if (!is_name_valid(entry->d_name) || (snprintf(path, PATH_MAX, "%s/%s", path_local, entry->d_name) >= PATH_MAX)) {
+            ++*skipped;
+            continue;
+        }
+        if (lstat(path, &st) || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+            ++*skipped;
+            continue;
+        }
+        if (import_list_push(&list, entry->d_name, S_ISDIR(st.st_mode) ? TYPE_DIRECTORY : TYPE_REGULAR)) {
+            sprintf(buffer, "[Error] import: out of memory\n");
+            err = 1;
             break;
         }
-        switch (cmd[i]) {
-            case ' ':
-                if (on_space) continue;
-                on_space = 1;
-                units_lens[units_count] = i - units_begins[units_count];
-                ++units_count;
-                break;
-            default:
-                if (on_space) units_begins[units_count] = i;
-                on_space = 0;
+    }
+    closedir(dir);
+    if (err) {
+        import_list_free(&list);
+        return 1;
+    }
 
+    if (err = create_files_in_dir(fs, inode_dir_p, list.file_types, list.name_ps, list.size, list.inode_ps)) {
+        sprintf(buffer, "[Error] import, create_files_in_dir (%d)\n", err);
+        import_list_free(&list);
+        return 1;
+    }
+
+    // Regular files are filled in first, their sizes are added to the tree once.
+    for (i = 0; (i < list.size) && !err; ++i) {
+        if (list.file_types[i] != TYPE_REGULAR) continue;
+        snprintf(path, PATH_MAX, "%s/%s", path_local, list.names[i]);
+        file = fopen(path, "r");
+        if (file == NULL) {
+            ++*skipped;
+            continue;
         }
+        get_inode(fs, list.inode_ps[i], &inode_file);
+        get_file_totals(fs, &inode_file, &totals);
+        totals_before.bytes += totals.bytes;
+        totals_before.blocks += totals.blocks;
+        totals_before.files += totals.files;
+        err = upload_file_content(fs, list.inode_ps[i], file, SIZE_MAX, "import", buffer);
+        get_inode(fs, list.inode_ps[i], &inode_file);
+        get_file_totals(fs, &inode_file, &totals);
+        totals_after.bytes += totals.bytes;
+        totals_after.blocks += totals.blocks;
+        totals_after.files += totals.files;
+        fclose(file);
     }
+    add_dir_totals(fs, inode_dir_p, &totals_before, &totals_after);
 
-    // Processing units.
-    return_code = 0;
-    if (units_count > 0) {
-        memcpy(unit, cmd + units_begins[0], units_lens[0]);
-        memcpy(unit + units_lens[0], &zero, sizeof(zero));
+    for (i = 0; (i < list.size) && !err; ++i) {
+        if (list.file_types[i] != TYPE_DIRECTORY) continue;
+        snprintf(path, PATH_MAX, "%s/%s", path_local, list.names[i]);
+        err = import_dir(fs, list.inode_ps[i], path, skipped, buffer);
+    }
 
-        if (strcmp(unit, "pwd") == 0) {
-            if (units_count == 1) {
-                cmd_pwd(fs, *inode_p, buffer, 1);
+    import_list_free(&list);
+    return err;
+}
+
+void cmd_import(int fs, inode_pointer_t inode_p, const char *path_local, const char *name_fs, char *buffer) {
+    char err;
+    inode_pointer_t inode_dir_p;
+    unsigned int skipped = 0;
+
+    // Check name.
+    if (!is_name_valid(name_fs)) {
+        sprintf(buffer, "name \"%s\" is invalid\n", name_fs);
+        return;
+    }
+    if (is_name_taken(fs, inode_p, name_fs)) {
+        sprintf(buffer, "name \"%s\" is already taken\n", name_fs);
+        return;
+    }
+
+    // Create directory in our FS and fill it.
+    if (err = create_file_in_dir(fs, inode_p, TYPE_DIRECTORY, name_fs, &inode_dir_p)) {
+        sprintf(buffer, "[Error] import, create_file_in_dir (%d)\n", err);
+        return;
+    }
+    if (import_dir(fs, inode_dir_p, path_local, &skipped, buffer)) {
+        remove_incomplete_dir(fs, inode_p, inode_dir_p, name_fs, buffer);
+        return;
+    }
+    if (skipped > 0) {
+        sprintf(buffer, "%u local files skipped (name or type is not supported)\n", skipped);
+    }
+}
+
+// Copies content of FS directory into existing local directory, recursively.
+static char export_dir(int fs, inode_pointer_t inode_dir_p, const char *path_local, char *buffer) {
+    struct INode inode;
+    struct BlockDirectoryRecord records[RECORDS_PER_BLOCK];
+    inode_pointer_t inode_ps[RECORDS_PER_BLOCK];
+    struct INode inodes[RECORDS_PER_BLOCK];
+    char block[FS_BLOCK_SIZE];
+    char path[PATH_MAX];
+    unsigned int k, i, n, j;
+    FILE *file;
+    char err;
+
+    get_inode(fs, inode_dir_p, &inode);
+
+    for (k = 0; k < get_dir_blocks_count(&inode); ++k) {
+        if (err = get_dir_block_k(fs, &inode, k, block)) {
+            sprintf(buffer, "[Error] export, get_dir_block_k (%d)\n", err);
+            return 1;
+        }
+
+        // Inodes of the whole block are read as one batch.
+        for (n = 0, i = (k == 0) ? 2 : 0; i < get_dir_records_count(&inode); ++i, ++n) {
+            memcpy(&records[n], block + i * RECORD_SIZE, RECORD_SIZE);
+            if (strlen(records[n].name) == 0) break;
+            inode_ps[n] = records[n].inode_p;
+        }
+        if (err = get_inodes(fs, inode_ps, n, inodes)) {
+            sprintf(buffer, "[Error] export, get_inodes (%d)\n", err);
+            return 1;
+        }
+
+        for (j = 0; j < n; ++j) {
+            if (snprintf(path, PATH_MAX, "%s/%s", path_local, records[j].name) >= PATH_MAX) {
+                sprintf(buffer, "export: local path is too long\n");
+                return 1;
+            }
+            if (inodes[j].file_type == TYPE_DIRECTORY) {
+                if (mkdir(path, 0777) && (errno != EEXIST)) {
+                    sprintf(buffer, "Can't create local directory \"%s\".\n", path);
+                    return 1;
+                }
+                if (export_dir(fs, inode_ps[j], path, buffer)) {
+                    return 1;
+                }
             } else {
-                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "pwd", 0, units_count - 1);
+                file = fopen(path, "w");
+                if (file == NULL) {
+                    sprintf(buffer, "Can't access local file \"%s\".\n", path);
+                    return 1;
+                }
+                err = download_file_content(fs, &inodes[j], file, "export", buffer);
+                fclose(file);
+                if (err) {
+                    return 1;
+                }
             }
-        } else if (strcmp(unit, "ls") == 0) {
-            if (units_count == 1) {
+        }
+    }
+    return 0;
+}
+
+void cmd_export(int fs, inode_pointer_t inode_p, const char *name_fs, const char *path_local, char *buffer) {
+    struct INode inode;
+    inode_pointer_t inode_dir_p;
+
+    // Check name.
+    if (!is_name_valid(name_fs)) {
+        sprintf(buffer, "name \"%s\" is invalid\n", name_fs);
+        return;
+    }
+
+    // Find directory.
+    get_inode(fs, inode_p, &inode);
+    if (get_inode_by_name_in_inode(fs, &inode, name_fs, &inode_dir_p)) {
+        sprintf(buffer, "directory \"%s\" doesn't exist\n", name_fs);
+        return;
+    }
+    get_inode(fs, inode_dir_p, &inode);
+    if (inode.file_type != TYPE_DIRECTORY) {
+        sprintf(buffer, "\"%s\" is not a directory\n", name_fs);
+        return;
+    }
+
+    // Local directory may already exist, its files are overwritten then.
+    if (mkdir(path_local, 0777) && (errno != EEXIST)) {
+        sprintf(buffer, "Can't create local directory \"%s\".\n", path_local);
+        return;
+    }
+    export_dir(fs, inode_dir_p, path_local, buffer);
+}
+
+// Paths of files created by untar, relative to its root directory.
+struct PathIndex {
+    char **paths;
+    inode_pointer_t *inode_ps;
+    size_t size;
+    size_t capacity;  // power of two
+};
+
+static size_t path_index_slot(struct PathIndex *index, const char *path) {
+    size_t hash = 14695981039346656037ULL;
+    const char *c;
+    for (c = path; *c != '\0'; ++c) hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    hash &= index->capacity - 1;
+    while ((index->paths[hash] != NULL) && (strcmp(index->paths[hash], path) != 0)) {
+        hash = (hash + 1) & (index->capacity - 1);
+    }
+    return hash;
+}
+
+static char path_index_find(struct PathIndex *index, const char *path, inode_pointer_t *inode_p_holder) {
+    size_t slot = path_index_slot(index, path);
+    if (index->paths[slot] == NULL) return 1;
+    *inode_p_holder = index->inode_ps[slot];
+    return 0;
+}
+
+static char path_index_add(struct PathIndex *index, const char *path, inode_pointer_t inode_p) {
+    struct PathIndex index_new;
+    size_t i, slot;
+
+    // Table is kept at most half full.
+    if (2 * (index->size + 1) > index->capacity) {
+        index_new.capacity = index->capacity ? 2 * index->capacity : 1024;
+        index_new.size = index->size;
+        index_new.paths = calloc(index_new.capacity, sizeof(char *));
+        index_new.inode_ps = malloc(index_new.capacity * sizeof(inode_pointer_t));
+        if ((index_new.paths == NULL) || (index_new.inode_ps == NULL)) {
+            free(index_new.paths);
+            free(index_new.inode_ps);
+            return 1;
+        }
+        for (i = 0; i < index->capacity; ++i) {
+            if (index->paths[i] == NULL) continue;
+            slot = path_index_slot(&index_new, index->paths[i]);
+            index_new.paths[slot] = index->paths[i];
+            index_new.inode_ps[slot] = index->inode_ps[i];
+        }
+        free(index->paths);
+        free(index->inode_ps);
+        *index = index_new;
+    }
+
+    slot = path_index_slot(index, path);
+    if ((index->paths[slot] = strdup(path)) == NULL) return 1;
+    index->inode_ps[slot] = inode_p;
+    ++index->size;
+    return 0;
+}
+
+static void path_index_free(struct PathIndex *index) {
+    size_t i;
+    for (i = 0; i < index->capacity; ++i) free(index->paths[i]);
+    free(index->paths);
+    free(index->inode_ps);
+}
+
+// Finds directory of untar by its relative path, missing directories on the way are created.
+static char untar_get_dir(int fs, struct PathIndex *index, char *path, inode_pointer_t *inode_p_holder) {
+    char *slash;
+    const char *name;
+    inode_pointer_t inode_parent_p;
+
+    if (path_index_find(index, path, inode_p_holder) == 0) {
+        return 0;
+    }
+
+    // Parent is found (or created) first.
+    slash = strrchr(path, '/');
+    if (slash == NULL) {
+        path_index_find(index, "", &inode_parent_p);
+        name = path;
+    } else {
+        *slash = '\0';
+        if (untar_get_dir(fs, index, path, &inode_parent_p)) {
+            *slash = '/';
+            return 1;
+        }
+        *slash = '/';
+        name = slash + 1;
+    }
+
+    if (!is_name_valid(name) || (strlen(name) == 0)) {
+        return 1;
+    }
+    if (create_file_in_dir(fs, inode_parent_p, TYPE_DIRECTORY, name, inode_p_holder)) {
+        return 2;
+    }
+    return path_index_add(index, path, *inode_p_holder) ? 2 : 0;
+}
+
+// Removes leading "./" and "/" and trailing "/" of archive path.
+static char *untar_normalize_path(char *path) {
+    size_t len;
+    while ((path[0] == '/') || ((path[0] == '.') && (path[1] == '/'))) {
+        path += (path[0] == '/') ? 1 : 2;
+    }
+    len = strlen(path);
+    while ((len > 0) && (path[len - 1] == '/')) path[--len] = '\0';
+    if (strcmp(path, ".") == 0) path[0] = '\0';
+    return path;
+}
+
+void cmd_untar(int fs, inode_pointer_t inode_p, const char *path_local, const char *name_fs, char *buffer) {
+    struct PathIndex index = {NULL, NULL, 0, 0};
+    struct INode inode_file;
+    struct TreeTotals totals_before, totals_after;
+    inode_pointer_t inode_root_p, inode_dir_p, inode_file_p;
+    char path_buffer[ARCHIVE_PATH_MAX];
+    char *path, *slash;
+    const char *name;
+    char type, r, err;
+    unsigned long long size;
+    unsigned int skipped = 0;
+    FILE *file;
+
+    // Check name.
+    if (!is_name_valid(name_fs)) {
+        sprintf(buffer, "name \"%s\" is invalid\n", name_fs);
+        return;
+    }
+    if (is_name_taken(fs, inode_p, name_fs)) {
+        sprintf(buffer, "name \"%s\" is already taken\n", name_fs);
+        return;
+    }
+
+    // Open local archive.
+    file = fopen(path_local, "r");
+    if (file == NULL) {
+        sprintf(buffer, "Can't access local file \"%s\".\n", path_local);
+        return;
+    }
+    setvbuf(file, NULL, _IOFBF, WRITE_BUFFER_SIZE_MIN);
+
+    // Archive is unpacked into a new directory.
+    if (err = create_file_in_dir(fs, inode_p, TYPE_DIRECTORY, name_fs, &inode_root_p)) {
+        sprintf(buffer, "[Error] untar, create_file_in_dir (%d)\n", err);
+        fclose(file);
+        return;
+    }
+    if (path_index_add(&index, "", inode_root_p)) {
+        sprintf(buffer, "[Error] untar: out of memory\n");
+        remove_incomplete_dir(fs, inode_p, inode_root_p, name_fs, buffer);
+        fclose(file);
+        return;
+    }
+
+    // Entries are processed in one pass, file data goes right into the write buffer.
+    while ((r = archive_header_read(file, path_buffer, &type, &size)) == ARCHIVE_READ_OK) {
+        path = untar_normalize_path(path_buffer);
+        if (type == ARCHIVE_TYPE_DIRECTORY) {
+            err = (path[0] == '\0') ? 0 : untar_get_dir(fs, &index, path, &inode_dir_p);
+            if (err == 1) ++skipped;
+            if (err == 2) break;
+            err = 0;
+            if (archive_skip(file, size + archive_padding(size))) {
+                r = ARCHIVE_READ_BROKEN;
+                break;
+            }
+            continue;
+        }
+
+        // Everything but regular files is skipped, as well as duplicates and bad names.
+        slash = strrchr(path, '/');
+        name = (slash == NULL) ? path : (slash + 1);
+        if ((type != ARCHIVE_TYPE_REGULAR) || !is_name_valid(name) || (strlen(name) == 0) ||
+            (path_index_find(&index, path, &inode_file_p) == 0)) {
+            ++skipped;
+            if (archive_skip(file, size + archive_padding(size))) {
+                r = ARCHIVE_READ_BROKEN;
+                break;
+            }
+            continue;
+        }
+        if (slash == NULL) {
+            inode_dir_p = inode_root_p;
+        } else {
+            *slash = '\0';
+            err = untar_get_dir(fs, &index, path, &inode_dir_p);
+            *slash = '/';
+            if (err == 2) break;
+            if (err == 1) {
+                ++skipped;
+                err = 0;
+                if (archive_skip(file, size + archive_padding(size))) {
+                    r = ARCHIVE_READ_BROKEN;
+                    break;
+                }
+                continue;
+            }
+        }
+
+        if (err = create_file_in_dir(fs, inode_dir_p, TYPE_REGULAR, name, &inode_file_p)) {
+            sprintf(buffer, "[Error] untar, create_file_in_dir (%d)\n", err);
+            break;
+        }
+        if (err = path_index_add(&index, path, inode_file_p)) {
+            sprintf(buffer, "[Error] untar: out of memory\n");
+            break;
+        }
+        get_inode(fs, inode_file_p, &inode_file);
+        get_file_totals(fs, &inode_file, &totals_before);
+        err = upload_file_content(fs, inode_file_p, file, size, "untar", buffer);
+        get_inode(fs, inode_file_p, &inode_file);
+        get_file_totals(fs, &inode_file, &totals_after);
+        add_dir_totals(fs, inode_dir_p, &totals_before, &totals_after);
+        if (err) break;
+        if ((totals_after.bytes != size) || archive_skip(file, archive_padding(size))) {
+            r = ARCHIVE_READ_BROKEN;
+            break;
+        }
+    }
+
+    if (err == 2) {
+        sprintf(buffer, "[Error] untar: can't create directory\n");
+    } else if (r == ARCHIVE_READ_BROKEN) {
+        sprintf(buffer, "untar: \"%s\" is not a valid tar archive or it is truncated\n", path_local);
+    } else if ((r == ARCHIVE_READ_END) && (skipped > 0)) {
+        sprintf(buffer, "%u archive entries skipped (name or type is not supported)\n", skipped);
+    }
+
+    // Tree is either unpacked in full or not at all.
+    if (err || (r != ARCHIVE_READ_END)) {
+        remove_incomplete_dir(fs, inode_p, inode_root_p, name_fs, buffer);
+    }
+
+    path_index_free(&index);
+    fclose(file);
+}
+
+// Writes content of FS directory into archive, recursively.
+static char tar_dir(int fs, inode_pointer_t inode_dir_p, const char *path_archive, FILE *file, char *buffer) {
+    struct INode inode;
+    struct BlockDirectoryRecord records[RECORDS_PER_BLOCK];
+    inode_pointer_t inode_ps[RECORDS_PER_BLOCK];
+    struct INode inodes[RECORDS_PER_BLOCK];
+    char block[FS_BLOCK_SIZE];
+    char padding[ARCHIVE_BLOCK_SIZE] = {0};
+    char path[ARCHIVE_PATH_MAX];
+    unsigned int k, i, n, j;
+    size_t sz;
+    char err;
+
+    get_inode(fs, inode_dir_p, &inode);
+
+    for (k = 0; k < get_dir_blocks_count(&inode); ++k) {
+        if (err = get_dir_block_k(fs, &inode, k, block)) {
+            sprintf(buffer, "[Error] tar, get_dir_block_k (%d)\n", err);
+            return 1;
+        }
+
+        // Inodes of the whole block are read as one batch.
+        for (n = 0, i = (k == 0) ? 2 : 0; i < get_dir_records_count(&inode); ++i, ++n) {
+            memcpy(&records[n], block + i * RECORD_SIZE, RECORD_SIZE);
+            if (strlen(records[n].name) == 0) break;
+            inode_ps[n] = records[n].inode_p;
+        }
+        if (err = get_inodes(fs, inode_ps, n, inodes)) {
+            sprintf(buffer, "[Error] tar, get_inodes (%d)\n", err);
+            return 1;
+        }
+
+        for (j = 0; j < n; ++j) {
+            if (snprintf(path, ARCHIVE_PATH_MAX, "%s/%s", path_archive, records[j].name) >= ARCHIVE_PATH_MAX - 1) {
+                sprintf(buffer, "tar: path is too long\n");
+                return 1;
+            }
+            if (inodes[j].file_type == TYPE_DIRECTORY) {
+                strcat(path, "/");
+                if (archive_header_write(file, path, ARCHIVE_TYPE_DIRECTORY, 0)) {
+                    sprintf(buffer, "[Error] tar: can't write archive\n");
+                    return 1;
+                }
+                path[strlen(path) - 1] = '\0';
+                if (tar_dir(fs, inode_ps[j], path, file, buffer)) {
+                    return 1;
+                }
+            } else {
+                sz = get_regular_file_size(fs, &inodes[j]);
+                if (archive_header_write(file, path, ARCHIVE_TYPE_REGULAR, sz)) {
+                    sprintf(buffer, "[Error] tar: can't write archive\n");
+                    return 1;
+                }
+                if (download_file_content(fs, &inodes[j], file, "tar", buffer)) {
+                    return 1;
+                }
+                if ((archive_padding(sz) > 0) && (fwrite(padding, archive_padding(sz), 1, file) != 1)) {
+                    sprintf(buffer, "[Error] tar: can't write archive\n");
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+void cmd_tar(int fs, inode_pointer_t inode_p, const char *name_fs, const char *path_local, char *buffer) {
+    struct INode inode;
+    inode_pointer_t inode_dir_p;
+    char path[MAX_NAME_LENGTH + 1];
+    FILE *file;
+
+    // Check name.
+    if (!is_name_valid(name_fs)) {
+        sprintf(buffer, "name \"%s\" is invalid\n", name_fs);
+        return;
+    }
+
+    // Find directory.
+    get_inode(fs, inode_p, &inode);
+    if (get_inode_by_name_in_inode(fs, &inode, name_fs, &inode_dir_p)) {
+        sprintf(buffer, "directory \"%s\" doesn't exist\n", name_fs);
+        return;
+    }
+    get_inode(fs, inode_dir_p, &inode);
+    if (inode.file_type != TYPE_DIRECTORY) {
+        sprintf(buffer, "\"%s\" is not a directory\n", name_fs);
+        return;
+    }
+
+    // Open local archive.
+    file = fopen(path_local, "w");
+    if (file == NULL) {
+        sprintf(buffer, "Can't access local file \"%s\".\n", path_local);
+        return;
+    }
+    setvbuf(file, NULL, _IOFBF, WRITE_BUFFER_SIZE_MIN);
+
+    // Archive keeps the directory itself, as tar does.
+    sprintf(path, "%s/", name_fs);
+    if (archive_header_write(file, path, ARCHIVE_TYPE_DIRECTORY, 0)) {
+        sprintf(buffer, "[Error] tar: can't write archive\n");
+    } else if (tar_dir(fs, inode_dir_p, name_fs, file, buffer) == 0) {
+        if (archive_end_write(file)) {
+            sprintf(buffer, "[Error] tar: can't write archive\n");
+        }
+    }
+    fclose(file);
+}
+
+static int parse_size(const char *str, size_t *size_holder) {
+    char *end;
+    unsigned long long value;
+    if ((str[0] < '0') || (str[0] > '9')) return 0;
+    value = strtoull(str, &end, 10);
+    if (*end != '\0') return 0;
+    *size_holder = value;
+    return 1;
+}
+
+static char get_regular_file(int fs, inode_pointer_t inode_p, const char *name, inode_pointer_t *inode_file_p, char *buffer) {
+    struct INode inode;
+    struct INode inode_file;
+
+    // Check name.
+    if (!is_name_valid(name)) {
+        sprintf(buffer, "name \"%s\" is invalid\n", name);
+        return 1;
+    }
+
+    // Find file.
+    get_inode(fs, inode_p, &inode);
+    if (get_inode_by_name_in_inode(fs, &inode, name, inode_file_p)) {
+        sprintf(buffer, "file \"%s\" doesn't exist\n", name);
+        return 1;
+    }
+
+    // Be sure it's a regular file.
+    get_inode(fs, *inode_file_p, &inode_file);
+    if (inode_file.file_type != TYPE_REGULAR) {
+        sprintf(buffer, "\"%s\" is not a regular file\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+void cmd_write(int fs, inode_pointer_t inode_p, const char *name_fs, const char *offset_str, const char *name_local, char *buffer) {
+    char err;
+    inode_pointer_t inode_file_p;
+    struct INode inode_file;
+    struct TreeTotals totals_before, totals_after;
+    char chunk[WRITE_BUFFER_SIZE_MIN];
+    FILE *file;
+    size_t offset, sz;
+
+    if (!parse_size(offset_str, &offset)) {
+        sprintf(buffer, "offset \"%s\" is invalid\n", offset_str);
+        return;
+    }
+    if (get_regular_file(fs, inode_p, name_fs, &inode_file_p, buffer)) {
+        return;
+    }
+
+    // Open local file.
+    file = fopen(name_local, "r");
+    if (file == NULL) {
+        sprintf(buffer, "Can't access local file \"%s\".\n", name_local);
+        return;
+    }
+
+    // Only the range covered by local file's content is touched.
+    get_inode(fs, inode_file_p, &inode_file);
+    get_file_totals(fs, &inode_file, &totals_before);
+    while ((sz = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        if (err = write_file(fs, inode_file_p, offset, chunk, sz)) {
+            sprintf(buffer, "[Error] write, write_file (%d)\n", err);
+            break;
+        }
+        offset += sz;
+    }
+    get_inode(fs, inode_file_p, &inode_file);
+    get_file_totals(fs, &inode_file, &totals_after);
+    add_dir_totals(fs, inode_p, &totals_before, &totals_after);
+
+    fclose(file);
+}
+
+void cmd_read(int fs, inode_pointer_t inode_p, const char *name, const char *offset_str, const char *size_str, char *buffer) {
+    char err;
+    inode_pointer_t inode_file_p;
+    struct INode inode_file;
+    char data[READ_SIZE_MAX];
+    size_t offset, sz;
+
+    if (!parse_size(offset_str, &offset)) {
+        sprintf(buffer, "offset \"%s\" is invalid\n", offset_str);
+        return;
+    }
+    if (!parse_size(size_str, &sz) || (sz > READ_SIZE_MAX)) {
+        sprintf(buffer, "length \"%s\" is invalid (up to %d bytes)\n", size_str, READ_SIZE_MAX);
+        return;
+    }
+    if (get_regular_file(fs, inode_p, name, &inode_file_p, buffer)) {
+        return;
+    }
+
+    get_inode(fs, inode_file_p, &inode_file);
+    if (err = read_file(fs, &inode_file, offset, data, sz, &sz)) {
+        sprintf(buffer, "[Error] read, read_file (%d)\n", err);
+        return;
+    }
+    append_content(buffer, data, sz);
+}
+
+void cmd_truncate(int fs, inode_pointer_t inode_p, const char *name, const char *size_str, char *buffer) {
+    char err;
+    inode_pointer_t inode_file_p;
+    struct INode inode_file;
+    struct TreeTotals totals_before, totals_after;
+    size_t sz;
+
+    if (!parse_size(size_str, &sz)) {
+        sprintf(buffer, "length \"%s\" is invalid\n", size_str);
+        return;
+    }
+    if (get_regular_file(fs, inode_p, name, &inode_file_p, buffer)) {
+        return;
+    }
+
+    get_inode(fs, inode_file_p, &inode_file);
+    get_file_totals(fs, &inode_file, &totals_before);
+    if (err = truncate_file(fs, inode_file_p, sz)) {
+        sprintf(buffer, "[Error] truncate, truncate_file (%d)\n", err);
+    }
+    get_inode(fs, inode_file_p, &inode_file);
+    get_file_totals(fs, &inode_file, &totals_after);
+    add_dir_totals(fs, inode_p, &totals_before, &totals_after);
+}
+
+void cmd_du(int fs, inode_pointer_t inode_p, const char *name, char *buffer) {
+    struct INode inode;
+    inode_pointer_t inode_file_p;
+    struct TreeTotals totals;
+
+    get_inode(fs, inode_p, &inode);
+    if (name != NULL) {
+        // Check name.
+        if (!is_name_valid(name)) {
+            sprintf(buffer, "name \"%s\" is invalid\n", name);
+            return;
+        }
+
+        // Get file with provided name.
+        if (get_inode_by_name_in_inode(fs, &inode, name, &inode_file_p)) {
+            sprintf(buffer, "file \"%s\" doesn't exist\n", name);
+            return;
+        }
+        get_inode(fs, inode_file_p, &inode);
+    }
+
+    // Directories keep totals of their subtrees, nothing is scanned.
+    get_file_totals(fs, &inode, &totals);
+    sprintf(buffer, "%llu bytes, %llu blocks, %llu files\n", totals.bytes, totals.blocks, totals.files);
+}
+
+void cmd_snapshot(int fs, const char *name, char *buffer) {
+    char err;
+
+    // Check name.
+    if (!is_name_valid(name)) {
+        sprintf(buffer, "name \"%s\" is invalid\n", name);
+        return;
+    }
+
+    err = create_snapshot(fs, name);
+    if (err == 1) {
+        sprintf(buffer, "snapshot \"%s\" already exists\n", name);
+    } else if (err) {
+        sprintf(buffer, "[Error] snapshot (%d)\n", err);
+    }
+}
+
+void cmd_snapshots(int fs, char *buffer) {
+    cmd_ls(fs, get_snapshots_dir(fs), buffer);
+}
+
+void cmd_rmsnapshot(int fs, const char *name, char *buffer) {
+    char err;
+
+    // Check name.
+    if (!is_name_valid(name)) {
+        sprintf(buffer, "name \"%s\" is invalid\n", name);
+        return;
+    }
+
+    err = remove_snapshot(fs, name);
+    if (err == 1) {
+        sprintf(buffer, "snapshot \"%s\" doesn't exist\n", name);
+    } else if (err) {
+        sprintf(buffer, "[Error] rmsnapshot (%d)\n", err);
+    }
+}
+
+void cmd_compact(int fs, char *buffer) {
+    off_t size = fs_size(fs);
+    block_pointer_t blocks_end;
+
+    if (compact_image(fs, &blocks_end)) {
+        sprintf(buffer, "[Error] compact\n");
+        return;
+    }
+    sprintf(buffer, "FS file: %lld KB -> %lld KB (%u blocks)\n", (long long)(size / 1024), (long long)(fs_size(fs) / 1024), blocks_end);
+}
+
+void cmd_defrag(int fs, inode_pointer_t inode_p, const char *name, char *buffer) {
+    struct INode inode;
+    inode_pointer_t inode_file_p = inode_p;
+    struct DefragTotals totals;
+    block_pointer_t before, after;
+
+    if (name != NULL) {
+        // Check name.
+        if (!is_name_valid(name)) {
+            sprintf(buffer, "name \"%s\" is invalid\n", name);
+            return;
+        }
+
+        // Get file with provided name.
+        get_inode(fs, inode_p, &inode);
+        if (get_inode_by_name_in_inode(fs, &inode, name, &inode_file_p)) {
+            sprintf(buffer, "file \"%s\" doesn't exist\n", name);
+            return;
+        }
+    }
+
+    // Regular file is reported by itself, directory by totals of its subtree.
+    get_inode(fs, inode_file_p, &inode);
+    if (inode.file_type == TYPE_REGULAR) {
+        if (defrag_file(fs, inode_file_p, &before, &after)) {
+            sprintf(buffer, "[Error] defrag\n");
+            return;
+        }
+        sprintf(buffer, "extents: %u -> %u\n", before, after);
+        return;
+    }
+    if (defrag_tree(fs, inode_file_p, &totals)) {
+        sprintf(buffer, "[Error] defrag\n");
+        return;
+    }
+    sprintf(buffer, "%llu files, %llu rewritten, extents: %llu -> %llu\n",
+            totals.files, totals.files_rewritten, totals.extents_before, totals.extents_after);
+}
+
+void cmd_compactdir(int fs, inode_pointer_t inode_p, const char *name, char *buffer) {
+    struct INode inode;
+    inode_pointer_t inode_dir_p = inode_p;
+    unsigned long long before, after;
+
+    if (name != NULL) {
+        // Check name.
+        if (!is_name_valid(name)) {
+            sprintf(buffer, "name \"%s\" is invalid\n", name);
+            return;
+        }
+
+        // Get directory with provided name.
+        get_inode(fs, inode_p, &inode);
+        if (get_inode_by_name_in_inode(fs, &inode, name, &inode_dir_p)) {
+            sprintf(buffer, "directory \"%s\" doesn't exist\n", name);
+            return;
+        }
+        get_inode(fs, inode_dir_p, &inode);
+        if (inode.file_type != TYPE_DIRECTORY) {
+            sprintf(buffer, "\"%s\" is not a directory\n", name);
+            return;
+        }
+    }
+
+    if (compact_dirs(fs, inode_dir_p, &before, &after)) {
+        sprintf(buffer, "[Error] compactdir\n");
+        return;
+    }
+    sprintf(buffer, "directory blocks: %llu -> %llu\n", before, after);
+}
+
+static int is_cmd_one_of(const char *cmd, const char **verbs, size_t count) {
+    size_t len, i;
+
+    cmd += strspn(cmd, " ");
+    len = strcspn(cmd, " \n");
+    for (i = 0; i < count; ++i) {
+        if ((strlen(verbs[i]) == len) && (strncmp(cmd, verbs[i], len) == 0)) return 1;
+    }
+    return 0;
+}
+
+int is_cmd_modifying(const char *cmd) {
+    static const char *verbs[] = {"mkdir", "rmdir", "touch", "rm", "upload", "import", "untar", "write",
+                                  "truncate", "cp", "mv", "snapshot", "rmsnapshot", "compact", "defrag", "compactdir"};
+    return is_cmd_one_of(cmd, verbs, sizeof(verbs) / sizeof(verbs[0]));
+}
+
+// Commands which free or move blocks a snapshot server may be reading.
+int is_cmd_exclusive(const char *cmd) {
+    static const char *verbs[] = {"rmsnapshot", "compact", "defrag"};
+    return is_cmd_one_of(cmd, verbs, sizeof(verbs) / sizeof(verbs[0]));
+}
+
+void cmd_help(char *buffer) {
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "pwd", "-- показать текущую директорию");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "ls", "-- аналог ls -l");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "mkdir DIRECTORY", "-- создать каталог");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "rmdir DIRECTORY", "-- удаляет каталог и его содержимое");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "cd DIRECTORY", "-- изменить текущую директорию");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "touch FILE", "-- создать пустой файл");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "rm FILE", "-- удалить файл");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "cat FILE", "-- вывести содержимое файла");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "upload FILE_LOCAL FILE_FS", "-- загрузка локального файла с абсолютным путём FILE_LOCAL в ФС");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "download FILE_FS FILE_LOCAL", "-- выгрузка файла FILE_FS в локальный файл по абсолютному пути FILE_LOCAL");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "cp FILE TARGET", "-- копия файла FILE с именем TARGET или в каталог TARGET, блоки данных общие до первой записи");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "mv FILE TARGET", "-- переименовать файл или каталог FILE в TARGET или переместить в каталог TARGET");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "import DIR_LOCAL DIRECTORY", "-- загрузка локального каталога DIR_LOCAL со всем содержимым в новый каталог ФС");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "export DIRECTORY DIR_LOCAL", "-- выгрузка каталога DIRECTORY со всем содержимым в локальный каталог DIR_LOCAL");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "untar FILE_LOCAL DIRECTORY", "-- распаковка локального tar-архива FILE_LOCAL в новый каталог ФС");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "tar DIRECTORY FILE_LOCAL", "-- упаковка каталога DIRECTORY со всем содержимым в локальный tar-архив FILE_LOCAL");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "read FILE OFFSET LEN", "-- вывести LEN байт файла начиная со смещения OFFSET");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "write FILE OFFSET FILE_LOCAL", "-- записать содержимое локального файла FILE_LOCAL в файл FILE со смещения OFFSET");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "truncate FILE LEN", "-- изменить размер файла до LEN байт (новая часть читается как нули)");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "du [FILE]", "-- объём файла или каталога со всем содержимым (байты, блоки, файлы)");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "snapshot NAME", "-- снимок всего дерева ФС только для чтения, блоки данных общие с живым деревом");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "snapshots", "-- список снимков");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "rmsnapshot NAME", "-- удалить снимок");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "compact", "-- перенести блоки из хвоста файла ФС в свободные места и укоротить файл");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "defrag [FILE]", "-- переписать фрагментированные файлы в непрерывные участки, показать число фрагментов до и после");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "compactdir [DIRECTORY]", "-- переписать каталоги поддерева в минимальное число блоков");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "unmount", "-- завершение работы сервера виртуальной ФС");
+    sprintf(buffer + strlen(buffer), "%-30s%s\n", "help", "-- вывести список доступных комманд");
+}
+
+int get_cmd(int fs, inode_pointer_t inode_root, inode_pointer_t *inode_p, char *cmd, char *buffer) {
+    char unit[BUFFER_SIZE];
+    char unit2[BUFFER_SIZE];
+    char unit3[BUFFER_SIZE];
+    unsigned int i, units_count, *units_begins, *units_lens;
+    int on_space, return_code;
+    char zero = '\0';
+
+    buffer[0] = zero;
+
+    // Count units.
+    on_space = 1;
+    units_count = 0;
+    for (i = 0; i < BUFFER_SIZE; ++i) {
+        if (cmd[i] == '\0') {
+            if (!on_space) ++units_count;
+            break;
+        }
+        switch (cmd[i]) {
+            case ' ':
+                if (on_space) continue;
+                on_space = 1;
+                ++units_count;
+                break;
+            default:
+                on_space = 0;
+        }
+    }
+    if (i == BUFFER_SIZE) {
+        sprintf(buffer, "[Error] Command line is too long.\n");
+        return 0;
+    }
+
+    // Remember all units.
+    units_begins = malloc(units_count * sizeof(unsigned int));
+    units_lens = malloc(units_count * sizeof(unsigned int));
+    on_space = 1;
+    units_count = 0;
+    for (i = 0; i < BUFFER_SIZE; ++i) {
+        if (cmd[i] == '\0') {
+            if (!on_space) {
+                units_lens[units_count] = i - units_begins[units_count];
+                ++units_count;
+            }
+            break;
+        }
+        switch (cmd[i]) {
+            case ' ':
+                if (on_space) continue;
+                on_space = 1;
+                units_lens[units_count] = i - units_begins[units_count];
+                ++units_count;
+                break;
+            default:
+                if (on_space) units_begins[units_count] = i;
+                on_space = 0;
+
+        }
+    }
+
+    // Processing units.
+    return_code = 0;
+    if (units_count > 0) {
+        memcpy(unit, cmd + units_begins[0], units_lens[0]);
+        memcpy(unit + units_lens[0], &zero, sizeof(zero));
+
+        if (strcmp(unit, "pwd") == 0) {
+            if (units_count == 1) {
+                cmd_pwd(fs, *inode_p, buffer, 1);
+            } else {
+                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "pwd", 0, units_count - 1);
+            }
+        } else if (strcmp(unit, "ls") == 0) {
+            if (units_count == 1) {
                 cmd_ls(fs, *inode_p, buffer);
             } else {
                 sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "ls", 0, units_count - 1);
@@ -515,7 +1617,7 @@ int get_cmd(FILE *fs, inode_pointer_t *inode_p, char *cmd, char *buffer) {
             if (units_count == 2) {
                 memcpy(unit, cmd + units_begins[1], units_lens[1]);
                 memcpy(unit + units_lens[1], &zero, sizeof(zero));
-                *inode_p = cmd_cd(fs, *inode_p, unit, buffer);
+                *inode_p = cmd_cd(fs, inode_root, *inode_p, unit, buffer);
             } else {
                 sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "cd", 1, units_count - 1);
             }
@@ -563,6 +1665,158 @@ int get_cmd(FILE *fs, inode_pointer_t *inode_p, char *cmd, char *buffer) {
             } else {
                 sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "upload", 2, units_count - 1);
             }
+        } else if (strcmp(unit, "cp") == 0) {
+            if (units_count == 3) {
+                memcpy(unit, cmd + units_begins[1], units_lens[1]);
+                memcpy(unit + units_lens[1], &zero, sizeof(zero));
+                memcpy(unit2, cmd + units_begins[2], units_lens[2]);
+                memcpy(unit2 + units_lens[2], &zero, sizeof(zero));
+                cmd_cp(fs, *inode_p, unit, unit2, buffer);
+            } else {
+                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "cp", 2, units_count - 1);
+            }
+        } else if (strcmp(unit, "mv") == 0) {
+            if (units_count == 3) {
+                memcpy(unit, cmd + units_begins[1], units_lens[1]);
+                memcpy(unit + units_lens[1], &zero, sizeof(zero));
+                memcpy(unit2, cmd + units_begins[2], units_lens[2]);
+                memcpy(unit2 + units_lens[2], &zero, sizeof(zero));
+                cmd_mv(fs, *inode_p, unit, unit2, buffer);
+            } else {
+                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "mv", 2, units_count - 1);
+            }
+        } else if (strcmp(unit, "import") == 0) {
+            if (units_count == 3) {
+                memcpy(unit, cmd + units_begins[1], units_lens[1]);
+                memcpy(unit + units_lens[1], &zero, sizeof(zero));
+                memcpy(unit2, cmd + units_begins[2], units_lens[2]);
+                memcpy(unit2 + units_lens[2], &zero, sizeof(zero));
+                cmd_import(fs, *inode_p, unit, unit2, buffer);
+            } else {
+                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "import", 2, units_count - 1);
+            }
+        } else if (strcmp(unit, "export") == 0) {
+            if (units_count == 3) {
+                memcpy(unit, cmd + units_begins[1], units_lens[1]);
+                memcpy(unit + units_lens[1], &zero, sizeof(zero));
+                memcpy(unit2, cmd + units_begins[2], units_lens[2]);
+                memcpy(unit2 + units_lens[2], &zero, sizeof(zero));
+                cmd_export(fs, *inode_p, unit, unit2, buffer);
+            } else {
+                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "export", 2, units_count - 1);
+            }
+        } else if (strcmp(unit, "untar") == 0) {
+            if (units_count == 3) {
+                memcpy(unit, cmd + units_begins[1], units_lens[1]);
+                memcpy(unit + units_lens[1], &zero, sizeof(zero));
+                memcpy(unit2, cmd + units_begins[2], units_lens[2]);
+                memcpy(unit2 + units_lens[2], &zero, sizeof(zero));
+                cmd_untar(fs, *inode_p, unit, unit2, buffer);
+            } else {
+                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "untar", 2, units_count - 1);
+            }
+        } else if (strcmp(unit, "tar") == 0) {
+            if (units_count == 3) {
+                memcpy(unit, cmd + units_begins[1], units_lens[1]);
+                memcpy(unit + units_lens[1], &zero, sizeof(zero));
+                memcpy(unit2, cmd + units_begins[2], units_lens[2]);
+                memcpy(unit2 + units_lens[2], &zero, sizeof(zero));
+                cmd_tar(fs, *inode_p, unit, unit2, buffer);
+            } else {
+                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "tar", 2, units_count - 1);
+            }
+        } else if (strcmp(unit, "read") == 0) {
+            if (units_count == 4) {
+                memcpy(unit, cmd + units_begins[1], units_lens[1]);
+                memcpy(unit + units_lens[1], &zero, sizeof(zero));
+                memcpy(unit2, cmd + units_begins[2], units_lens[2]);
+                memcpy(unit2 + units_lens[2], &zero, sizeof(zero));
+                memcpy(unit3, cmd + units_begins[3], units_lens[3]);
+                memcpy(unit3 + units_lens[3], &zero, sizeof(zero));
+                cmd_read(fs, *inode_p, unit, unit2, unit3, buffer);
+            } else {
+                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "read", 3, units_count - 1);
+            }
+        } else if (strcmp(unit, "write") == 0) {
+            if (units_count == 4) {
+                memcpy(unit, cmd + units_begins[1], units_lens[1]);
+                memcpy(unit + units_lens[1], &zero, sizeof(zero));
+                memcpy(unit2, cmd + units_begins[2], units_lens[2]);
+                memcpy(unit2 + units_lens[2], &zero, sizeof(zero));
+                memcpy(unit3, cmd + units_begins[3], units_lens[3]);
+                memcpy(unit3 + units_lens[3], &zero, sizeof(zero));
+                cmd_write(fs, *inode_p, unit, unit2, unit3, buffer);
+            } else {
+                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "write", 3, units_count - 1);
+            }
+        } else if (strcmp(unit, "truncate") == 0) {
+            if (units_count == 3) {
+                memcpy(unit, cmd + units_begins[1], units_lens[1]);
+                memcpy(unit + units_lens[1], &zero, sizeof(zero));
+                memcpy(unit2, cmd + units_begins[2], units_lens[2]);
+                memcpy(unit2 + units_lens[2], &zero, sizeof(zero));
+                cmd_truncate(fs, *inode_p, unit, unit2, buffer);
+            } else {
+                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "truncate", 2, units_count - 1);
+            }
+        } else if (strcmp(unit, "du") == 0) {
+            if (units_count == 1) {
+                cmd_du(fs, *inode_p, NULL, buffer);
+            } else if (units_count == 2) {
+                memcpy(unit, cmd + units_begins[1], units_lens[1]);
+                memcpy(unit + units_lens[1], &zero, sizeof(zero));
+                cmd_du(fs, *inode_p, unit, buffer);
+            } else {
+                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "du", 1, units_count - 1);
+            }
+        } else if (strcmp(unit, "snapshot") == 0) {
+            if (units_count == 2) {
+                memcpy(unit, cmd + units_begins[1], units_lens[1]);
+                memcpy(unit + units_lens[1], &zero, sizeof(zero));
+                cmd_snapshot(fs, unit, buffer);
+            } else {
+                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "snapshot", 1, units_count - 1);
+            }
+        } else if (strcmp(unit, "snapshots") == 0) {
+            if (units_count == 1) {
+                cmd_snapshots(fs, buffer);
+            } else {
+                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "snapshots", 0, units_count - 1);
+            }
+        } else if (strcmp(unit, "rmsnapshot") == 0) {
+            if (units_count == 2) {
+                memcpy(unit, cmd + units_begins[1], units_lens[1]);
+                memcpy(unit + units_lens[1], &zero, sizeof(zero));
+                cmd_rmsnapshot(fs, unit, buffer);
+            } else {
+                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "rmsnapshot", 1, units_count - 1);
+            }
+        } else if (strcmp(unit, "compact") == 0) {
+            if (units_count == 1) {
+                cmd_compact(fs, buffer);
+            } else {
+                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "compact", 0, units_count - 1);
+            }
+        } else if (strcmp(unit, "defrag") == 0) {
+            if (units_count == 1) {
+                cmd_defrag(fs, *inode_p, NULL, buffer);
+            } else if (units_count == 2) {
+                memcpy(unit, cmd + units_begins[1], units_lens[1]);
+                memcpy(unit + units_lens[1], &zero, sizeof(zero));
+                cmd_defrag(fs, *inode_p, unit, buffer);
+            } else {
+                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "defrag", 1, units_count - 1);
+            }
+        } else if (strcmp(unit, "compactdir") == 0) {
+            if (units_count == 1) {
+                cmd_compactdir(fs, *inode_p, NULL, buffer);
+            } else if (units_count == 2) {
+                memcpy(unit, cmd + units_begins[1], units_lens[1]);
+                memcpy(unit + units_lens[1], &zero, sizeof(zero));
+                cmd_compactdir(fs, *inode_p, unit, buffer);
+            } else {
+                sprintf(buffer, "%s: invalid number of parameters (expected %d, got %d)\n", "compactdir", 1, units_count - 1);
+            }
         } else if (strcmp(unit, "unmount") == 0) {
             return_code = 1;
         } else if (strcmp(unit, "help") == 0) {
@@ -572,7 +1826,6 @@ int get_cmd(FILE *fs, inode_pointer_t *inode_p, char *cmd, char *buffer) {
         }
     }
 
-    fflush(fs);
     free(units_begins);
     free(units_lens);
     return return_code;
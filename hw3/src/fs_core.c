@@ -1,4 +1,5 @@
 #include <fs_core.h>
+#include <pthread.h>
 
 void directory_block_init(char *bytes, inode_pointer_t *inode_current, inode_pointer_t *inode_parent) {
     // Overwrite all with empty records.
@@ -17,17 +18,17 @@ void directory_block_init(char *bytes, inode_pointer_t *inode_current, inode_poi
     }
 }
 
-FILE* open_fs_file(const char *fname) {
+int open_fs_file(const char *fname) {
     // Opening file.
-    FILE *file = fopen(fname, "r+");
-    if (file == NULL) {
+    int file = open(fname, O_RDWR);
+    if (file < 0) {
         fprintf(stderr, "Error while opening FS file.\n");
         exit(1);
     }
 
     // Sanity check.
     struct SuperBlock superblock;
-    fread(&superblock, sizeof(struct SuperBlock), 1, file);
+    fs_read(file, &superblock, sizeof(struct SuperBlock), AREA_POS_SUPERBLOCK);
     if (superblock.magic_number != FS_MAGIC_NUMBER) {
         fprintf(stderr, "Provided file is not FS file.\n");
         exit(1);
@@ -36,19 +37,30 @@ FILE* open_fs_file(const char *fname) {
         fprintf(stderr, "Block size other than %d is not supported yet!\n", FS_BLOCK_SIZE);
         exit(1);
     }
+    if (superblock.version != FS_VERSION) {
+        fprintf(stderr, "FS version %u is not supported (expected %d).\n", superblock.version, FS_VERSION);
+        exit(1);
+    }
 
     return file;
 }
 
-FILE* generate_fs_file(const char *fname) {
-    unsigned int i;
-    char bitmap_chunk = 0;
+static char create_hidden_dir(int file, inode_pointer_t inode_root_p, inode_pointer_t *inode_p_holder) {
+    char block[FS_BLOCK_SIZE];
+    struct INode inode = {TYPE_DIRECTORY, INODE_FLAG_INLINE, INODE_INLINE_RECORDS * RECORD_SIZE, {0}};
 
-    // Reserve the first bit in all bitmaps for root directory.
-    write_bit(&bitmap_chunk, 0, 1);
+    if (occupy_inode(file, inode_root_p, inode_p_holder)) {
+        return 1;
+    }
+    directory_block_init(block, inode_p_holder, inode_p_holder);
+    memcpy(inode.block_p, block, INODE_INLINE_RECORDS * RECORD_SIZE);
+    update_inode(file, *inode_p_holder, &inode);
+    return 0;
+}
 
-    FILE *file = fopen(fname, "w+");
-    if (file == NULL) {
+int generate_fs_file(const char *fname) {
+    int file = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (file < 0) {
         fprintf(stderr, "Error while creating file for FS.\n");
         exit(1);
     }
@@ -57,48 +69,67 @@ FILE* generate_fs_file(const char *fname) {
     struct SuperBlock superblock;
     superblock.magic_number = FS_MAGIC_NUMBER;
     superblock.block_size = FS_BLOCK_SIZE;
-    fwrite(&superblock, sizeof(struct SuperBlock), 1, file);
-
-    // Blocks Bitmap Area
-    fputc(bitmap_chunk, file);
-    for (i = 1; i < AREA_SIZE_BITMAP_BLOCKS; ++i) {
-        fputc(0, file);
-    }
-
-    // inodes Bitmap Area
-    fputc(bitmap_chunk, file);
-    for (i = 1; i < AREA_SIZE_BITMAP_INODES; ++i) {
-        fputc(0, file);
+    superblock.version = FS_VERSION;
+    superblock.inode_groups_count = 0;
+    superblock.inode_hint = 0;
+    superblock.orphans_p = 0;
+    superblock.snapshots_p = 0;
+    fs_write(file, &superblock, sizeof(struct SuperBlock), AREA_POS_SUPERBLOCK);
+
+    // Blocks Bitmap Area, Block Groups Area and Inode Groups Area are all zeros,
+    //  so the file is just extended over them without writing anything.
+    // Inode groups themselves will be allocated dynamically.
+    if (fs_resize(file, AREA_POS_BLOCKS)) {
+        fprintf(stderr, "Error while creating file for FS.\n");
+        exit(1);
     }
 
-    // inodes table
-    struct INode inode = {TYPE_NONE, 0, {0}};
-    struct INode inode_root = {TYPE_DIRECTORY, 1, {0}};
-    unsigned int inodes_count = (1 << (8 * sizeof(inode_pointer_t)));
-    fwrite(&inode_root, sizeof(struct INode), 1, file);
-    for (i = 1; i < inodes_count; ++i) {
-        fwrite(&inode, sizeof(struct INode), 1, file);
+    // Root directory.
+    // Its block and inode are the first ones to be occupied, so both are 0.
+    block_pointer_t block_root_p;
+    inode_pointer_t inode_root_p;
+    char block[FS_BLOCK_SIZE];
+    struct INode inode_root = {TYPE_DIRECTORY, 0, 1, {0}, {FS_BLOCK_SIZE, 1, 1}};
+    if (occupy_block(file, &block_root_p) || occupy_inode(file, 0, &inode_root_p)) {
+        fprintf(stderr, "Error while creating root directory.\n");
+        exit(1);
     }
-
-    // Blocks
-    // Generate the only block for root directory.
-    // Space for other blocks will be allocated dynamically.
-    char block[FS_BLOCK_SIZE] = {0};
-    inode_pointer_t inode_root_p = 0;
     directory_block_init(block, &inode_root_p, &inode_root_p);
-    fwrite(block, FS_BLOCK_SIZE, 1, file);
+    update_block(file, block_root_p, block);
+    inode_root.block_p[0] = block_root_p;
+    update_inode(file, inode_root_p, &inode_root);
+
+    // Hidden directories for files being removed in background and for snapshots.
+    // They aren't linked anywhere, so their parents are themselves.
+    inode_pointer_t inode_orphans_p, inode_snapshots_p;
+    if (create_hidden_dir(file, inode_root_p, &inode_orphans_p) || create_hidden_dir(file, inode_root_p, &inode_snapshots_p)) {
+        fprintf(stderr, "Error while creating hidden directories.\n");
+        exit(1);
+    }
+    fs_read(file, &superblock, sizeof(struct SuperBlock), AREA_POS_SUPERBLOCK);
+    superblock.orphans_p = inode_orphans_p;
+    superblock.snapshots_p = inode_snapshots_p;
+    fs_write(file, &superblock, sizeof(struct SuperBlock), AREA_POS_SUPERBLOCK);
 
     return file;
 }
 
-char get_block_k(FILE* fs, struct INode *inode, block_pointer_t k, block_pointer_t* block_p_holder) {
+static void get_superblock(int fs, struct SuperBlock *superblock_holder) {
+    fs_read(fs, superblock_holder, sizeof(struct SuperBlock), AREA_POS_SUPERBLOCK);
+}
+
+static void update_superblock(int fs, struct SuperBlock *superblock) {
+    fs_write(fs, superblock, sizeof(struct SuperBlock), AREA_POS_SUPERBLOCK);
+}
+
+char get_block_k(int fs, struct INode *inode, block_pointer_t k, block_pointer_t* block_p_holder) {
     block_pointer_t block_p;
     unsigned short level;
     unsigned int p;
     char block_temp[FS_BLOCK_SIZE];
 
     // Sanity check.
-    if (k >= inode->file_size) {
+    if ((inode->flags & INODE_FLAG_INLINE) || (k >= inode->file_size)) {
         return 1;
     }
 
@@ -131,11 +162,12 @@ char get_block_k(FILE* fs, struct INode *inode, block_pointer_t k, block_pointer
     }
 
     // Iteratively descend to level 0.
+    // Zero pointer on the way means a hole, the whole subtree is unallocated.
     while (level > 0) {
+        if (block_p == 0) break;
         p = k / int_pow(BLOCKS_P_PER_BLOCK, level - 1);
         k = k % int_pow(BLOCKS_P_PER_BLOCK, level - 1);
-        fseek(fs, AREA_POS_BLOCKS + FS_BLOCK_SIZE * block_p, SEEK_SET);
-        fread(block_temp, FS_BLOCK_SIZE, 1, fs);
+        get_block(fs, block_p, block_temp);
         memcpy(&block_p, block_temp + sizeof(block_pointer_t) * p, sizeof(block_pointer_t));
         --level;
     }
@@ -144,73 +176,555 @@ char get_block_k(FILE* fs, struct INode *inode, block_pointer_t k, block_pointer
     return 0;
 }
 
-char is_block_allocated(FILE *fs, block_pointer_t block_p) {
-    fseek(fs, 0L, SEEK_END);
-    long sz = ftell(fs);
-    if ((AREA_POS_BLOCKS + FS_BLOCK_SIZE * block_p) < sz) {
+char get_blocks_k(int fs, struct INode *inode, block_pointer_t k, block_pointer_t count, block_pointer_t *blocks_holder) {
+    block_pointer_t cached_p[4] = {0, 0, 0, 0};  // indirect block kept for each level
+    block_pointer_t cached[4][BLOCKS_P_PER_BLOCK];
+    block_pointer_t block_p, i, j;
+    unsigned int level, p;
+
+    // Sanity check.
+    if ((inode->flags & INODE_FLAG_INLINE) || (k + count > inode->file_size) || (k + count < k)) {
+        return 1;
+    }
+
+    for (i = 0; i < count; ++i) {
+        j = k + i;
+
+        // Determine required level.
+        if (j < (INODE_BLOCKS_COUNT - 3)) {
+            blocks_holder[i] = inode->block_p[j];
+            continue;
+        }
+        j -= (INODE_BLOCKS_COUNT - 3);
+        if (j < BLOCKS_P_PER_BLOCK) {
+            level = 1;
+        } else {
+            j -= BLOCKS_P_PER_BLOCK;
+            if (j < int_pow(BLOCKS_P_PER_BLOCK, 2)) {
+                level = 2;
+            } else {
+                j -= int_pow(BLOCKS_P_PER_BLOCK, 2);
+                if (j < int_pow(BLOCKS_P_PER_BLOCK, 3)) {
+                    level = 3;
+                } else {
+                    return 2;
+                }
+            }
+        }
+        block_p = inode->block_p[INODE_BLOCKS_COUNT - (4 - level)];
+
+        // Descend, reading only indirect blocks which differ from cached ones.
+        while ((level > 0) && (block_p != 0)) {
+            if (cached_p[level] != block_p) {
+                get_block(fs, block_p, (char *)cached[level]);
+                cached_p[level] = block_p;
+            }
+            p = j / int_pow(BLOCKS_P_PER_BLOCK, level - 1);
+            j = j % int_pow(BLOCKS_P_PER_BLOCK, level - 1);
+            block_p = cached[level][p];
+            --level;
+        }
+        blocks_holder[i] = block_p;
+    }
+    return 0;
+}
+
+static block_pointer_t get_block_pointer(int fs, block_pointer_t block_p, unsigned int i) {
+    block_pointer_t pointer = 0;  // never written entries are zeros
+    fs_read(fs, &pointer, sizeof(pointer), AREA_POS_BLOCKS + (off_t)block_p * FS_BLOCK_SIZE + i * sizeof(block_pointer_t));
+    return pointer;
+}
+
+static void update_block_pointer(int fs, block_pointer_t block_p, unsigned int i, block_pointer_t pointer) {
+    fs_write(fs, &pointer, sizeof(pointer), AREA_POS_BLOCKS + (off_t)block_p * FS_BLOCK_SIZE + i * sizeof(block_pointer_t));
+}
+
+char is_block_allocated(int fs, block_pointer_t block_p) {
+    if ((AREA_POS_BLOCKS + (off_t)FS_BLOCK_SIZE * block_p) < fs_size(fs)) {
         return 1;
     } else {
         return 0;
     }
 }
 
-char occupy_block(FILE *fs, block_pointer_t *block_p_holder) {
-    unsigned int i, j;
-    block_pointer_t block_p;
+void get_block_group(int fs, unsigned int group, struct BlockGroupDescriptor *gd_holder) {
+    fs_read(fs, gd_holder, sizeof(struct BlockGroupDescriptor), AREA_POS_BLOCK_GROUPS + group * sizeof(struct BlockGroupDescriptor));
+}
+
+void update_block_group(int fs, unsigned int group, struct BlockGroupDescriptor *gd) {
+    fs_write(fs, gd, sizeof(struct BlockGroupDescriptor), AREA_POS_BLOCK_GROUPS + group * sizeof(struct BlockGroupDescriptor));
+}
+
+static int find_free_run_in_page(char *page, unsigned int from, unsigned int count) {
+    unsigned int j, run = 0;
+    for (j = from; j < BLOCKS_PER_GROUP; ++j) {
+        if (read_bit(page, j)) {
+            run = 0;
+        } else if (++run == count) {
+            return j - (count - 1);
+        }
+    }
+    return -1;
+}
+
+char occupy_blocks_run(int fs, block_pointer_t goal, block_pointer_t count, block_pointer_t *block_p_holder) {
+    unsigned int i, n, group, byte_first, byte_last;
+    int j;
     char page[PAGE_SIZE_BITMAP_BLOCKS];
+    struct BlockGroupDescriptor gd;
+
+    if ((count == 0) || (count > BLOCKS_PER_GROUP)) {
+        return 2;
+    }
+
+    group = goal / BLOCKS_PER_GROUP;
+    for (n = 0; n < BLOCK_GROUPS_COUNT; ++n, group = (group + 1) % BLOCK_GROUPS_COUNT) {
+        // Skip groups without enough space.
+        get_block_group(fs, group, &gd);
+        if (gd.used_blocks + count > BLOCKS_PER_GROUP) continue;
+
+        fs_read(fs, page, PAGE_SIZE_BITMAP_BLOCKS, AREA_POS_BITMAP_BLOCKS + group * PAGE_SIZE_BITMAP_BLOCKS);
+
+        // Try to continue from the goal, then from the beginning of the group.
+        j = -1;
+        if (n == 0) j = find_free_run_in_page(page, goal % BLOCKS_PER_GROUP, count);
+        if (j < 0) j = find_free_run_in_page(page, 0, count);
+        if (j < 0) continue;
+
+        // Update only changed bytes of blocks bitmap.
+        for (i = 0; i < count; ++i) {
+            write_bit(page, j + i, 1);
+        }
+        byte_first = j / 8;
+        byte_last = (j + count - 1) / 8;
+        fs_write(fs, page + byte_first, byte_last - byte_first + 1, AREA_POS_BITMAP_BLOCKS + group * PAGE_SIZE_BITMAP_BLOCKS + byte_first);
+
+        gd.used_blocks += count;
+        update_block_group(fs, group, &gd);
+
+        *block_p_holder = group * BLOCKS_PER_GROUP + j;
+        return 0;
+    }
+
+    return 1;
+}
+
+char occupy_block_near(int fs, block_pointer_t goal, block_pointer_t *block_p_holder) {
     char block[FS_BLOCK_SIZE] = {0};
-    fseek(fs, AREA_POS_BITMAP_BLOCKS, SEEK_SET);
 
-    for (i = 0; i < PAGES_COUNT; ++i) {
-        fread(page, PAGE_SIZE_BITMAP_BLOCKS, 1, fs);
-        for (j = 0; j < PAGE_SIZE_BITMAP_BLOCKS; ++j) {
-            if (!(read_bit(page, j))) {
-                block_p = i * PAGE_SIZE_BITMAP_BLOCKS + j;
-                write_bit(page, j, 1);
+    if (occupy_blocks_run(fs, goal, 1, block_p_holder)) {
+        return 1;
+    }
+
+    // Initialize occupied block.
+    // Blocks past the end of FS file have never been written, so they
+    //  are read as zeros anyway and zeroing them would be a wasted write.
+    if (is_block_allocated(fs, *block_p_holder)) {
+        update_block(fs, *block_p_holder, block);
+    }
+    return 0;
+}
+
+char occupy_block(int fs, block_pointer_t *block_p_holder) {
+    return occupy_block_near(fs, 0, block_p_holder);
+}
 
-                // Update blocks bitmap.
-                fseek(fs, AREA_POS_BITMAP_BLOCKS + i * PAGE_SIZE_BITMAP_BLOCKS, SEEK_SET);
-                fwrite(page, PAGE_SIZE_BITMAP_BLOCKS, 1, fs);
+// Position of block's entry in references table of its group.
+static off_t get_refs_pos(struct BlockGroupDescriptor *gd, block_pointer_t block_p) {
+    return AREA_POS_BLOCKS + (off_t)gd->refs_p * FS_BLOCK_SIZE + (off_t)(block_p % BLOCKS_PER_GROUP) * sizeof(block_refs_t);
+}
 
-                // Initialize (and allocate) occupied block.
-                fseek(fs, AREA_POS_BLOCKS + FS_BLOCK_SIZE * block_p, SEEK_SET);
-                fwrite(block, FS_BLOCK_SIZE, 1, fs);
+// Punching is given up after the first failure: blocks are free either way, only their space stays in use.
+static char punch_failed = 0;
 
-                *block_p_holder = block_p;
-                return 0;
+// Gives disk space of a freed run back, short runs are not worth a system call.
+static void punch_blocks_run(int fs, block_pointer_t first, block_pointer_t count) {
+    if (!punch_failed && (count >= PUNCH_MIN_BLOCKS) && is_block_allocated(fs, first)) {
+        punch_failed = fs_punch(fs, AREA_POS_BLOCKS + (off_t)first * FS_BLOCK_SIZE, (off_t)count * FS_BLOCK_SIZE);
+    }
+}
+
+// Marks a run of blocks inside one group as free, regardless of references.
+static void release_blocks_run(int fs, block_pointer_t first, block_pointer_t count) {
+    unsigned int group = first / BLOCKS_PER_GROUP, i, byte_first, byte_last;
+    char page[PAGE_SIZE_BITMAP_BLOCKS];
+    struct BlockGroupDescriptor gd;
+
+    byte_first = (first % BLOCKS_PER_GROUP) / 8;
+    byte_last = ((first + count - 1) % BLOCKS_PER_GROUP) / 8;
+    fs_read(fs, page + byte_first, byte_last - byte_first + 1, AREA_POS_BITMAP_BLOCKS + group * PAGE_SIZE_BITMAP_BLOCKS + byte_first);
+    for (i = 0; i < count; ++i) {
+        write_bit(page, (first + i) % BLOCKS_PER_GROUP, 0);
+    }
+    fs_write(fs, page + byte_first, byte_last - byte_first + 1, AREA_POS_BITMAP_BLOCKS + group * PAGE_SIZE_BITMAP_BLOCKS + byte_first);
+
+    get_block_group(fs, group, &gd);
+    gd.used_blocks -= count;
+    update_block_group(fs, group, &gd);
+    punch_blocks_run(fs, first, count);
+}
+
+// Allocates zeroed references table for the group, gd is reread as the table may be in the group itself.
+static char create_refs_table(int fs, unsigned int group, struct BlockGroupDescriptor *gd) {
+    block_pointer_t refs_p;
+    char *zeros;
+
+    if (occupy_blocks_run(fs, group * BLOCKS_PER_GROUP, REFS_TABLE_BLOCKS, &refs_p)) {
+        return 1;
+    }
+    if (is_block_allocated(fs, refs_p)) {
+        if ((zeros = calloc(REFS_TABLE_BLOCKS, FS_BLOCK_SIZE)) == NULL) {
+            release_blocks_run(fs, refs_p, REFS_TABLE_BLOCKS);
+            return 1;
+        }
+        fs_write(fs, zeros, (size_t)REFS_TABLE_BLOCKS * FS_BLOCK_SIZE, AREA_POS_BLOCKS + (off_t)refs_p * FS_BLOCK_SIZE);
+        free(zeros);
+    }
+    get_block_group(fs, group, gd);
+    gd->refs_p = refs_p;
+    update_block_group(fs, group, gd);
+    return 0;
+}
+
+// Frees references table of the group once it has no tracked blocks, gd is reread.
+static void drop_refs_table(int fs, unsigned int group, struct BlockGroupDescriptor *gd) {
+    block_pointer_t refs_p = gd->refs_p;
+
+    if ((refs_p == 0) || (gd->tracked_blocks > 0)) {
+        return;
+    }
+    gd->refs_p = 0;
+    update_block_group(fs, group, gd);
+    release_blocks_run(fs, refs_p, REFS_TABLE_BLOCKS);
+    get_block_group(fs, group, gd);
+}
+
+void free_block(int fs, block_pointer_t block_p) {
+    free_blocks(fs, &block_p, 1);
+}
+
+static int compare_block_pointers(const void *a, const void *b) {
+    block_pointer_t x = *(const block_pointer_t *)a;
+    block_pointer_t y = *(const block_pointer_t *)b;
+    return (x > y) - (x < y);
+}
+
+void free_blocks(int fs, block_pointer_t *blocks, size_t count) {
+    size_t i, j, t, u, v;
+    unsigned int group, byte_first, byte_last, freed;
+    block_pointer_t first_j, last_j;
+    block_pointer_t run_first = 0, run_count = 0;
+    char page[PAGE_SIZE_BITMAP_BLOCKS];
+    block_refs_t refs[REFS_WINDOW];
+    block_refs_t *entry;
+    struct BlockGroupDescriptor gd;
+
+    qsort(blocks, count, sizeof(block_pointer_t), compare_block_pointers);
+    for (i = 0; (i < count) && (blocks[i] == 0); ++i) {}  // holes
+
+    for (; i < count; i = j) {
+        // Process all blocks of the same group at once.
+        group = blocks[i] / BLOCKS_PER_GROUP;
+        for (j = i; (j < count) && (blocks[j] / BLOCKS_PER_GROUP == group); ++j) {}
+        get_block_group(fs, group, &gd);
+
+        byte_first = (blocks[i] % BLOCKS_PER_GROUP) / 8;
+        byte_last = (blocks[j - 1] % BLOCKS_PER_GROUP) / 8;
+        fs_read(fs, page + byte_first, byte_last - byte_first + 1, AREA_POS_BITMAP_BLOCKS + group * PAGE_SIZE_BITMAP_BLOCKS + byte_first);
+
+        // References table is processed by windows, a shared block only loses a reference.
+        freed = 0;
+        for (t = i; t < j; t = u) {
+            first_j = blocks[t] % BLOCKS_PER_GROUP;
+            for (u = t; (u < j) && (blocks[u] % BLOCKS_PER_GROUP < first_j - first_j % REFS_WINDOW + REFS_WINDOW); ++u) {}
+            last_j = blocks[u - 1] % BLOCKS_PER_GROUP;
+            if (gd.refs_p != 0) {
+                fs_read(fs, refs, (last_j - first_j + 1) * sizeof(block_refs_t), get_refs_pos(&gd, blocks[t]));
+            }
+            for (v = t; v < u; ++v) {
+                entry = &refs[blocks[v] % BLOCKS_PER_GROUP - first_j];
+                if ((gd.refs_p != 0) && (*entry > 1)) {
+                    --*entry;
+                    continue;
+                }
+                if ((gd.refs_p != 0) && (*entry == 1)) {
+                    *entry = 0;
+                    --gd.tracked_blocks;
+                }
+                write_bit(page, blocks[v] % BLOCKS_PER_GROUP, 0);
+                ++freed;
+
+                // Consecutive freed blocks make up a run to punch.
+                if ((run_count > 0) && (blocks[v] == run_first + run_count)) {
+                    ++run_count;
+                } else if ((run_count == 0) || (blocks[v] != run_first + run_count - 1)) {
+                    punch_blocks_run(fs, run_first, run_count);
+                    run_first = blocks[v];
+                    run_count = 1;
+                }
             }
+            if (gd.refs_p != 0) {
+                fs_write(fs, refs, (last_j - first_j + 1) * sizeof(block_refs_t), get_refs_pos(&gd, blocks[t]));
+            }
+        }
+
+        if (freed > 0) {
+            fs_write(fs, page + byte_first, byte_last - byte_first + 1, AREA_POS_BITMAP_BLOCKS + group * PAGE_SIZE_BITMAP_BLOCKS + byte_first);
         }
+        gd.used_blocks -= freed;
+        update_block_group(fs, group, &gd);
+        drop_refs_table(fs, group, &gd);
     }
+    punch_blocks_run(fs, run_first, run_count);
+}
 
-    return 1;
+// Entry of block in references table, 0 for an untracked block.
+static block_refs_t get_refs_entry(int fs, block_pointer_t block_p) {
+    struct BlockGroupDescriptor gd;
+    block_refs_t refs = 0;
+
+    get_block_group(fs, block_p / BLOCKS_PER_GROUP, &gd);
+    if (gd.refs_p != 0) {
+        fs_read(fs, &refs, sizeof(refs), get_refs_pos(&gd, block_p));
+    }
+    return refs;
 }
 
-void free_block(FILE *fs, block_pointer_t block_p) {
-    char byte;
-    fseek(fs, AREA_POS_BITMAP_BLOCKS + (block_p / 8), SEEK_SET);
-    fread(&byte, sizeof(byte), 1, fs);
-    write_bit(&byte, block_p % 8, 0);
-    fseek(fs, -sizeof(byte), SEEK_CUR);
-    fwrite(&byte, sizeof(byte), 1, fs);
+block_refs_t get_block_refs(int fs, block_pointer_t block_p) {
+    block_refs_t refs = get_refs_entry(fs, block_p);
+    return (refs == 0) ? 1 : refs;
+}
+
+char share_blocks(int fs, block_pointer_t *blocks, size_t count) {
+    size_t i, j, t, u, v, first, shared = 0;
+    unsigned int group;
+    block_pointer_t first_j, last_j;
+    block_pointer_t *sorted;
+    block_refs_t refs[REFS_WINDOW];
+    block_refs_t *entry;
+    struct BlockGroupDescriptor gd;
+    char err = 0;
+
+    // Sorted copy lets each window of references table be read and written once.
+    if ((sorted = malloc(count * sizeof(block_pointer_t) + 1)) == NULL) {
+        return 1;
+    }
+    memcpy(sorted, blocks, count * sizeof(block_pointer_t));
+    qsort(sorted, count, sizeof(block_pointer_t), compare_block_pointers);
+    for (i = 0; (i < count) && (sorted[i] == 0); ++i) {}  // holes
+    first = i;
+
+    for (; !err && (i < count); i = j) {
+        group = sorted[i] / BLOCKS_PER_GROUP;
+        for (j = i; (j < count) && (sorted[j] / BLOCKS_PER_GROUP == group); ++j) {}
+        get_block_group(fs, group, &gd);
+        if ((gd.refs_p == 0) && (err = create_refs_table(fs, group, &gd))) {
+            break;
+        }
+
+        for (t = i; !err && (t < j); t = u) {
+            first_j = sorted[t] % BLOCKS_PER_GROUP;
+            for (u = t; (u < j) && (sorted[u] % BLOCKS_PER_GROUP < first_j - first_j % REFS_WINDOW + REFS_WINDOW); ++u) {}
+            last_j = sorted[u - 1] % BLOCKS_PER_GROUP;
+            fs_read(fs, refs, (last_j - first_j + 1) * sizeof(block_refs_t), get_refs_pos(&gd, sorted[t]));
+            for (v = t; v < u; ++v) {
+                entry = &refs[sorted[v] % BLOCKS_PER_GROUP - first_j];
+                if (*entry == BLOCK_REFS_MAX) {
+                    err = 1;
+                    break;
+                }
+                if (*entry == 0) {
+                    // Untracked block has its single owner.
+                    *entry = 1;
+                    ++gd.tracked_blocks;
+                }
+                ++*entry;
+                ++shared;
+            }
+            // Window is written back even when it's cut short, so references added so far can be dropped.
+            fs_write(fs, refs, (last_j - first_j + 1) * sizeof(block_refs_t), get_refs_pos(&gd, sorted[t]));
+        }
+        update_block_group(fs, group, &gd);
+    }
+
+    // Nothing stays shared on failure.
+    if (err && (shared > 0)) {
+        free_blocks(fs, sorted + first, shared);
+    }
+    free(sorted);
+    return err;
+}
+
+static unsigned long long hash_block(const char *block) {
+    unsigned long long hash = 14695981039346656037ULL, word;
+    unsigned int i;
+
+    for (i = 0; i < FS_BLOCK_SIZE; i += sizeof(word)) {
+        memcpy(&word, block + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+static off_t get_dedup_slot_pos(unsigned long long hash) {
+    return AREA_POS_DEDUP_INDEX + (off_t)(hash & (DEDUP_INDEX_SLOTS - 1)) * sizeof(struct DedupSlot);
+}
+
+static int compare_requests_pos(const void *a, const void *b) {
+    off_t x = ((const struct IORequest *)a)->pos;
+    off_t y = ((const struct IORequest *)b)->pos;
+    return (x > y) - (x < y);
+}
+
+// Copies sorted requests skipping ones to the same position as the previous one.
+static size_t unique_requests(const struct IORequest *sorted, size_t count, struct IORequest *unique_holder) {
+    size_t i, n = 0;
+
+    for (i = 0; i < count; ++i) {
+        if ((i > 0) && (sorted[i].pos == sorted[i - 1].pos)) continue;
+        unique_holder[n++] = sorted[i];
+    }
+    return n;
+}
+
+char find_equal_blocks(int fs, const char *data, size_t count, block_pointer_t *blocks_holder) {
+    struct IORequest requests[DEDUP_BATCH], unique[DEDUP_BATCH];
+    struct DedupSlot slots[DEDUP_BATCH];
+    unsigned long long hashes[DEDUP_BATCH];
+    struct BlockGroupDescriptor gd;
+    block_refs_t refs;
+    char *candidates;
+    size_t done, i, n, m;
+    unsigned int group = BLOCK_GROUPS_COUNT;
+    char err = 0;
+
+    if ((candidates = malloc((size_t)DEDUP_BATCH * FS_BLOCK_SIZE)) == NULL) {
+        return 1;
+    }
+
+    for (done = 0; !err && (done < count); done += n) {
+        n = (count - done < DEDUP_BATCH) ? count - done : DEDUP_BATCH;
+
+        // Slots of the whole batch are read at once, each slot only once.
+        for (i = 0; i < n; ++i) {
+            hashes[i] = hash_block(data + (done + i) * FS_BLOCK_SIZE);
+            requests[i].write = 0;
+            requests[i].data = &slots[i];
+            requests[i].size = sizeof(struct DedupSlot);
+            requests[i].pos = get_dedup_slot_pos(hashes[i]);
+        }
+        qsort(requests, n, sizeof(struct IORequest), compare_requests_pos);
+        if ((err = io_batch(fs, unique, unique_requests(requests, n, unique)))) break;
+        for (i = 1; i < n; ++i) {
+            if (requests[i].pos == requests[i - 1].pos) {
+                memcpy(requests[i].data, requests[i - 1].data, sizeof(struct DedupSlot));
+            }
+        }
+
+        // Candidates with matching tag are read as another batch.
+        for (i = 0, m = 0; i < n; ++i) {
+            blocks_holder[done + i] = 0;
+            if ((slots[i].block_p == 0) || (slots[i].tag != (unsigned int)(hashes[i] >> 32))) continue;
+            requests[m].write = 0;
+            requests[m].data = candidates + i * FS_BLOCK_SIZE;
+            requests[m].size = FS_BLOCK_SIZE;
+            requests[m].pos = AREA_POS_BLOCKS + (off_t)slots[i].block_p * FS_BLOCK_SIZE;
+            ++m;
+        }
+        qsort(requests, m, sizeof(struct IORequest), compare_requests_pos);
+        if ((err = io_batch(fs, unique, unique_requests(requests, m, unique)))) break;
+        for (i = 1; i < m; ++i) {
+            if (requests[i].pos == requests[i - 1].pos) {
+                memcpy(requests[i].data, requests[i - 1].data, FS_BLOCK_SIZE);
+            }
+        }
+
+        // Block is shared only while it's tracked and its content is equal.
+        for (i = 0; i < n; ++i) {
+            if ((slots[i].block_p == 0) || (slots[i].tag != (unsigned int)(hashes[i] >> 32))) continue;
+            if (memcmp(candidates + i * FS_BLOCK_SIZE, data + (done + i) * FS_BLOCK_SIZE, FS_BLOCK_SIZE) != 0) continue;
+            if (slots[i].block_p / BLOCKS_PER_GROUP != group) {
+                group = slots[i].block_p / BLOCKS_PER_GROUP;
+                get_block_group(fs, group, &gd);
+            }
+            refs = 0;
+            if (gd.refs_p != 0) {
+                fs_read(fs, &refs, sizeof(refs), get_refs_pos(&gd, slots[i].block_p));
+            }
+            if (refs > 0) {
+                blocks_holder[done + i] = slots[i].block_p;
+            }
+        }
+    }
+
+    free(candidates);
+    return err;
+}
+
+char index_blocks_run(int fs, block_pointer_t first, block_pointer_t count, const char *data) {
+    struct IORequest requests[DEDUP_BATCH], unique[DEDUP_BATCH];
+    struct DedupSlot slots[DEDUP_BATCH];
+    unsigned long long hash;
+    block_refs_t refs[REFS_WINDOW];
+    struct BlockGroupDescriptor gd;
+    unsigned int group = first / BLOCKS_PER_GROUP;
+    block_pointer_t done, i, n;
+
+    // Fresh blocks are tracked as owned by a single file. Tracking is what tells an indexed data block
+    // from a block reused for metadata after being freed, so lookup can't do without it.
+    get_block_group(fs, group, &gd);
+    if ((gd.refs_p == 0) && create_refs_table(fs, group, &gd)) {
+        return 1;
+    }
+    for (i = 0; i < REFS_WINDOW; ++i) {
+        refs[i] = 1;
+    }
+    for (done = 0; done < count; done += n) {
+        n = (count - done < REFS_WINDOW) ? count - done : REFS_WINDOW;
+        fs_write(fs, refs, n * sizeof(block_refs_t), get_refs_pos(&gd, first + done));
+    }
+    gd.tracked_blocks += count;
+    update_block_group(fs, group, &gd);
+
+    // Index slots are written as batches.
+    for (done = 0; done < count; done += n) {
+        n = (count - done < DEDUP_BATCH) ? count - done : DEDUP_BATCH;
+        for (i = 0; i < n; ++i) {
+            hash = hash_block(data + (size_t)(done + i) * FS_BLOCK_SIZE);
+            slots[i].tag = (unsigned int)(hash >> 32);
+            slots[i].block_p = first + done + i;
+            requests[i].write = 1;
+            requests[i].data = &slots[i];
+            requests[i].size = sizeof(struct DedupSlot);
+            requests[i].pos = get_dedup_slot_pos(hash);
+        }
+        qsort(requests, n, sizeof(struct IORequest), compare_requests_pos);
+        if (io_batch(fs, unique, unique_requests(requests, n, unique))) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
-char inode_block_append(FILE *fs, struct INode *inode, block_pointer_t *block_p_holder) {
+char inode_block_attach(int fs, struct INode *inode, block_pointer_t new_block_p) {
     unsigned int p;
-    unsigned int k = inode->file_size;
+    unsigned int k;
     unsigned int level = 0;
-    block_pointer_t block_p, new_block_p;
+    block_pointer_t block_p, indirect_p;
+    block_pointer_t goal = new_block_p + 1;  // keep indirect blocks next to data
+
+    // Inline inode has no blocks to attach to.
+    if (inode->flags & INODE_FLAG_INLINE) {
+        return 1;
+    }
+
+    k = inode->file_size;
     if (k < (INODE_BLOCKS_COUNT - 3)) {
         // Direct addressing.
-        if (!(occupy_block(fs, &new_block_p))) {
-            inode->block_p[k] = new_block_p;
-            inode->file_size += 1;
-            if (block_p_holder != NULL) {
-                *block_p_holder = new_block_p;
-            }
-            return 0;
-        } else {
-            return 1;
-        }
+        inode->block_p[k] = new_block_p;
+        inode->file_size += 1;
+        return 0;
     } else {
         // Inirect addressing.
         k -= (INODE_BLOCKS_COUNT - 3);
@@ -236,9 +750,9 @@ char inode_block_append(FILE *fs, struct INode *inode, block_pointer_t *block_p_
 
     // level is from {1, 2, 3}.
     if (k == 0) {
-        if (!(occupy_block(fs, &new_block_p))) {
-            inode->block_p[INODE_BLOCKS_COUNT - (4 - level)] = new_block_p;
-            block_p = new_block_p;
+        if (!(occupy_block_near(fs, goal++, &indirect_p))) {
+            inode->block_p[INODE_BLOCKS_COUNT - (4 - level)] = indirect_p;
+            block_p = indirect_p;
         } else {
             return 1;
         }
@@ -248,34 +762,67 @@ char inode_block_append(FILE *fs, struct INode *inode, block_pointer_t *block_p_
         p = k / int_pow(BLOCKS_P_PER_BLOCK, level - 1);
         k = k % int_pow(BLOCKS_P_PER_BLOCK, level - 1);
         if (k == 0) {
-            if (!(occupy_block(fs, &new_block_p))) {
-                fseek(fs, AREA_POS_BLOCKS + block_p * FS_BLOCK_SIZE + p * sizeof(block_pointer_t), SEEK_SET);
-                fwrite(&new_block_p, sizeof(new_block_p), 1, fs);
-                block_p = new_block_p;
+            if (!(occupy_block_near(fs, goal++, &indirect_p))) {
+                update_block_pointer(fs, block_p, p, indirect_p);
+                block_p = indirect_p;
             } else {
                 return 1;
             }
         } else {
-            fseek(fs, AREA_POS_BLOCKS + block_p * FS_BLOCK_SIZE + p * sizeof(block_pointer_t), SEEK_SET);
-            fread(&block_p, sizeof(block_p), 1, fs);
+            block_p = get_block_pointer(fs, block_p, p);
         }
         --level;
     }
 
-    if (!(occupy_block(fs, &new_block_p))) {
-        fseek(fs, AREA_POS_BLOCKS + block_p * FS_BLOCK_SIZE + k * sizeof(block_pointer_t), SEEK_SET);
-        fwrite(&new_block_p, sizeof(new_block_p), 1, fs);
-        inode->file_size += 1;
-        if (block_p_holder != NULL) {
-            *block_p_holder = new_block_p;
-        }
-        return 0;
+    update_block_pointer(fs, block_p, k, new_block_p);
+    inode->file_size += 1;
+    return 0;
+}
+
+static char inode_block_append_init(int fs, inode_pointer_t inode_p, struct INode *inode, block_pointer_t *block_p_holder, char zero) {
+    char err;
+    block_pointer_t new_block_p, goal;
+
+    // Inline content has to be moved to a block first.
+    if (inode_inline_promote(fs, inode_p, inode)) {
+        return 1;
+    }
+
+    // Keep the file contiguous, or at least close to its inode.
+    if ((inode->file_size == 0) || get_block_k(fs, inode, inode->file_size - 1, &goal)) {
+        goal = get_inode_goal(fs, inode_p);
+    } else {
+        goal += 1;
+    }
+
+    if (zero) {
+        err = occupy_block_near(fs, goal, &new_block_p);
     } else {
+        err = occupy_blocks_run(fs, goal, 1, &new_block_p);
+    }
+    if (err) {
         return 1;
     }
+    if (err = inode_block_attach(fs, inode, new_block_p)) {
+        free_block(fs, new_block_p);
+        return err;
+    }
+
+    if (block_p_holder != NULL) {
+        *block_p_holder = new_block_p;
+    }
+    return 0;
+}
+
+char inode_block_append(int fs, inode_pointer_t inode_p, struct INode *inode, block_pointer_t *block_p_holder) {
+    return inode_block_append_init(fs, inode_p, inode, block_p_holder, 1);
+}
+
+char inode_block_append_nozero(int fs, inode_pointer_t inode_p, struct INode *inode, block_pointer_t *block_p_holder) {
+    return inode_block_append_init(fs, inode_p, inode, block_p_holder, 0);
 }
 
-char inode_block_pop(FILE *fs, struct INode *inode) {
+char inode_block_pop(int fs, struct INode *inode) {
     // Basically we can just substract inode.file_size.
     // But the most difficult part is to find out whether there will completely
     //  unused block left. If so, we should call free_block.
@@ -283,15 +830,18 @@ char inode_block_pop(FILE *fs, struct INode *inode) {
     unsigned int k = inode->file_size - 1;
     unsigned int level = 0;
     block_pointer_t block_p, block_p_victim;
+    block_pointer_t block_p_parent = 0;
+    unsigned int p_parent = 0;
 
     // Is there anything to pop?
-    if (inode->file_size == 0) {
+    if ((inode->flags & INODE_FLAG_INLINE) || (inode->file_size == 0)) {
         return INODE_BLOCK_POP_NOTHING;
     }
 
     if (k < (INODE_BLOCKS_COUNT - 3)) {
         // Direct addressing.
         block_p = inode->block_p[k];
+        inode->block_p[k] = 0;
         level = 0;
     } else {
         // Inirect addressing.
@@ -314,75 +864,622 @@ char inode_block_pop(FILE *fs, struct INode *inode) {
                 }
             }
         }
+        if (k == 0) {
+            inode->block_p[INODE_BLOCKS_COUNT - (4 - level)] = 0;
+        }
     }
 
     // level is from {1, 2, 3}.
-    while (level > 0) {
+    while ((level > 0) && (block_p != 0)) {
         p = k / int_pow(BLOCKS_P_PER_BLOCK, level - 1);
         k = k % int_pow(BLOCKS_P_PER_BLOCK, level - 1);
-        fseek(fs, AREA_POS_BLOCKS + block_p * FS_BLOCK_SIZE + p * sizeof(block_pointer_t), SEEK_SET);
-        fread(&block_p_victim, sizeof(block_pointer_t), 1, fs);
+        block_p_victim = get_block_pointer(fs, block_p, p);
         if ((p == 0) && (k == 0)) {
             free_block(fs, block_p);
+        } else {
+            block_p_parent = block_p;
+            p_parent = p;
         }
         block_p = block_p_victim;
         --level;
     }
 
-    free_block(fs, block_p);
+    // Pointers past the end of file are kept zero, so the file can grow with holes.
+    if (block_p_parent != 0) {
+        update_block_pointer(fs, block_p_parent, p_parent, 0);
+    }
+    if (block_p != 0) {
+        free_block(fs, block_p);
+    }
     inode->file_size -= 1;
     return INODE_BLOCK_POP_SUCCESS;
 }
 
-void get_block(FILE* fs, block_pointer_t block_p, char* block_holder) {
-    fseek(fs, AREA_POS_BLOCKS + block_p * FS_BLOCK_SIZE, SEEK_SET);
-    fread(block_holder, FS_BLOCK_SIZE, 1, fs);
-}
-
-void update_block(FILE* fs, block_pointer_t block_p, char* block) {
-    fseek(fs, AREA_POS_BLOCKS + block_p * FS_BLOCK_SIZE, SEEK_SET);
-    fwrite(block, FS_BLOCK_SIZE, 1, fs);
+char block_list_push(struct BlockList *list, block_pointer_t block_p) {
+    block_pointer_t *items_new;
+    if (list->size == list->capacity) {
+        list->capacity = (list->capacity == 0) ? BLOCKS_P_PER_BLOCK : list->capacity * 2;
+        items_new = realloc(list->items, list->capacity * sizeof(block_pointer_t));
+        if (items_new == NULL) return 1;
+        list->items = items_new;
+    }
+    list->items[list->size++] = block_p;
+    return 0;
 }
 
-char get_inode_by_name_in_block(FILE* fs, block_pointer_t block_p, const char* name, inode_pointer_t* inode_p_holder) {
-    // Reading block.
-    char block[FS_BLOCK_SIZE];
-    fseek(fs, AREA_POS_BLOCKS + FS_BLOCK_SIZE * block_p, SEEK_SET);
-    fread(block, FS_BLOCK_SIZE, 1, fs);
+/*
+ * Collects blocks of a subtree of block map, which covers file blocks
+ *  [base, base + BLOCKS_P_PER_BLOCK^level), except the first keep ones.
+ * Only file blocks below end are considered.
+ */
+static char collect_blocks(int fs, block_pointer_t block_p, unsigned int level,
+                           unsigned long long base, unsigned long long keep,
+                           unsigned long long end, struct BlockList *list) {
+    unsigned int i;
+    unsigned long long span, child_base;
+    block_pointer_t pointers[BLOCKS_P_PER_BLOCK];
+    char cut = 0;
+
+    if (level > 0) {
+        span = int_pow(BLOCKS_P_PER_BLOCK, level - 1);
+        get_block(fs, block_p, (char *)pointers);
+        for (i = 0; i < BLOCKS_P_PER_BLOCK; ++i) {
+            child_base = base + i * span;
+            if (child_base >= end) break;
+            if (child_base + span <= keep) continue;
+            if (pointers[i] == 0) continue;
+            if (collect_blocks(fs, pointers[i], level - 1, child_base, keep, end, list)) {
+                return 1;
+            }
+            if (child_base >= keep) {
+                pointers[i] = 0;
+                cut = 1;
+            }
+        }
 
-    // Searching.
-    struct BlockDirectoryRecord record;
-    int i;
-    for (i = 0; i < RECORDS_PER_BLOCK; ++i) {
-        memcpy(&record, block + i * RECORD_SIZE, RECORD_SIZE);
-        if (strcmp(name, record.name) == 0) {
-            if (inode_p_holder != NULL) *inode_p_holder = record.inode_p;
-            return 0;
+        // Kept block must not point to freed ones, so the file can grow with holes later.
+        if (cut && (base < keep)) {
+            update_block(fs, block_p, (char *)pointers);
         }
     }
 
-    return 1;
+    // The block itself goes away only if nothing before keep depends on it.
+    if (base >= keep) {
+        return block_list_push(list, block_p);
+    }
+    return 0;
 }
 
-char get_inode_by_name_in_inode(FILE* fs, struct INode *inode, const char* name, inode_pointer_t* inode_p_holder) {
-    block_pointer_t k = 0;
-    block_pointer_t block_p = 0;
-    while (!(get_block_k(fs, inode, k, &block_p))) {
-        if (get_inode_by_name_in_block(fs, block_p, name, inode_p_holder) == 0) {
-            return 0;
+/*
+ * Detaches blocks of inode past the first count ones and collects them into list.
+ * With count == 0 nothing is written to FS file.
+ */
+static char inode_detach_blocks(int fs, struct INode *inode, block_pointer_t count, struct BlockList *list) {
+    unsigned int k, level;
+    unsigned long long base;
+
+    if ((inode->flags & INODE_FLAG_INLINE) || (count >= inode->file_size)) {
+        return 0;
+    }
+
+    // Direct blocks.
+    for (k = count; (k < INODE_BLOCKS_COUNT - 3) && (k < inode->file_size); ++k) {
+        if (inode->block_p[k] == 0) continue;  // hole
+        if (block_list_push(list, inode->block_p[k])) {
+            return 1;
         }
-        ++k;
+        inode->block_p[k] = 0;
     }
-    return 1;
-}
 
-char get_name_by_inode_in_block(FILE* fs, block_pointer_t block_p, inode_pointer_t inode_p, char* name_holder) {
-    // Reading block.
+    // Indirect addressing, levels 1..3.
+    base = INODE_BLOCKS_COUNT - 3;
+    for (level = 1; level <= 3; ++level) {
+        if (base >= inode->file_size) break;
+        if ((base + int_pow(BLOCKS_P_PER_BLOCK, level) > count) && (inode->block_p[INODE_BLOCKS_COUNT - (4 - level)] != 0)) {
+            if (collect_blocks(fs, inode->block_p[INODE_BLOCKS_COUNT - (4 - level)], level, base, count, inode->file_size, list)) {
+                return 1;
+            }
+            if (base >= count) {
+                inode->block_p[INODE_BLOCKS_COUNT - (4 - level)] = 0;
+            }
+        }
+        base += int_pow(BLOCKS_P_PER_BLOCK, level);
+    }
+
+    inode->file_size = count;
+    return 0;
+}
+
+char inode_collect_blocks(int fs, struct INode *inode, struct BlockList *list) {
+    struct INode inode_copy = *inode;
+    return inode_detach_blocks(fs, &inode_copy, 0, list);
+}
+
+char inode_truncate_blocks(int fs, struct INode *inode, block_pointer_t count) {
+    struct BlockList list = {NULL, 0, 0};
+    char err;
+
+    if (!(err = inode_detach_blocks(fs, inode, count, &list))) {
+        free_blocks(fs, list.items, list.size);
+    }
+    free(list.items);
+    return err;
+}
+
+char inode_block_fill(int fs, inode_pointer_t inode_p, struct INode *inode, block_pointer_t k, char zero, block_pointer_t *block_p_holder) {
+    unsigned int p = 0;
+    unsigned int level = 0;
+    block_pointer_t *root_p;
+    block_pointer_t block_p, child_p, copy_p;
+    block_pointer_t parent_p = 0;
+    block_pointer_t goal = 0;
+    char block[FS_BLOCK_SIZE];
+    char fresh = 0;
+    char err;
+
+    if ((inode->flags & INODE_FLAG_INLINE) || (k >= inode->file_size)) {
+        return 1;
+    }
+
+    if (k < (INODE_BLOCKS_COUNT - 3)) {
+        // Direct addressing.
+        root_p = &inode->block_p[k];
+    } else {
+        // Inirect addressing.
+        k -= (INODE_BLOCKS_COUNT - 3);
+        if (k < BLOCKS_P_PER_BLOCK) {
+            level = 1;
+        } else {
+            k -= BLOCKS_P_PER_BLOCK;
+            if (k < int_pow(BLOCKS_P_PER_BLOCK, 2)) {
+                level = 2;
+            } else {
+                k -= int_pow(BLOCKS_P_PER_BLOCK, 2);
+                if (k < int_pow(BLOCKS_P_PER_BLOCK, 3)) {
+                    level = 3;
+                } else {
+                    return 2;
+                }
+            }
+        }
+        root_p = &inode->block_p[INODE_BLOCKS_COUNT - (4 - level)];
+    }
+
+    // Holes are filled near the inode, the same way the file itself is placed.
+    // Indirect blocks and partially written data blocks must be zeroed.
+    if (*root_p == 0) {
+        goal = get_inode_goal(fs, inode_p);
+        if ((level > 0) || zero) {
+            err = occupy_block_near(fs, goal++, root_p);
+        } else {
+            err = occupy_blocks_run(fs, goal++, 1, root_p);
+        }
+        if (err) return 3;
+        fresh = (level == 0);
+    }
+
+    block_p = *root_p;
+    while (level > 0) {
+        p = k / int_pow(BLOCKS_P_PER_BLOCK, level - 1);
+        k = k % int_pow(BLOCKS_P_PER_BLOCK, level - 1);
+        child_p = get_block_pointer(fs, block_p, p);
+        if (child_p == 0) {
+            if (goal == 0) goal = block_p + 1;
+            if ((level > 1) || zero) {
+                err = occupy_block_near(fs, goal++, &child_p);
+            } else {
+                err = occupy_blocks_run(fs, goal++, 1, &child_p);
+            }
+            if (err) return 3;
+            update_block_pointer(fs, block_p, p, child_p);
+            fresh = (level == 1);
+        }
+        parent_p = block_p;
+        block_p = child_p;
+        --level;
+    }
+
+    // Data block shared with other files is replaced by a private copy.
+    // Only data blocks are ever shared, indirect ones belong to a single file.
+    if (!fresh && (get_block_refs(fs, block_p) > 1)) {
+        if (occupy_blocks_run(fs, block_p + 1, 1, &copy_p)) return 3;
+        if (zero) {
+            get_block(fs, block_p, block);
+            update_block(fs, copy_p, block);
+        }
+        if (parent_p == 0) {
+            *root_p = copy_p;
+        } else {
+            update_block_pointer(fs, parent_p, p, copy_p);
+        }
+        free_block(fs, block_p);
+        block_p = copy_p;
+    }
+
+    if (block_p_holder != NULL) {
+        *block_p_holder = block_p;
+    }
+    return 0;
+}
+
+char inode_inline_promote(int fs, inode_pointer_t inode_p, struct INode *inode) {
+    char inline_data[INODE_INLINE_SIZE];
     char block[FS_BLOCK_SIZE];
-    fseek(fs, AREA_POS_BLOCKS + FS_BLOCK_SIZE * block_p, SEEK_SET);
-    fread(block, FS_BLOCK_SIZE, 1, fs);
+    block_pointer_t block_p;
+    unsigned int sz = inode->file_size;
+
+    if (!(inode->flags & INODE_FLAG_INLINE)) {
+        return 0;
+    }
+
+    // Detach inline content from the inode.
+    memcpy(inline_data, inode->block_p, INODE_INLINE_SIZE);
+    memset(inode->block_p, 0, INODE_INLINE_SIZE);
+    inode->flags &= ~INODE_FLAG_INLINE;
+    inode->file_size = 0;
+
+    // Empty regular file doesn't need any blocks.
+    if ((inode->file_type == TYPE_REGULAR) && (sz == 0)) {
+        return 0;
+    }
+
+    // The block is overwritten right away, no need to zero it.
+    if (inode_block_append_nozero(fs, inode_p, inode, &block_p)) {
+        // Roll back.
+        memcpy(inode->block_p, inline_data, INODE_INLINE_SIZE);
+        inode->flags |= INODE_FLAG_INLINE;
+        inode->file_size = sz;
+        return 1;
+    }
+
+    if (inode->file_type == TYPE_DIRECTORY) {
+        directory_block_init(block, NULL, NULL);
+        memcpy(block, inline_data, INODE_INLINE_RECORDS * RECORD_SIZE);
+    } else {
+        memset(block, 0, FS_BLOCK_SIZE);
+        memcpy(block, inline_data, sz);
+        block[sz] = EOF;
+    }
+    update_block(fs, block_p, block);
+    return 0;
+}
+
+char write_buffer_open(int fs, inode_pointer_t inode_p, struct FileWriteBuffer *wb) {
+    wb->inode_p = inode_p;
+    get_inode(fs, inode_p, &wb->inode);
+    if ((wb->inode.file_type != TYPE_REGULAR) || (wb->inode.file_size != 0)) {
+        return 1;
+    }
+
+    wb->data = malloc(WRITE_BUFFER_SIZE_MIN);
+    if (wb->data == NULL) {
+        return 2;
+    }
+    wb->size = 0;
+    wb->capacity = WRITE_BUFFER_SIZE_MIN;
+    return 0;
+}
+
+static char write_buffer_flush_blocks(int fs, struct FileWriteBuffer *wb, block_pointer_t count) {
+    char err = 0;
+    block_pointer_t done = 0;
+    block_pointer_t i, t, n, first, goal;
+    block_pointer_t *equal;
+
+    if (inode_inline_promote(fs, wb->inode_p, &wb->inode)) {
+        return 1;
+    }
+
+    // Blocks already stored in FS file are shared instead of being written again.
+    // Failed lookup only means no sharing.
+    if ((equal = malloc((size_t)count * sizeof(block_pointer_t))) == NULL) {
+        return 1;
+    }
+    if (find_equal_blocks(fs, wb->data, count, equal)) {
+        memset(equal, 0, (size_t)count * sizeof(block_pointer_t));
+    }
+
+    while (!err && (done < count)) {
+        if (equal[done] != 0) {
+            for (n = 1; (done + n < count) && (equal[done + n] != 0); ++n) {}
+            if (err = share_blocks(fs, equal + done, n)) break;
+            for (i = 0; i < n; ++i) {
+                if (err = inode_block_attach(fs, &wb->inode, equal[done + i])) {
+                    free_blocks(fs, equal + done + i, n - i);
+                    break;
+                }
+            }
+            done += n;
+            continue;
+        }
+
+        if ((wb->inode.file_size == 0) || get_block_k(fs, &wb->inode, wb->inode.file_size - 1, &goal)) {
+            goal = get_inode_goal(fs, wb->inode_p);
+        } else {
+            goal += 1;
+        }
+
+        // Take the longest run of new blocks available, halving the request on failure.
+        for (n = 1; (done + n < count) && (n < BLOCKS_PER_GROUP) && (equal[done + n] == 0); ++n) {}
+        while (occupy_blocks_run(fs, goal, n, &first)) {
+            n /= 2;
+            if (n == 0) break;
+        }
+        if (n == 0) {
+            err = 1;
+            break;
+        }
+
+        // The whole run is written at once, without zeroing it first.
+        fs_write(fs, wb->data + (size_t)done * FS_BLOCK_SIZE, FS_BLOCK_SIZE * n, AREA_POS_BLOCKS + (off_t)first * FS_BLOCK_SIZE);
+        index_blocks_run(fs, first, n, wb->data + (size_t)done * FS_BLOCK_SIZE);
+        for (i = 0; i < n; ++i) {
+            if (err = inode_block_attach(fs, &wb->inode, first + i)) {
+                // Tail of the run isn't owned by the file.
+                for (t = i; t < n; ++t) {
+                    equal[done + t] = first + t;
+                }
+                free_blocks(fs, equal + done + i, n - i);
+                break;
+            }
+        }
+        done += n;
+    }
+
+    free(equal);
+    if (err) {
+        return err;
+    }
+
+    wb->size -= (size_t)count * FS_BLOCK_SIZE;
+    memmove(wb->data, wb->data + (size_t)count * FS_BLOCK_SIZE, wb->size);
+    return 0;
+}
+
+char write_buffer_write(int fs, struct FileWriteBuffer *wb, const char *data, size_t size) {
+    size_t n;
+    char *data_new;
+    char err;
+
+    while (size > 0) {
+        if (wb->size == wb->capacity) {
+            if (wb->capacity < WRITE_BUFFER_SIZE_MAX) {
+                data_new = realloc(wb->data, wb->capacity * 2);
+                if (data_new == NULL) return 1;
+                wb->data = data_new;
+                wb->capacity *= 2;
+            } else if (err = write_buffer_flush_blocks(fs, wb, wb->size / FS_BLOCK_SIZE)) {
+                return err;
+            }
+        }
+        n = wb->capacity - wb->size;
+        if (n > size) n = size;
+        memcpy(wb->data + wb->size, data, n);
+        wb->size += n;
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+char write_buffer_close(int fs, struct FileWriteBuffer *wb) {
+    char err = 0;
+    char *data_new;
+    size_t size_full;
+
+    if ((wb->inode.flags & INODE_FLAG_INLINE) && (wb->size <= INODE_INLINE_SIZE)) {
+        // Small content never leaves the inode.
+        memcpy(wb->inode.block_p, wb->data, wb->size);
+        wb->inode.file_size = wb->size;
+    } else {
+        // The last block keeps EOF mark right after the data.
+        size_full = (wb->size / FS_BLOCK_SIZE + 1) * FS_BLOCK_SIZE;
+        if (size_full > wb->capacity) {
+            data_new = realloc(wb->data, size_full);
+            if (data_new == NULL) {
+                free(wb->data);
+                wb->data = NULL;
+                return 1;
+            }
+            wb->data = data_new;
+            wb->capacity = size_full;
+        }
+        memset(wb->data + wb->size, 0, size_full - wb->size);
+        wb->data[wb->size] = EOF;
+        wb->size = size_full;
+        err = write_buffer_flush_blocks(fs, wb, size_full / FS_BLOCK_SIZE);
+    }
+
+    update_inode(fs, wb->inode_p, &wb->inode);
+    free(wb->data);
+    wb->data = NULL;
+    return err;
+}
+
+char read_buffer_open(int fs, struct INode *inode, struct FileReadBuffer *rb) {
+    if (inode->file_type != TYPE_REGULAR) {
+        return 1;
+    }
+    rb->inode = *inode;
+    rb->next_k = 0;
+    rb->window = READ_AHEAD_MIN;
+    rb->first_k = 0;
+    rb->count = 0;
+
+    // Buffers grow along with the window.
+    rb->blocks = malloc(READ_AHEAD_MIN * sizeof(block_pointer_t));
+    rb->data = malloc(READ_AHEAD_MIN * FS_BLOCK_SIZE);
+    if ((rb->blocks == NULL) || (rb->data == NULL)) {
+        read_buffer_close(rb);
+        return 2;
+    }
+    return 0;
+}
+
+static char read_buffer_fill(int fs, struct FileReadBuffer *rb, block_pointer_t k) {
+    block_pointer_t i, j, n;
+    block_pointer_t *blocks_new;
+    char *data_new;
+    struct IORequest *requests;
+    size_t requests_count = 0;
+    char err;
+
+    // Sequential access widens the window, any other one resets it.
+    if (k == rb->next_k) {
+        if ((rb->count > 0) && (rb->window < READ_AHEAD_MAX)) {
+            blocks_new = realloc(rb->blocks, 2 * rb->window * sizeof(block_pointer_t));
+            if (blocks_new != NULL) rb->blocks = blocks_new;
+            data_new = realloc(rb->data, (size_t)2 * rb->window * FS_BLOCK_SIZE);
+            if (data_new != NULL) rb->data = data_new;
+            if ((blocks_new != NULL) && (data_new != NULL)) rb->window *= 2;
+        }
+    } else {
+        rb->window = READ_AHEAD_MIN;
+    }
+
+    n = rb->inode.file_size - k;
+    if (n > rb->window) n = rb->window;
+    if (get_blocks_k(fs, &rb->inode, k, n, rb->blocks)) {
+        return 1;
+    }
+
+    // Physically adjacent blocks are read at once, holes are zeros.
+    // All runs of the window are read as one batch.
+    requests = malloc(n * sizeof(struct IORequest));
+    if (requests == NULL) {
+        return 2;
+    }
+    for (i = 0; i < n; i = j) {
+        if (rb->blocks[i] == 0) {
+            memset(rb->data + (size_t)i * FS_BLOCK_SIZE, 0, FS_BLOCK_SIZE);
+            j = i + 1;
+            continue;
+        }
+        for (j = i + 1; (j < n) && (rb->blocks[j] == rb->blocks[j - 1] + 1); ++j) {}
+        requests[requests_count].write = 0;
+        requests[requests_count].data = rb->data + (size_t)i * FS_BLOCK_SIZE;
+        requests[requests_count].size = (size_t)(j - i) * FS_BLOCK_SIZE;
+        requests[requests_count].pos = AREA_POS_BLOCKS + (off_t)rb->blocks[i] * FS_BLOCK_SIZE;
+        ++requests_count;
+    }
+    err = io_batch(fs, requests, requests_count);
+    free(requests);
+    if (err) {
+        return 3;
+    }
+
+    // The file is most likely contiguous, so the next window follows this one.
+    if ((n > 0) && (rb->blocks[n - 1] != 0) && (k + n < rb->inode.file_size)) {
+        posix_fadvise(fs, AREA_POS_BLOCKS + ((off_t)rb->blocks[n - 1] + 1) * FS_BLOCK_SIZE,
+                      (off_t)rb->window * FS_BLOCK_SIZE, POSIX_FADV_WILLNEED);
+    }
+
+    rb->first_k = k;
+    rb->count = n;
+    return 0;
+}
+
+char read_buffer_get_block(int fs, struct FileReadBuffer *rb, block_pointer_t k, char *block_holder) {
+    if (rb->inode.flags & INODE_FLAG_INLINE) {
+        return get_file_block_k(fs, &rb->inode, k, block_holder);
+    }
+    if (k >= rb->inode.file_size) {
+        return 1;
+    }
+    if ((k < rb->first_k) || (k >= rb->first_k + rb->count)) {
+        if (read_buffer_fill(fs, rb, k)) {
+            return 2;
+        }
+    }
+    memcpy(block_holder, rb->data + (size_t)(k - rb->first_k) * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+    rb->next_k = k + 1;
+    return 0;
+}
+
+void read_buffer_close(struct FileReadBuffer *rb) {
+    free(rb->blocks);
+    free(rb->data);
+    rb->blocks = NULL;
+    rb->data = NULL;
+}
+
+void get_block(int fs, block_pointer_t block_p, char* block_holder) {
+    fs_read(fs, block_holder, FS_BLOCK_SIZE, AREA_POS_BLOCKS + (off_t)block_p * FS_BLOCK_SIZE);
+}
+
+void update_block(int fs, block_pointer_t block_p, char* block) {
+    fs_write(fs, block, FS_BLOCK_SIZE, AREA_POS_BLOCKS + (off_t)block_p * FS_BLOCK_SIZE);
+}
+
+block_pointer_t get_dir_blocks_count(struct INode *inode) {
+    if (inode->flags & INODE_FLAG_INLINE) return 1;
+    return inode->file_size;
+}
+
+unsigned int get_dir_records_count(struct INode *inode) {
+    if (inode->flags & INODE_FLAG_INLINE) return INODE_INLINE_RECORDS;
+    return RECORDS_PER_BLOCK;
+}
+
+char get_dir_block_k(int fs, struct INode *inode, block_pointer_t k, char *block_holder) {
+    block_pointer_t block_p;
+    if (inode->flags & INODE_FLAG_INLINE) {
+        if (k != 0) return 1;
+        directory_block_init(block_holder, NULL, NULL);
+        memcpy(block_holder, inode->block_p, INODE_INLINE_RECORDS * RECORD_SIZE);
+        return 0;
+    }
+    if (get_block_k(fs, inode, k, &block_p)) return 1;
+    get_block(fs, block_p, block_holder);
+    return 0;
+}
+
+char update_dir_block_k(int fs, inode_pointer_t inode_p, struct INode *inode, block_pointer_t k, char *block) {
+    block_pointer_t block_p;
+    if (inode->flags & INODE_FLAG_INLINE) {
+        if (k != 0) return 1;
+        memcpy(inode->block_p, block, INODE_INLINE_RECORDS * RECORD_SIZE);
+        update_inode(fs, inode_p, inode);
+        return 0;
+    }
+    if (get_block_k(fs, inode, k, &block_p)) return 1;
+    update_block(fs, block_p, block);
+    return 0;
+}
+
+char get_file_block_k(int fs, struct INode *inode, block_pointer_t k, char *block_holder) {
+    block_pointer_t block_p;
+    if (inode->flags & INODE_FLAG_INLINE) {
+        if (k != 0) return 1;
+        memset(block_holder, 0, FS_BLOCK_SIZE);
+        memcpy(block_holder, inode->block_p, inode->file_size);
+        return 0;
+    }
+    if (get_block_k(fs, inode, k, &block_p)) return 1;
+    if (block_p == 0) {
+        // Hole is read as zeros.
+        memset(block_holder, 0, FS_BLOCK_SIZE);
+        return 0;
+    }
+    get_block(fs, block_p, block_holder);
+    return 0;
+}
+
+static char find_name_in_block(char *block, const char* name, inode_pointer_t* inode_p_holder) {
+    struct BlockDirectoryRecord record;
+    int i;
+    for (i = 0; i < RECORDS_PER_BLOCK; ++i) {
+        memcpy(&record, block + i * RECORD_SIZE, RECORD_SIZE);
+        if (strcmp(name, record.name) == 0) {
+            if (inode_p_holder != NULL) *inode_p_holder = record.inode_p;
+            return 0;
+        }
+    }
+
+    return 1;
+}
 
-    // Searching.
+static char find_inode_in_block(char *block, inode_pointer_t inode_p, char* name_holder) {
     struct BlockDirectoryRecord record;
     int i;
     for (i = 0; i < RECORDS_PER_BLOCK; ++i) {
@@ -396,11 +1493,35 @@ char get_name_by_inode_in_block(FILE* fs, block_pointer_t block_p, inode_pointer
     return 1;
 }
 
-char get_name_by_inode_in_inode(FILE* fs, struct INode *inode, inode_pointer_t inode_p, char* name_holder) {
+char get_inode_by_name_in_block(int fs, block_pointer_t block_p, const char* name, inode_pointer_t* inode_p_holder) {
+    char block[FS_BLOCK_SIZE];
+    get_block(fs, block_p, block);
+    return find_name_in_block(block, name, inode_p_holder);
+}
+
+char get_inode_by_name_in_inode(int fs, struct INode *inode, const char* name, inode_pointer_t* inode_p_holder) {
+    char block[FS_BLOCK_SIZE];
+    block_pointer_t k = 0;
+    while (!(get_dir_block_k(fs, inode, k, block))) {
+        if (find_name_in_block(block, name, inode_p_holder) == 0) {
+            return 0;
+        }
+        ++k;
+    }
+    return 1;
+}
+
+char get_name_by_inode_in_block(int fs, block_pointer_t block_p, inode_pointer_t inode_p, char* name_holder) {
+    char block[FS_BLOCK_SIZE];
+    get_block(fs, block_p, block);
+    return find_inode_in_block(block, inode_p, name_holder);
+}
+
+char get_name_by_inode_in_inode(int fs, struct INode *inode, inode_pointer_t inode_p, char* name_holder) {
+    char block[FS_BLOCK_SIZE];
     block_pointer_t k = 0;
-    block_pointer_t block_p = 0;
-    while (!(get_block_k(fs, inode, k, &block_p))) {
-        if (get_name_by_inode_in_block(fs, block_p, inode_p, name_holder) == 0) {
+    while (!(get_dir_block_k(fs, inode, k, block))) {
+        if (find_inode_in_block(block, inode_p, name_holder) == 0) {
             return 0;
         }
         ++k;
@@ -408,31 +1529,25 @@ char get_name_by_inode_in_inode(FILE* fs, struct INode *inode, inode_pointer_t i
     return 1;
 }
 
-char get_parent_directory(FILE* fs, inode_pointer_t inode_p, inode_pointer_t* inode_p_parent) {
+char get_parent_directory(int fs, inode_pointer_t inode_p, inode_pointer_t* inode_p_parent) {
     // Reading directory inode.
     struct INode inode;
-    fseek(fs, AREA_POS_INODES + inode_p * sizeof(struct INode), SEEK_SET);
-    fread(&inode, sizeof(struct INode), 1, fs);
+    get_inode(fs, inode_p, &inode);
 
     // Sanity check.
     if (inode.file_type != TYPE_DIRECTORY) {
         return 1;
     }
 
-    block_pointer_t k = 0;
-    block_pointer_t block_p = 0;
     char name_parent[3] = {'.', '.', '\0'};
-    while (!(get_block_k(fs, &inode, k, &block_p))) {
-        if (get_inode_by_name_in_block(fs, block_p, name_parent, inode_p_parent) == 0) {
-            return 0;
-        }
-        ++k;
+    if (get_inode_by_name_in_inode(fs, &inode, name_parent, inode_p_parent) == 0) {
+        return 0;
     }
 
     return 2;
 }
 
-char get_directory_name(FILE* fs, inode_pointer_t inode_p, char* name_holder) {
+char get_directory_name(int fs, inode_pointer_t inode_p, char* name_holder) {
     // Name of root is zero string.
     if (inode_p == 0) {
         char zero = '\0';
@@ -448,25 +1563,20 @@ char get_directory_name(FILE* fs, inode_pointer_t inode_p, char* name_holder) {
 
     // Reading parent directory inode.
     struct INode inode_parent;
-    fseek(fs, AREA_POS_INODES + inode_p_parent * sizeof(struct INode), SEEK_SET);
-    fread(&inode_parent, sizeof(struct INode), 1, fs);
+    get_inode(fs, inode_p_parent, &inode_parent);
 
     // Getting out directory name from parent directory.
-    block_pointer_t block_p;
-    block_pointer_t k = 0;
-    while (!(get_block_k(fs, &inode_parent, k, &block_p))) {
-        if (get_name_by_inode_in_block(fs, block_p, inode_p, name_holder) == 0) {
-            return 0;
-        }
-        ++k;
+    if (get_name_by_inode_in_inode(fs, &inode_parent, inode_p, name_holder) == 0) {
+        return 0;
     }
 
     return 2;
 }
 
-int get_full_path(FILE *fs, inode_pointer_t inode_p, char *holder) {
+int get_full_path(int fs, inode_pointer_t inode_p, char *holder) {
+    struct SuperBlock superblock;
     unsigned int level = 0;
-    inode_pointer_t inode_p2;
+    inode_pointer_t inode_p2, inode_top_p;
     int i;
     size_t path_len = 0;
     inode_pointer_t *inode_fp;
@@ -480,14 +1590,18 @@ int get_full_path(FILE *fs, inode_pointer_t inode_p, char *holder) {
     }
 
     // Determine a level current directory is in.
+    // Hidden directories are their own parents just like root, the path starts from them.
     inode_p2 = inode_p;
     while (inode_p2 != 0) {
-        if (get_parent_directory(fs, inode_p2, &inode_p2)) {
+        if (get_parent_directory(fs, inode_p2, &inode_top_p)) {
             return 1;
         }
+        if (inode_top_p == inode_p2) break;
+        inode_p2 = inode_top_p;
         ++level;
     }
-    inode_fp = malloc(level * sizeof(inode_pointer_t));
+    inode_top_p = inode_p2;
+    inode_fp = malloc(level * sizeof(inode_pointer_t) + 1);
 
     // Build fullpath chain of inodes numbers.
     inode_p2 = inode_p;
@@ -499,6 +1613,12 @@ int get_full_path(FILE *fs, inode_pointer_t inode_p, char *holder) {
         }
     }
 
+    if (inode_top_p != 0) {
+        get_superblock(fs, &superblock);
+        strcpy(holder + path_len, (inode_top_p == superblock.snapshots_p) ? "@snapshots" : "@");
+        path_len += strlen(holder + path_len);
+    }
+
     // Getting full path.
     char name[MAX_NAME_LENGTH];
     for (i = level - 1; i >= 0; --i) {
@@ -519,58 +1639,195 @@ int get_full_path(FILE *fs, inode_pointer_t inode_p, char *holder) {
     return 0;
 }
 
-char occupy_inode(FILE *fs, inode_pointer_t *inode_p_holder) {
-    unsigned int j;
-    inode_pointer_t inode_p;
-    struct INode inode = {TYPE_NONE, 0, {0}};
-    char bitmap_inodes[AREA_SIZE_BITMAP_INODES];
+void get_inode_group(int fs, unsigned int group, struct InodeGroupDescriptor *gd_holder) {
+    fs_read(fs, gd_holder, sizeof(struct InodeGroupDescriptor), AREA_POS_INODE_GROUPS + group * sizeof(struct InodeGroupDescriptor));
+}
 
-    fseek(fs, AREA_POS_BITMAP_INODES, SEEK_SET);
-    fread(bitmap_inodes, AREA_SIZE_BITMAP_INODES, 1, fs);
-    for (j = 0; j < AREA_SIZE_BITMAP_INODES; ++j) {
-        if (!(read_bit(bitmap_inodes, j))) {
-            inode_p = j;
-            write_bit(bitmap_inodes, j, 1);
+void update_inode_group(int fs, unsigned int group, struct InodeGroupDescriptor *gd) {
+    fs_write(fs, gd, sizeof(struct InodeGroupDescriptor), AREA_POS_INODE_GROUPS + group * sizeof(struct InodeGroupDescriptor));
+}
 
-            // Update inodes bitmap.
-            fseek(fs, AREA_POS_BITMAP_INODES, SEEK_SET);
-            fwrite(bitmap_inodes, AREA_SIZE_BITMAP_INODES, 1, fs);
+char create_inode_group(int fs, unsigned int *group_holder) {
+    struct SuperBlock superblock;
+    struct InodeGroupDescriptor gd;
+    block_pointer_t goal;
 
-            // Initialize occupied inode.
-            fseek(fs, AREA_POS_INODES + sizeof(struct INode) * inode_p, SEEK_SET);
-            fwrite(&inode, sizeof(struct INode), 1, fs);
+    get_superblock(fs, &superblock);
+    if (superblock.inode_groups_count >= INODE_GROUPS_MAX) {
+        return 1;
+    }
 
-            *inode_p_holder = inode_p;
-            return 0;
+    // Bitmap must be zeroed, while inodes are initialized on occupation.
+    goal = (superblock.inode_groups_count % BLOCK_GROUPS_COUNT) * BLOCKS_PER_GROUP;
+    if (occupy_block_near(fs, goal, &gd.bitmap_p)) {
+        return 2;
+    }
+    if (occupy_blocks_run(fs, gd.bitmap_p + 1, INODE_GROUP_TABLE_SIZE, &gd.table_p)) {
+        free_block(fs, gd.bitmap_p);
+        return 3;
+    }
+    gd.free_inodes = INODES_PER_GROUP;
+
+    *group_holder = superblock.inode_groups_count;
+    update_inode_group(fs, superblock.inode_groups_count, &gd);
+    superblock.inode_groups_count += 1;
+    update_superblock(fs, &superblock);
+    return 0;
+}
+
+static off_t get_inode_pos(int fs, inode_pointer_t inode_p) {
+    struct InodeGroupDescriptor gd;
+    get_inode_group(fs, inode_p / INODES_PER_GROUP, &gd);
+    return AREA_POS_BLOCKS + (off_t)gd.table_p * FS_BLOCK_SIZE + (inode_p % INODES_PER_GROUP) * sizeof(struct INode);
+}
+
+block_pointer_t get_inode_goal(int fs, inode_pointer_t inode_p) {
+    struct InodeGroupDescriptor gd;
+    get_inode_group(fs, inode_p / INODES_PER_GROUP, &gd);
+    return gd.table_p + (inode_p % INODES_PER_GROUP) / INODES_PER_BLOCK;
+}
+
+// Occupies up to count free inodes of the group starting from j-th, returns how many were taken.
+static unsigned int occupy_inodes_in_group(int fs, struct SuperBlock *superblock, unsigned int group, unsigned int j,
+                                           unsigned int count, inode_pointer_t *inode_ps_holder) {
+    struct InodeGroupDescriptor gd;
+    char bitmap_inodes[FS_BLOCK_SIZE];
+    unsigned int taken = 0;
+    inode_pointer_t hint = superblock->inode_hint;
+
+    get_inode_group(fs, group, &gd);
+    if (gd.free_inodes == 0) {
+        return 0;
+    }
+    get_block(fs, gd.bitmap_p, bitmap_inodes);
+    for (; (j < INODES_PER_GROUP) && (taken < count) && (taken < gd.free_inodes); ++j) {
+        if (read_bit(bitmap_inodes, j)) continue;
+        write_bit(bitmap_inodes, j, 1);
+        inode_ps_holder[taken++] = group * INODES_PER_GROUP + j;
+
+        // Move the hint past occupied inode.
+        if (group * INODES_PER_GROUP + j == superblock->inode_hint) {
+            superblock->inode_hint += 1;
         }
     }
+    if (taken == 0) {
+        return 0;
+    }
 
-    return 1;
+    // Bitmap, group counter and hint are updated once for the whole run.
+    update_block(fs, gd.bitmap_p, bitmap_inodes);
+    gd.free_inodes -= taken;
+    update_inode_group(fs, group, &gd);
+    if (superblock->inode_hint != hint) {
+        update_superblock(fs, superblock);
+    }
+    return taken;
+}
+
+char occupy_inodes(int fs, inode_pointer_t inode_goal_p, unsigned int count, inode_pointer_t *inode_ps_holder) {
+    unsigned int group, j, i;
+    unsigned int done = 0;
+    struct INode inode = {TYPE_NONE, 0, 0, {0}};
+    struct SuperBlock superblock;
+
+    get_superblock(fs, &superblock);
+
+    // Try the goal's group first.
+    group = inode_goal_p / INODES_PER_GROUP;
+    if (group < superblock.inode_groups_count) {
+        j = 0;
+        if (superblock.inode_hint > group * INODES_PER_GROUP) {
+            j = superblock.inode_hint - group * INODES_PER_GROUP;
+        }
+        if (j < INODES_PER_GROUP) {
+            done += occupy_inodes_in_group(fs, &superblock, group, j, count, inode_ps_holder);
+        }
+    }
+
+    group = superblock.inode_hint / INODES_PER_GROUP;
+    j = superblock.inode_hint % INODES_PER_GROUP;
+
+    while (done < count) {
+        if (group == superblock.inode_groups_count) {
+            // All groups are full, so it's time for a new one.
+            if (create_inode_group(fs, &group)) {
+                for (i = 0; i < done; ++i) free_inode(fs, inode_ps_holder[i]);
+                return 1;
+            }
+            get_superblock(fs, &superblock);
+        }
+
+        done += occupy_inodes_in_group(fs, &superblock, group, j, count - done, inode_ps_holder + done);
+        ++group;
+        j = 0;
+    }
+
+    // Initialize occupied inodes.
+    for (i = 0; i < count; ++i) {
+        update_inode(fs, inode_ps_holder[i], &inode);
+    }
+    return 0;
+}
+
+char occupy_inode(int fs, inode_pointer_t inode_goal_p, inode_pointer_t *inode_p_holder) {
+    return occupy_inodes(fs, inode_goal_p, 1, inode_p_holder);
 }
 
-void free_inode(FILE *fs, inode_pointer_t inode_p) {
+void free_inode(int fs, inode_pointer_t inode_p) {
     char byte;
-    fseek(fs, AREA_POS_BITMAP_INODES + (inode_p / 8), SEEK_SET);
-    fread(&byte, sizeof(byte), 1, fs);
-    write_bit(&byte, inode_p % 8, 0);
-    fseek(fs, -sizeof(byte), SEEK_CUR);
-    fwrite(&byte, sizeof(byte), 1, fs);
+    unsigned int group = inode_p / INODES_PER_GROUP;
+    unsigned int j = inode_p % INODES_PER_GROUP;
+    struct SuperBlock superblock;
+    struct InodeGroupDescriptor gd;
+
+    get_inode_group(fs, group, &gd);
+    fs_read(fs, &byte, sizeof(byte), AREA_POS_BLOCKS + (off_t)gd.bitmap_p * FS_BLOCK_SIZE + (j / 8));
+    write_bit(&byte, j % 8, 0);
+    fs_write(fs, &byte, sizeof(byte), AREA_POS_BLOCKS + (off_t)gd.bitmap_p * FS_BLOCK_SIZE + (j / 8));
+    gd.free_inodes += 1;
+    update_inode_group(fs, group, &gd);
+
+    get_superblock(fs, &superblock);
+    if (inode_p < superblock.inode_hint) {
+        superblock.inode_hint = inode_p;
+        update_superblock(fs, &superblock);
+    }
+}
+
+void get_inode(int fs, inode_pointer_t inode_p, struct INode *inode_holder) {
+    fs_read(fs, inode_holder, sizeof(struct INode), get_inode_pos(fs, inode_p));
 }
 
-void get_inode(FILE* fs, inode_pointer_t inode_p, struct INode *inode_holder) {
-    fseek(fs, AREA_POS_INODES + inode_p * sizeof(struct INode), SEEK_SET);
-    fread(inode_holder, sizeof(struct INode), 1, fs);
+char get_inodes(int fs, inode_pointer_t *inode_ps, unsigned int count, struct INode *inodes_holder) {
+    struct IORequest requests[INODES_BATCH_MAX];
+    unsigned int i, n;
+
+    while (count > 0) {
+        n = (count < INODES_BATCH_MAX) ? count : INODES_BATCH_MAX;
+        for (i = 0; i < n; ++i) {
+            requests[i].write = 0;
+            requests[i].data = &inodes_holder[i];
+            requests[i].size = sizeof(struct INode);
+            requests[i].pos = get_inode_pos(fs, inode_ps[i]);
+        }
+        if (io_batch(fs, requests, n)) {
+            return 1;
+        }
+        inode_ps += n;
+        inodes_holder += n;
+        count -= n;
+    }
+    return 0;
 }
 
-void update_inode(FILE* fs, inode_pointer_t inode_p, struct INode *inode) {
-    fseek(fs, AREA_POS_INODES + inode_p * sizeof(struct INode), SEEK_SET);
-    fwrite(inode, sizeof(struct INode), 1, fs);
+void update_inode(int fs, inode_pointer_t inode_p, struct INode *inode) {
+    fs_write(fs, inode, sizeof(struct INode), get_inode_pos(fs, inode_p));
 }
 
-char is_directory_block_full(char *block) {
+char is_directory_block_full(char *block, unsigned int records_count) {
     struct BlockDirectoryRecord record;
     unsigned int i;
-    for (i = 0; i < RECORDS_PER_BLOCK; ++i) {
+    for (i = 0; i < records_count; ++i) {
         memcpy(&record, block + i * RECORD_SIZE, RECORD_SIZE);
         if (strlen(record.name) == 0) {
             return 0;
@@ -591,138 +1848,330 @@ char is_directory_block_empty(char *block) {
     return 1;
 }
 
-char create_file_in_dir(FILE *fs, inode_pointer_t inode_p, int file_type, const char *name, inode_pointer_t *inode_p_holder) {
-    block_pointer_t block_p, block_new_p;
+static void get_own_totals(int fs, struct INode *inode, struct TreeTotals *totals_holder) {
+    totals_holder->bytes = get_regular_file_size(fs, inode);
+    totals_holder->blocks = get_allocated_blocks(fs, inode);
+    totals_holder->files = 1;
+}
+
+void get_file_totals(int fs, struct INode *inode, struct TreeTotals *totals_holder) {
+    if (inode->file_type == TYPE_DIRECTORY) {
+        *totals_holder = inode->totals;
+    } else {
+        get_own_totals(fs, inode, totals_holder);
+    }
+}
+
+void add_dir_totals(int fs, inode_pointer_t inode_dir_p, struct TreeTotals *totals_before, struct TreeTotals *totals_after) {
+    struct SuperBlock superblock;
+    struct INode inode;
+    struct BlockDirectoryRecord record_parent;
+    char block[FS_BLOCK_SIZE];
+
+    get_superblock(fs, &superblock);
+
+    // Deltas may be negative, unsigned arithmetic wraps them around just fine.
+    while (inode_dir_p != superblock.orphans_p) {
+        get_inode(fs, inode_dir_p, &inode);
+        if (inode.file_type != TYPE_DIRECTORY) return;
+        inode.totals.bytes += totals_after->bytes - totals_before->bytes;
+        inode.totals.blocks += totals_after->blocks - totals_before->blocks;
+        inode.totals.files += totals_after->files - totals_before->files;
+        update_inode(fs, inode_dir_p, &inode);
+
+        // Parent is the second record of the first block, root is its own parent.
+        if (get_dir_block_k(fs, &inode, 0, block)) return;
+        memcpy(&record_parent, block + RECORD_SIZE, RECORD_SIZE);
+        if (record_parent.inode_p == inode_dir_p) return;
+        inode_dir_p = record_parent.inode_p;
+    }
+}
+
+// Appends records to directory, each block is written once.
+// Totals of linked files (totals_files) are added to the directory and all above.
+static char link_records_to_dir(int fs, inode_pointer_t inode_dir_p, inode_pointer_t *inode_ps, const char **names,
+                                unsigned int count, struct TreeTotals *totals_files) {
+    block_pointer_t k;
     char block[FS_BLOCK_SIZE];
-    inode_pointer_t inode_new_p;
     struct INode inode;
-    struct INode inode_new;
     struct BlockDirectoryRecord record;
-    unsigned int i;
+    struct TreeTotals totals_before, totals_after;
+    unsigned int i, done;
 
     // Read the inode.
-    get_inode(fs, inode_p, &inode);
+    get_inode(fs, inode_dir_p, &inode);
 
     // Sanity check: inode represents a directory.
     if (inode.file_type != TYPE_DIRECTORY) {
         return 1;
     }
-
-    // Types other than regular file and directory are not supported yet.
-    if ((file_type != TYPE_DIRECTORY) && (file_type != TYPE_REGULAR)) {
-        return 2;
-    }
+    get_own_totals(fs, &inode, &totals_before);
 
     // Access the last block.
-    if (get_block_k(fs, &inode, inode.file_size - 1, &block_p)) {
+    k = get_dir_blocks_count(&inode) - 1;
+    if (get_dir_block_k(fs, &inode, k, block)) {
         return 3;
     }
+    for (i = 0; i < get_dir_records_count(&inode); ++i) {
+        memcpy(&record, block + i * sizeof(record), sizeof(record));
+        if (strlen(record.name) == 0) break;
+    }
 
-    // If the block is full, then we need a new one.
-    get_block(fs, block_p, block);
-    if (is_directory_block_full(block)) {
-        if (inode_block_append(fs, &inode, &block_p)) {
-            return 4;
+    for (done = 0; done < count; ) {
+        // If the block is full, then we need a new one.
+        // Inline directory gets its records moved to a regular block instead.
+        if (i == get_dir_records_count(&inode)) {
+            if (inode.flags & INODE_FLAG_INLINE) {
+                if (done > 0) {
+                    update_dir_block_k(fs, inode_dir_p, &inode, k, block);
+                }
+                if (inode_inline_promote(fs, inode_dir_p, &inode)) {
+                    return 4;
+                }
+                k = get_dir_blocks_count(&inode) - 1;
+                if (get_dir_block_k(fs, &inode, k, block)) {
+                    return 3;
+                }
+                i = INODE_INLINE_RECORDS;
+            } else {
+                // New block is built in memory and written once, with the records.
+                if (done > 0) {
+                    update_dir_block_k(fs, inode_dir_p, &inode, k, block);
+                }
+                if (inode_block_append_nozero(fs, inode_dir_p, &inode, NULL)) {
+                    return 4;
+                }
+                k = get_dir_blocks_count(&inode) - 1;
+                directory_block_init(block, NULL, NULL);
+                i = 0;
+            }
+            update_inode(fs, inode_dir_p, &inode);
         }
-        update_inode(fs, inode_p, &inode);
+
+        // Attach the inode to the last block.
+        record.inode_p = inode_ps[done];
+        strncpy(record.name, names[done], MAX_NAME_LENGTH);
+        memcpy(block + i * sizeof(record), &record, sizeof(record));
+        ++i;
+        ++done;
     }
+    update_dir_block_k(fs, inode_dir_p, &inode, k, block);
+
+    // Directory itself may have grown.
+    get_own_totals(fs, &inode, &totals_after);
+    totals_after.bytes += totals_files->bytes;
+    totals_after.blocks += totals_files->blocks;
+    totals_after.files += totals_files->files;
+    add_dir_totals(fs, inode_dir_p, &totals_before, &totals_after);
+    return 0;
+}
 
-    // Initialize inode for a new file.
-    if (occupy_inode(fs, &inode_new_p)) {
-        return 5;
+char link_file_to_dir(int fs, inode_pointer_t inode_dir_p, inode_pointer_t inode_p, const char *name) {
+    struct INode inode;
+    struct TreeTotals totals_file;
+
+    get_inode(fs, inode_p, &inode);
+    get_file_totals(fs, &inode, &totals_file);
+    return link_records_to_dir(fs, inode_dir_p, &inode_p, &name, 1, &totals_file);
+}
+
+char create_files_in_dir(int fs, inode_pointer_t inode_p, const int *file_types, const char **names,
+                         unsigned int count, inode_pointer_t *inode_ps_holder) {
+    char err;
+    unsigned int i;
+    struct INode inode;
+    struct INode inode_new;
+    struct TreeTotals totals_new = {0, 0, count};
+    char block_new[FS_BLOCK_SIZE];
+
+    // Sanity check: inode represents a directory.
+    get_inode(fs, inode_p, &inode);
+    if (inode.file_type != TYPE_DIRECTORY) {
+        return 1;
     }
-    get_inode(fs, inode_new_p, &inode_new);
-    if (file_type == TYPE_DIRECTORY) {
-        // It's a directory.
-        inode_new.file_type = TYPE_DIRECTORY;
-        if (inode_block_append(fs, &inode_new, &block_new_p)) {
-            return 6;
+
+    // Types other than regular file and directory are not supported yet.
+    for (i = 0; i < count; ++i) {
+        if ((file_types[i] != TYPE_DIRECTORY) && (file_types[i] != TYPE_REGULAR)) {
+            return 2;
         }
-        get_block(fs, block_new_p, block);
-        directory_block_init(block, &inode_new_p, &inode_p);
-        update_block(fs, block_new_p, block);
-    } else {
-        // It's a regular file.
-        inode_new.file_type = TYPE_REGULAR;
     }
-    update_inode(fs, inode_new_p, &inode_new);
+    if (count == 0) {
+        return 0;
+    }
 
-    // Attach the inode (inode_new_p) to the block (block_p).
-    get_block(fs, block_p, block);
-    for (i = 0; i < RECORDS_PER_BLOCK; ++i) {
-        memcpy(&record, block + i * sizeof(record), sizeof(record));
-        if (strlen(record.name) == 0) {
-            record.inode_p = inode_new_p;
-            memcpy(record.name, name, MAX_NAME_LENGTH);
-            memcpy(block + i * sizeof(record), &record, sizeof(record));
-            update_block(fs, block_p, block);
-            if (inode_p_holder != NULL) *inode_p_holder = inode_new_p;
-            return 0;
+    // Initialize inodes for new files, all of them are occupied at once.
+    // Both directories and regular files start inline.
+    if (occupy_inodes(fs, inode_p, count, inode_ps_holder)) {
+        return 5;
+    }
+    for (i = 0; i < count; ++i) {
+        memset(&inode_new, 0, sizeof(struct INode));
+        inode_new.flags = INODE_FLAG_INLINE;
+        if (file_types[i] == TYPE_DIRECTORY) {
+            // It's a directory.
+            inode_new.file_type = TYPE_DIRECTORY;
+            inode_new.file_size = INODE_INLINE_RECORDS * RECORD_SIZE;
+            directory_block_init(block_new, &inode_ps_holder[i], &inode_p);
+            memcpy(inode_new.block_p, block_new, INODE_INLINE_RECORDS * RECORD_SIZE);
+            inode_new.totals.files = 1;
+        } else {
+            // It's a regular file.
+            inode_new.file_type = TYPE_REGULAR;
+            inode_new.file_size = 0;
         }
+        update_inode(fs, inode_ps_holder[i], &inode_new);
     }
 
-    return 7;
+    // Attach the inodes to the directory.
+    if (err = link_records_to_dir(fs, inode_p, inode_ps_holder, names, count, &totals_new)) {
+        for (i = 0; i < count; ++i) free_inode(fs, inode_ps_holder[i]);
+        return err;
+    }
+    return 0;
 }
 
-char remove_file(FILE *fs, inode_pointer_t inode_p) {
-    struct INode inode;
+char create_file_in_dir(int fs, inode_pointer_t inode_p, int file_type, const char *name, inode_pointer_t *inode_p_holder) {
+    inode_pointer_t inode_new_p;
     char err;
-    unsigned int i, k, i_edge;
-    block_pointer_t block_p;
-    struct BlockDirectoryRecord record;
-    char block[FS_BLOCK_SIZE];
 
-    get_inode(fs, inode_p, &inode);
+    if (err = create_files_in_dir(fs, inode_p, &file_type, &name, 1, &inode_new_p)) {
+        return err;
+    }
+    if (inode_p_holder != NULL) *inode_p_holder = inode_new_p;
+    return 0;
+}
 
-    // Apply removing to all subfiles.
-    if (inode.file_type == TYPE_DIRECTORY) {
-        for (k = 0; k < inode.file_size; ++k) {
-            if (get_block_k(fs, &inode, k, &block_p)) {
-                return 1;
-            }
-            get_block(fs, block_p, block);
-            if (k == 0) {
-                i_edge = 2;
-            } else {
-                i_edge = 0;
-            }
-            for (i = i_edge; i < RECORDS_PER_BLOCK; ++i) {
-                memcpy(&record, block + i * sizeof(record), sizeof(record));
-                if (strlen(record.name) > 0) {
-                    if (remove_file(fs, record.inode_p)) {
-                        return 2;
-                    }
-                }
+char clone_file(int fs, inode_pointer_t inode_src_p, inode_pointer_t inode_dst_p) {
+    struct INode inode_src;
+    struct INode inode_dst;
+    block_pointer_t blocks[BLOCKS_P_PER_BLOCK];
+    block_pointer_t k, n, i;
+    char err = 0;
+
+    get_inode(fs, inode_src_p, &inode_src);
+    get_inode(fs, inode_dst_p, &inode_dst);
+    if ((inode_src.file_type != TYPE_REGULAR) || (inode_dst.file_type != TYPE_REGULAR) ||
+        !(inode_dst.flags & INODE_FLAG_INLINE) || (inode_dst.file_size != 0)) {
+        return 1;
+    }
+
+    // Inline content is simply copied.
+    if (inode_src.flags & INODE_FLAG_INLINE) {
+        memcpy(inode_dst.block_p, inode_src.block_p, INODE_INLINE_SIZE);
+        inode_dst.file_size = inode_src.file_size;
+        update_inode(fs, inode_dst_p, &inode_dst);
+        return 0;
+    }
+
+    // Block map is rebuilt window by window, data blocks get one more reference.
+    // Holes stay holes.
+    if (inode_inline_promote(fs, inode_dst_p, &inode_dst)) {
+        return 2;
+    }
+    inode_dst.flags |= inode_src.flags & INODE_FLAG_SPARSE;
+    for (k = 0; !err && (k < inode_src.file_size); k += n) {
+        n = (inode_src.file_size - k < BLOCKS_P_PER_BLOCK) ? inode_src.file_size - k : BLOCKS_P_PER_BLOCK;
+        if (get_blocks_k(fs, &inode_src, k, n, blocks) || share_blocks(fs, blocks, n)) {
+            err = 3;
+            break;
+        }
+        for (i = 0; i < n; ++i) {
+            if (inode_block_attach(fs, &inode_dst, blocks[i])) {
+                free_blocks(fs, blocks + i, n - i);
+                err = 3;
+                break;
             }
         }
     }
 
-    // Pop all blocks one by one.
-    while (1) {
-        err = inode_block_pop(fs, &inode);
-        if (err == INODE_BLOCK_POP_SUCCESS) {
-            continue;
-        } else if (err == INODE_BLOCK_POP_NOTHING) {
-            break;
-        } else {
-            return 3;
+    // Partial copy is dropped.
+    if (err) {
+        inode_truncate_blocks(fs, &inode_dst, 0);
+    }
+    update_inode(fs, inode_dst_p, &inode_dst);
+    return err;
+}
+
+struct TreeRemoval {
+    pthread_mutex_t lock;
+    struct BlockList blocks;
+    struct BlockList inodes;
+    size_t limit;
+    char err;
+};
+
+static int remove_tree_visit(int fs, inode_pointer_t inode_p, struct INode *inode, void *arg) {
+    struct TreeRemoval *removal = arg;
+    struct BlockList blocks = {NULL, 0, 0};
+    size_t i;
+    int stop = 0;
+
+    // Block map is walked outside the lock, only merging is serialized.
+    if (inode_collect_blocks(fs, inode, &blocks)) {
+        free(blocks.items);
+        pthread_mutex_lock(&removal->lock);
+        removal->err = 1;
+        pthread_mutex_unlock(&removal->lock);
+        return 1;
+    }
+
+    pthread_mutex_lock(&removal->lock);
+    for (i = 0; (i < blocks.size) && !removal->err; ++i) {
+        if (block_list_push(&removal->blocks, blocks.items[i])) removal->err = 1;
+    }
+    if (block_list_push(&removal->inodes, inode_p)) removal->err = 1;
+    if (removal->err) stop = 1;
+    if (removal->limit && (removal->blocks.size + removal->inodes.size > removal->limit)) stop = 1;
+    pthread_mutex_unlock(&removal->lock);
+
+    free(blocks.items);
+    return stop;
+}
+
+char remove_tree(int fs, inode_pointer_t *inode_parent_p, inode_pointer_t inode_p, size_t limit, size_t *cost_holder) {
+    struct TreeRemoval removal = {PTHREAD_MUTEX_INITIALIZER, {NULL, 0, 0}, {NULL, 0, 0}, limit, 0};
+    char walk_err;
+    char err = 0;
+    size_t i;
+
+    // Whole subtree is collected first, nothing is changed until it's known.
+    walk_err = walk_tree(fs, inode_p, remove_tree_visit, &removal);
+    if (removal.err || (walk_err && (walk_err != WALK_TREE_STOPPED))) {
+        err = 1;
+    } else if (walk_err == WALK_TREE_STOPPED) {
+        err = REMOVE_TREE_TOO_BIG;
+    } else if ((inode_parent_p != NULL) && unlink_file_from_dir(fs, *inode_parent_p, inode_p)) {
+        err = 3;
+    } else {
+        // All blocks of the subtree are freed in one batch.
+        free_blocks(fs, removal.blocks.items, removal.blocks.size);
+        qsort(removal.inodes.items, removal.inodes.size, sizeof(inode_pointer_t), compare_block_pointers);
+        for (i = 0; i < removal.inodes.size; ++i) {
+            free_inode(fs, removal.inodes.items[i]);
         }
+        if (cost_holder != NULL) *cost_holder = removal.blocks.size + removal.inodes.size;
     }
 
-    free_inode(fs, inode_p);
+    free(removal.blocks.items);
+    free(removal.inodes.items);
+    return err;
 }
 
-char remove_file_from_dir(FILE *fs, inode_pointer_t inode_dir_p, inode_pointer_t inode_victim_p) {
+char remove_file(int fs, inode_pointer_t inode_p) {
+    return remove_tree(fs, NULL, inode_p, 0, NULL);
+}
+
+static char unlink_record_from_dir(int fs, inode_pointer_t inode_dir_p, inode_pointer_t inode_victim_p) {
     // First, we extract the last record.
     // If it turns out to be the victim, then do nothing.
     // Otherwise, we search for the victim's record and replace it with extracted one.
-    block_pointer_t block_p;
     char block[FS_BLOCK_SIZE];
     struct INode inode_dir;
     struct BlockDirectoryRecord record_last, record_victim;
     struct BlockDirectoryRecord record_null = {0, {'\0'}};
     int i, i_edge;
-    unsigned int k;
+    unsigned int k, k_last;
 
     get_inode(fs, inode_dir_p, &inode_dir);
 
@@ -732,16 +2181,16 @@ char remove_file_from_dir(FILE *fs, inode_pointer_t inode_dir_p, inode_pointer_t
     }
 
     // Extract the last record.
-    if (get_block_k(fs, &inode_dir, inode_dir.file_size - 1, &block_p)) {
+    k_last = get_dir_blocks_count(&inode_dir) - 1;
+    if (get_dir_block_k(fs, &inode_dir, k_last, block)) {
         return 2;
     }
-    get_block(fs, block_p, block);
-    if (inode_dir.file_size == 1) {
+    if (k_last == 0) {
         i_edge = 2;
     } else {
         i_edge = 0;
     }
-    for (i = RECORDS_PER_BLOCK - 1; i >= i_edge; --i) {
+    for (i = get_dir_records_count(&inode_dir) - 1; i >= i_edge; --i) {
         memcpy(&record_last, block + i * sizeof(record_last), sizeof(record_last));
         if (strlen(record_last.name) > 0) {
             memcpy(block + i * sizeof(record_last), &record_null, sizeof(record_last));
@@ -752,41 +2201,34 @@ char remove_file_from_dir(FILE *fs, inode_pointer_t inode_dir_p, inode_pointer_t
         return 3;
     }
     if (is_directory_block_empty(block)) {
-        inode_dir.file_size -= 1;
-        free_block(fs, block_p);
+        // Never happens to inline directory as it always keeps "." and "..".
+        // Indirect block left without pointers is freed along with the last block.
+        inode_block_pop(fs, &inode_dir);
         update_inode(fs, inode_dir_p, &inode_dir);
     } else {
-        update_block(fs, block_p, block);
+        update_dir_block_k(fs, inode_dir_p, &inode_dir, k_last, block);
     }
 
     // Is the last record a victim?
     if (record_last.inode_p == inode_victim_p) {
-        if (remove_file(fs, inode_victim_p)) {
-            return 4;
-        }
         return 0;
     }
 
     // Search for the victim's record and overwrite it with extracted one.
-    // Also remove file itself.
-    for (k = 0; k < inode_dir.file_size; ++k) {
-        if (get_block_k(fs, &inode_dir, k, &block_p)) {
+    for (k = 0; k < get_dir_blocks_count(&inode_dir); ++k) {
+        if (get_dir_block_k(fs, &inode_dir, k, block)) {
             return 5;
         }
-        get_block(fs, block_p, block);
         if (k == 0) {
             i_edge = 2;
         } else {
             i_edge = 0;
         }
-        for (i = i_edge; i < RECORDS_PER_BLOCK; ++i) {
+        for (i = i_edge; i < get_dir_records_count(&inode_dir); ++i) {
             memcpy(&record_victim, block + i * sizeof(record_victim), sizeof(record_victim));
             if (record_victim.inode_p == inode_victim_p) {
                 memcpy(block + i * sizeof(record_victim), &record_last, sizeof(record_last));
-                update_block(fs, block_p, block);
-                if (remove_file(fs, inode_victim_p)) {
-                    return 6;
-                }
+                update_dir_block_k(fs, inode_dir_p, &inode_dir, k, block);
                 return 0;
             }
         }
@@ -795,60 +2237,1358 @@ char remove_file_from_dir(FILE *fs, inode_pointer_t inode_dir_p, inode_pointer_t
     return 7;
 }
 
-block_pointer_t get_size_on_disk(struct INode *inode) {
-    block_pointer_t sz = inode->file_size;
-    size_t k = sz - 1;  // index of the last block with file data
-    size_t p;
-    int level = 0;
-
-    if (sz == 0) return 0;
+char compact_dir(int fs, inode_pointer_t inode_dir_p) {
+    struct INode inode;
+    struct TreeTotals totals_before, totals_after;
+    struct BlockDirectoryRecord record;
+    char block[FS_BLOCK_SIZE], block_packed[FS_BLOCK_SIZE];
+    block_pointer_t k, k_packed = 0, count;
+    unsigned int i, i_packed = 0;
+    char moved = 0;
 
-    // Determine the level of indirect addressing.
-    if (k >= (INODE_BLOCKS_COUNT - 3)) {
-        k -= (INODE_BLOCKS_COUNT - 3);
-        if (k < BLOCKS_P_PER_BLOCK) {
-            level = 1;
-        } else {
-            k -= BLOCKS_P_PER_BLOCK;
-            if (k < int_pow(BLOCKS_P_PER_BLOCK, 2)) {
-                level = 2;
-            } else {
-                k -= int_pow(BLOCKS_P_PER_BLOCK, 2);
-                if (k < int_pow(BLOCKS_P_PER_BLOCK, 3)) {
-                    level = 3;
-                }
+    get_inode(fs, inode_dir_p, &inode);
+    if (inode.file_type != TYPE_DIRECTORY) {
+        return 1;
+    }
+    if (inode.flags & INODE_FLAG_INLINE) {
+        return 0;
+    }
+    get_own_totals(fs, &inode, &totals_before);
+
+    // Records are packed in place, a packed block never gets ahead of the block being read.
+    // Blocks are written only after some record has moved.
+    count = get_dir_blocks_count(&inode);
+    memset(block_packed, 0, FS_BLOCK_SIZE);
+    for (k = 0; k < count; ++k) {
+        if (get_dir_block_k(fs, &inode, k, block)) {
+            return 2;
+        }
+        for (i = 0; i < RECORDS_PER_BLOCK; ++i) {
+            memcpy(&record, block + i * RECORD_SIZE, RECORD_SIZE);
+            if (record.name[0] == '\0') continue;
+            if ((k != k_packed) || (i != i_packed)) moved = 1;
+            memcpy(block_packed + i_packed * RECORD_SIZE, &record, RECORD_SIZE);
+            if (++i_packed == RECORDS_PER_BLOCK) {
+                if (moved) update_dir_block_k(fs, inode_dir_p, &inode, k_packed, block_packed);
+                ++k_packed;
+                memset(block_packed, 0, FS_BLOCK_SIZE);
+                i_packed = 0;
             }
         }
-        sz += 1;
     }
 
-    while (level > 1) {
-        p = k / int_pow(BLOCKS_P_PER_BLOCK, level - 1);
-        k = k % int_pow(BLOCKS_P_PER_BLOCK, level - 1);
-        sz += p * int_pow(BLOCKS_P_PER_BLOCK, level - 2);
-        sz += 1;
-        --level;
+    // Few records go back into the inode, root keeps its block as block 0 can't be pointed to.
+    if ((k_packed == 0) && (i_packed <= INODE_INLINE_RECORDS) && (inode_dir_p != 0)) {
+        if (inode_truncate_blocks(fs, &inode, 0)) {
+            return 3;
+        }
+        memset(inode.block_p, 0, INODE_INLINE_SIZE);
+        memcpy(inode.block_p, block_packed, INODE_INLINE_RECORDS * RECORD_SIZE);
+        inode.flags |= INODE_FLAG_INLINE;
+        inode.file_size = INODE_INLINE_RECORDS * RECORD_SIZE;
+    } else {
+        if (i_packed > 0) {
+            if (moved) update_dir_block_k(fs, inode_dir_p, &inode, k_packed, block_packed);
+            ++k_packed;
+        }
+
+        // Already packed directory is left as it is.
+        if (!moved && (k_packed == count)) {
+            return 0;
+        }
+        if ((k_packed < count) && inode_truncate_blocks(fs, &inode, k_packed)) {
+            return 3;
+        }
     }
+    update_inode(fs, inode_dir_p, &inode);
 
-    return sz;
+    get_own_totals(fs, &inode, &totals_after);
+    add_dir_totals(fs, inode_dir_p, &totals_before, &totals_after);
+    return 0;
 }
 
-size_t get_regular_file_size(FILE *fs, struct INode *inode) {
-    block_pointer_t block_p;
+// Inodes collected by walk_tree to be changed after the walk.
+struct TreeInodes {
+    pthread_mutex_t lock;
+    struct BlockList inodes;
+    char err;
+};
+
+static char tree_inodes_push(struct TreeInodes *collection, inode_pointer_t inode_p) {
+    char err;
+
+    pthread_mutex_lock(&collection->lock);
+    if ((err = block_list_push(&collection->inodes, inode_p))) {
+        collection->err = 1;
+    }
+    pthread_mutex_unlock(&collection->lock);
+    return err;
+}
+
+static int compact_dirs_visit(int fs, inode_pointer_t inode_p, struct INode *inode, void *arg) {
+    if ((inode->file_type != TYPE_DIRECTORY) || (inode->flags & INODE_FLAG_INLINE)) return 0;
+    return tree_inodes_push(arg, inode_p);
+}
+
+char compact_dirs(int fs, inode_pointer_t inode_p, unsigned long long *blocks_before, unsigned long long *blocks_after) {
+    struct TreeInodes dirs = {PTHREAD_MUTEX_INITIALIZER, {NULL, 0, 0}, 0};
+    struct INode inode;
+    size_t i;
+    char err = 0;
+
+    *blocks_before = *blocks_after = 0;
+
+    // Directories are collected first, as they can't be rewritten while the walk reads them.
+    if (walk_tree(fs, inode_p, compact_dirs_visit, &dirs) || dirs.err) {
+        free(dirs.inodes.items);
+        return 1;
+    }
+    for (i = 0; !err && (i < dirs.inodes.size); ++i) {
+        get_inode(fs, dirs.inodes.items[i], &inode);
+        *blocks_before += get_size_on_disk(&inode);
+        err = compact_dir(fs, dirs.inodes.items[i]);
+        get_inode(fs, dirs.inodes.items[i], &inode);
+        *blocks_after += get_size_on_disk(&inode);
+    }
+
+    free(dirs.inodes.items);
+    return err;
+}
+
+char unlink_file_from_dir(int fs, inode_pointer_t inode_dir_p, inode_pointer_t inode_victim_p) {
+    struct INode inode_dir, inode_victim;
+    struct TreeTotals totals_before, totals_after, totals_file;
+    struct BlockDirectoryRecord record;
     char block[FS_BLOCK_SIZE];
-    size_t eof_pos;
-    size_t sz = 0;
-    if (inode->file_type != TYPE_REGULAR) return FS_BLOCK_SIZE * get_size_on_disk(inode);
-    if (inode->file_size == 0) return sz;
-    sz += (inode->file_size - 1) * FS_BLOCK_SIZE;
-    if (get_block_k(fs, inode, inode->file_size - 1, &block_p)) return sz;
-    get_block(fs, block_p, block);
-    for (eof_pos = 0; (eof_pos < FS_BLOCK_SIZE) && block[eof_pos] != EOF; ++eof_pos) {}
-    sz += eof_pos;
-    return sz;
+    block_pointer_t count;
+    unsigned int i, records = 0;
+    char err;
+
+    get_inode(fs, inode_dir_p, &inode_dir);
+    count = get_dir_blocks_count(&inode_dir);
+    get_own_totals(fs, &inode_dir, &totals_before);
+    get_inode(fs, inode_victim_p, &inode_victim);
+    get_file_totals(fs, &inode_victim, &totals_file);
+    totals_before.bytes += totals_file.bytes;
+    totals_before.blocks += totals_file.blocks;
+    totals_before.files += totals_file.files;
+    if (err = unlink_record_from_dir(fs, inode_dir_p, inode_victim_p)) {
+        return err;
+    }
+
+    // Directory itself may have shrunk by a block.
+    get_inode(fs, inode_dir_p, &inode_dir);
+    get_own_totals(fs, &inode_dir, &totals_after);
+    add_dir_totals(fs, inode_dir_p, &totals_before, &totals_after);
+
+    if (inode_dir.flags & INODE_FLAG_INLINE) {
+        return 0;
+    }
+
+    // Directory which has just lost a block is packed.
+    if (get_dir_blocks_count(&inode_dir) < count) {
+        return compact_dir(fs, inode_dir_p);
+    }
+
+    // Single block with few records left goes back into the inode (root keeps its block).
+    if ((inode_dir.file_size == 1) && (inode_dir_p != 0)) {
+        if (get_dir_block_k(fs, &inode_dir, 0, block)) {
+            return 0;
+        }
+        for (i = 0; i < RECORDS_PER_BLOCK; ++i) {
+            memcpy(&record, block + i * RECORD_SIZE, RECORD_SIZE);
+            if (record.name[0] != '\0') ++records;
+        }
+        if (records <= INODE_INLINE_RECORDS) {
+            return compact_dir(fs, inode_dir_p);
+        }
+    }
+    return 0;
+}
+
+char remove_file_from_dir(int fs, inode_pointer_t inode_dir_p, inode_pointer_t inode_victim_p) {
+    struct INode inode_victim;
+    struct BlockDirectoryRecord record;
+    char err;
+
+    // Detach the file first: a crash afterwards may leak it, but never
+    //  leaves a record pointing to freed inode.
+    if (err = unlink_file_from_dir(fs, inode_dir_p, inode_victim_p)) {
+        return err;
+    }
+
+    // Small files and empty directories are removed right away,
+    //  everything else is reclaimed in background.
+    get_inode(fs, inode_victim_p, &inode_victim);
+    if (inode_victim.file_type == TYPE_DIRECTORY) {
+        if (get_last_record(fs, &inode_victim, &record) != 0) {
+            return remove_file(fs, inode_victim_p) ? 4 : 0;
+        }
+    } else if (get_allocated_blocks(fs, &inode_victim) <= ORPHAN_MIN_BLOCKS) {
+        return remove_file(fs, inode_victim_p) ? 4 : 0;
+    }
+    return orphan_file(fs, inode_victim_p) ? 6 : 0;
+}
+
+// Changes name in file's record, the record stays in place.
+static char rename_record_in_dir(int fs, inode_pointer_t inode_dir_p, inode_pointer_t inode_p, const char *name) {
+    struct INode inode_dir;
+    struct BlockDirectoryRecord record;
+    char block[FS_BLOCK_SIZE];
+    unsigned int i, k;
+
+    get_inode(fs, inode_dir_p, &inode_dir);
+    for (k = 0; k < get_dir_blocks_count(&inode_dir); ++k) {
+        if (get_dir_block_k(fs, &inode_dir, k, block)) {
+            return 3;
+        }
+        for (i = (k == 0) ? 2 : 0; i < get_dir_records_count(&inode_dir); ++i) {
+            memcpy(&record, block + i * RECORD_SIZE, RECORD_SIZE);
+            if ((record.inode_p == inode_p) && (strlen(record.name) > 0)) {
+                memset(record.name, 0, MAX_NAME_LENGTH);
+                strncpy(record.name, name, MAX_NAME_LENGTH);
+                memcpy(block + i * RECORD_SIZE, &record, RECORD_SIZE);
+                update_dir_block_k(fs, inode_dir_p, &inode_dir, k, block);
+                return 0;
+            }
+        }
+    }
+    return 7;
+}
+
+char move_file(int fs, inode_pointer_t inode_dir_p, inode_pointer_t inode_p, inode_pointer_t inode_dir_new_p, const char *name) {
+    struct INode inode;
+    struct BlockDirectoryRecord record_parent;
+    char block[FS_BLOCK_SIZE];
+    inode_pointer_t ancestor_p, parent_p;
+
+    get_inode(fs, inode_dir_new_p, &inode);
+    if (inode.file_type != TYPE_DIRECTORY) {
+        return 1;
+    }
+    if (inode_dir_new_p == inode_dir_p) {
+        return rename_record_in_dir(fs, inode_dir_p, inode_p, name);
+    }
+
+    // Directory can't become a part of its own subtree: no ancestor of the target may be the directory.
+    get_inode(fs, inode_p, &inode);
+    if (inode.file_type == TYPE_DIRECTORY) {
+        for (ancestor_p = inode_dir_new_p; ancestor_p != inode_p; ancestor_p = parent_p) {
+            if (get_parent_directory(fs, ancestor_p, &parent_p)) return 3;
+            if (parent_p == ancestor_p) break;
+        }
+        if (ancestor_p == inode_p) {
+            return 2;
+        }
+    }
+
+    // New record goes first: a crash in between leaves the file reachable twice, but never lost.
+    if (link_file_to_dir(fs, inode_dir_new_p, inode_p, name)) {
+        return 4;
+    }
+    if (unlink_file_from_dir(fs, inode_dir_p, inode_p)) {
+        return 5;
+    }
+
+    // Parent is the second record of the first block.
+    if (inode.file_type == TYPE_DIRECTORY) {
+        if (get_dir_block_k(fs, &inode, 0, block)) {
+            return 6;
+        }
+        memcpy(&record_parent, block + RECORD_SIZE, RECORD_SIZE);
+        record_parent.inode_p = inode_dir_new_p;
+        memcpy(block + RECORD_SIZE, &record_parent, RECORD_SIZE);
+        update_dir_block_k(fs, inode_p, &inode, 0, block);
+    }
+    return 0;
+}
+
+// Fills an empty directory with copies of another directory's files, regular files share data blocks.
+// Records are copied block by block, each block of records is created as one batch.
+static char copy_dir_tree(int fs, inode_pointer_t inode_src_p, inode_pointer_t inode_dst_p) {
+    struct INode inode_src, inode;
+    struct BlockDirectoryRecord record;
+    struct TreeTotals totals_before = {0, 0, 0}, totals_after = {0, 0, 0}, totals_file;
+    char block[FS_BLOCK_SIZE];
+    char names[RECORDS_PER_BLOCK][MAX_NAME_LENGTH];
+    const char *name_ps[RECORDS_PER_BLOCK];
+    int file_types[RECORDS_PER_BLOCK];
+    inode_pointer_t inode_ps[RECORDS_PER_BLOCK], inode_new_ps[RECORDS_PER_BLOCK];
+    unsigned int i, k, n;
+    char err = 0;
+
+    get_inode(fs, inode_src_p, &inode_src);
+    for (k = 0; !err && (k < get_dir_blocks_count(&inode_src)); ++k) {
+        if (get_dir_block_k(fs, &inode_src, k, block)) {
+            return 3;
+        }
+        for (n = 0, i = (k == 0) ? 2 : 0; i < get_dir_records_count(&inode_src); ++i) {
+            memcpy(&record, block + i * RECORD_SIZE, RECORD_SIZE);
+            if (strlen(record.name) == 0) break;
+            get_inode(fs, record.inode_p, &inode);
+            memcpy(names[n], record.name, MAX_NAME_LENGTH);
+            name_ps[n] = names[n];
+            file_types[n] = inode.file_type;
+            inode_ps[n] = record.inode_p;
+            ++n;
+        }
+        if (err = create_files_in_dir(fs, inode_dst_p, file_types, name_ps, n, inode_new_ps)) {
+            break;
+        }
+
+        // Content of regular files is added to totals once per block of records.
+        for (i = 0; !err && (i < n); ++i) {
+            if (file_types[i] == TYPE_DIRECTORY) {
+                err = copy_dir_tree(fs, inode_ps[i], inode_new_ps[i]);
+                continue;
+            }
+            if (err = clone_file(fs, inode_ps[i], inode_new_ps[i])) break;
+            get_inode(fs, inode_new_ps[i], &inode);
+            get_file_totals(fs, &inode, &totals_file);
+            totals_after.bytes += totals_file.bytes;
+            totals_after.blocks += totals_file.blocks;
+        }
+        add_dir_totals(fs, inode_dst_p, &totals_before, &totals_after);
+        totals_after.bytes = 0;
+        totals_after.blocks = 0;
+    }
+    return err;
+}
+
+inode_pointer_t get_snapshots_dir(int fs) {
+    struct SuperBlock superblock;
+    get_superblock(fs, &superblock);
+    return superblock.snapshots_p;
+}
+
+char get_snapshot(int fs, const char *name, inode_pointer_t *inode_p_holder) {
+    struct INode inode;
+    get_inode(fs, get_snapshots_dir(fs), &inode);
+    return get_inode_by_name_in_inode(fs, &inode, name, inode_p_holder) ? 1 : 0;
+}
+
+char create_snapshot(int fs, const char *name) {
+    inode_pointer_t inode_snapshots_p = get_snapshots_dir(fs);
+    inode_pointer_t inode_p;
+
+    if (get_snapshot(fs, name, NULL) == 0) {
+        return 1;
+    }
+    if (create_file_in_dir(fs, inode_snapshots_p, TYPE_DIRECTORY, name, &inode_p)) {
+        return 2;
+    }
+
+    // Partial snapshot is removed, the live tree is never changed.
+    if (copy_dir_tree(fs, 0, inode_p)) {
+        remove_file_from_dir(fs, inode_snapshots_p, inode_p);
+        return 3;
+    }
+    return 0;
+}
+
+char remove_snapshot(int fs, const char *name) {
+    inode_pointer_t inode_p;
+
+    if (get_snapshot(fs, name, &inode_p)) {
+        return 1;
+    }
+    return remove_file_from_dir(fs, get_snapshots_dir(fs), inode_p) ? 2 : 0;
+}
+
+char get_last_record(int fs, struct INode *inode, struct BlockDirectoryRecord *record_holder) {
+    char block[FS_BLOCK_SIZE];
+    int i, i_edge;
+    block_pointer_t k = get_dir_blocks_count(inode) - 1;
+
+    if (get_dir_block_k(fs, inode, k, block)) {
+        return 2;
+    }
+    i_edge = (k == 0) ? 2 : 0;
+    for (i = get_dir_records_count(inode) - 1; i >= i_edge; --i) {
+        memcpy(record_holder, block + i * RECORD_SIZE, RECORD_SIZE);
+        if (strlen(record_holder->name) > 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+char orphan_file(int fs, inode_pointer_t inode_p) {
+    struct SuperBlock superblock;
+    struct INode inode;
+    struct BlockDirectoryRecord record_parent;
+    char block[FS_BLOCK_SIZE];
+    char name[MAX_NAME_LENGTH];
+
+    get_superblock(fs, &superblock);
+
+    // Changes made by reclaiming stop at orphans directory.
+    get_inode(fs, inode_p, &inode);
+    if (inode.file_type == TYPE_DIRECTORY) {
+        if (get_dir_block_k(fs, &inode, 0, block)) {
+            return 2;
+        }
+        memcpy(&record_parent, block + RECORD_SIZE, RECORD_SIZE);
+        record_parent.inode_p = superblock.orphans_p;
+        memcpy(block + RECORD_SIZE, &record_parent, RECORD_SIZE);
+        update_dir_block_k(fs, inode_p, &inode, 0, block);
+    }
+
+    // Name doesn't matter, it only has to be non-empty.
+    sprintf(name, "%x", inode_p);
+    return link_file_to_dir(fs, superblock.orphans_p, inode_p, name);
+}
+
+// Walks a subtree of block map from the end, until count allocated blocks are found.
+// File blocks from cut_holder on hold the ones found so far, the indirect block itself included.
+static char find_tail_cut_in_block(int fs, block_pointer_t block_p, unsigned int level, unsigned long long base,
+                                   block_pointer_t *count, unsigned long long *cut_holder) {
+    block_pointer_t pointers[BLOCKS_P_PER_BLOCK];
+    unsigned long long span;
+    unsigned int i;
+
+    if (level > 0) {
+        span = int_pow(BLOCKS_P_PER_BLOCK, level - 1);
+        get_block(fs, block_p, (char *)pointers);
+        for (i = BLOCKS_P_PER_BLOCK; i > 0; --i) {
+            if (pointers[i - 1] == 0) continue;  // hole, the whole subtree is skipped
+            if (find_tail_cut_in_block(fs, pointers[i - 1], level - 1, base + (i - 1) * span, count, cut_holder)) {
+                return 1;
+            }
+        }
+    }
+    *cut_holder = base;
+    return (--*count == 0);
+}
+
+/*
+ * Finds the number of blocks to keep in a file, so that count allocated blocks go past it.
+ * Holes are skipped, so a sparse file isn't shrunk by its logical size.
+ * Returns 0 if the file has fewer allocated blocks.
+ */
+static char get_tail_cut(int fs, struct INode *inode, block_pointer_t count, block_pointer_t *cut_holder) {
+    unsigned long long base, cut;
+    unsigned int k, level;
+
+    if (!(inode->flags & INODE_FLAG_SPARSE)) {
+        if (inode->file_size <= count) return 0;
+        *cut_holder = inode->file_size - count;
+        return 1;
+    }
+
+    for (level = 3; level >= 1; --level) {
+        if (inode->block_p[INODE_BLOCKS_COUNT - (4 - level)] == 0) continue;
+        for (base = INODE_BLOCKS_COUNT - 3, k = 1; k < level; ++k) {
+            base += int_pow(BLOCKS_P_PER_BLOCK, k);
+        }
+        if (find_tail_cut_in_block(fs, inode->block_p[INODE_BLOCKS_COUNT - (4 - level)], level, base, &count, &cut)) {
+            *cut_holder = cut;
+            return 1;
+        }
+    }
+    for (k = INODE_BLOCKS_COUNT - 3; k > 0; --k) {
+        if ((inode->block_p[k - 1] != 0) && (--count == 0)) {
+            *cut_holder = k - 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+char reclaim_orphans(int fs, unsigned int budget) {
+    struct SuperBlock superblock;
+    struct INode inode_parent, inode;
+    struct BlockDirectoryRecord record;
+    inode_pointer_t inode_parent_p, inode_p;
+    block_pointer_t cut;
+    size_t cost;
+    char err;
+
+    get_superblock(fs, &superblock);
+
+    while (budget > 0) {
+        // Start from the last orphaned subtree.
+        inode_parent_p = superblock.orphans_p;
+        get_inode(fs, inode_parent_p, &inode_parent);
+        if (get_last_record(fs, &inode_parent, &record) != 0) {
+            return 0;
+        }
+        inode_p = record.inode_p;
+
+        while (1) {
+            get_inode(fs, inode_p, &inode);
+
+            // Large file is shrunk step by step, and the progress is saved in its inode.
+            // Steps are measured in allocated blocks, holes cost nothing.
+            if ((inode.file_type == TYPE_REGULAR) && !(inode.flags & INODE_FLAG_INLINE) && get_tail_cut(fs, &inode, budget, &cut)) {
+                if (inode_truncate_blocks(fs, &inode, cut)) {
+                    return 2;
+                }
+                update_inode(fs, inode_p, &inode);
+                budget = 0;
+                break;
+            }
+
+            // Subtree which fits the budget is removed as a whole,
+            //  a larger one is split by descending to its last child.
+            err = remove_tree(fs, &inode_parent_p, inode_p, budget, &cost);
+            if (err == 0) {
+                budget = (cost < budget) ? (budget - cost) : 0;
+                break;
+            }
+            if (err != REMOVE_TREE_TOO_BIG) {
+                return 3;
+            }
+            if (inode.file_type != TYPE_DIRECTORY) {
+                // Indirect blocks didn't fit, the data goes first.
+                if (inode_truncate_blocks(fs, &inode, 0)) {
+                    return 2;
+                }
+                update_inode(fs, inode_p, &inode);
+                budget = 0;
+                break;
+            }
+            if (get_last_record(fs, &inode, &record) != 0) {
+                // Nothing to split: large empty directory goes at once.
+                if (remove_tree(fs, &inode_parent_p, inode_p, 0, NULL)) {
+                    return 3;
+                }
+                budget = 0;
+                break;
+            }
+            inode_parent_p = inode_p;
+            inode_p = record.inode_p;
+        }
+    }
+
+    get_inode(fs, superblock.orphans_p, &inode_parent);
+    return (get_last_record(fs, &inode_parent, &record) == 0) ? 1 : 0;
+}
+
+// Blocks moved by compaction: sorted old numbers and their new places.
+// New place 0 means not moved yet, the same number means the block stays.
+struct Relocation {
+    block_pointer_t *old;
+    block_pointer_t *new;
+    size_t count;
+};
+
+static size_t find_relocation(struct Relocation *rel, block_pointer_t block_p) {
+    size_t lo = 0, hi = rel->count, mid;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (rel->old[mid] < block_p) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return ((lo < rel->count) && (rel->old[lo] == block_p)) ? lo : rel->count;
+}
+
+static block_pointer_t get_relocated(struct Relocation *rel, block_pointer_t block_p) {
+    size_t i = find_relocation(rel, block_p);
+    return ((i < rel->count) && (rel->new[i] != 0)) ? rel->new[i] : block_p;
+}
+
+// Highest occupied block + 1, descriptors are read all at once.
+static block_pointer_t get_blocks_end(int fs) {
+    struct BlockGroupDescriptor *gds;
+    char page[PAGE_SIZE_BITMAP_BLOCKS];
+    int group, j;
+
+    if ((gds = malloc(AREA_SIZE_BLOCK_GROUPS)) == NULL) {
+        return (fs_size(fs) - AREA_POS_BLOCKS) / FS_BLOCK_SIZE;
+    }
+    fs_read(fs, gds, AREA_SIZE_BLOCK_GROUPS, AREA_POS_BLOCK_GROUPS);
+    for (group = BLOCK_GROUPS_COUNT - 1; group >= 0; --group) {
+        if (gds[group].used_blocks == 0) continue;
+        fs_read(fs, page, PAGE_SIZE_BITMAP_BLOCKS, AREA_POS_BITMAP_BLOCKS + (off_t)group * PAGE_SIZE_BITMAP_BLOCKS);
+        for (j = BLOCKS_PER_GROUP - 1; (j >= 0) && !read_bit(page, j); --j) {}
+        free(gds);
+        return (block_pointer_t)group * BLOCKS_PER_GROUP + j + 1;
+    }
+    free(gds);
+    return 0;
+}
+
+// Occupies a run ending below limit, the lowest groups are tried again if the goal doesn't fit.
+static char occupy_run_below(int fs, block_pointer_t goal, block_pointer_t count, block_pointer_t limit, block_pointer_t *first_holder) {
+    if (!occupy_blocks_run(fs, goal, count, first_holder)) {
+        if (*first_holder + count <= limit) return 0;
+        release_blocks_run(fs, *first_holder, count);
+    }
+    if ((goal != 0) && !occupy_blocks_run(fs, 0, count, first_holder)) {
+        if (*first_holder + count <= limit) return 0;
+        release_blocks_run(fs, *first_holder, count);
+    }
+    return 1;
+}
+
+// Copies content of a run of blocks through a buffer of COMPACT_RUN_MAX blocks.
+static void copy_blocks_run(int fs, block_pointer_t from, block_pointer_t to, block_pointer_t count, char *buffer) {
+    block_pointer_t done, n;
+
+    for (done = 0; done < count; done += n) {
+        n = (count - done < COMPACT_RUN_MAX) ? count - done : COMPACT_RUN_MAX;
+        fs_read(fs, buffer, (size_t)n * FS_BLOCK_SIZE, AREA_POS_BLOCKS + (off_t)(from + done) * FS_BLOCK_SIZE);
+        fs_write(fs, buffer, (size_t)n * FS_BLOCK_SIZE, AREA_POS_BLOCKS + (off_t)(to + done) * FS_BLOCK_SIZE);
+    }
+}
+
+// Copies references of a moved run (up to REFS_WINDOW blocks, both runs inside a group) to its new place.
+static char copy_refs_run(int fs, block_pointer_t from, block_pointer_t to, block_pointer_t count) {
+    struct BlockGroupDescriptor gd;
+    block_refs_t refs[REFS_WINDOW];
+    unsigned int tracked = 0, i;
+
+    get_block_group(fs, from / BLOCKS_PER_GROUP, &gd);
+    if (gd.refs_p == 0) {
+        return 0;
+    }
+    fs_read(fs, refs, count * sizeof(block_refs_t), get_refs_pos(&gd, from));
+    for (i = 0; i < count; ++i) {
+        tracked += (refs[i] != 0);
+    }
+    if (tracked == 0) {
+        return 0;
+    }
+
+    // Entries of free blocks are always zero, so the new ones are simply overwritten.
+    get_block_group(fs, to / BLOCKS_PER_GROUP, &gd);
+    if ((gd.refs_p == 0) && create_refs_table(fs, to / BLOCKS_PER_GROUP, &gd)) {
+        return 1;
+    }
+    fs_write(fs, refs, count * sizeof(block_refs_t), get_refs_pos(&gd, to));
+    gd.tracked_blocks += tracked;
+    update_block_group(fs, to / BLOCKS_PER_GROUP, &gd);
+    return 0;
+}
+
+// Clears references of a run (up to REFS_WINDOW blocks inside a group), so its blocks are freed as untracked.
+static void clear_refs_run(int fs, block_pointer_t first, block_pointer_t count) {
+    struct BlockGroupDescriptor gd;
+    block_refs_t refs[REFS_WINDOW];
+    unsigned int group = first / BLOCKS_PER_GROUP, tracked = 0, i;
+
+    get_block_group(fs, group, &gd);
+    if (gd.refs_p == 0) {
+        return;
+    }
+    fs_read(fs, refs, count * sizeof(block_refs_t), get_refs_pos(&gd, first));
+    for (i = 0; i < count; ++i) {
+        tracked += (refs[i] != 0);
+        refs[i] = 0;
+    }
+    if (tracked == 0) {
+        return;
+    }
+    fs_write(fs, refs, count * sizeof(block_refs_t), get_refs_pos(&gd, first));
+    gd.tracked_blocks -= tracked;
+    update_block_group(fs, group, &gd);
+    drop_refs_table(fs, group, &gd);
+}
+
+static void pin_blocks_run(struct Relocation *rel, block_pointer_t first, block_pointer_t count) {
+    block_pointer_t i;
+    size_t j;
+
+    for (i = 0; i < count; ++i) {
+        if ((j = find_relocation(rel, first + i)) < rel->count) rel->new[j] = first + i;
+    }
+}
+
+// Moves a run of metadata blocks below limit as a whole, old blocks are added to the list to free.
+static char move_metadata_run(int fs, struct Relocation *rel, block_pointer_t *first_p, block_pointer_t count,
+                              block_pointer_t limit, char *buffer, struct BlockList *freed) {
+    block_pointer_t first = *first_p, new_first, i;
+    size_t j;
+
+    if (first + count <= limit) {
+        return 0;
+    }
+
+    // Run which can't be moved stays where it is.
+    if (occupy_run_below(fs, 0, count, limit, &new_first)) {
+        pin_blocks_run(rel, first, count);
+        return 1;
+    }
+    copy_blocks_run(fs, first, new_first, count, buffer);
+    for (i = 0; i < count; ++i) {
+        // Blocks of the tail are freed along with moved data, the rest right here.
+        if ((j = find_relocation(rel, first + i)) < rel->count) {
+            rel->new[j] = new_first + i;
+        } else if (block_list_push(freed, first + i)) {
+            return 1;
+        }
+    }
+    *first_p = new_first;
+    return 0;
+}
+
+// Rewrites pointers of an indirect block and everything below it, count data blocks are covered.
+static void remap_indirect_block(int fs, struct Relocation *rel, block_pointer_t block_p, unsigned int level, block_pointer_t count) {
+    block_pointer_t pointers[BLOCKS_P_PER_BLOCK];
+    block_pointer_t per = int_pow(BLOCKS_P_PER_BLOCK, level - 1);
+    block_pointer_t i, new_p;
+    char changed = 0;
+
+    get_block(fs, block_p, (char *)pointers);
+    for (i = 0; (i < BLOCKS_P_PER_BLOCK) && (i * per < count); ++i) {
+        if (pointers[i] == 0) continue;
+        if ((new_p = get_relocated(rel, pointers[i])) != pointers[i]) {
+            pointers[i] = new_p;
+            changed = 1;
+        }
+        if (level > 1) {
+            remap_indirect_block(fs, rel, pointers[i], level - 1, (count - i * per < per) ? count - i * per : per);
+        }
+    }
+    if (changed) {
+        update_block(fs, block_p, (char *)pointers);
+    }
+}
+
+// Rewrites block pointers of an inode, returns 1 if the inode itself changed.
+static char remap_inode(int fs, struct Relocation *rel, struct INode *inode) {
+    block_pointer_t n = inode->file_size, covered, new_p, k;
+    block_pointer_t *root_p;
+    unsigned int level;
+    char changed = 0;
+
+    for (k = 0; (k < INODE_BLOCKS_COUNT - 3) && (k < n); ++k) {
+        if ((inode->block_p[k] != 0) && ((new_p = get_relocated(rel, inode->block_p[k])) != inode->block_p[k])) {
+            inode->block_p[k] = new_p;
+            changed = 1;
+        }
+    }
+    n -= k;
+    for (level = 1; (level <= 3) && (n > 0); ++level) {
+        covered = int_pow(BLOCKS_P_PER_BLOCK, level);
+        if (covered > n) covered = n;
+        root_p = &inode->block_p[INODE_BLOCKS_COUNT - (4 - level)];
+        if (*root_p != 0) {
+            if ((new_p = get_relocated(rel, *root_p)) != *root_p) {
+                *root_p = new_p;
+                changed = 1;
+            }
+            remap_indirect_block(fs, rel, *root_p, level, covered);
+        }
+        n -= covered;
+    }
+    return changed;
+}
+
+char compact_image(int fs, block_pointer_t *blocks_end_holder) {
+    struct SuperBlock superblock;
+    struct BlockGroupDescriptor gd;
+    struct InodeGroupDescriptor igd;
+    struct Relocation rel = {NULL, NULL, 0};
+    struct BlockList tail = {NULL, 0, 0};
+    struct BlockList freed = {NULL, 0, 0};
+    struct INode *table = NULL;
+    struct DedupSlot *slots;
+    char bitmap_inodes[FS_BLOCK_SIZE];
+    char page[PAGE_SIZE_BITMAP_BLOCKS];
+    char *buffer;
+    unsigned long long used = 0;
+    block_pointer_t limit, goal = 0, first, n;
+    unsigned int group, j;
+    size_t i, k;
+    char changed, err = 0;
+
+    if ((buffer = malloc((size_t)COMPACT_RUN_MAX * FS_BLOCK_SIZE)) == NULL) {
+        return 1;
+    }
+
+    // Everything fits below the number of used blocks, unless free space there is fragmented.
+    for (group = 0; group < BLOCK_GROUPS_COUNT; ++group) {
+        get_block_group(fs, group, &gd);
+        used += gd.used_blocks;
+    }
+    limit = used;
+    for (group = limit / BLOCKS_PER_GROUP; !err && (group < BLOCK_GROUPS_COUNT); ++group) {
+        get_block_group(fs, group, &gd);
+        if (gd.used_blocks == 0) continue;
+        fs_read(fs, page, PAGE_SIZE_BITMAP_BLOCKS, AREA_POS_BITMAP_BLOCKS + (off_t)group * PAGE_SIZE_BITMAP_BLOCKS);
+        for (j = 0; j < BLOCKS_PER_GROUP; ++j) {
+            first = group * BLOCKS_PER_GROUP + j;
+            if ((first >= limit) && read_bit(page, j) && (err = block_list_push(&tail, first))) break;
+        }
+    }
+    rel.old = tail.items;
+    rel.count = tail.size;
+    if (!err && (rel.count > 0) && ((rel.new = calloc(rel.count, sizeof(block_pointer_t))) == NULL)) {
+        err = 1;
+    }
+
+    if (!err && (rel.count > 0)) {
+        // Metadata runs are moved as a whole: inode bitmaps and tables, then references tables.
+        get_superblock(fs, &superblock);
+        for (group = 0; group < superblock.inode_groups_count; ++group) {
+            get_inode_group(fs, group, &igd);
+            move_metadata_run(fs, &rel, &igd.bitmap_p, 1, limit, buffer, &freed);
+            move_metadata_run(fs, &rel, &igd.table_p, INODE_GROUP_TABLE_SIZE, limit, buffer, &freed);
+            update_inode_group(fs, group, &igd);
+        }
+        for (group = 0; group < BLOCK_GROUPS_COUNT; ++group) {
+            get_block_group(fs, group, &gd);
+            if (gd.refs_p == 0) continue;
+
+            // Table of a group lying in the tail is dropped once its blocks are moved out.
+            if ((block_pointer_t)group * BLOCKS_PER_GROUP >= limit) {
+                pin_blocks_run(&rel, gd.refs_p, REFS_TABLE_BLOCKS);
+                continue;
+            }
+            first = gd.refs_p;
+            if (move_metadata_run(fs, &rel, &first, REFS_TABLE_BLOCKS, limit, buffer, &freed) || (first == gd.refs_p)) continue;
+            get_block_group(fs, group, &gd);
+            gd.refs_p = first;
+            update_block_group(fs, group, &gd);
+        }
+
+        // Data and indirect blocks are moved in runs, references go along with them.
+        for (i = 0; i < rel.count; i = k) {
+            if (rel.new[i] != 0) {
+                k = i + 1;
+                continue;
+            }
+            for (k = i + 1; (k < rel.count) && (k - i < COMPACT_RUN_MAX) && (rel.new[k] == 0) &&
+                            (rel.old[k] == rel.old[k - 1] + 1) && (rel.old[k] / BLOCKS_PER_GROUP == rel.old[i] / BLOCKS_PER_GROUP); ++k) {}
+            for (n = k - i; (n > 0) && occupy_run_below(fs, goal, n, limit, &first); n /= 2) {}
+            if (n == 0) break;
+            k = i + n;
+            copy_blocks_run(fs, rel.old[i], first, n, buffer);
+            if (copy_refs_run(fs, rel.old[i], first, n)) {
+                release_blocks_run(fs, first, n);
+                for (; i < k; ++i) rel.new[i] = rel.old[i];
+                continue;
+            }
+            for (; i < k; ++i) rel.new[i] = first + (i - (k - n));
+            goal = first + n;
+        }
+
+        // Pointers of all inodes are rewritten, inode tables are read as a whole.
+        if ((table = malloc((size_t)INODE_GROUP_TABLE_SIZE * FS_BLOCK_SIZE)) == NULL) {
+            err = 1;
+        }
+        for (group = 0; !err && (group < superblock.inode_groups_count); ++group) {
+            get_inode_group(fs, group, &igd);
+            get_block(fs, igd.bitmap_p, bitmap_inodes);
+            fs_read(fs, table, (size_t)INODE_GROUP_TABLE_SIZE * FS_BLOCK_SIZE, AREA_POS_BLOCKS + (off_t)igd.table_p * FS_BLOCK_SIZE);
+            for (j = 0; j < INODES_PER_GROUP; ++j) {
+                if (!read_bit(bitmap_inodes, j) || (table[j].flags & INODE_FLAG_INLINE)) continue;
+                if ((table[j].file_type != TYPE_REGULAR) && (table[j].file_type != TYPE_DIRECTORY)) continue;
+                if (remap_inode(fs, &rel, &table[j])) {
+                    update_inode(fs, group * INODES_PER_GROUP + j, &table[j]);
+                }
+            }
+        }
+
+        // Index keeps pointing to moved blocks, so duplicates are still found.
+        for (k = 0; !err && (k < DEDUP_INDEX_SLOTS); k += COMPACT_SLOTS) {
+            slots = (struct DedupSlot *)buffer;
+            fs_read(fs, slots, COMPACT_SLOTS * sizeof(struct DedupSlot), AREA_POS_DEDUP_INDEX + (off_t)k * sizeof(struct DedupSlot));
+            for (i = 0, changed = 0; i < COMPACT_SLOTS; ++i) {
+                if ((slots[i].block_p != 0) && (get_relocated(&rel, slots[i].block_p) != slots[i].block_p)) {
+                    slots[i].block_p = get_relocated(&rel, slots[i].block_p);
+                    changed = 1;
+                }
+            }
+            if (changed) {
+                fs_write(fs, slots, COMPACT_SLOTS * sizeof(struct DedupSlot), AREA_POS_DEDUP_INDEX + (off_t)k * sizeof(struct DedupSlot));
+            }
+        }
+
+        // Old places are freed last, a failure before leaves them allocated but unreferenced.
+        for (i = 0; !err && (i < rel.count); i = k) {
+            for (k = i + 1; (k < rel.count) && (k - i < REFS_WINDOW) && (rel.old[k] == rel.old[k - 1] + 1) &&
+                            (rel.old[k] / BLOCKS_PER_GROUP == rel.old[i] / BLOCKS_PER_GROUP); ++k) {}
+            if ((rel.new[i] == 0) || (rel.new[i] == rel.old[i])) {
+                k = i + 1;
+                continue;
+            }
+            for (n = 1; (i + n < k) && (rel.new[i + n] != 0) && (rel.new[i + n] != rel.old[i + n]); ++n) {}
+            k = i + n;
+            clear_refs_run(fs, rel.old[i], n);
+            for (; i < k; ++i) {
+                if (block_list_push(&freed, rel.old[i])) err = 1;
+            }
+        }
+        if (!err) {
+            free_blocks(fs, freed.items, freed.size);
+        }
+    }
+
+    // FS file ends right after the last occupied block.
+    *blocks_end_holder = get_blocks_end(fs);
+    if (!err && (AREA_POS_BLOCKS + (off_t)*blocks_end_holder * FS_BLOCK_SIZE < fs_size(fs))) {
+        err = fs_resize(fs, AREA_POS_BLOCKS + (off_t)*blocks_end_holder * FS_BLOCK_SIZE);
+    }
+
+    free(table);
+    free(rel.new);
+    free(tail.items);
+    free(freed.items);
+    free(buffer);
+    return err;
+}
+
+char get_file_extents(int fs, struct INode *inode, block_pointer_t *extents_holder) {
+    block_pointer_t blocks[BLOCKS_P_PER_BLOCK];
+    block_pointer_t k, n, i, prev = 0;
+
+    *extents_holder = 0;
+    if (inode->flags & INODE_FLAG_INLINE) {
+        return 0;
+    }
+    for (k = 0; k < inode->file_size; k += n) {
+        n = (inode->file_size - k < BLOCKS_P_PER_BLOCK) ? inode->file_size - k : BLOCKS_P_PER_BLOCK;
+        if (get_blocks_k(fs, inode, k, n, blocks)) {
+            return 1;
+        }
+        // Holes don't break an extent.
+        for (i = 0; i < n; ++i) {
+            if (blocks[i] == 0) continue;
+            if ((*extents_holder == 0) || (blocks[i] != prev + 1)) ++*extents_holder;
+            prev = blocks[i];
+        }
+    }
+    return 0;
+}
+
+// Gets a new place for a moved block, runs are occupied as long as the rest of the file and halved while they don't fit.
+static char get_defrag_place(int fs, block_pointer_t *run_first, block_pointer_t *run_left, block_pointer_t goal,
+                             block_pointer_t rest, block_pointer_t *block_p_holder) {
+    block_pointer_t n;
+
+    if (*run_left == 0) {
+        for (n = (rest < BLOCKS_PER_GROUP) ? rest : BLOCKS_PER_GROUP; (n > 0) && occupy_blocks_run(fs, goal, n, run_first); n /= 2) {}
+        if (n == 0) {
+            return 1;
+        }
+        *run_left = n;
+    }
+    *block_p_holder = (*run_first)++;
+    --*run_left;
+    return 0;
+}
+
+char defrag_file(int fs, inode_pointer_t inode_p, block_pointer_t *extents_before, block_pointer_t *extents_after) {
+    struct INode inode, inode_new;
+    struct IORequest requests[BLOCKS_P_PER_BLOCK];
+    struct BlockList blocks_old = {NULL, 0, 0};
+    block_pointer_t blocks[BLOCKS_P_PER_BLOCK], places[BLOCKS_P_PER_BLOCK], shared[BLOCKS_P_PER_BLOCK];
+    block_refs_t refs[BLOCKS_P_PER_BLOCK];
+    block_pointer_t run_first = 0, run_left = 0, goal;
+    block_pointer_t k, n, i, m, s, t, attached;
+    char *buffer;
+    char shared_added, err = 0;
+
+    get_inode(fs, inode_p, &inode);
+    *extents_before = *extents_after = 0;
+    if (((inode.file_type != TYPE_REGULAR) && (inode.file_type != TYPE_DIRECTORY)) || (inode.flags & INODE_FLAG_INLINE)) {
+        return 0;
+    }
+    if (get_file_extents(fs, &inode, extents_before)) {
+        return 1;
+    }
+    *extents_after = *extents_before;
+    if (*extents_before <= (inode.file_size + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP) {
+        return 0;
+    }
+    if ((buffer = malloc((size_t)BLOCKS_P_PER_BLOCK * FS_BLOCK_SIZE)) == NULL) {
+        return 1;
+    }
+
+    // New block map is built aside, the inode keeps pointing to the old one until it's complete.
+    inode_new = inode;
+    inode_new.file_size = 0;
+    memset(inode_new.block_p, 0, sizeof(inode_new.block_p));
+    goal = get_inode_goal(fs, inode_p);
+
+    for (k = 0; !err && (k < inode.file_size); k += n) {
+        n = (inode.file_size - k < BLOCKS_P_PER_BLOCK) ? inode.file_size - k : BLOCKS_P_PER_BLOCK;
+        if (get_blocks_k(fs, &inode, k, n, blocks)) {
+            err = 1;
+            break;
+        }
+        memcpy(places, blocks, n * sizeof(block_pointer_t));
+        attached = 0;
+        shared_added = 0;
+
+        // Shared blocks stay where they are, so sharing isn't lost, the rest are read as one batch.
+        for (i = 0, m = 0; !err && (i < n); ++i) {
+            if (blocks[i] == 0) continue;
+            if ((refs[i] = get_refs_entry(fs, blocks[i])) > 1) continue;
+            if ((err = get_defrag_place(fs, &run_first, &run_left, goal, inode.file_size - k - i, &places[i]))) break;
+            requests[m].write = 0;
+            requests[m].data = buffer + (size_t)m * FS_BLOCK_SIZE;
+            requests[m].size = FS_BLOCK_SIZE;
+            requests[m].pos = AREA_POS_BLOCKS + (off_t)blocks[i] * FS_BLOCK_SIZE;
+            ++m;
+        }
+        if (!err) {
+            err = io_batch(fs, requests, m);
+        }
+
+        // Moved blocks are written by runs, tracked ones go to the index again.
+        for (i = 0, m = 0; !err && (i < n); i = t) {
+            if (places[i] == blocks[i]) {
+                t = i + 1;
+                continue;
+            }
+            for (t = i + 1; (t < n) && (places[t] != blocks[t]) && (places[t] == places[t - 1] + 1) &&
+                            (places[t] / BLOCKS_PER_GROUP == places[i] / BLOCKS_PER_GROUP) && (refs[t] == refs[i]); ++t) {}
+            fs_write(fs, buffer + (size_t)m * FS_BLOCK_SIZE, (size_t)(t - i) * FS_BLOCK_SIZE, AREA_POS_BLOCKS + (off_t)places[i] * FS_BLOCK_SIZE);
+            if (refs[i] == 1) {
+                err = index_blocks_run(fs, places[i], t - i, buffer + (size_t)m * FS_BLOCK_SIZE);
+            }
+            m += t - i;
+        }
+
+        // Blocks left in place get one more reference, the old map gives it back.
+        if (!err) {
+            for (i = 0, s = 0; i < n; ++i) {
+                if ((places[i] == blocks[i]) && (blocks[i] != 0)) shared[s++] = blocks[i];
+            }
+            err = share_blocks(fs, shared, s);
+            shared_added = !err;
+        }
+        for (; !err && (attached < n); ++attached) {
+            if (inode_block_attach(fs, &inode_new, places[attached])) {
+                err = 1;
+                break;
+            }
+        }
+
+        // Blocks which weren't attached are given back.
+        for (i = attached; err && (i < n); ++i) {
+            if (places[i] != blocks[i]) {
+                free_block(fs, places[i]);
+            } else if (shared_added && (blocks[i] != 0)) {
+                free_block(fs, blocks[i]);
+            }
+        }
+    }
+    if (run_left > 0) {
+        release_blocks_run(fs, run_first, run_left);
+    }
+
+    // Inode is switched to the new map with a single write, the old blocks are freed afterwards.
+    if (!err) {
+        err = inode_collect_blocks(fs, &inode, &blocks_old);
+    }
+    if (!err) {
+        get_file_extents(fs, &inode_new, extents_after);
+        update_inode(fs, inode_p, &inode_new);
+        free_blocks(fs, blocks_old.items, blocks_old.size);
+    } else {
+        inode_truncate_blocks(fs, &inode_new, 0);
+        *extents_after = *extents_before;
+    }
+
+    free(blocks_old.items);
+    free(buffer);
+    return err;
+}
+
+static int defrag_tree_visit(int fs, inode_pointer_t inode_p, struct INode *inode, void *arg) {
+    if ((inode->file_type != TYPE_REGULAR) && (inode->file_type != TYPE_DIRECTORY)) return 0;
+    if (inode->flags & INODE_FLAG_INLINE) return 0;
+    return tree_inodes_push(arg, inode_p);
+}
+
+char defrag_tree(int fs, inode_pointer_t inode_p, struct DefragTotals *totals_holder) {
+    struct TreeInodes defrag = {PTHREAD_MUTEX_INITIALIZER, {NULL, 0, 0}, 0};
+    block_pointer_t before, after;
+    size_t i;
+    char err = 0;
+
+    memset(totals_holder, 0, sizeof(struct DefragTotals));
+
+    // Files are collected first, as blocks can't be moved while directories are read by the walk.
+    if (walk_tree(fs, inode_p, defrag_tree_visit, &defrag) || defrag.err) {
+        free(defrag.inodes.items);
+        return 1;
+    }
+    qsort(defrag.inodes.items, defrag.inodes.size, sizeof(inode_pointer_t), compare_block_pointers);
+    for (i = 0; !err && (i < defrag.inodes.size); ++i) {
+        err = defrag_file(fs, defrag.inodes.items[i], &before, &after);
+        totals_holder->files += 1;
+        totals_holder->files_rewritten += (after != before);
+        totals_holder->extents_before += before;
+        totals_holder->extents_after += after;
+    }
+
+    free(defrag.inodes.items);
+    return err;
+}
+
+block_pointer_t get_size_on_disk(struct INode *inode) {
+    block_pointer_t sz = inode->file_size;
+    size_t k = sz - 1;  // index of the last block with file data
+    size_t p;
+    int level = 0;
+
+    if ((sz == 0) || (inode->flags & INODE_FLAG_INLINE)) return 0;
+
+    // Determine the level of indirect addressing.
+    if (k >= (INODE_BLOCKS_COUNT - 3)) {
+        k -= (INODE_BLOCKS_COUNT - 3);
+        if (k < BLOCKS_P_PER_BLOCK) {
+            level = 1;
+        } else {
+            k -= BLOCKS_P_PER_BLOCK;
+            if (k < int_pow(BLOCKS_P_PER_BLOCK, 2)) {
+                level = 2;
+            } else {
+                k -= int_pow(BLOCKS_P_PER_BLOCK, 2);
+                if (k < int_pow(BLOCKS_P_PER_BLOCK, 3)) {
+                    level = 3;
+                }
+            }
+        }
+        sz += 1;
+    }
+
+    while (level > 1) {
+        p = k / int_pow(BLOCKS_P_PER_BLOCK, level - 1);
+        k = k % int_pow(BLOCKS_P_PER_BLOCK, level - 1);
+        sz += p * int_pow(BLOCKS_P_PER_BLOCK, level - 2);
+        sz += 1;
+        --level;
+    }
+
+    return sz;
+}
+
+// Counts allocated blocks of a subtree of block map, including the block itself.
+static block_pointer_t count_mapped_blocks(int fs, block_pointer_t block_p, unsigned int level) {
+    block_pointer_t pointers[BLOCKS_P_PER_BLOCK];
+    block_pointer_t count = 1;
+    unsigned int i;
+
+    if (level == 0) return count;
+    get_block(fs, block_p, (char *)pointers);
+    for (i = 0; i < BLOCKS_P_PER_BLOCK; ++i) {
+        if (pointers[i] != 0) count += count_mapped_blocks(fs, pointers[i], level - 1);
+    }
+    return count;
+}
+
+block_pointer_t get_allocated_blocks(int fs, struct INode *inode) {
+    block_pointer_t count = 0;
+    unsigned int k, level;
+
+    // Without holes every block up to the end is there, block map isn't read.
+    if (!(inode->flags & INODE_FLAG_SPARSE) || (inode->flags & INODE_FLAG_INLINE)) {
+        return get_size_on_disk(inode);
+    }
+
+    // Pointers past the end of file are zero, so the whole map is walked.
+    for (k = 0; k < INODE_BLOCKS_COUNT - 3; ++k) {
+        if (inode->block_p[k] != 0) ++count;
+    }
+    for (level = 1; level <= 3; ++level) {
+        if (inode->block_p[INODE_BLOCKS_COUNT - (4 - level)] != 0) {
+            count += count_mapped_blocks(fs, inode->block_p[INODE_BLOCKS_COUNT - (4 - level)], level);
+        }
+    }
+    return count;
+}
+
+size_t get_regular_file_size(int fs, struct INode *inode) {
+    char block[FS_BLOCK_SIZE];
+    size_t eof_pos;
+    size_t sz = 0;
+    if (inode->file_type != TYPE_REGULAR) return FS_BLOCK_SIZE * get_size_on_disk(inode);
+    if (inode->flags & INODE_FLAG_INLINE) return inode->file_size;
+    if (inode->file_size == 0) return sz;
+    sz += (size_t)(inode->file_size - 1) * FS_BLOCK_SIZE;
+    if (get_file_block_k(fs, inode, inode->file_size - 1, block)) return sz;
+
+    // EOF mark is followed by zeros only, while data may contain EOF bytes too.
+    for (eof_pos = FS_BLOCK_SIZE - 1; (eof_pos > 0) && (block[eof_pos] != EOF); --eof_pos) {}
+    sz += eof_pos;
+    return sz;
+}
+
+char read_file(int fs, struct INode *inode, size_t offset, char *data, size_t size, size_t *size_holder) {
+    struct FileReadBuffer rb;
+    char block[FS_BLOCK_SIZE];
+    block_pointer_t k;
+    size_t size_file, pos, n;
+    size_t done = 0;
+
+    if (read_buffer_open(fs, inode, &rb)) {
+        return 1;
+    }
+
+    // Nothing can be read past the end of file.
+    size_file = get_regular_file_size(fs, inode);
+    if (offset >= size_file) {
+        size = 0;
+    } else if (size > size_file - offset) {
+        size = size_file - offset;
+    }
+
+    // Only the blocks covering requested range are read.
+    for (k = offset / FS_BLOCK_SIZE; done < size; ++k) {
+        pos = (done == 0) ? (offset % FS_BLOCK_SIZE) : 0;
+        n = FS_BLOCK_SIZE - pos;
+        if (n > size - done) n = size - done;
+        if (read_buffer_get_block(fs, &rb, k, block)) {
+            read_buffer_close(&rb);
+            return 2;
+        }
+        memcpy(data + done, block + pos, n);
+        done += n;
+    }
+    read_buffer_close(&rb);
+
+    if (size_holder != NULL) *size_holder = done;
+    return 0;
+}
+
+char truncate_file(int fs, inode_pointer_t inode_p, size_t size) {
+    struct INode inode;
+    char block[FS_BLOCK_SIZE];
+    block_pointer_t block_p;
+    size_t size_old;
+
+    get_inode(fs, inode_p, &inode);
+    if (inode.file_type != TYPE_REGULAR) {
+        return 1;
+    }
+
+    // Inline content is just cut or padded with zeros.
+    if ((inode.flags & INODE_FLAG_INLINE) && (size <= INODE_INLINE_SIZE)) {
+        if (size > inode.file_size) {
+            memset((char *)inode.block_p + inode.file_size, 0, size - inode.file_size);
+        } else {
+            memset((char *)inode.block_p + size, 0, INODE_INLINE_SIZE - size);
+        }
+        inode.file_size = size;
+        update_inode(fs, inode_p, &inode);
+        return 0;
+    }
+
+    if (size / FS_BLOCK_SIZE + 1 > FILE_BLOCKS_MAX) {
+        return 2;
+    }
+    if (inode_inline_promote(fs, inode_p, &inode)) {
+        return 3;
+    }
+    size_old = get_regular_file_size(fs, &inode);
+
+    if (size == 0) {
+        // Empty file has no blocks at all.
+        if (inode_truncate_blocks(fs, &inode, 0)) {
+            return 4;
+        }
+        inode.flags &= ~INODE_FLAG_SPARSE;
+    } else if (size < size_old) {
+        if (inode_truncate_blocks(fs, &inode, size / FS_BLOCK_SIZE + 1)) {
+            return 4;
+        }
+    } else if (size > size_old) {
+        // Old EOF mark becomes a zero byte of data.
+        // New blocks are left as holes, only the last one is allocated.
+        if ((inode.file_size > 0) && !get_block_k(fs, &inode, inode.file_size - 1, &block_p) && (block_p != 0) &&
+            !inode_block_fill(fs, inode_p, &inode, inode.file_size - 1, 1, &block_p)) {
+            get_block(fs, block_p, block);
+            block[size_old % FS_BLOCK_SIZE] = 0;
+            update_block(fs, block_p, block);
+        }
+        if (size / FS_BLOCK_SIZE > inode.file_size) {
+            inode.flags |= INODE_FLAG_SPARSE;
+        }
+        inode.file_size = size / FS_BLOCK_SIZE + 1;
+    }
+
+    // Put EOF mark, everything past it in the last block is zeros.
+    if ((size > 0) && (size != size_old)) {
+        if (inode_block_fill(fs, inode_p, &inode, size / FS_BLOCK_SIZE, 1, &block_p)) {
+            update_inode(fs, inode_p, &inode);
+            return 5;
+        }
+        get_block(fs, block_p, block);
+        memset(block + size % FS_BLOCK_SIZE, 0, FS_BLOCK_SIZE - size % FS_BLOCK_SIZE);
+        block[size % FS_BLOCK_SIZE] = EOF;
+        update_block(fs, block_p, block);
+    }
+
+    update_inode(fs, inode_p, &inode);
+    return 0;
+}
+
+char write_file(int fs, inode_pointer_t inode_p, size_t offset, const char *data, size_t size) {
+    struct INode inode;
+    char block[FS_BLOCK_SIZE];
+    block_pointer_t block_p, k;
+    size_t pos, n;
+    size_t done = 0;
+    char err;
+
+    get_inode(fs, inode_p, &inode);
+    if (inode.file_type != TYPE_REGULAR) {
+        return 1;
+    }
+    if (size == 0) {
+        return 0;
+    }
+
+    // Inline file stays inline while the content fits.
+    if ((inode.flags & INODE_FLAG_INLINE) && (offset + size <= INODE_INLINE_SIZE)) {
+        if (offset > inode.file_size) {
+            memset((char *)inode.block_p + inode.file_size, 0, offset - inode.file_size);
+        }
+        memcpy((char *)inode.block_p + offset, data, size);
+        if (offset + size > inode.file_size) {
+            inode.file_size = offset + size;
+        }
+        update_inode(fs, inode_p, &inode);
+        return 0;
+    }
+
+    // Extend the file first, so the data never overlaps EOF mark.
+    if (offset + size > get_regular_file_size(fs, &inode)) {
+        if (err = truncate_file(fs, inode_p, offset + size)) {
+            return err;
+        }
+        get_inode(fs, inode_p, &inode);
+    }
+
+    for (k = offset / FS_BLOCK_SIZE; done < size; ++k) {
+        pos = (done == 0) ? (offset % FS_BLOCK_SIZE) : 0;
+        n = FS_BLOCK_SIZE - pos;
+        if (n > size - done) n = size - done;
+
+        if (n == FS_BLOCK_SIZE) {
+            // Fully overwritten block is neither read nor zeroed.
+            if (inode_block_fill(fs, inode_p, &inode, k, 0, &block_p)) {
+                update_inode(fs, inode_p, &inode);
+                return 6;
+            }
+            memcpy(block, data + done, FS_BLOCK_SIZE);
+        } else {
+            if (inode_block_fill(fs, inode_p, &inode, k, 1, &block_p)) {
+                update_inode(fs, inode_p, &inode);
+                return 6;
+            }
+            get_block(fs, block_p, block);
+            memcpy(block + pos, data + done, n);
+        }
+        update_block(fs, block_p, block);
+        done += n;
+    }
+
+    update_inode(fs, inode_p, &inode);
+    return 0;
 }
 
-char get_dir(FILE *fs, inode_pointer_t inode_p, const char *target, inode_pointer_t *inode_target_p) {
+char get_dir(int fs, inode_pointer_t inode_p, const char *target, inode_pointer_t *inode_target_p) {
     struct INode inode;
     struct INode inode2;
     inode_pointer_t inode2_p;
@@ -874,7 +3614,7 @@ int is_name_valid(const char *name) {
     return 1;
 }
 
-int is_name_taken(FILE *fs, inode_pointer_t inode_p, const char *name) {
+int is_name_taken(int fs, inode_pointer_t inode_p, const char *name) {
     struct INode inode;
     get_inode(fs, inode_p, &inode);
     if (get_inode_by_name_in_inode(fs, &inode, name, NULL)) return 0;
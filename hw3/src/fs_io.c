@@ -0,0 +1,374 @@
+#define _GNU_SOURCE  // fallocate
+#include <fs_io.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef FS_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
+
+// Size of FS file is tracked for a single descriptor, the first one asked about or resized.
+// Writes through another descriptor would make it stale, so a process works with one FS file only.
+// Writes may come from pool workers.
+static pthread_mutex_t end_lock = PTHREAD_MUTEX_INITIALIZER;
+static int end_fs = -1;
+static off_t end_pos = 0;
+
+static void end_track(int fs, off_t pos) {
+    pthread_mutex_lock(&end_lock);
+    assert((end_fs == -1) || (fs == end_fs));
+    if ((fs == end_fs) && (pos > end_pos)) end_pos = pos;
+    pthread_mutex_unlock(&end_lock);
+}
+
+off_t fs_size(int fs) {
+    struct stat st;
+    off_t size;
+
+    pthread_mutex_lock(&end_lock);
+    assert((end_fs == -1) || (fs == end_fs));
+    if (end_fs == -1) {
+        fstat(fs, &st);
+        end_fs = fs;
+        end_pos = st.st_size;
+    }
+    size = end_pos;
+    pthread_mutex_unlock(&end_lock);
+    return size;
+}
+
+char fs_resize(int fs, off_t size) {
+    char err;
+
+    pthread_mutex_lock(&end_lock);
+    assert((end_fs == -1) || (fs == end_fs));
+    err = (ftruncate(fs, size) != 0);
+    if (!err) {
+        end_fs = fs;
+        end_pos = size;
+    }
+    pthread_mutex_unlock(&end_lock);
+    return err;
+}
+
+char fs_punch(int fs, off_t pos, off_t size) {
+    if (fallocate(fs, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, size) == 0) return 0;
+    return (errno != EOPNOTSUPP) && (errno != ENOSYS);
+}
+
+char fs_read(int fs, void *data, size_t size, off_t pos) {
+    ssize_t n;
+    size_t done = 0;
+    char err = 0;
+    while (done < size) {
+        n = pread(fs, (char *)data + done, size - done, pos + done);
+        if ((n < 0) && (errno == EINTR)) continue;
+        if (n <= 0) {
+            err = (n < 0);
+            break;
+        }
+        done += n;
+    }
+
+    // Area past the end of FS file has never been written, it's zeros.
+    memset((char *)data + done, 0, size - done);
+    return err;
+}
+
+char fs_write(int fs, const void *data, size_t size, off_t pos) {
+    ssize_t n;
+    size_t done = 0;
+    while (done < size) {
+        n = pwrite(fs, (const char *)data + done, size - done, pos + done);
+        if ((n < 0) && (errno == EINTR)) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    end_track(fs, pos + done);
+    return done < size;
+}
+
+/*
+ * Completes a request, which has been done only partially (done bytes).
+ *  returns: 0 <=> the request is done in full.
+ */
+static char io_finish(int fs, struct IORequest *request, size_t done) {
+    if (done >= request->size) return 0;
+    if (request->write) {
+        return fs_write(fs, (char *)request->data + done, request->size - done, request->pos + done);
+    }
+    return fs_read(fs, (char *)request->data + done, request->size - done, request->pos + done);
+}
+
+// Batches are performed one at a time, whichever thread submits them.
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef FS_IO_URING
+
+struct IORing {
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+static struct IORing ring;
+static int ring_state = 0;  // 0 - not set up yet, 1 - ready, -1 - unavailable
+
+static int ring_setup(void) {
+    struct io_uring_params params;
+    size_t sq_size, cq_size;
+    char *sq_ptr, *cq_ptr;
+
+    memset(&params, 0, sizeof(params));
+    ring.fd = syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &params);
+    if (ring.fd < 0) return 1;
+
+    // Map submission and completion rings (one mapping on newer kernels).
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size) sq_size = cq_size;
+    }
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        close(ring.fd);
+        return 1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            close(ring.fd);
+            return 1;
+        }
+    }
+    ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        close(ring.fd);
+        return 1;
+    }
+
+    ring.entries = params.sq_entries;
+    ring.sq_tail = (unsigned int *)(sq_ptr + params.sq_off.tail);
+    ring.sq_mask = (unsigned int *)(sq_ptr + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *)(sq_ptr + params.sq_off.array);
+    ring.cq_head = (unsigned int *)(cq_ptr + params.cq_off.head);
+    ring.cq_tail = (unsigned int *)(cq_ptr + params.cq_off.tail);
+    ring.cq_mask = (unsigned int *)(cq_ptr + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+    return 0;
+}
+
+// Reaps whatever has completed, in any order. A request which couldn't be done sets failed.
+static unsigned int ring_reap(int fs, struct IORequest *requests, char *failed) {
+    unsigned int head, reaped = 0;
+    struct io_uring_cqe *cqe;
+
+    head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &ring.cqes[head & *ring.cq_mask];
+        // Short or failed request (e.g. read past the end) is finished synchronously.
+        if (io_finish(fs, &requests[cqe->user_data], (cqe->res > 0) ? (size_t)cqe->res : 0)) *failed = 1;
+        ++head;
+        ++reaped;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+// returns: 0 <=> the ring works, requests are done either way (failed is set if some couldn't be).
+static char ring_batch(int fs, struct IORequest *requests, size_t count, char *failed) {
+    size_t submitted = 0;
+    size_t completed = 0;
+    size_t i;
+    unsigned int inflight = 0;
+    unsigned int pending = 0;   // queued, but not consumed by kernel yet
+    unsigned int tail, idx, reaped;
+    struct io_uring_sqe *sqe;
+    struct IORequest *request;
+    int ret;
+    char err = 0;
+
+    while (completed < count) {
+        // Fill submission queue as much as possible.
+        tail = *ring.sq_tail;
+        while ((submitted < count) && (inflight + pending < ring.entries)) {
+            request = &requests[submitted];
+            idx = tail & *ring.sq_mask;
+            sqe = &ring.sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = fs;
+            sqe->addr = (unsigned long)request->data;
+            sqe->len = request->size;
+            sqe->off = request->pos;
+            sqe->user_data = submitted;
+            ring.sq_array[idx] = idx;
+            ++tail;
+            ++submitted;
+            ++pending;
+        }
+        __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+        ret = syscall(__NR_io_uring_enter, ring.fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret >= 0) {
+            pending -= ret;
+            inflight += ret;
+        } else if ((errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) {
+            err = 1;
+            break;
+        }
+
+        reaped = ring_reap(fs, requests, failed);
+        inflight -= reaped;
+        completed += reaped;
+    }
+    if (!err) {
+        return 0;
+    }
+
+    // Ring is broken: queued entries are taken back (kernel consumes them only on enter),
+    //  they and the ones never queued are performed synchronously.
+    __atomic_store_n(ring.sq_tail, *ring.sq_tail - pending, __ATOMIC_RELEASE);
+    for (i = submitted - pending; i < count; ++i) {
+        if (io_finish(fs, &requests[i], 0)) *failed = 1;
+    }
+
+    // Requests in flight still own their buffers, so they're waited for.
+    while (inflight > 0) {
+        inflight -= ring_reap(fs, requests, failed);
+        if (inflight == 0) break;
+        if (syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            sched_yield();
+        }
+    }
+    return 1;
+}
+
+#endif
+
+struct IOPoolJob {
+    int fs;
+    struct IORequest *requests;
+    size_t count;
+    size_t next;        // the first request not taken by workers
+    size_t completed;
+    char failed;        // some request couldn't be done
+};
+
+static struct IOPoolJob job = {0, NULL, 0, 0, 0, 0};
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static int pool_state = 0;  // 0 - not started yet, 1 - ready, -1 - unavailable
+
+static void *pool_worker(void *arg) {
+    size_t i;
+    char err;
+    (void)arg;
+
+    pthread_mutex_lock(&pool_lock);
+    while (1) {
+        while (job.next >= job.count) {
+            pthread_cond_wait(&pool_work, &pool_lock);
+        }
+        i = job.next++;
+        pthread_mutex_unlock(&pool_lock);
+
+        err = io_finish(job.fs, &job.requests[i], 0);
+
+        pthread_mutex_lock(&pool_lock);
+        if (err) job.failed = 1;
+        if (++job.completed == job.count) {
+            pthread_cond_signal(&pool_done);
+        }
+    }
+    return NULL;
+}
+
+static int pool_start(void) {
+    pthread_t thread;
+    int i;
+    for (i = 0; i < IO_THREADS; ++i) {
+        if (pthread_create(&thread, NULL, pool_worker, NULL)) {
+            // Workers which have started are still enough.
+            return (i == 0);
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+static char pool_batch(int fs, struct IORequest *requests, size_t count) {
+    char err;
+
+    pthread_mutex_lock(&pool_lock);
+    job.fs = fs;
+    job.requests = requests;
+    job.completed = 0;
+    job.failed = 0;
+    job.next = 0;
+    job.count = count;
+    pthread_cond_broadcast(&pool_work);
+    while (job.completed < job.count) {
+        pthread_cond_wait(&pool_done, &pool_lock);
+    }
+    job.count = 0;
+    job.next = 0;
+    err = job.failed;
+    pthread_mutex_unlock(&pool_lock);
+    return err;
+}
+
+char io_batch(int fs, struct IORequest *requests, size_t count) {
+    size_t i;
+    char err = 0;
+
+    // Nothing to overlap for a single request.
+    if (count <= 1) {
+        for (i = 0; i < count; ++i) err |= io_finish(fs, &requests[i], 0);
+        return err;
+    }
+
+    pthread_mutex_lock(&batch_lock);
+#ifdef FS_IO_URING
+    if (ring_state == 0) {
+        ring_state = ring_setup() ? -1 : 1;
+    }
+    if (ring_state == 1) {
+        // Batch is complete either way, a failed ring is just not used anymore.
+        if (ring_batch(fs, requests, count, &err)) {
+            ring_state = -1;
+        }
+    } else
+#endif
+    {
+        if (pool_state == 0) {
+            pool_state = pool_start() ? -1 : 1;
+        }
+        if (pool_state == 1) {
+            err = pool_batch(fs, requests, count);
+        } else {
+            for (i = 0; i < count; ++i) err |= io_finish(fs, &requests[i], 0);
+        }
+    }
+    pthread_mutex_unlock(&batch_lock);
+
+    // Writes completed by the kernel in full are not seen by fs_write.
+    for (i = 0; i < count; ++i) {
+        if (requests[i].write) end_track(fs, requests[i].pos + requests[i].size);
+    }
+    return err;
+}
@@ -0,0 +1,247 @@
+#include <fs_core.h>
+#include <string.h>
+#include <pthread.h>
+
+// Directories waiting to be read by one thread.
+// The owner takes from the tail, other threads steal from the head.
+struct WalkQueue {
+    pthread_mutex_t lock;
+    inode_pointer_t *items;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+};
+
+struct TreeWalk {
+    int fs;
+    tree_walk_fn visit;
+    void *arg;
+    unsigned int threads;
+    struct WalkQueue queues[WALK_THREADS_MAX];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    size_t pending;       // directories queued or being read
+    unsigned long pushes; // incremented after each push, lets idle threads wait safely
+    unsigned int idle;
+    char result;
+};
+
+struct WalkWorker {
+    struct TreeWalk *walk;
+    unsigned int id;
+};
+
+static char walk_queue_push(struct WalkQueue *queue, inode_pointer_t *items, size_t count) {
+    inode_pointer_t *items_new;
+    size_t capacity_new;
+    char err = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail + count > queue->capacity) {
+        // Drop the already stolen head before growing.
+        memmove(queue->items, queue->items + queue->head, (queue->tail - queue->head) * sizeof(inode_pointer_t));
+        queue->tail -= queue->head;
+        queue->head = 0;
+    }
+    if (queue->tail + count > queue->capacity) {
+        capacity_new = queue->capacity ? queue->capacity : 64;
+        while (capacity_new < queue->tail + count) capacity_new *= 2;
+        if ((items_new = realloc(queue->items, capacity_new * sizeof(inode_pointer_t))) == NULL) {
+            err = 1;
+        } else {
+            queue->items = items_new;
+            queue->capacity = capacity_new;
+        }
+    }
+    if (!err) {
+        memcpy(queue->items + queue->tail, items, count * sizeof(inode_pointer_t));
+        queue->tail += count;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return err;
+}
+
+static char walk_queue_take(struct WalkQueue *queue, char steal, inode_pointer_t *inode_p_holder) {
+    char err = 1;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail) {
+        *inode_p_holder = steal ? queue->items[queue->head++] : queue->items[--queue->tail];
+        if (queue->head == queue->tail) queue->head = queue->tail = 0;
+        err = 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return err;
+}
+
+static void walk_stop(struct TreeWalk *walk, char result) {
+    pthread_mutex_lock(&walk->lock);
+    if (walk->result == 0) walk->result = result;
+    pthread_cond_broadcast(&walk->changed);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static char walk_stopped(struct TreeWalk *walk) {
+    char result;
+    pthread_mutex_lock(&walk->lock);
+    result = walk->result;
+    pthread_mutex_unlock(&walk->lock);
+    return result;
+}
+
+// Visits all subfiles of directory and queues subdirectories.
+static void walk_dir(struct TreeWalk *walk, unsigned int id, inode_pointer_t inode_p) {
+    struct INode inode;
+    struct BlockDirectoryRecord record;
+    inode_pointer_t inode_ps[RECORDS_PER_BLOCK];
+    inode_pointer_t dirs_ps[RECORDS_PER_BLOCK];
+    struct INode inodes[RECORDS_PER_BLOCK];
+    char block[FS_BLOCK_SIZE];
+    unsigned int k, i, n, j, dirs;
+
+    get_inode(walk->fs, inode_p, &inode);
+
+    for (k = 0; k < get_dir_blocks_count(&inode); ++k) {
+        if (walk_stopped(walk)) return;
+        if (get_dir_block_k(walk->fs, &inode, k, block)) {
+            walk_stop(walk, 2);
+            return;
+        }
+
+        // Inodes of the whole block are read as one batch.
+        for (n = 0, i = (k == 0) ? 2 : 0; i < get_dir_records_count(&inode); ++i, ++n) {
+            memcpy(&record, block + i * RECORD_SIZE, RECORD_SIZE);
+            if (strlen(record.name) == 0) break;
+            inode_ps[n] = record.inode_p;
+        }
+        if (get_inodes(walk->fs, inode_ps, n, inodes)) {
+            walk_stop(walk, 2);
+            return;
+        }
+
+        for (j = 0, dirs = 0; j < n; ++j) {
+            if (walk->visit(walk->fs, inode_ps[j], &inodes[j], walk->arg)) {
+                walk_stop(walk, WALK_TREE_STOPPED);
+                return;
+            }
+            if (inodes[j].file_type == TYPE_DIRECTORY) {
+                dirs_ps[dirs++] = inode_ps[j];
+            }
+        }
+        if (dirs == 0) continue;
+
+        // Directories are counted before they become visible to other threads.
+        pthread_mutex_lock(&walk->lock);
+        walk->pending += dirs;
+        pthread_mutex_unlock(&walk->lock);
+        if (walk_queue_push(&walk->queues[id], dirs_ps, dirs)) {
+            walk_stop(walk, 2);
+            return;
+        }
+        pthread_mutex_lock(&walk->lock);
+        ++walk->pushes;
+        if (walk->idle > 0) pthread_cond_broadcast(&walk->changed);
+        pthread_mutex_unlock(&walk->lock);
+    }
+}
+
+static void *walk_worker(void *arg) {
+    struct WalkWorker *worker = arg;
+    struct TreeWalk *walk = worker->walk;
+    inode_pointer_t inode_p;
+    unsigned long pushes;
+    unsigned int i;
+    char found;
+
+    while (1) {
+        pthread_mutex_lock(&walk->lock);
+        pushes = walk->pushes;
+        if ((walk->pending == 0) || (walk->result != 0)) {
+            pthread_mutex_unlock(&walk->lock);
+            break;
+        }
+        pthread_mutex_unlock(&walk->lock);
+
+        // Own queue first (the deepest directories), then steal the oldest ones.
+        found = !walk_queue_take(&walk->queues[worker->id], 0, &inode_p);
+        for (i = 1; !found && (i < walk->threads); ++i) {
+            found = !walk_queue_take(&walk->queues[(worker->id + i) % walk->threads], 1, &inode_p);
+        }
+
+        if (found) {
+            walk_dir(walk, worker->id, inode_p);
+            pthread_mutex_lock(&walk->lock);
+            if (--walk->pending == 0) pthread_cond_broadcast(&walk->changed);
+            pthread_mutex_unlock(&walk->lock);
+            continue;
+        }
+
+        // Nothing to take: wait until something is pushed or the walk is over.
+        pthread_mutex_lock(&walk->lock);
+        ++walk->idle;
+        while ((walk->pushes == pushes) && (walk->pending > 0) && (walk->result == 0)) {
+            pthread_cond_wait(&walk->changed, &walk->lock);
+        }
+        --walk->idle;
+        pthread_mutex_unlock(&walk->lock);
+    }
+
+    return NULL;
+}
+
+char walk_tree(int fs, inode_pointer_t inode_p, tree_walk_fn visit, void *arg) {
+    struct TreeWalk walk;
+    struct WalkWorker workers[WALK_THREADS_MAX];
+    pthread_t threads[WALK_THREADS_MAX];
+    struct INode inode;
+    unsigned int i, started;
+    long cpus;
+
+    get_inode(fs, inode_p, &inode);
+    if (visit(fs, inode_p, &inode, arg)) {
+        return WALK_TREE_STOPPED;
+    }
+    if (inode.file_type != TYPE_DIRECTORY) {
+        return 0;
+    }
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    walk.fs = fs;
+    walk.visit = visit;
+    walk.arg = arg;
+    walk.threads = (cpus < 1) ? 1 : ((cpus > WALK_THREADS_MAX) ? WALK_THREADS_MAX : cpus);
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.changed, NULL);
+    walk.pending = 1;
+    walk.pushes = 0;
+    walk.idle = 0;
+    walk.result = 0;
+    for (i = 0; i < walk.threads; ++i) {
+        pthread_mutex_init(&walk.queues[i].lock, NULL);
+        walk.queues[i].items = NULL;
+        walk.queues[i].head = walk.queues[i].tail = walk.queues[i].capacity = 0;
+        workers[i].walk = &walk;
+        workers[i].id = i;
+    }
+
+    if (walk_queue_push(&walk.queues[0], &inode_p, 1)) {
+        walk.result = 2;
+    } else {
+        // Calling thread works as the first worker.
+        for (started = 1; started < walk.threads; ++started) {
+            if (pthread_create(&threads[started], NULL, walk_worker, &workers[started])) break;
+        }
+        walk_worker(&workers[0]);
+        for (i = 1; i < started; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    for (i = 0; i < walk.threads; ++i) {
+        pthread_mutex_destroy(&walk.queues[i].lock);
+        free(walk.queues[i].items);
+    }
+    pthread_cond_destroy(&walk.changed);
+    pthread_mutex_destroy(&walk.lock);
+    return walk.result;
+}
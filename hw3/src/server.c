@@ -4,14 +4,18 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <syslog.h>
 #include <sys/socket.h>
+#include <sys/select.h>
 #include <netinet/in.h>
 #include <string.h>
 #include <fs.h>
 
 #define PORT 8080
 #define SERVER_BUFFER_SIZE 1024
+#define RECLAIM_IDLE_USEC 20000  // idle time before orphans reclaiming step
+#define RECLAIM_BUDGET    1024   // blocks freed per step
 
 // pwd
 // ls
@@ -23,30 +27,69 @@
 // cat FILE
 // upload FILE_LOCAL FILE_FS
 // download FILE_FS FILE_LOCAL
+// cp FILE TARGET
+// mv FILE TARGET
+// import DIR_LOCAL DIRECTORY
+// export DIRECTORY DIR_LOCAL
+// untar FILE_LOCAL DIRECTORY
+// tar DIRECTORY FILE_LOCAL
+// read FILE OFFSET LEN
+// write FILE OFFSET FILE_LOCAL
+// truncate FILE LEN
+// du [FILE]
+// snapshot NAME
+// snapshots
+// rmsnapshot NAME
+// compact
+// defrag [FILE]
+// compactdir [DIRECTORY]
 // unmount
 // help
 
 // SuperBlock
 // Blocks Bitmap Area
-// inodes Bitmap Area
-// inodes table
-// blocks
+// Block Groups Area
+// inode Groups Area
+// Dedup Index Area
+// blocks (inode groups bitmaps and tables are allocated among them)
 
-// # SuperBlock Size = 8 Bytes
+// # SuperBlock Size = 28 Bytes
 //      4 Bytes (unsigned int) - Magic Number
 //      4 Bytes (unsigned int) - Block Size
+//      4 Bytes (unsigned int) - Version
+//      4 Bytes (unsigned int) - inode Groups Count
+//      4 Bytes (unsigned int) - Free inode Hint
+//      4 Bytes (unsigned int) - Orphans Directory inode
+//      4 Bytes (unsigned int) - Snapshots Directory inode
 // # Block Size = 1 KB
 // # Block Pointer = 4 Bytes (unsigned int (2^32))
-// # inode Size = 64 Bytes:
-//      4*1  Bytes - file type
+// # inode Size = 128 Bytes:
+//      2*1  Bytes - file type
+//      2*1  Bytes - flags
 //      4*1  Bytes - file size
 //      4*11 Bytes - blocks pointers
 //      4*3  Bytes - indirect addressing
-// # inode Pointer = 2 Bytes (unsigned short (2^16))
+//      (file content up to 56 Bytes is stored inline instead of blocks pointers)
+//      8*3  Bytes - subtree totals of directory (bytes, blocks, files)
+//      40   Bytes - reserved
+// # inode Pointer = 4 Bytes (unsigned int (2^32))
+// # Block Group = 2^16 blocks (one 8 KB page of blocks bitmap)
+// # Block Group Descriptor = 12 Bytes:
+//      4 Bytes - used blocks count
+//      4 Bytes - the first block of references table (256 blocks, 0 - none)
+//      4 Bytes - tracked blocks count
+// # Block References Entry = 4 Bytes - files sharing the block (0 - single owner)
+// # Dedup Slot = 8 Bytes (4 Bytes content hash tag + 4 Bytes block Pointer)
+// # inode Group Descriptor = 12 Bytes:
+//      4 Bytes - inodes bitmap block (8192 inodes)
+//      4 Bytes - the first block of inodes table (1024 blocks)
+//      4 Bytes - free inodes count
+// # Directory Record = 18 Bytes (4 Bytes inode Pointer + 14 Bytes name)
 
 // Blocks Bitmap Area Size = 2^32 Bits = 512 MB
-// inodes Bitmap Area Size = 2^16 Bits = 8 KB
-// inode Area Size = 2^16 * 64 Bytes = 4 MB
+// Block Groups Area Size = 2^16 * 12 Bytes = 768 KB
+// inode Groups Area Size = 2^32 / 8192 * 12 Bytes = 6 MB
+// Dedup Index Area Size = 2^20 * 8 Bytes = 8 MB
 // max FS size = 2^32 KB = 4096 GB
 // max Blocks/File = 12+(1+256)+(1+256+256^2)+(1+256+256^2+256^3) = 16 909 071
 // max File Size = 16 843 020 Blocks = 16 843 020 KB ~ 16 GB
@@ -85,8 +128,8 @@ static void daemonize_fs(int fd) {
     openlog("fs_virtual", LOG_PID, LOG_DAEMON);
 }
 
-FILE* get_fs_file(char *file_path) {
-    FILE *file;
+int get_fs_file(char *file_path) {
+    int file;
     if (access(file_path, F_OK) != -1) {
         // Filesystem file already exists.
         printf("Loading filesystem...");
@@ -103,11 +146,21 @@ FILE* get_fs_file(char *file_path) {
     return file;
 }
 
-void server_fs(FILE* fs) {
-    inode_pointer_t inode_cur_dir = 0;
-    int listener, sock, bytes_read;
+// Snapshot is served read-only from its root, while the live tree may be served by another server.
+// Servers share FS file through flock: a request to snapshot is done under a shared lock,
+//  and the live server frees or moves blocks (rmsnapshot, compact, defrag, reclaiming orphans)
+//  only under an exclusive one. Snapshot removed in between requests is no longer served.
+void server_fs(int fs, inode_pointer_t inode_root, const char *snapshot, int port) {
+    inode_pointer_t inode_cur_dir = inode_root;
+    inode_pointer_t inode_snapshot;
+    int listener, sock, bytes_read, lock, removed = 0;
+    char reclaimed;
+    int read_only = (snapshot != NULL);
     struct sockaddr_in address; 
     int opt = 1;
+    int orphans_pending = !read_only;  // there may be orphans left from previous run
+    fd_set listener_set;
+    struct timeval timeout;
     char cmd[BUFFER_SIZE] = {0}; 
     char buffer[BUFFER_SIZE] = {0}; 
     char *hello = "Hello from server";
@@ -127,7 +180,7 @@ void server_fs(FILE* fs) {
         exit(EXIT_FAILURE); 
     } 
     address.sin_family = AF_INET; 
-    address.sin_port = htons(PORT); 
+    address.sin_port = htons(port); 
     address.sin_addr.s_addr = htonl(INADDR_ANY); 
 
     // Forcefully attaching socket to the port 8080 
@@ -145,6 +198,27 @@ void server_fs(FILE* fs) {
     syslog(LOG_NOTICE, "Virtual FS started.");
 
     while (1) {
+        // Reclaim removed files in background while there are no clients.
+        if (orphans_pending) {
+            FD_ZERO(&listener_set);
+            FD_SET(listener, &listener_set);
+            timeout.tv_sec = 0;
+            timeout.tv_usec = RECLAIM_IDLE_USEC;
+            if (select(listener + 1, &listener_set, NULL, NULL, &timeout) == 0) {
+                // Request to a snapshot in progress postpones reclaiming till the next idle period.
+                if (flock(fs, LOCK_EX | LOCK_NB) != 0) {
+                    continue;
+                }
+                reclaimed = reclaim_orphans(fs, RECLAIM_BUDGET);
+                if (reclaimed > 1) {
+                    syslog(LOG_ERR, "reclaiming orphans failed");
+                }
+                orphans_pending = (reclaimed != 0);
+                flock(fs, LOCK_UN);
+                continue;
+            }
+        }
+
         if ((sock = accept(listener, NULL, NULL)) < 0) {
             syslog(LOG_ERR, "accept failed");
             perror("accept failed");
@@ -154,39 +228,67 @@ void server_fs(FILE* fs) {
         if ((bytes_read = recv(sock, cmd, BUFFER_SIZE, 0)) >= 0) {
             // Process input command and get its output.
             cmd[bytes_read] = '\0';
-            if (get_cmd(fs, &inode_cur_dir, cmd, buffer))
-                break;
+            lock = read_only ? LOCK_SH : (is_cmd_exclusive(cmd) ? LOCK_EX : 0);
+            if (lock) flock(fs, lock);
+            removed = read_only && (get_snapshot(fs, snapshot, &inode_snapshot) || (inode_snapshot != inode_root));
+            if (removed) {
+                sprintf(buffer, "snapshot has been removed\n");
+            } else if (read_only && is_cmd_modifying(cmd)) {
+                sprintf(buffer, "snapshot is read-only\n");
+            } else {
+                if (get_cmd(fs, inode_root, &inode_cur_dir, cmd, buffer))
+                    break;
+                orphans_pending = !read_only;
+            }
 
             // Append current directory to command output.
             buffer[strlen(buffer) + 1] = '\0';
-            cmd_pwd(fs, inode_cur_dir, buffer + (strlen(buffer) + 1), 0);
+            if (!removed) cmd_pwd(fs, inode_cur_dir, buffer + (strlen(buffer) + 1), 0);
+            if (lock) flock(fs, LOCK_UN);
 
             send(sock, buffer, BUFFER_SIZE, 0);
         }
 
         close(sock);
+        if (removed) {
+            syslog(LOG_NOTICE, "Snapshot has been removed.");
+            break;
+        }
     }
 }
 
 int main(int argc, char *argv[]) {
-    FILE *fs;
-    int fd;
+    int fs;
+    inode_pointer_t inode_root = 0;
+    int port = PORT;
 
-    if (argc != 2) {
-        fprintf(stderr, "Expected single argument, got %d.\n", argc - 1);
+    // fs_server FS_FILE [SNAPSHOT PORT]
+    if ((argc != 2) && (argc != 4)) {
+        fprintf(stderr, "Expected 1 or 3 arguments, got %d.\n", argc - 1);
         return EXIT_FAILURE;
     }
-    fs = get_fs_file(argv[1]);
+    if (argc == 4) {
+        if (access(argv[1], F_OK) == -1) {
+            fprintf(stderr, "FS file \"%s\" doesn't exist.\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+        fs = open_fs_file(argv[1]);
+        if (get_snapshot(fs, argv[2], &inode_root)) {
+            fprintf(stderr, "Snapshot \"%s\" doesn't exist.\n", argv[2]);
+            return EXIT_FAILURE;
+        }
+        port = atoi(argv[3]);
+    } else {
+        fs = get_fs_file(argv[1]);
+    }
 
-    fd = fileno(fs);
-    daemonize_fs(fd);
+    daemonize_fs(fs);
 
-    server_fs(fs);
+    server_fs(fs, inode_root, (argc == 4) ? argv[2] : NULL, port);
 
-    fclose(fs);
+    close(fs);
     syslog(LOG_NOTICE, "Virtual FS terminated.");
     closelog();
 
     return EXIT_SUCCESS;
 }
-